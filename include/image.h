@@ -0,0 +1,35 @@
+#ifndef MOS6502_IMAGE_H_
+#define MOS6502_IMAGE_H_
+
+#include "lib.h"
+#include "ram.h"
+
+// Binary images mapped from disk. Files are mmapped read-only and every page
+// they fully cover is mapped into RAM straight from the file, without a copy,
+// as read-only host memory (see memmap_host). Pages a segment covers only
+// partly are copied into ROM pages. One image can be mapped into any number of
+// RAMs, which then all share its pages.
+//
+// A manifest lists the segments of a multi-segment image, one per line:
+//
+//     # Comment
+//     file load_addr [offset [size]]
+//
+// `file` is relative to the manifest. `load_addr`, `offset` into the file and
+// `size` are in C syntax, e.g. 0x8000. Without `size`, the segment runs to the
+// end of the file. Later segments win where they overlap.
+typedef struct MOS_6502_Image MOS_6502_Image;
+
+// Maps all of `path` at `load`. Returns NULL when the file cannot be mapped or
+// does not fit.
+MOS_6502_Image *mos6502_image_open(char const *path, WORD load);
+// Maps every segment listed in the manifest at `path`. Returns NULL, after
+// printing why, when a line is malformed or a segment cannot be mapped.
+MOS_6502_Image *mos6502_image_manifest(char const *path);
+// Maps the pages of `image` into `mem`. Reset keeps them mapped.
+void mos6502_image_map(MOS_6502_Image const *image, RAM *mem);
+// Unmaps the files. RAMs `image` was mapped into must not run anymore, or must
+// have been given other pages where it was.
+void mos6502_image_free(MOS_6502_Image *image);
+
+#endif // MOS6502_IMAGE_H_
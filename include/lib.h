@@ -27,6 +27,16 @@ typedef uint16_t WORD;
         goto defer; \
     } while (0)
 
+#if defined(__GNUC__)
+#define forceinline inline __attribute__((always_inline))
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define forceinline inline
+#define likely(x)   (x)
+#define unlikely(x) (x)
+#endif
+
 #define ASSERT_EQ(l, r)   expect((l) == (r), "")
 #define ASSERT_SET(bit)   expect(bit == 0b1, "");
 #define ASSERT_UNSET(bit) expect(bit == 0b0, "");
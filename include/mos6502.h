@@ -4,47 +4,141 @@
 #include "lib.h"
 #include "ram.h"
 
-// http://www.6502.org/users/obelisk/6502/reference.html#LDA
-#define LDA_IMM 0xA9 // 2 bytes // 2 cycles
-#define LDA_ZPG 0xA5 // 2 bytes // 3 cycles
-#define LDA_ZPX 0xB5 // 2 bytes // 4 cycles
-#define LDA_ABS 0xAD // 3 bytes // 4 cycles
-#define LDA_ABX 0xBD // 3 bytes // (4|5) cycles
-#define LDA_ABY 0xB9 // 3 bytes // (4|5) cycles
-#define LDA_IDX 0xA1 // 2 bytes // 6 cycles
-#define LDA_IDY 0xB1 // 2 bytes // (5|6) cycles
-// http://www.6502.org/users/obelisk/6502/reference.html#LDX
-#define LDX_IMM 0xA2 // 2 bytes // 2 cycles
-#define LDX_ZPG 0xA6 // 2 bytes // 3 cycles
-#define LDX_ZPY 0xB6 // 2 bytes // 4 cycles
-#define LDX_ABS 0xAE // 3 bytes // 4 cycles
-#define LDX_ABY 0xBE // 3 bytes // (4|5) cycles
-// http://www.6502.org/users/obelisk/6502/reference.html#LDY
-#define LDY_IMM 0xA0 // 2 bytes // 2 cycles
-#define LDY_ZPG 0xA4 // 2 bytes // 3 cycles
-#define LDY_ZPX 0xB4 // 2 bytes // 4 cycles
-#define LDY_ABS 0xAC // 3 bytes // 4 cycles
-#define LDY_ABX 0xBC // 3 bytes // (4|5) cycles
-
-// http://www.6502.org/users/obelisk/6502/reference.html#STA
-#define STA_ZPG 0x85 // 2 bytes // 3 cycles
-#define STA_ZPX 0x95 // 2 bytes // 4 cycles
-#define STA_ABS 0x8D // 3 bytes // 4 cycles
-#define STA_ABX 0x9D // 3 bytes // 5 cycles
-#define STA_ABY 0x99 // 3 bytes // 5 cycles
-#define STA_IDX 0x81 // 2 bytes // 6 cycles
-#define STA_IDY 0x91 // 2 bytes // 6 cycles
-// http://www.6502.org/users/obelisk/6502/reference.html#STX
-#define STX_ZPG 0x86 // 2 bytes // 3 cycles
-#define STX_ZPY 0x96 // 2 bytes // 4 cycles
-#define STX_ABS 0x8E // 3 bytes // 4 cycles
-// http://www.6502.org/users/obelisk/6502/reference.html#STY
-#define STY_ZPG 0x84 // 2 bytes // 3 cycles
-#define STY_ZPX 0x94 // 2 bytes // 4 cycles
-#define STY_ABS 0x8C // 3 bytes // 4 cycles
-
-// http://www.6502.org/users/obelisk/6502/reference.html#JSR
-#define JSR 0x20 // Jump to Subroutine // 3 bytes // 6 cycles
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    AddrMode_IMM, // Immediate
+    AddrMode_ZPG, // from Zero Page
+    AddrMode_ZPX, // from Zero Page + X
+    AddrMode_ZPY, // from Zero Page + Y
+    AddrMode_ABS, // from absolute address
+    AddrMode_ABX, // from absolute address + X
+    AddrMode_ABY, // from absolute address + Y
+    AddrMode_IDX, // from address in X
+    AddrMode_IDY, // from address in Y
+    AddrMode_IMP, // Implied, no operand
+    AddrMode_REL, // PC-relative, signed 8-bit offset
+} AddrMode;
+
+// Operations, as in the `operation` column of MOS6502_OPCODES
+typedef enum {
+    Op_LD,  // Load register
+    Op_ST,  // Store register
+    Op_JSR, // Jump to subroutine
+    Op_RTS, // Return from subroutine
+    Op_BRK, // Force interrupt
+    Op_RTI, // Return from interrupt
+    Op_CLI, // Clear interrupt disable
+    Op_SEI, // Set interrupt disable
+    Op_JMP, // Jump
+    Op_BR,  // Branch on a flag, selected by the opcode
+} Op;
+
+// Register an instruction reads from or writes to
+typedef enum {
+    Reg_none,
+    Reg_a,
+    Reg_x,
+    Reg_y,
+} Reg;
+
+// Single source of truth for every implemented opcode. The opcode constants,
+// the handlers in mos6502.c and the metadata tables are all generated from it.
+//
+// X(name, opcode, mnemonic, operation, mode, register, bytes, cycles, penalty)
+//
+// `penalty` is the extra cycle taken when indexing crosses a page boundary,
+// or for branches the most they add: one when taken, one more when the
+// target is on another page.
+#define MOS6502_OPCODES(X)                                          \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#LDA */ \
+    X(LDA_IMM, 0xA9, LDA, LD, IMM, a, 2, 2, 0)                      \
+    X(LDA_ZPG, 0xA5, LDA, LD, ZPG, a, 2, 3, 0)                      \
+    X(LDA_ZPX, 0xB5, LDA, LD, ZPX, a, 2, 4, 0)                      \
+    X(LDA_ABS, 0xAD, LDA, LD, ABS, a, 3, 4, 0)                      \
+    X(LDA_ABX, 0xBD, LDA, LD, ABX, a, 3, 4, 1)                      \
+    X(LDA_ABY, 0xB9, LDA, LD, ABY, a, 3, 4, 1)                      \
+    X(LDA_IDX, 0xA1, LDA, LD, IDX, a, 2, 6, 0)                      \
+    X(LDA_IDY, 0xB1, LDA, LD, IDY, a, 2, 5, 1)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#LDX */ \
+    X(LDX_IMM, 0xA2, LDX, LD, IMM, x, 2, 2, 0)                      \
+    X(LDX_ZPG, 0xA6, LDX, LD, ZPG, x, 2, 3, 0)                      \
+    X(LDX_ZPY, 0xB6, LDX, LD, ZPY, x, 2, 4, 0)                      \
+    X(LDX_ABS, 0xAE, LDX, LD, ABS, x, 3, 4, 0)                      \
+    X(LDX_ABY, 0xBE, LDX, LD, ABY, x, 3, 4, 1)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#LDY */ \
+    X(LDY_IMM, 0xA0, LDY, LD, IMM, y, 2, 2, 0)                      \
+    X(LDY_ZPG, 0xA4, LDY, LD, ZPG, y, 2, 3, 0)                      \
+    X(LDY_ZPX, 0xB4, LDY, LD, ZPX, y, 2, 4, 0)                      \
+    X(LDY_ABS, 0xAC, LDY, LD, ABS, y, 3, 4, 0)                      \
+    X(LDY_ABX, 0xBC, LDY, LD, ABX, y, 3, 4, 1)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#STA */ \
+    X(STA_ZPG, 0x85, STA, ST, ZPG, a, 2, 3, 0)                      \
+    X(STA_ZPX, 0x95, STA, ST, ZPX, a, 2, 4, 0)                      \
+    X(STA_ABS, 0x8D, STA, ST, ABS, a, 3, 4, 0)                      \
+    X(STA_ABX, 0x9D, STA, ST, ABX, a, 3, 5, 0)                      \
+    X(STA_ABY, 0x99, STA, ST, ABY, a, 3, 5, 0)                      \
+    X(STA_IDX, 0x81, STA, ST, IDX, a, 2, 6, 0)                      \
+    X(STA_IDY, 0x91, STA, ST, IDY, a, 2, 6, 0)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#STX */ \
+    X(STX_ZPG, 0x86, STX, ST, ZPG, x, 2, 3, 0)                      \
+    X(STX_ZPY, 0x96, STX, ST, ZPY, x, 2, 4, 0)                      \
+    X(STX_ABS, 0x8E, STX, ST, ABS, x, 3, 4, 0)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#STY */ \
+    X(STY_ZPG, 0x84, STY, ST, ZPG, y, 2, 3, 0)                      \
+    X(STY_ZPX, 0x94, STY, ST, ZPX, y, 2, 4, 0)                      \
+    X(STY_ABS, 0x8C, STY, ST, ABS, y, 3, 4, 0)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#JSR */ \
+    X(JSR, 0x20, JSR, JSR, ABS, none, 3, 6, 0)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#RTS */ \
+    X(RTS, 0x60, RTS, RTS, IMP, none, 1, 6, 0)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#JMP */ \
+    X(JMP_ABS, 0x4C, JMP, JMP, ABS, none, 3, 3, 0)                  \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BPL */ \
+    X(BPL, 0x10, BPL, BR, REL, none, 2, 2, 2)                       \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BMI */ \
+    X(BMI, 0x30, BMI, BR, REL, none, 2, 2, 2)                       \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BVC */ \
+    X(BVC, 0x50, BVC, BR, REL, none, 2, 2, 2)                       \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BVS */ \
+    X(BVS, 0x70, BVS, BR, REL, none, 2, 2, 2)                       \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BCC */ \
+    X(BCC, 0x90, BCC, BR, REL, none, 2, 2, 2)                       \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BCS */ \
+    X(BCS, 0xB0, BCS, BR, REL, none, 2, 2, 2)                       \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BNE */ \
+    X(BNE, 0xD0, BNE, BR, REL, none, 2, 2, 2)                       \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BEQ */ \
+    X(BEQ, 0xF0, BEQ, BR, REL, none, 2, 2, 2)                       \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#BRK */ \
+    X(BRK, 0x00, BRK, BRK, IMP, none, 1, 7, 0)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#RTI */ \
+    X(RTI, 0x40, RTI, RTI, IMP, none, 1, 6, 0)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#CLI */ \
+    X(CLI, 0x58, CLI, CLI, IMP, none, 1, 2, 0)                      \
+    /* http://www.6502.org/users/obelisk/6502/reference.html#SEI */ \
+    X(SEI, 0x78, SEI, SEI, IMP, none, 1, 2, 0)
+
+enum {
+#define X(name, opcode, ...) name = opcode,
+    MOS6502_OPCODES(X)
+#undef X
+};
+
+typedef struct {
+    char const *name;     // e.g. "LDA_IMM", NULL for opcodes not implemented
+    char const *mnemonic; // e.g. "LDA"
+    Op op;
+    AddrMode mode;
+    Reg reg;
+    BYTE bytes;   // Instruction length, opcode included
+    BYTE cycles;  // Base cycle cost
+    BYTE penalty; // Extra cycles when indexing crosses a page boundary
+} MOS_6502_OpInfo;
+
+// Indexed by opcode
+extern MOS_6502_OpInfo const mos6502_opinfo[0x100];
 
 typedef struct {
     WORD pc; // Program counter
@@ -64,9 +158,216 @@ typedef struct {
     BYTE o : 1; // Overflow Flag
     BYTE n : 1; // Negative Flag
     // MSB
+
+    // Interrupt lines raised and not serviced yet, see Int_*. Written by any
+    // thread through mos6502_raise and mos6502_lower.
+    _Atomic uint32_t pending;
 } MOS_6502;
 
+// Status register (P) bits, in the same order as the flags of MOS_6502
+enum {
+    Flag_C = 1 << 0, // Carry Flag
+    Flag_Z = 1 << 1, // Zero Flag
+    Flag_I = 1 << 2, // Interrupt Disable
+    Flag_D = 1 << 3, // Decimal Mode
+    Flag_B = 1 << 4, // Break Command
+    Flag__ = 1 << 5, // UNUSED
+    Flag_V = 1 << 6, // Overflow Flag
+    Flag_N = 1 << 7, // Negative Flag
+};
+
+// Interrupt lines, as bits of MOS_6502.pending
+enum {
+    Int_NMI = 1 << 0, // Edge-triggered: taken once per raise, whatever the I flag
+    // Level-triggered: taken while raised and I is clear. Every bit above
+    // this one is another IRQ source on the same line, so devices can share
+    // it and lower their own bit once acknowledged.
+    Int_IRQ = 1 << 1,
+};
+
+// Vectors the CPU jumps through on an interrupt
+enum {
+    Vector_NMI = 0xFFFA,
+    Vector_RESET = 0xFFFC,
+    Vector_IRQ = 0xFFFE, // Also taken by BRK
+};
+
+// Raises and lowers `lines` of `cpu`. Lock-free, so any thread may call them
+// while another one runs the CPU. The CPU only looks at its lines at the
+// start of mos6502_exec, right after CLI and RTI and, with the block cache,
+// between blocks: an interrupt raised by a scheduler event is taken right at
+// the boundary the event fired on, one raised by another thread at the next
+// block boundary, and an IRQ held while I was set right after the CLI or RTI
+// that clears it. Taking one costs the 7 cycles of the 6502 entry sequence.
+void mos6502_raise(MOS_6502 *cpu, uint32_t lines);
+void mos6502_lower(MOS_6502 *cpu, uint32_t lines);
+
+// Packs the flags of `cpu` into a status register byte
+BYTE mos6502_getp(MOS_6502 const *cpu);
+// Unpacks status register byte `p` into the flags of `cpu`
+void mos6502_setp(MOS_6502 *cpu, BYTE p);
+
 uint64_t mos6502_exec(MOS_6502 *cpu, RAM *mem, uint64_t max_cycles);
 void mos6502_reset(MOS_6502 *cpu, RAM *mem);
 
+// Registers and memory of a machine, to branch from any number of times
+typedef struct {
+    MOS_6502 cpu;
+    RAM_Snapshot mem;
+} MOS_6502_Snapshot;
+
+// Captures `cpu` and `mem` into `snap` without copying memory: the pages are
+// shared and copied only once `mem` writes to them
+void mos6502_snapshot(MOS_6502 const *cpu, RAM *mem, MOS_6502_Snapshot *snap);
+// Sets `cpu` and `mem` back to `snap`, in time proportional to the pages of
+// `mem`, or only to those written since when `mem` was last snapshotted to or
+// forked from `snap`. Each fork holds only the pages it wrote to.
+void mos6502_fork(MOS_6502_Snapshot const *snap, MOS_6502 *cpu, RAM *mem);
+void mos6502_snapshot_free(MOS_6502_Snapshot *snap);
+
+// Runs `n` independent CPUs, each on its own RAM, with the same result as
+// calling mos6502_exec(&cpus[i], &mems[i], max_cycles) for every one of them.
+// CPUs that run the same opcode are stepped together with vectorized register
+// updates; one that diverges continues alone in mos6502_exec. When `cycles`
+// is not NULL, cycles[i] receives what mos6502_exec would have returned.
+void mos6502_exec_batch(MOS_6502 *cpus, RAM *mems, size_t n, uint64_t max_cycles, uint64_t *cycles);
+
+// Attaches a decoded-block cache to `mem`. From then on mos6502_exec runs
+// straight-line code from predecoded blocks instead of fetching and decoding
+// every instruction again, and fast-forwards through busy-wait loops (see
+// MOS_6502_CacheStats).
+void mos6502_cache_enable(RAM *mem);
+void mos6502_cache_disable(RAM *mem);
+// Drops every decoded block, e.g. after host memory mapped with memmap_host
+// was written to by the host
+void mos6502_cache_flush(RAM *mem);
+
+// High-level emulation of a subroutine, run instead of its 6502 code when a
+// JSR jumps to it. `cpu` is as on entry to the subroutine, return address
+// pushed, and the hook applies the subroutine's effect on the registers,
+// flags and memory. The CPU then returns from it as RTS would. Returns the
+// cycles the subroutine takes, RTS included, for hooks that do not charge a
+// fixed count. The interrupt lines of `cpu` are not those of the CPU.
+typedef uint32_t (*MOS_6502_HookFn)(MOS_6502 *cpu, RAM *mem, void *user);
+
+// Hooks `fn` to the subroutine at `addr`, replacing any previous hook. Every
+// call costs the 6 cycles of the JSR plus `cycles`, or plus what `fn` returns
+// when `cycles` is 0, and counts as a single instruction against the budget
+// of mos6502_exec. Hooks stay through resets until memfree.
+void mos6502_hook(RAM *mem, WORD addr, MOS_6502_HookFn fn, void *user, uint32_t cycles);
+void mos6502_unhook(RAM *mem, WORD addr);
+
+// Memoizes the subroutine at `addr`, for subroutines whose effect depends
+// only on the registers and on the memory they read. A call runs as usual the
+// first time, while the bytes it reads and writes are recorded. Later calls
+// with the same A, X, Y, P and S replay its writes, registers and cycles
+// instead, as long as no byte it read was stored another value since. Calls
+// that touch mapped pages, run hooks, read or write more than 32 bytes, do
+// not return within 4096 instructions or within the budget of the exec they
+// start in, or get interrupted, are never replayed. While a trace, a profile
+// or breakpoints are active, calls always run as usual. Takes the place of
+// any hook at `addr`.
+void mos6502_memo(RAM *mem, WORD addr);
+void mos6502_unmemo(RAM *mem, WORD addr);
+
+typedef struct {
+    uint64_t hits;          // Calls replayed
+    uint64_t misses;        // Calls run, and recorded when they could be
+    uint64_t invalidations; // Recorded calls dropped since a byte they read changed
+} MOS_6502_MemoStats;
+
+// Counters of the memoized subroutines of `mem` since mos6502_memo was first
+// called on it
+MOS_6502_MemoStats mos6502_memo_stats(RAM const *mem);
+
+typedef struct {
+    // Busy-wait loops fast-forwarded: loops that only read memory and left
+    // every register unchanged over a whole iteration, skipped up to the end
+    // of the budget, i.e. to the next scheduled event under mos6502_sched_run
+    uint64_t idle_skips;
+    uint64_t idle_cycles; // Cycles credited to them without running
+} MOS_6502_CacheStats;
+
+// Counters of the cache of `mem` since it was enabled
+MOS_6502_CacheStats mos6502_cache_stats(RAM const *mem);
+
+typedef enum {
+    Engine_Interpreter, // Reference engine, always available
+    Engine_JIT,         // Compiles hot blocks to native code (x86-64 Linux only)
+} Engine;
+
+// Selects how the cache of `mem` runs its blocks. With Engine_JIT, a block is
+// compiled once it ran `threshold` times. Both engines produce the same
+// registers, memory and cycle counts, so they can be switched at any point.
+// Returns false, leaving the engine unchanged, when the JIT is unavailable.
+bool mos6502_cache_engine(RAM *mem, Engine engine, uint32_t threshold);
+
+// Starts counting the opcode pairs and triples that the cache of `mem` runs,
+// to choose superinstructions from (see src/fusions.h)
+void mos6502_cache_profile(RAM *mem);
+// Writes the counts to `path`, most frequent first. Returns false when the
+// file could not be written.
+bool mos6502_cache_profile_save(RAM *mem, char const *path);
+
+// Execution profile, kept by builds with MOS6502_PROFILE defined only. The
+// counters are plain arrays indexed by opcode or address. Without the define
+// nothing is counted and the memory accessors carry no trace of it.
+typedef struct {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t op_count[0x100];  // Times each opcode ran
+    uint64_t op_cycles[0x100]; // Cycles it took, hooked subroutines included
+    uint64_t pc[RAM_SIZE];     // Instructions run at each address
+    RAM_Heat heat;
+} MOS_6502_Profile;
+
+// Starts profiling mos6502_exec on `mem`, which then runs every instruction
+// on its own, so that neither blocks, native code nor fast-forwarded loops
+// hide any from the profile. Returns false in builds without profiling.
+bool mos6502_profile_enable(RAM *mem);
+void mos6502_profile_disable(RAM *mem);
+// NULL unless profiling
+MOS_6502_Profile const *mos6502_profile(RAM const *mem);
+// Writes the profile to `path` as text: the counts of every opcode, the
+// addresses most run first, the heat map, and the opcode pairs and triples
+// run within a block, most run first, which 6502-fusegen reads as it reads
+// mos6502_cache_profile_save. Returns false when the file could not be
+// written.
+bool mos6502_profile_save(RAM *mem, char const *path);
+
+typedef enum {
+    Break_Exec,  // Breakpoint: before the instruction at the address runs
+    Break_Read,  // Watchpoint: before an instruction loads from the address
+    Break_Write, // Watchpoint: before an instruction stores to the address
+} Break;
+
+// Why the last mos6502_exec on a RAM returned
+typedef enum {
+    Stop_Budget,     // `max_cycles` were run
+    Stop_Breakpoint, // The next instruction is at a breakpoint
+    Stop_Watchpoint, // The next instruction accesses a watched address
+    Stop_Event,      // mos6502_stop was called
+} Stop;
+
+// Sets and clears a breakpoint or watchpoint at `addr`. While any is set,
+// mos6502_exec runs every instruction on its own and looks ahead at what it
+// accesses, stopping before it with PC still pointing at it; the hot loops
+// only run once none is left. Loads and stores count whichever instruction
+// does them: the stack of JSR, RTS and BRK, the pointers of indirect modes
+// and the vector of BRK included, but not instruction fetches nor what hooks
+// do. The first instruction a call to mos6502_exec runs is never stopped
+// before, so that running again steps past the stop.
+void mos6502_break(RAM *mem, Break kind, WORD addr);
+void mos6502_unbreak(RAM *mem, Break kind, WORD addr);
+// Stops the current or next mos6502_exec on `mem` with Stop_Event, e.g. from
+// a hook, a device, a scheduler event or another thread. Honored at the next
+// instruction boundary while breakpoints or watchpoints are set, and as
+// mos6502_exec starts otherwise.
+void mos6502_stop(RAM *mem);
+// Why the last mos6502_exec on `mem` returned. Sets `addr`, unless NULL, to
+// the address of the breakpoint or watchpoint that stopped it.
+Stop mos6502_stopped(RAM const *mem, WORD *addr);
+
+char const *modename(AddrMode mode);
+
 #endif // MOS6502_H_
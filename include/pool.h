@@ -0,0 +1,52 @@
+#ifndef MOS6502_POOL_H_
+#define MOS6502_POOL_H_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// One run of the emulator: reset, load `image` at `load`, start at `entry`
+// and run until `max_cycles` are spent, exactly like mos6502_exec would.
+typedef struct MOS_6502_Job {
+    // Set by the submitter
+    BYTE const *image; // Must stay valid until the job comes back
+    size_t size;
+    WORD load;
+    WORD entry;
+    uint64_t max_cycles;
+    bool keep_mem; // Hand the final memory back in `mem` instead of freeing it
+    void *user;    // Left untouched
+
+    // Set by the pool by the time the job comes back from mos6502_pool_wait
+    MOS_6502 cpu;
+    uint64_t cycles; // What mos6502_exec would have returned
+    RAM *mem;        // Only with `keep_mem`, to be released with memfree() and free()
+
+    // Owned by the pool
+    struct MOS_6502_Job *_Atomic next;
+} MOS_6502_Job;
+
+typedef struct MOS_6502_Pool MOS_6502_Pool;
+
+// Starts `threads` workers, one per online CPU when 0. Jobs are submitted to
+// the workers round-robin, each into its own queues, and a worker steals from
+// the others when it runs dry. A job runs for at most `quantum` cycles at a
+// time before going to the back of its worker's queue, so long jobs do not
+// hold up short ones.
+MOS_6502_Pool *mos6502_pool_new(size_t threads, uint64_t quantum);
+// Stops the workers. Every job submitted must have come back from
+// mos6502_pool_wait first.
+void mos6502_pool_free(MOS_6502_Pool *pool);
+
+// `job` belongs to the pool until mos6502_pool_wait returns it. Only one
+// thread may call it at a time.
+void mos6502_pool_submit(MOS_6502_Pool *pool, MOS_6502_Job *job);
+// Returns the next finished job, blocking until one is done, or NULL when no
+// job is left. Only one thread may call it at a time.
+MOS_6502_Job *mos6502_pool_wait(MOS_6502_Pool *pool);
+
+#endif // MOS6502_POOL_H_
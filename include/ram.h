@@ -4,31 +4,252 @@
 #include "lib.h"
 
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #define RAM_SIZE (64 * 1024) // 64KiB
 static_assert(
         RAM_SIZE == UINT16_MAX + 1, "Memory should be addressable by 16-bit addresses");
 
+#define RAM_PAGE_SIZE 256
+#define RAM_PAGES     (RAM_SIZE / RAM_PAGE_SIZE)
+
+// Page of memory, shared copy-on-write between RAMs and snapshots
+typedef struct RAM_Page {
+    _Atomic uint32_t refs;
+    bool rom; // Stores to the page are ignored instead of copying it
+    union {
+        BYTE data[RAM_PAGE_SIZE];
+        struct RAM_Page *next; // While free in the page arena of a thread
+    };
+} RAM_Page;
+
+// Accesses to each address, counted while mos6502_profile_enable is in effect
+typedef struct {
+    uint64_t read[RAM_SIZE];  // Loads, instruction fetches included
+    uint64_t write[RAM_SIZE]; // Stores
+    uint64_t exec[RAM_SIZE];  // Bytes of the instructions run
+} RAM_Heat;
+
+// Memory-mapped device. Loads and stores to the pages it is mapped at call
+// these with the full address instead of touching memory.
 typedef struct {
-    BYTE data[RAM_SIZE];
+    BYTE (*read)(void *device, WORD addr);
+    void (*write)(void *device, WORD addr, BYTE b);
+    void *device;
+} RAM_Io;
+
+// Must be zero-initialized before first use, e.g. `RAM mem = { 0 };`, and
+// released with memfree before it is freed.
+//
+// Every access goes through `host`, the bus: a table of 256 pointers to the
+// host memory behind each page. Loads and stores of pages that have one are a
+// load plus an index; the others take the slow path in ram.c.
+typedef struct RAM {
+    // NULL until first read, and for devices
+    BYTE *host[RAM_PAGES];
+    // Pages stores may go straight to `host` for: written since the last reset
+    // or restore, owned by this RAM alone and holding no decoded code. Stores
+    // to any other page take the slow path, which copies or allocates it.
+    uint64_t wr[RAM_PAGES / 64];
+
+    // Memory behind the pages not on `bus`. NULL for pages that were never
+    // written, which read as zero.
+    RAM_Page *page[RAM_PAGES];
+    // Pages written since the last reset or restore
+    uint64_t dirty[RAM_PAGES / 64];
+    // Pages in `page` that are not NULL
+    uint64_t used[RAM_PAGES / 64];
+    // Pages stores are ignored on: mapped from a RAM_Rom, which reset and
+    // memclear leave in place, or onto read-only host memory
+    uint64_t rom[RAM_PAGES / 64];
+    // RAM or snapshot the pages that are not dirty were last restored from
+    void const *origin;
+
+    // Pages mapped with memmap_host or memmap_io. Reset, restore and
+    // snapshots leave them alone.
+    uint64_t bus[RAM_PAGES / 64];
+    RAM_Io const **io; // Device of each page, NULL until memmap_io is called
+
+    // Pages that blocks of `cache` were decoded from. Stores into them
+    // invalidate those blocks.
+    uint64_t code[RAM_PAGES / 64];
+    struct MOS_6502_Cache *cache; // NULL unless mos6502_cache_enable was called
+    struct MOS_6502_Hooks *hooks; // NULL until mos6502_hook is first called, freed by memfree
+
+    // Pages holding a byte that a memoized call read. Stores into them take
+    // the slow path, which drops the calls that read the byte.
+    uint64_t watch[RAM_PAGES / 64];
+    struct MOS_6502_Memo *memo; // NULL until mos6502_memo is first called, freed by memfree
+
+    // NULL unless profiling, which only builds with MOS6502_PROFILE defined
+    // can do. Freed by memfree.
+    struct MOS_6502_Profiler *profiler;
+    RAM_Heat *heat; // Where the loads and stores below are counted
+
+    struct MOS_6502_Trace *trace; // NULL unless mos6502_trace_start was called
+    // Called by memfree before anything else, for a layer above the memory
+    // that has to tear down state of its own, such as a running trace
+    void (*cleanup)(struct RAM *mem);
+    // NULL until mos6502_break is first called or a run honors mos6502_stop,
+    // freed by memfree
+    struct MOS_6502_Debug *debug;
+    // Set by mos6502_stop, from any thread, until a run honors it. Lives here
+    // rather than in `debug` so that setting it never allocates.
+    _Atomic bool stop;
 } RAM;
 
+// Page table of a RAM at one point in time, holding a reference to each page
+typedef struct {
+    RAM_Page *page[RAM_PAGES];
+    uint64_t used[RAM_PAGES / 64];
+} RAM_Snapshot;
+
+// Read-only pages, built once and mapped into any number of RAMs that then
+// all share them. Must be zero-initialized before first use.
+typedef struct {
+    RAM_Page *page[RAM_PAGES];
+    uint64_t used[RAM_PAGES / 64];
+} RAM_Rom;
+
+// Counts an access to `addr` in `map` of the heat map of `mem`, in profiling
+// builds only
+#ifdef MOS6502_PROFILE
+#define memcount(mem, map, addr)               \
+    do {                                       \
+        if (unlikely((mem)->heat != NULL)) {   \
+            (mem)->heat->map[(WORD) (addr)]++; \
+        }                                      \
+    } while (0)
+#else
+#define memcount(mem, map, addr) ((void) 0)
+#endif
+
+// Slow paths of the loads and stores below
+BYTE memldb_slow(RAM *mem, WORD addr);
+void memstb_slow(RAM *mem, WORD addr, BYTE b);
+
 // Cycles: 1
 // Returns byte copy at `addr`
-BYTE memldb(RAM *mem, WORD addr);
+static inline BYTE memldb(RAM *mem, WORD addr)
+{
+    memcount(mem, read, addr);
+    BYTE const *page = mem->host[addr >> 8];
+    if (likely(page != NULL)) {
+        return page[addr & 0xFF];
+    }
+    return memldb_slow(mem, addr);
+}
 
-// Cycles: 2 
+// Cycles: 2
 // Expects `addr` to reference the low byte of word to be loaded
 // Returns little-endian word copy from `addr` through `addr + 1`
-WORD memldw(RAM *mem, WORD addr);
+static inline WORD memldw(RAM *mem, WORD addr)
+{
+    expect(addr < RAM_SIZE - 1, "Address 0x%x cannot be the low byte of a word", addr);
+    BYTE const *page = mem->host[addr >> 8];
+    if (likely(page != NULL && (addr & 0xFF) != 0xFF)) {
+        memcount(mem, read, addr);
+        memcount(mem, read, addr + 1);
+        return page[addr & 0xFF] | page[(addr & 0xFF) + 1] << 8;
+    }
+    WORD w = memldb(mem, addr);
+    return w |= memldb(mem, addr + 1) << 8;
+}
 
 // Cycles: 1
 // Set byte at `addr` to be `b`
-void memstb(RAM *mem, WORD addr, BYTE b);
+static inline void memstb(RAM *mem, WORD addr, BYTE b)
+{
+    memcount(mem, write, addr);
+    if (likely(mem->wr[addr >> 14] >> (addr >> 8 & 63) & 1)) {
+        mem->host[addr >> 8][addr & 0xFF] = b;
+    } else {
+        memstb_slow(mem, addr, b);
+    }
+}
 
 // Cycles: 2
 // Expects `addr` to reference the low byte of word to be loaded
 // Set bytes from `addr` through `addr + 1` to be `w` in little-endian
-void memstw(RAM *mem, WORD addr, WORD w);
+static inline void memstw(RAM *mem, WORD addr, WORD w)
+{
+    memstb(mem, addr, w & 0xFF);
+    memstb(mem, addr + 1, w >> 8);
+}
+
+// Returns the byte at `addr` without side effects, for debuggers and tracers:
+// nothing is counted, and devices and pages never written read as 0
+static inline BYTE mempeek(RAM const *mem, WORD addr)
+{
+    BYTE const *page = mem->host[addr >> 8];
+    return page != NULL ? page[addr & 0xFF] : 0;
+}
+
+// Same for the little-endian word at `addr`, wrapping around memory
+static inline WORD mempeekw(RAM const *mem, WORD addr)
+{
+    return mempeek(mem, addr) | mempeek(mem, addr + 1) << 8;
+}
+
+// Copies `size` bytes from `src` to `addr` onwards, like as many memstb
+void memload(RAM *mem, WORD addr, BYTE const *src, size_t size);
+// Copies `size` bytes from `addr` onwards to `dst`, like as many memldb
+void memread(RAM *mem, WORD addr, BYTE *dst, size_t size);
+// Whether the `size` bytes from `addr` onwards are the same as `bytes`
+bool memequal(RAM *mem, WORD addr, BYTE const *bytes, size_t size);
+
+// Zeroes `mem` by dropping every page it holds but ROM, in time proportional
+// to the pages written since the last clear
+void memclear(RAM *mem);
+// Drops every page of `mem`, ROM and mappings included
+void memfree(RAM *mem);
+
+// Makes `mem` a copy of `from`. When `mem` was last restored from `from`,
+// only the pages written since are copied back, so `from` must not change
+// while copies of it are in use.
+void memrestore(RAM *mem, RAM const *from);
+
+// Takes a reference to every page of `mem` into `snap`. Both then share the
+// pages until `mem` writes to them.
+void memsnapshot(RAM *mem, RAM_Snapshot *snap);
+// Makes `mem` share the pages of `snap`. When `mem` was last forked from
+// `snap`, only the pages written since are swapped back.
+void memfork(RAM *mem, RAM_Snapshot const *snap);
+// Drops the references of `snap`, which must not be forked from anymore
+void memsnapshot_free(RAM_Snapshot *snap);
+
+// Copies `size` bytes from `src` to `addr` onwards into `rom`, whose pages
+// must not have been mapped yet
+void memrom_load(RAM_Rom *rom, WORD addr, BYTE const *src, size_t size);
+// Maps every page of `rom` into `mem`, in place of what was there
+void memrom_map(RAM *mem, RAM_Rom const *rom);
+// Drops the references of `rom`. RAMs it was mapped into keep their pages.
+void memrom_free(RAM_Rom *rom);
+
+// Maps the `size` bytes from `addr`, both multiples of RAM_PAGE_SIZE, onto
+// `host`, which must outlive the mapping. Stores go straight to it, or are
+// ignored unless `writable`. Mapping the same memory at several addresses
+// mirrors it; mapping another bank in its place switches banks.
+void memmap_host(RAM *mem, WORD addr, size_t size, BYTE *host, bool writable);
+// Maps the `size` bytes from `addr`, both multiples of RAM_PAGE_SIZE, to
+// `io`, which must outlive the mapping
+void memmap_io(RAM *mem, WORD addr, size_t size, RAM_Io const *io);
+// Gives the `size` bytes from `addr` back to the memory of `mem`, zeroed
+void memunmap(RAM *mem, WORD addr, size_t size);
+
+// Drops everything decoded from `page`. Implemented by the block cache.
+void memcode_invalidate(RAM *mem, BYTE page);
+
+// Implemented by the memoization layer. While a call is being recorded every
+// access takes the slow path, which hands it to these first. They return
+// whether they carried it out.
+bool memo_load(RAM *mem, WORD addr, BYTE *b);
+bool memo_store(RAM *mem, WORD addr, BYTE b);
+// Drops the memoized calls that read any of the `size` bytes from `addr`
+void memo_invalidate(RAM *mem, WORD addr, size_t size);
 
 #endif // MOS6502_RAM_H_
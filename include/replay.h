@@ -0,0 +1,66 @@
+#ifndef MOS6502_REPLAY_H_
+#define MOS6502_REPLAY_H_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Deterministic record and replay of a machine. A replay runs its CPU and
+// RAM itself, checkpointing them every `interval` cycles and logging every
+// external input with the cycle it came at, so that it can seek back and
+// forth to any cycle: it restores the closest checkpoint before it and runs
+// forward from there, replaying the inputs on the way.
+//
+// A checkpoint is a MOS_6502_Snapshot, which shares the pages of the RAM
+// until they are written: each one only holds the pages written since the
+// one before. Memory mapped with memmap_host or memmap_io is not part of
+// checkpoints, and must not change what the CPU sees.
+//
+// Anything that changes what the CPU does must go through the replay: its
+// interrupt lines and memory must not be touched directly while it runs.
+typedef struct MOS_6502_Replay MOS_6502_Replay;
+
+// Which checkpoints a replay drops once it has more than it may keep. The
+// first one is kept by all but Thinning_Window, so the whole run can be
+// sought through.
+typedef enum {
+    Thinning_Spread, // Every other one, doubling the interval: evenly spread over the run
+    Thinning_Recent, // The one closest to its neighbours for its age: sparser further back
+    Thinning_Window, // The oldest: seeking before the oldest one left fails
+} Thinning;
+
+typedef struct {
+    uint64_t interval;  // Cycles between two checkpoints
+    size_t checkpoints; // Checkpoints kept, at least 2
+    Thinning thinning;
+} MOS_6502_ReplayConfig;
+
+// Starts recording `cpu` and `mem` as they are now, which is cycle 0. Both
+// must outlive the replay.
+MOS_6502_Replay *mos6502_replay_new(MOS_6502 *cpu, RAM *mem, MOS_6502_ReplayConfig const *config);
+// Drops the checkpoints and the log. The CPU and RAM stay as they are.
+void mos6502_replay_free(MOS_6502_Replay *replay);
+
+// Cycle the machine is at
+uint64_t mos6502_replay_now(MOS_6502_Replay const *replay);
+size_t mos6502_replay_checkpoints(MOS_6502_Replay const *replay);
+
+// Runs the machine like mos6502_exec. Past a seek back, this runs the
+// recorded run again, inputs included, until it gets to its end.
+uint64_t mos6502_replay_run(MOS_6502_Replay *replay, uint64_t cycles);
+// Puts the machine at cycle `when`, or at the end of the instruction running
+// then, with every input logged up to that cycle applied. Returns false when
+// `when` lies before the oldest checkpoint.
+bool mos6502_replay_seek(MOS_6502_Replay *replay, uint64_t when);
+
+// External inputs, applied right away and logged at the current cycle. Past a
+// seek back, the recorded run is dropped from the current cycle on, and a new
+// one starts with the input.
+void mos6502_replay_raise(MOS_6502_Replay *replay, uint32_t lines);
+void mos6502_replay_lower(MOS_6502_Replay *replay, uint32_t lines);
+void mos6502_replay_store(MOS_6502_Replay *replay, WORD addr, BYTE b);
+
+#endif // MOS6502_REPLAY_H_
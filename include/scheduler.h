@@ -0,0 +1,47 @@
+#ifndef MOS6502_SCHEDULER_H_
+#define MOS6502_SCHEDULER_H_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdbool.h>
+
+// Cycle-timestamped events. mos6502_sched_run runs the CPU uninterrupted up to
+// the earliest deadline, stopping on the instruction boundary that reaches or
+// crosses it exactly like mos6502_exec stops at its budget. It then fires every
+// event that is due, earliest first and in the order they were scheduled on a
+// tie, and continues to the next deadline.
+typedef struct MOS_6502_Scheduler MOS_6502_Scheduler;
+
+// Identifies a scheduled event, e.g. to cancel it. Never 0.
+typedef uint64_t MOS_6502_Event;
+
+// Called once `when` has been reached: the clock then reads `when` or up to
+// one instruction more. May schedule and cancel events.
+typedef void (*MOS_6502_EventFn)(MOS_6502_Scheduler *sched, void *user, uint64_t when);
+
+MOS_6502_Scheduler *mos6502_sched_new(void);
+void mos6502_sched_free(MOS_6502_Scheduler *sched);
+
+// Cycles run since the scheduler was created
+uint64_t mos6502_sched_now(MOS_6502_Scheduler const *sched);
+
+// Schedules `fn` for cycle `when`, or for the next boundary when that is
+// already past
+MOS_6502_Event mos6502_sched_at(MOS_6502_Scheduler *sched, uint64_t when, MOS_6502_EventFn fn,
+                                void *user);
+// Schedules `fn` for `delay` cycles from now
+MOS_6502_Event mos6502_sched_in(MOS_6502_Scheduler *sched, uint64_t delay, MOS_6502_EventFn fn,
+                                void *user);
+// Returns false when `event` already fired or was cancelled
+bool mos6502_sched_cancel(MOS_6502_Scheduler *sched, MOS_6502_Event event);
+
+// Runs `cpu` for `cycles` cycles from now, firing the events that come due
+// meanwhile, including any at the very end. Returns the cycles run, which
+// like for mos6502_exec can exceed `cycles` by part of an instruction. Returns
+// early when a breakpoint, a watchpoint or mos6502_stop, from an event or
+// elsewhere, stops the CPU, which mos6502_stopped then tells.
+uint64_t mos6502_sched_run(MOS_6502_Scheduler *sched, MOS_6502 *cpu, RAM *mem, uint64_t cycles);
+
+#endif // MOS6502_SCHEDULER_H_
@@ -0,0 +1,39 @@
+#ifndef MOS6502_TRACE_H_
+#define MOS6502_TRACE_H_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdbool.h>
+
+// Instruction-level trace. While a trace is attached to a RAM, mos6502_exec
+// runs every instruction on its own and first records it into a ring buffer,
+// from which a thread of the trace compresses it to a file. The recording
+// side never takes a lock nor a system call, unless the ring is full.
+typedef struct {
+    uint64_t cycle; // Cycles run since the trace started, when the instruction began
+    WORD pc;
+    BYTE opcode;
+    BYTE a, x, y, s, p; // Before the instruction ran
+    // Memory the instruction accesses, or the target of a jump, branch or
+    // JSR. 0 for immediate and implied modes.
+    WORD addr;
+} MOS_6502_TraceEntry;
+
+// Starts tracing what mos6502_exec runs on `mem` into a new file at `path`.
+// Returns false when the file could not be created.
+bool mos6502_trace_start(RAM *mem, char const *path);
+// Waits for the file to hold every instruction recorded and closes it, which
+// memfree also does. Returns false when the file could not be written.
+bool mos6502_trace_stop(RAM *mem);
+
+typedef struct MOS_6502_TraceReader MOS_6502_TraceReader;
+
+// Returns NULL when `path` cannot be read or is not a trace
+MOS_6502_TraceReader *mos6502_trace_open(char const *path);
+// Decodes the next instruction of the trace. Returns false at its end.
+bool mos6502_trace_next(MOS_6502_TraceReader *reader, MOS_6502_TraceEntry *entry);
+void mos6502_trace_close(MOS_6502_TraceReader *reader);
+
+#endif // MOS6502_TRACE_H_
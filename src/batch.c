@@ -0,0 +1,417 @@
+#include "core.h"
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Lockstep engine for many independent CPUs. Up to BATCH_LANES of them are
+// kept in struct-of-arrays form and stepped together for as long as they all
+// run the same opcode. Each register holds every lane in one GCC vector, which
+// the compiler lowers to as many SSE2 registers as it takes, or AVX2 ones
+// when built with -mavx2: every register, flag, PC and cycle update is then a
+// few vector instructions, however many lanes are left. Lanes no longer
+// running take no part in the results and keep whatever the vectors compute.
+//
+// Memory stays per lane, since every lane has its own RAM, in one loop over
+// the lanes per access: lanes do not depend on each other, so their loads
+// overlap without any help. Lanes whose page is not on the bus go through
+// ram.c. Each handler also fetches for its own opcode, whose length is then
+// known when it is compiled.
+
+#define BATCH_LANES 32
+
+typedef BYTE Lanes8 __attribute__((vector_size(BATCH_LANES)));
+typedef WORD Lanes16 __attribute__((vector_size(2 * BATCH_LANES)));
+typedef uint32_t Lanes32 __attribute__((vector_size(4 * BATCH_LANES)));
+typedef int8_t Offsets8 __attribute__((vector_size(BATCH_LANES)));
+typedef int16_t Offsets16 __attribute__((vector_size(2 * BATCH_LANES)));
+
+#define LANES16(v) __builtin_convertvector(v, Lanes16)
+
+typedef struct {
+    size_t count;             // Lanes still running in lockstep
+    size_t lane[BATCH_LANES]; // Index into `cpus` and `mems` of each lane
+    RAM *mem[BATCH_LANES];    // &mems[lane[j]]
+
+    Lanes16 pc;
+    Lanes8 s;
+    Lanes8 a;
+    Lanes8 x;
+    Lanes8 y;
+    Lanes8 p;
+    Lanes16 nz;
+    // Lanes all run the same opcodes, so they all spent `base` cycles plus
+    // their own page crossings and taken branches
+    uint64_t base;
+    Lanes32 extra;
+
+    // Scratch for the instruction being run
+    Lanes16 operand;
+    Lanes16 addr;
+    Lanes16 penalty;
+} Batch;
+
+static void batch_load(Batch *batch, size_t j, MOS_6502 const *cpu)
+{
+    Core core = core_load(cpu);
+    batch->pc[j] = core.pc;
+    batch->s[j] = core.s;
+    batch->a[j] = core.a;
+    batch->x[j] = core.x;
+    batch->y[j] = core.y;
+    batch->p[j] = core.p;
+    batch->nz[j] = core.nz;
+    batch->extra[j] = 0;
+}
+
+static Core batch_core(Batch const *batch, size_t j)
+{
+    return (Core) {
+        .pc = batch->pc[j],
+        .s = batch->s[j],
+        .a = batch->a[j],
+        .x = batch->x[j],
+        .y = batch->y[j],
+        .p = batch->p[j],
+        .nz = batch->nz[j],
+    };
+}
+
+// Takes lane `j` out of lockstep, letting the scalar engine run it to the end
+// of the budget. The last lane moves into its slot.
+static void batch_peel(Batch *batch, size_t j, MOS_6502 *cpus, RAM *mems, uint64_t max_cycles,
+                       uint64_t *cycles)
+{
+    size_t lane = batch->lane[j];
+    Core core = batch_core(batch, j);
+    core_store(&core, &cpus[lane]);
+
+    uint64_t spent = batch->base + batch->extra[j];
+    if (spent < max_cycles) {
+        spent += mos6502_exec(&cpus[lane], &mems[lane], max_cycles - spent);
+    }
+    if (cycles != NULL) {
+        cycles[lane] = spent;
+    }
+
+    size_t last = --batch->count;
+    batch->lane[j] = batch->lane[last];
+    batch->mem[j] = batch->mem[last];
+    batch->pc[j] = batch->pc[last];
+    batch->s[j] = batch->s[last];
+    batch->a[j] = batch->a[last];
+    batch->x[j] = batch->x[last];
+    batch->y[j] = batch->y[last];
+    batch->p[j] = batch->p[last];
+    batch->nz[j] = batch->nz[last];
+    batch->extra[j] = batch->extra[last];
+    batch->operand[j] = batch->operand[last];
+}
+
+// Loads the byte at `addr` of every lane into `reg`, as memldb does. Lanes
+// never have a profiler, so there is nothing to count.
+static forceinline void batch_ldb(Batch *batch, Lanes8 *reg)
+{
+    size_t count = batch->count;
+    for (size_t j = 0; j < count; j++) {
+        WORD addr = batch->addr[j];
+        BYTE const *page = batch->mem[j]->host[addr >> 8];
+        (*reg)[j] = likely(page != NULL) ? page[addr & 0xFF] : memldb_slow(batch->mem[j], addr);
+    }
+}
+
+// Stores `reg` of every lane at its `addr`, as memstb does
+static forceinline void batch_stb(Batch *batch, Lanes8 const *reg)
+{
+    size_t count = batch->count;
+    for (size_t j = 0; j < count; j++) {
+        RAM *mem = batch->mem[j];
+        WORD addr = batch->addr[j];
+        if (likely(mem->wr[addr >> 14] >> (addr >> 8 & 63) & 1)) {
+            mem->host[addr >> 8][addr & 0xFF] = (*reg)[j];
+        } else {
+            memstb_slow(mem, addr, (*reg)[j]);
+        }
+    }
+}
+
+// Effective addresses of every lane, as mos6502_getaddr computes them
+static forceinline void batch_getaddr(Batch *batch, AddrMode mode)
+{
+    switch (mode) {
+        case AddrMode_ZPG:
+        case AddrMode_ABS:
+            batch->addr = batch->operand;
+            break;
+
+        case AddrMode_ZPX:
+        case AddrMode_ABX:
+            batch->addr = batch->operand + LANES16(batch->x);
+            break;
+
+        case AddrMode_ZPY:
+        case AddrMode_ABY:
+            batch->addr = batch->operand + LANES16(batch->y);
+            break;
+
+        case AddrMode_IDX:
+            batch->addr = batch->operand + LANES16(batch->x);
+            for (size_t j = 0; j < batch->count; j++) {
+                batch->addr[j] = memldw(batch->mem[j], batch->addr[j]);
+            }
+            break;
+
+        case AddrMode_IDY:
+            for (size_t j = 0; j < batch->count; j++) {
+                batch->addr[j] = memldw(batch->mem[j], batch->operand[j]);
+            }
+            batch->addr += LANES16(batch->y);
+            break;
+
+        default:
+            panic("Mode \"%s\" not implemented.", modename(mode));
+    }
+}
+
+static forceinline void batch_ld(Batch *batch, AddrMode mode, Lanes8 *reg)
+{
+    if (mode == AddrMode_IMM) {
+        *reg = __builtin_convertvector(batch->operand, Lanes8);
+    } else {
+        batch_getaddr(batch, mode);
+        batch_ldb(batch, reg);
+    }
+    batch->nz = LANES16(*reg);
+
+    // https://retrocomputing.stackexchange.com/a/146. Comparisons give -1
+    // where they hold.
+    if (mode == AddrMode_ABX) {
+        batch->penalty = (Lanes16) -((batch->addr & 0xFF) < LANES16(batch->x));
+    } else if (mode == AddrMode_ABY || mode == AddrMode_IDY) {
+        batch->penalty = (Lanes16) -((batch->addr & 0xFF) < LANES16(batch->y));
+    }
+}
+
+static forceinline void batch_st(Batch *batch, AddrMode mode, Lanes8 const *reg)
+{
+    batch_getaddr(batch, mode);
+    batch_stb(batch, reg);
+}
+
+// Same push as mos6502_pushw. Expects `pc` to already point past the JSR.
+// Both bytes go to the stack page, which is looked up once for them.
+static forceinline void batch_jsr(Batch *batch)
+{
+    size_t count = batch->count;
+    for (size_t j = 0; j < count; j++) {
+        RAM *mem = batch->mem[j];
+        WORD ret = batch->pc[j] - 1;
+        BYTE s = batch->s[j];
+        if (likely(mem->wr[0] >> 1 & 1)) {
+            mem->host[1][s] = ret >> 8;
+            mem->host[1][(BYTE) (s - 1)] = ret;
+        } else {
+            memstb_slow(mem, 0x0100 | s, ret >> 8);
+            memstb_slow(mem, 0x0100 | (BYTE) (s - 1), ret);
+        }
+    }
+    batch->s -= 2;
+    batch->pc = batch->operand;
+}
+
+// Same pull as mos6502_pullw, looking the stack page up once
+static forceinline void batch_rts(Batch *batch)
+{
+    size_t count = batch->count;
+    for (size_t j = 0; j < count; j++) {
+        BYTE const *page = batch->mem[j]->host[1];
+        BYTE s = batch->s[j];
+        if (likely(page != NULL)) {
+            batch->pc[j] = page[(BYTE) (s + 1)] | page[(BYTE) (s + 2)] << 8;
+        } else {
+            BYTE lo = memldb_slow(batch->mem[j], 0x0100 | (BYTE) (s + 1));
+            batch->pc[j] = lo | memldb_slow(batch->mem[j], 0x0100 | (BYTE) (s + 2)) << 8;
+        }
+    }
+    batch->s += 2;
+    batch->pc += 1;
+}
+
+// Same as mos6502_brk, one lane at a time since it is all memory accesses
+static forceinline void batch_brk(Batch *batch)
+{
+    for (size_t j = 0; j < batch->count; j++) {
+        Core core = batch_core(batch, j);
+        core.pc++;
+        core_interrupt(&core, batch->mem[j], Vector_IRQ, Flag_B);
+        batch->pc[j] = core.pc;
+        batch->s[j] = core.s;
+        batch->p[j] = core.p;
+    }
+}
+
+// Same as mos6502_rti, one lane at a time for the same reason
+static forceinline void batch_rti(Batch *batch)
+{
+    for (size_t j = 0; j < batch->count; j++) {
+        Core core = batch_core(batch, j);
+        core_rti(&core, batch->mem[j]);
+        batch->pc[j] = core.pc;
+        batch->s[j] = core.s;
+        batch->p[j] = core.p;
+        batch->nz[j] = core.nz;
+    }
+}
+
+// CLI and SEI, which only ever touch I
+static forceinline void batch_flag(Batch *batch, BYTE set)
+{
+    batch->p = (batch->p & (BYTE) ~Flag_I) | set;
+}
+
+// Same as core_branch on every lane. Lanes may take different sides of it,
+// which batch_run then peels apart.
+static forceinline void batch_br(Batch *batch, BYTE opcode)
+{
+    // Where the flag core_cond selects is set, as -1
+    Lanes16 set;
+    switch (opcode >> 6) {
+        case 0:
+            set = (Lanes16) (((batch->nz >> 7) | (batch->nz >> 8)) & 1) != 0;
+            break;
+        case 1:
+            set = (Lanes16) ((LANES16(batch->p) & Flag_V) != 0);
+            break;
+        case 2:
+            set = (Lanes16) ((LANES16(batch->p) & Flag_C) != 0);
+            break;
+        default:
+            set = (Lanes16) ((batch->nz & 0xFF) == 0);
+            break;
+    }
+    Lanes16 taken = opcode & 0x20 ? set : ~set;
+    Offsets8 offset = __builtin_convertvector(batch->operand, Offsets8);
+    Lanes16 target = batch->pc + (Lanes16) __builtin_convertvector(offset, Offsets16);
+    Lanes16 far = (Lanes16) -((target ^ batch->pc) > 0xFF);
+    batch->penalty = taken & (1 + far);
+    batch->pc = (target & taken) | (batch->pc & ~taken);
+}
+
+static forceinline void batch_jmp(Batch *batch)
+{
+    batch->pc = batch->operand;
+}
+
+// Peels the lanes that are done, or that are about to run something else
+// than `opcode`, and fetches the operand of the others
+static forceinline void batch_fetch(Batch *batch, BYTE opcode, BYTE bytes, uint64_t max_cycles,
+                                    MOS_6502 *cpus, RAM *mems, uint64_t *cycles)
+{
+    uint64_t left = max_cycles > batch->base ? max_cycles - batch->base : 0;
+    // Peeling moves the last lane into the slot, which has been fetched
+    // already since lanes are walked from the last one
+    for (size_t j = batch->count; j-- > 0;) {
+        WORD pc = batch->pc[j];
+        BYTE const *page = batch->mem[j]->host[pc >> 8];
+        bool fast = likely(page != NULL && (pc & 0xFF) <= RAM_PAGE_SIZE - bytes);
+        BYTE const *at = fast ? page + (pc & 0xFF) : NULL;
+        if (batch->extra[j] >= left || (fast ? *at : memldb(batch->mem[j], pc)) != opcode) {
+            batch_peel(batch, j, cpus, mems, max_cycles, cycles);
+        } else if (fast) {
+            batch->operand[j] = bytes == 3 ? at[1] | at[2] << 8 : bytes == 2 ? at[1] : 0;
+        } else {
+            batch->operand[j] = bytes == 3   ? memldw(batch->mem[j], pc + 1)
+                                : bytes == 2 ? memldb(batch->mem[j], pc + 1)
+                                             : 0;
+        }
+    }
+}
+
+#define BATCH_LD(opcode, mode, reg)  batch_ld(batch, AddrMode_##mode, &batch->reg)
+#define BATCH_ST(opcode, mode, reg)  batch_st(batch, AddrMode_##mode, &batch->reg)
+#define BATCH_JSR(opcode, mode, reg) batch_jsr(batch)
+#define BATCH_RTS(opcode, mode, reg) batch_rts(batch)
+#define BATCH_BRK(opcode, mode, reg) batch_brk(batch)
+#define BATCH_RTI(opcode, mode, reg) batch_rti(batch)
+#define BATCH_CLI(opcode, mode, reg) batch_flag(batch, 0)
+#define BATCH_SEI(opcode, mode, reg) batch_flag(batch, Flag_I)
+#define BATCH_JMP(opcode, mode, reg) batch_jmp(batch)
+#define BATCH_BR(opcode, mode, reg)  batch_br(batch, opcode)
+
+// Runs instruction `name` on every lane that is about to run it, which lane 0
+// is. Operands may differ between lanes, the opcode may not. Only opcodes that
+// can take extra cycles look at `penalty`.
+#define BATCH_HANDLER(name, opcode, mnemonic, op, mode, reg, bytes, cycles_, penalty_)     \
+    static void batch_##name(Batch *batch, MOS_6502 *cpus, RAM *mems, uint64_t max_cycles, \
+                             uint64_t *cycles)                                             \
+    {                                                                                      \
+        batch_fetch(batch, opcode, bytes, max_cycles, cpus, mems, cycles);                 \
+        batch->pc += bytes;                                                                \
+        BATCH_##op(opcode, mode, reg);                                                     \
+        batch->base += cycles_;                                                            \
+        if (penalty_ != 0) {                                                               \
+            batch->extra += __builtin_convertvector(batch->penalty, Lanes32);              \
+        }                                                                                  \
+    }
+MOS6502_OPCODES(BATCH_HANDLER)
+#undef BATCH_HANDLER
+
+typedef void (*BatchHandler)(Batch *batch, MOS_6502 *cpus, RAM *mems, uint64_t max_cycles,
+                             uint64_t *cycles);
+
+#define ENTRY(name, opcode, ...) [opcode] = batch_##name,
+static BatchHandler const batch_handlers[0x100] = { MOS6502_OPCODES(ENTRY) };
+#undef ENTRY
+
+static void batch_run(Batch *batch, MOS_6502 *cpus, RAM *mems, uint64_t max_cycles,
+                      uint64_t *cycles)
+{
+    // A single lane is better off in the threaded interpreter. Extra cycles
+    // never outnumber base ones, so `extra` cannot wrap while `base` fits in
+    // 32 bits; lanes that get that far finish alone.
+    batch->base = 0;
+    while (batch->count > 1 && batch->base < UINT32_MAX / 2) {
+        BatchHandler handler = batch_handlers[memldb(batch->mem[0], batch->pc[0])];
+        if (handler == NULL) {
+            break;
+        }
+        handler(batch, cpus, mems, max_cycles, cycles);
+    }
+    while (batch->count > 0) {
+        batch_peel(batch, batch->count - 1, cpus, mems, max_cycles, cycles);
+    }
+}
+
+void mos6502_exec_batch(MOS_6502 *cpus, RAM *mems, size_t n, uint64_t max_cycles, uint64_t *cycles)
+{
+    // Vectors may need more alignment than malloc gives, 32 bytes with AVX2
+    Batch *batch = aligned_alloc(alignof(Batch), sizeof(Batch));
+    expect(batch != NULL, "Could not allocate the batch");
+    for (size_t first = 0; first < n; first += BATCH_LANES) {
+        size_t lanes = n - first < BATCH_LANES ? n - first : BATCH_LANES;
+        batch->count = 0;
+        for (size_t i = first; i < first + lanes; i++) {
+            // Lanes never look at their interrupt lines, hooks, profile,
+            // trace, breakpoints nor stop requests, so CPUs with any of those
+            // run alone
+            if (atomic_load_explicit(&cpus[i].pending, memory_order_acquire) != 0
+                || mems[i].hooks != NULL || mems[i].profiler != NULL || mems[i].trace != NULL
+                || mems[i].debug != NULL
+                || atomic_load_explicit(&mems[i].stop, memory_order_acquire)) {
+                uint64_t spent = mos6502_exec(&cpus[i], &mems[i], max_cycles);
+                if (cycles != NULL) {
+                    cycles[i] = spent;
+                }
+                continue;
+            }
+            size_t j = batch->count++;
+            batch->lane[j] = i;
+            batch->mem[j] = &mems[i];
+            batch_load(batch, j, &cpus[i]);
+        }
+        batch_run(batch, cpus, mems, max_cycles, cycles);
+    }
+    free(batch);
+}
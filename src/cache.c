@@ -0,0 +1,296 @@
+#include "cache.h"
+#include "core.h"
+#include "jit.h"
+#include "mos6502.h"
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Block *cache_slot(struct MOS_6502_Cache *cache, WORD pc)
+{
+    return &cache->blocks[(pc ^ (pc >> 10)) & (CACHE_BLOCKS - 1)];
+}
+
+// Also sends stores to `page` down the slow path of ram.c, which invalidates
+// the blocks decoded from it
+static void cache_mark(RAM *mem, BYTE page)
+{
+    mem->code[page / 64] |= (uint64_t) 1 << (page % 64);
+    mem->wr[page / 64] &= ~((uint64_t) 1 << (page % 64));
+}
+
+// Marks where superinstructions start. Instructions inside a fused group keep
+// their own handlers, for when the block is entered or left halfway through.
+static void cache_fuse(Block *block)
+{
+    for (BYTE i = 0; i < block->count;) {
+        Insn const *insn = &block->insn[i];
+        BYTE left = block->count - i;
+#define FUSION2(first, second)                                              \
+    if (left >= 2 && insn[0].opcode == first && insn[1].opcode == second) { \
+        block->insn[i].fusion = Fusion_##first##__##second;                 \
+        i += 2;                                                             \
+        continue;                                                           \
+    }
+#define FUSION3(first, second, third)                                    \
+    if (left >= 3 && insn[0].opcode == first && insn[1].opcode == second \
+        && insn[2].opcode == third) {                                    \
+        block->insn[i].fusion = Fusion_##first##__##second##__##third;   \
+        i += 3;                                                          \
+        continue;                                                        \
+    }
+        MOS6502_FUSIONS(FUSION2, FUSION3)
+#undef FUSION3
+#undef FUSION2
+        i++;
+    }
+}
+
+// Whether `block`, ending at `end`, is a loop on itself that only loads from
+// fixed addresses before jumping or branching back to its start
+static bool cache_idle_candidate(Block const *block, uint32_t end)
+{
+    Insn const *last = &block->insn[block->count - 1];
+    MOS_6502_OpInfo const *info = &mos6502_opinfo[last->opcode];
+    WORD target = info->op == Op_BR ? (WORD) (end + (int8_t) last->operand) : last->operand;
+    if ((info->op != Op_BR && info->op != Op_JMP) || target != block->pc) {
+        return false;
+    }
+    for (BYTE i = 0; i + 1 < block->count; i++) {
+        MOS_6502_OpInfo const *load = &mos6502_opinfo[block->insn[i].opcode];
+        if (load->op != Op_LD
+            || (load->mode != AddrMode_IMM && load->mode != AddrMode_ZPG
+                && load->mode != AddrMode_ABS)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decodes the straight-line run starting at `pc` into `block`. The run ends
+// after the first instruction that transfers control or CLI, before the first
+// opcode that is not implemented, or when it would wrap around memory.
+static void cache_decode(Block *block, RAM *mem, WORD pc)
+{
+    *block = (Block) { .pc = pc, .first_page = pc >> 8 };
+
+    uint32_t addr = pc;
+    while (block->count < BLOCK_INSNS) {
+        BYTE opcode = memldb(mem, addr);
+        MOS_6502_OpInfo const *info = &mos6502_opinfo[opcode];
+        if (info->name == NULL || addr + info->bytes > RAM_SIZE) {
+            break;
+        }
+
+        Insn *insn = &block->insn[block->count++];
+        insn->opcode = opcode;
+        insn->operand = info->bytes == 3 ? memldw(mem, addr + 1)
+                        : info->bytes == 2 ? memldb(mem, addr + 1)
+                                           : 0;
+        block->cycles += info->cycles;
+        block->penalty += info->penalty;
+        addr += info->bytes;
+
+        // CLI ends its block too, so that an IRQ it unmasks is taken right
+        // after it by the poll between blocks
+        if (info->op == Op_JSR || info->op == Op_RTS || info->op == Op_BRK || info->op == Op_RTI
+            || info->op == Op_JMP || info->op == Op_BR || info->op == Op_CLI) {
+            break;
+        }
+    }
+
+    if (block->count > 0) {
+        cache_fuse(block);
+        block->idle = cache_idle_candidate(block, addr);
+        block->valid = true;
+        block->last_page = (addr - 1) >> 8;
+        for (WORD page = block->first_page; page <= block->last_page; page++) {
+            cache_mark(mem, page);
+        }
+    }
+}
+
+Block *cache_lookup(struct MOS_6502_Cache *cache, RAM *mem, WORD pc)
+{
+    Block *block = cache_slot(cache, pc);
+    if (likely(block->valid && block->pc == pc)) {
+        return block;
+    }
+    cache_decode(block, mem, pc);
+    return block->valid ? block : NULL;
+}
+
+// Loads from devices may have side effects, and host memory may change under
+// the CPU at any time, so only loops reading plain memory are skipped
+static bool cache_idle_pure(Block const *block, RAM const *mem)
+{
+    for (BYTE i = 0; i + 1 < block->count; i++) {
+        Insn const *insn = &block->insn[i];
+        BYTE page = insn->operand >> 8;
+        if (mos6502_opinfo[insn->opcode].mode != AddrMode_IMM
+            && mem->bus[page / 64] >> (page % 64) & 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t cache_idle(struct MOS_6502_Cache *cache, Idle *idle, Block const *block,
+                    struct Core const *core, RAM const *mem, uint64_t cycles, uint64_t max_cycles,
+                    bool again)
+{
+    uint64_t skipped = 0;
+    if (again && idle->block == block && idle->pc == core->pc && idle->s == core->s
+        && idle->a == core->a && idle->x == core->x && idle->y == core->y && idle->p == core->p
+        && idle->nz == core->nz && cache_idle_pure(block, mem)) {
+        // Every run from here on is the same as the last one
+        uint64_t period = cycles - idle->cycles;
+        skipped = (max_cycles - cycles) / period * period;
+        if (skipped > 0) {
+            cache->stats.idle_skips++;
+            cache->stats.idle_cycles += skipped;
+        }
+    }
+    *idle = (Idle) {
+        .block = block,
+        .pc = core->pc,
+        .s = core->s,
+        .a = core->a,
+        .x = core->x,
+        .y = core->y,
+        .p = core->p,
+        .nz = core->nz,
+        .cycles = cycles + skipped,
+    };
+    return skipped;
+}
+
+// Called by the store paths of ram.c when a page flagged in `mem->code` is
+// written to: every block decoded from that page is stale.
+void memcode_invalidate(RAM *mem, BYTE page)
+{
+    mem->code[page / 64] &= ~((uint64_t) 1 << (page % 64));
+    if (mem->cache == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < CACHE_BLOCKS; i++) {
+        Block *block = &mem->cache->blocks[i];
+        if (block->valid && block->first_page <= page && page <= block->last_page) {
+            block->valid = false;
+        }
+    }
+}
+
+void mos6502_cache_enable(RAM *mem)
+{
+    if (mem->cache == NULL) {
+        mem->cache = calloc(1, sizeof(*mem->cache));
+        expect(mem->cache != NULL, "Could not allocate the block cache");
+    }
+}
+
+void mos6502_cache_disable(RAM *mem)
+{
+    if (mem->cache != NULL) {
+        jit_free(mem->cache->jit);
+        free(mem->cache->profile);
+    }
+    free(mem->cache);
+    mem->cache = NULL;
+    memset(mem->code, 0, sizeof(mem->code));
+}
+
+void mos6502_cache_flush(RAM *mem)
+{
+    if (mem->cache != NULL) {
+        for (size_t i = 0; i < CACHE_BLOCKS; i++) {
+            mem->cache->blocks[i].valid = false;
+        }
+        if (mem->cache->jit != NULL) {
+            jit_flush(mem->cache->jit);
+        }
+    }
+    memset(mem->code, 0, sizeof(mem->code));
+}
+
+// Forgets all native code, leaving every block to the interpreter again
+static void cache_drop_native(struct MOS_6502_Cache *cache)
+{
+    for (size_t i = 0; i < CACHE_BLOCKS; i++) {
+        cache->blocks[i].native = NULL;
+        cache->blocks[i].hits = 0;
+    }
+    jit_flush(cache->jit);
+}
+
+MOS_6502_CacheStats mos6502_cache_stats(RAM const *mem)
+{
+    expect(mem->cache != NULL, "Block cache not enabled");
+    return mem->cache->stats;
+}
+
+bool mos6502_cache_engine(RAM *mem, Engine engine, uint32_t threshold)
+{
+    struct MOS_6502_Cache *cache = mem->cache;
+    expect(cache != NULL, "Block cache not enabled");
+    if (engine == Engine_JIT && cache->jit == NULL && (cache->jit = jit_new()) == NULL) {
+        return false;
+    }
+    if (engine == Engine_Interpreter && cache->jit != NULL) {
+        cache_drop_native(cache);
+    }
+    cache->engine = engine;
+    cache->threshold = threshold;
+    return true;
+}
+
+NativeBlock cache_compile(struct MOS_6502_Cache *cache, Block *block)
+{
+    block->native = jit_compile(cache->jit, block);
+    if (block->native == NULL) {
+        // Out of code space: start over, hot blocks are compiled again soon
+        cache_drop_native(cache);
+        block->native = jit_compile(cache->jit, block);
+    }
+    return block->native;
+}
+
+void cache_profile(struct MOS_6502_Cache *cache, Block const *block)
+{
+    // Only the instruction that ends a block can be left out, see opgroup_member
+    BYTE count = block->count;
+    if (count > 0 && !opgroup_member(block->insn[count - 1].opcode)) {
+        count--;
+    }
+    for (BYTE i = 0; i + 1 < count; i++) {
+        BYTE a = opindex[block->insn[i].opcode];
+        BYTE b = opindex[block->insn[i + 1].opcode];
+        cache->profile->pairs[a][b]++;
+        if (i + 2 < count) {
+            cache->profile->triples[a][b][opindex[block->insn[i + 2].opcode]]++;
+        }
+    }
+}
+
+void mos6502_cache_profile(RAM *mem)
+{
+    expect(mem->cache != NULL, "Block cache not enabled");
+    if (mem->cache->profile == NULL) {
+        mem->cache->profile = calloc(1, sizeof(OpGroups));
+        expect(mem->cache->profile != NULL, "Could not allocate the profile");
+    }
+}
+
+bool mos6502_cache_profile_save(RAM *mem, char const *path)
+{
+    expect(mem->cache != NULL && mem->cache->profile != NULL, "Profiling not enabled");
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return false;
+    }
+    fprintf(out, "# 6502 fusion profile: times run, then the opcodes of a pair or triple\n");
+    opgroups_write(mem->cache->profile, out);
+    return fclose(out) == 0;
+}
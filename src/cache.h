@@ -0,0 +1,94 @@
+#ifndef MOS6502_CACHE_H_
+#define MOS6502_CACHE_H_
+
+#include "fusions.h"
+#include "lib.h"
+#include "mos6502.h"
+#include "profile.h"
+#include "ram.h"
+
+#include <stdbool.h>
+
+struct Core;
+struct Jit;
+
+// Native code generated by the JIT for a block: runs the whole block on
+// `core` and returns the cycles it took
+typedef uint64_t (*NativeBlock)(struct Core *core, RAM *mem);
+
+#define CACHE_BLOCKS 1024 // Direct-mapped on the entry PC, must be a power of two
+#define BLOCK_INSNS  16   // Longest straight-line run kept in one block
+
+enum {
+    Fusion_none,
+#define FUSION2(first, second)        Fusion_##first##__##second,
+#define FUSION3(first, second, third) Fusion_##first##__##second##__##third,
+    MOS6502_FUSIONS(FUSION2, FUSION3)
+#undef FUSION3
+#undef FUSION2
+    Fusions
+};
+
+typedef struct {
+    void const *handler; // Threaded build only: label that runs this instruction
+    WORD operand;        // Operand bytes, already fetched
+    BYTE opcode;
+    BYTE fusion; // Superinstruction starting here, see src/fusions.h
+} Insn;
+
+typedef struct {
+    WORD pc;     // Address of the first instruction
+    bool valid;  // Cleared when a page the block was decoded from is written
+    BYTE count;  // Instructions in `insn`, not counting the terminator
+    BYTE first_page;
+    BYTE last_page;
+    uint16_t cycles;  // Base cycles of all instructions
+    uint16_t penalty; // Most page-crossing cycles the instructions can add
+    uint32_t hits;    // Times the block was run, counted for the JIT only
+    bool idle;        // Busy-wait candidate, see cache_idle
+    NativeBlock native; // NULL until the JIT compiled the block
+    // Run in order; insn[count] only carries the handler that ends the block
+    Insn insn[BLOCK_INSNS + 1];
+} Block;
+
+// Last run of an idle candidate, for cache_idle to compare the next one with
+typedef struct {
+    Block const *block;
+    // Registers the block started with
+    WORD pc;
+    BYTE s, a, x, y, p;
+    WORD nz;
+    uint64_t cycles;
+} Idle;
+
+struct MOS_6502_Cache {
+    Engine engine;
+    uint32_t threshold;      // Runs after which the JIT compiles a block
+    struct Jit *jit;         // NULL until the JIT engine is first selected
+    OpGroups *profile;       // NULL unless mos6502_cache_profile was called
+    MOS_6502_CacheStats stats;
+    Block blocks[CACHE_BLOCKS];
+};
+
+// Returns the block starting at `pc`, decoding it on a miss. Returns NULL when
+// the opcode at `pc` is not implemented.
+// Handlers of a freshly decoded block are NULL until the caller resolves them.
+Block *cache_lookup(struct MOS_6502_Cache *cache, RAM *mem, WORD pc);
+
+// Counts the opcode pairs and triples of `block`, which is about to run whole
+void cache_profile(struct MOS_6502_Cache *cache, Block const *block);
+
+// Called before idle candidate `block` runs, `again` telling whether the
+// block run last was this same one. When that run left every register as it
+// found them, the loop can only end once something outside the CPU changes
+// memory, so this returns the cycles of as many more runs as fit before
+// `max_cycles`, to be credited without running them. Returns 0 otherwise.
+uint64_t cache_idle(struct MOS_6502_Cache *cache, Idle *idle, Block const *block,
+                    struct Core const *core, RAM const *mem, uint64_t cycles, uint64_t max_cycles,
+                    bool again);
+
+// Called when `block` reached the JIT threshold. Returns its native code, or
+// NULL if the block has to keep being interpreted.
+NativeBlock cache_compile(struct MOS_6502_Cache *cache, Block *block);
+
+#endif // MOS6502_CACHE_H_
@@ -0,0 +1,155 @@
+#ifndef MOS6502_CORE_H_
+#define MOS6502_CORE_H_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdatomic.h>
+
+// Working copy of the registers for the length of one mos6502_exec call. It
+// never leaves the exec loop, so the compiler keeps it in host registers and
+// MOS_6502 is only written back when the loop returns.
+typedef struct Core {
+    WORD pc; // Program counter
+    BYTE s;  // Stack pointer
+
+    BYTE a; // Accumulator
+    BYTE x; // Register index X
+    BYTE y; // Register indey Y
+
+    BYTE p; // Status register, see Flag_*. N and Z live in `nz` instead
+
+    // N and Z are evaluated lazily: instructions only record the result byte
+    // that sets them and core_getp() derives the flags when P is observed.
+    // Bit 8 stands for N when a P byte with both N and Z set was loaded,
+    // since no single result byte encodes that combination.
+    WORD nz;
+} Core;
+
+// Materializes P. Anything that observes the status register (branches, PHP,
+// interrupt entry, snapshots) must go through here.
+static forceinline BYTE core_getp(Core const *core)
+{
+    BYTE z = (core->nz & 0xFF) == 0;
+    BYTE n = ((core->nz >> 7) | (core->nz >> 8)) & 1;
+    return (core->p & ~(Flag_Z | Flag_N)) | z << 1 | n << 7;
+}
+
+static forceinline void core_setp(Core *core, BYTE p)
+{
+    core->p = p;
+    core->nz = (p & Flag_Z ? 0 : 1) | (p & Flag_N) << 1;
+}
+
+static forceinline Core core_load(MOS_6502 const *cpu)
+{
+    Core core = {
+        .pc = cpu->pc,
+        .s = cpu->s,
+        .a = cpu->a,
+        .x = cpu->x,
+        .y = cpu->y,
+    };
+    core_setp(&core, mos6502_getp(cpu));
+    return core;
+}
+
+static forceinline void core_store(Core const *core, MOS_6502 *cpu)
+{
+    cpu->pc = core->pc;
+    cpu->s = core->s;
+    cpu->a = core->a;
+    cpu->x = core->x;
+    cpu->y = core->y;
+    mos6502_setp(cpu, core_getp(core));
+}
+
+// Condition of branch `opcode`: bits 7-6 select N, V, C or Z, and the branch
+// is taken when that flag equals bit 5
+static forceinline bool core_cond(Core const *core, BYTE opcode)
+{
+    static BYTE const flags[4] = { Flag_N, Flag_V, Flag_C, Flag_Z };
+    return !(core_getp(core) & flags[opcode >> 6]) == !(opcode & 0x20);
+}
+
+// Expects `core->pc` to already point past the branch. Returns the extra
+// cycles: one when taken, plus one when the target is on another page.
+static forceinline BYTE core_branch(Core *core, BYTE opcode, BYTE offset)
+{
+    if (!core_cond(core, opcode)) {
+        return 0;
+    }
+    WORD target = core->pc + (int8_t) offset;
+    BYTE penalty = 1 + ((target ^ core->pc) > 0xFF);
+    core->pc = target;
+    return penalty;
+}
+
+// The stack lives in page 1 and grows down, `s` pointing at the next free byte
+static forceinline void core_push(Core *core, RAM *mem, BYTE b)
+{
+    memstb(mem, 0x0100 | core->s--, b);
+}
+
+static forceinline BYTE core_pull(Core *core, RAM *mem)
+{
+    return memldb(mem, 0x0100 | ++core->s);
+}
+
+// Pulls the return address JSR pushed, which points at its last byte
+static forceinline void core_rts(Core *core, RAM *mem)
+{
+    WORD lo = core_pull(core, mem);
+    WORD hi = core_pull(core, mem);
+    core->pc = (hi << 8 | lo) + 1;
+}
+
+// Entry sequence shared by BRK, IRQ and NMI: pushes PC and P, masks IRQs and
+// jumps through `vector`. Only BRK pushes P with B set.
+static forceinline void core_interrupt(Core *core, RAM *mem, WORD vector, BYTE b)
+{
+    core_push(core, mem, core->pc >> 8);
+    core_push(core, mem, core->pc);
+    core_push(core, mem, core_getp(core) | Flag__ | b);
+    core->p |= Flag_I;
+    core->pc = memldw(mem, vector);
+}
+
+// Pulls what core_interrupt pushed. B and the unused bit only exist on the
+// stack, so they keep their values.
+static forceinline void core_rti(Core *core, RAM *mem)
+{
+    BYTE p = core_pull(core, mem);
+    core_setp(core, (p & ~(Flag_B | Flag__)) | (core->p & (Flag_B | Flag__)));
+    WORD lo = core_pull(core, mem);
+    WORD hi = core_pull(core, mem);
+    core->pc = hi << 8 | lo;
+}
+
+// Takes the interrupt pending on `cpu`, if any can be taken. Returns the
+// cycles spent.
+static forceinline uint64_t core_poll(Core *core, RAM *mem, MOS_6502 *cpu)
+{
+    uint32_t pending = atomic_load_explicit(&cpu->pending, memory_order_acquire);
+    if (likely(pending == 0)) {
+        return 0;
+    }
+    if (pending & Int_NMI) {
+        atomic_fetch_and_explicit(&cpu->pending, ~(uint32_t) Int_NMI, memory_order_acq_rel);
+        core_interrupt(core, mem, Vector_NMI, 0);
+        return 7;
+    }
+    if (!(core->p & Flag_I)) {
+        core_interrupt(core, mem, Vector_IRQ, 0);
+        return 7;
+    }
+    return 0;
+}
+
+// Runs the instruction at `core->pc` alone through the interpreter, whichever
+// engine `mem` runs. Returns the cycles taken, or 0 without running anything
+// when the opcode is not implemented.
+uint64_t core_step(Core *core, RAM *mem);
+
+#endif // MOS6502_CORE_H_
@@ -0,0 +1,148 @@
+#include "debug.h"
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdlib.h>
+
+static bool debug_test(struct MOS_6502_Debug const *debug, Break kind, WORD addr)
+{
+    return debug->bits[kind][addr / 64] >> (addr % 64) & 1;
+}
+
+// Records a hit of `kind` at the `size` bytes from `addr`, if any
+static bool debug_access(struct MOS_6502_Debug *debug, Break kind, WORD addr, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (debug_test(debug, kind, addr + i)) {
+            debug->stopped = Stop_Watchpoint;
+            debug->addr = addr + i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Same for the `size` bytes of the stack from `s + from`, which wraps within
+// its page
+static bool debug_stack(struct MOS_6502_Debug *debug, Break kind, BYTE s, int from, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (debug_access(debug, kind, 0x0100 | (BYTE) (s + from + i), 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Same as the accesses of the instruction at `core->pc`, see mos6502_getaddr
+static bool debug_watch(struct MOS_6502_Debug *debug, Core const *core, RAM const *mem)
+{
+    MOS_6502_OpInfo const *info = &mos6502_opinfo[mempeek(mem, core->pc)];
+    WORD operand = info->bytes == 3 ? mempeekw(mem, core->pc + 1) : mempeek(mem, core->pc + 1);
+    switch (info->op) {
+        case Op_JSR:
+            return debug_stack(debug, Break_Write, core->s, -1, 2);
+        case Op_RTS:
+            return debug_stack(debug, Break_Read, core->s, 1, 2);
+        case Op_BRK:
+            return debug_stack(debug, Break_Write, core->s, -2, 3)
+                   || debug_access(debug, Break_Read, Vector_IRQ, 2);
+        case Op_RTI:
+            return debug_stack(debug, Break_Read, core->s, 1, 3);
+        case Op_LD:
+        case Op_ST:
+            break;
+        default:
+            return false;
+    }
+
+    WORD addr;
+    switch (info->mode) {
+        case AddrMode_IMM:
+            return false;
+        case AddrMode_ZPX:
+        case AddrMode_ABX:
+            addr = operand + core->x;
+            break;
+        case AddrMode_ZPY:
+        case AddrMode_ABY:
+            addr = operand + core->y;
+            break;
+        case AddrMode_IDX:
+            if (debug_access(debug, Break_Read, operand + core->x, 2)) {
+                return true;
+            }
+            addr = mempeekw(mem, operand + core->x);
+            break;
+        case AddrMode_IDY:
+            if (debug_access(debug, Break_Read, operand, 2)) {
+                return true;
+            }
+            addr = mempeekw(mem, operand) + core->y;
+            break;
+        default:
+            addr = operand;
+            break;
+    }
+    return debug_access(debug, info->op == Op_LD ? Break_Read : Break_Write, addr, 1);
+}
+
+bool debug_hit(struct MOS_6502_Debug *debug, Core const *core, RAM *mem)
+{
+    if (atomic_exchange_explicit(&mem->stop, false, memory_order_acq_rel)) {
+        debug->stopped = Stop_Event;
+        return true;
+    }
+    if (debug_test(debug, Break_Exec, core->pc)) {
+        debug->stopped = Stop_Breakpoint;
+        debug->addr = core->pc;
+        return true;
+    }
+    if ((debug->count[Break_Read] | debug->count[Break_Write]) == 0) {
+        return false;
+    }
+    return debug_watch(debug, core, mem);
+}
+
+struct MOS_6502_Debug *debug_get(RAM *mem)
+{
+    if (mem->debug == NULL) {
+        mem->debug = calloc(1, sizeof(*mem->debug));
+        expect(mem->debug != NULL, "Could not allocate the breakpoints");
+    }
+    return mem->debug;
+}
+
+void mos6502_break(RAM *mem, Break kind, WORD addr)
+{
+    struct MOS_6502_Debug *debug = debug_get(mem);
+    if (!debug_test(debug, kind, addr)) {
+        debug->bits[kind][addr / 64] |= (uint64_t) 1 << (addr % 64);
+        debug->count[kind]++;
+    }
+}
+
+void mos6502_unbreak(RAM *mem, Break kind, WORD addr)
+{
+    struct MOS_6502_Debug *debug = mem->debug;
+    if (debug != NULL && debug_test(debug, kind, addr)) {
+        debug->bits[kind][addr / 64] &= ~((uint64_t) 1 << (addr % 64));
+        debug->count[kind]--;
+    }
+}
+
+void mos6502_stop(RAM *mem)
+{
+    atomic_store_explicit(&mem->stop, true, memory_order_release);
+}
+
+Stop mos6502_stopped(RAM const *mem, WORD *addr)
+{
+    if (mem->debug == NULL) {
+        return Stop_Budget;
+    }
+    if (addr != NULL) {
+        *addr = mem->debug->addr;
+    }
+    return mem->debug->stopped;
+}
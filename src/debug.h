@@ -0,0 +1,38 @@
+#ifndef MOS6502_DEBUG_H_
+#define MOS6502_DEBUG_H_
+
+#include "core.h"
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// A single allocation, so that memfree can release it without knowing more
+struct MOS_6502_Debug {
+    uint64_t bits[3][RAM_SIZE / 64]; // Addresses of each Break kind
+    uint32_t count[3];               // Bits set in each map
+    Stop stopped;
+    WORD addr;
+};
+
+// Whether mos6502_exec has to run the debugging loop
+static forceinline bool debug_armed(RAM *mem)
+{
+    struct MOS_6502_Debug const *debug = mem->debug;
+    return atomic_load_explicit(&mem->stop, memory_order_acquire)
+           || (debug != NULL
+               && (debug->count[Break_Exec] | debug->count[Break_Read] | debug->count[Break_Write])
+                          != 0);
+}
+
+// Allocates the breakpoints of `mem` on first use. Only for the thread that
+// runs `mem`, or while nothing does.
+struct MOS_6502_Debug *debug_get(RAM *mem);
+
+// Whether the instruction at `core->pc` hits a breakpoint or watchpoint, or a
+// stop was asked for. Records why in `debug` when it does.
+bool debug_hit(struct MOS_6502_Debug *debug, Core const *core, RAM *mem);
+
+#endif // MOS6502_DEBUG_H_
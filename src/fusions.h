@@ -0,0 +1,16 @@
+#ifndef MOS6502_FUSIONS_H_
+#define MOS6502_FUSIONS_H_
+
+// Superinstructions: runs of opcodes that blocks execute with a single
+// dispatch. Earlier rows win when several match at the same instruction.
+// Regenerate from a profile with `make fusions PROFILE=<file>`.
+//
+// X2(first, second)
+// X3(first, second, third)
+#define MOS6502_FUSIONS(X2, X3)   \
+    X3(LDX_IMM, LDY_IMM, LDA_IMM) \
+    X2(LDA_IMM, STA_ABS)          \
+    X2(LDX_IMM, LDY_IMM)          \
+    X2(LDA_ZPG, STA_ZPG)
+
+#endif // MOS6502_FUSIONS_H_
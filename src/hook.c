@@ -0,0 +1,73 @@
+#include "hook.h"
+#include "core.h"
+#include "lib.h"
+#include "memo.h"
+#include "mos6502.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static Hook *hook_find(struct MOS_6502_Hooks *hooks, WORD addr)
+{
+    for (size_t i = 0; i < hooks->count; i++) {
+        if (hooks->hook[i].addr == addr) {
+            return &hooks->hook[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t hook_call(Core *core, RAM *mem, WORD addr)
+{
+    Hook const *hook = hook_find(mem->hooks, addr);
+    if (hook->fn == NULL) {
+        return memo_call(core, mem, addr);
+    }
+    if (mem->memo != NULL) {
+        // Whatever the hook does outside of memory cannot be replayed
+        memo_taint(mem);
+    }
+    MOS_6502 cpu = { 0 };
+    core_store(core, &cpu);
+    uint32_t cycles = hook->fn(&cpu, mem, hook->user);
+    *core = core_load(&cpu);
+    core_rts(core, mem);
+    return hook->cycles != 0 ? hook->cycles : cycles;
+}
+
+void hook_set(RAM *mem, WORD addr, MOS_6502_HookFn fn, void *user, uint32_t cycles)
+{
+    struct MOS_6502_Hooks *hooks = mem->hooks;
+    if (hooks == NULL) {
+        hooks = calloc(1, sizeof(*hooks));
+        expect(hooks != NULL, "Could not allocate the hook table");
+    }
+    Hook *hook = hook_find(hooks, addr);
+    if (hook == NULL) {
+        if (hooks->count == hooks->capacity) {
+            hooks->capacity = hooks->capacity ? hooks->capacity * 2 : 8;
+            hooks = realloc(hooks, sizeof(*hooks) + hooks->capacity * sizeof(Hook));
+            expect(hooks != NULL, "Could not grow the hook table");
+        }
+        hook = &hooks->hook[hooks->count++];
+    }
+    *hook = (Hook) { .addr = addr, .cycles = cycles, .fn = fn, .user = user };
+    hooks->bits[addr / 64] |= (uint64_t) 1 << (addr % 64);
+    mem->hooks = hooks;
+}
+
+void mos6502_hook(RAM *mem, WORD addr, MOS_6502_HookFn fn, void *user, uint32_t cycles)
+{
+    expect(fn != NULL, "No hook given for 0x%04x", addr);
+    hook_set(mem, addr, fn, user, cycles);
+}
+
+void mos6502_unhook(RAM *mem, WORD addr)
+{
+    struct MOS_6502_Hooks *hooks = mem->hooks;
+    Hook *hook = hooks != NULL ? hook_find(hooks, addr) : NULL;
+    if (hook != NULL) {
+        *hook = hooks->hook[--hooks->count];
+        hooks->bits[addr / 64] &= ~((uint64_t) 1 << (addr % 64));
+    }
+}
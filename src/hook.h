@@ -0,0 +1,42 @@
+#ifndef MOS6502_HOOK_H_
+#define MOS6502_HOOK_H_
+
+#include "core.h"
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+typedef struct {
+    WORD addr;
+    uint32_t cycles;    // Charged for every call, or 0 to charge what `fn` returns
+    MOS_6502_HookFn fn; // NULL for subroutines memoized by memo.c
+    void *user;
+} Hook;
+
+// A single allocation, so that memfree can release it without knowing more
+struct MOS_6502_Hooks {
+    uint64_t bits[RAM_SIZE / 64]; // Hooked subroutine addresses
+    size_t count;
+    size_t capacity;
+    Hook hook[];
+};
+
+// Hooks `fn` to `addr`, see mos6502_hook
+void hook_set(RAM *mem, WORD addr, MOS_6502_HookFn fn, void *user, uint32_t cycles);
+
+// Runs the hook of the subroutine `core` just entered at `addr` and returns
+// from it, unless memo_call leaves it running. Returns the cycles to charge.
+uint32_t hook_call(Core *core, RAM *mem, WORD addr);
+
+// Called by every engine right after a JSR to `addr`. Unhooked subroutines
+// cost a pointer test, or a bit test once anything is hooked in `mem`.
+static forceinline uint32_t hook_jsr(Core *core, RAM *mem, WORD addr)
+{
+    struct MOS_6502_Hooks const *hooks = mem->hooks;
+    if (likely(hooks == NULL || !(hooks->bits[addr / 64] >> (addr % 64) & 1))) {
+        return 0;
+    }
+    return hook_call(core, mem, addr);
+}
+
+#endif // MOS6502_HOOK_H_
@@ -0,0 +1,193 @@
+#define _DEFAULT_SOURCE
+
+#include "image.h"
+#include "lib.h"
+#include "ram.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_SEGMENTS 64
+
+typedef struct {
+    void *map;          // Whole file, NULL when it is empty
+    size_t length;
+    BYTE const *bytes;  // Where the segment starts in `map`
+    uint32_t load;
+    size_t size;
+} Segment;
+
+struct MOS_6502_Image {
+    size_t count;
+    Segment segments[IMAGE_SEGMENTS];
+    BYTE const *host[RAM_PAGES]; // Pages mapped straight from a file
+    RAM_Rom rom;                 // Pages segments only partly cover
+};
+
+// Maps `size` bytes of `path` from `offset`, or all of them from `offset` when
+// `size` is SIZE_MAX
+static bool image_add(MOS_6502_Image *image, char const *path, uint32_t load, size_t offset,
+                      size_t size)
+{
+    if (image->count == IMAGE_SEGMENTS) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || offset > (size_t) st.st_size) {
+        close(fd);
+        return false;
+    }
+    size_t length = st.st_size;
+    if (size == SIZE_MAX) {
+        size = length - offset;
+    }
+    if (size > length - offset || load + size > RAM_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    void *map = NULL;
+    if (length > 0) {
+        map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    image->segments[image->count++] = (Segment) {
+        .map = map,
+        .length = length,
+        .bytes = (BYTE const *) map + offset,
+        .load = load,
+        .size = size,
+    };
+    return true;
+}
+
+// Chooses where each page comes from: straight from the file when the last
+// segment to cover all of it is not overlapped by a later one, from a copy
+// otherwise
+static void image_build(MOS_6502_Image *image)
+{
+    for (uint32_t page = 0; page < RAM_PAGES; page++) {
+        uint32_t start = page << 8;
+        uint32_t end = start + RAM_PAGE_SIZE;
+        size_t first = 0; // First segment that counts for the page
+        for (size_t i = 0; i < image->count; i++) {
+            Segment const *seg = &image->segments[i];
+            if (seg->load <= start && seg->load + seg->size >= end) {
+                first = i;
+                image->host[page] = seg->bytes + (start - seg->load);
+            }
+        }
+
+        bool copied = false;
+        for (size_t i = first; i < image->count; i++) {
+            Segment const *seg = &image->segments[i];
+            if (seg->size == 0 || seg->load >= end || seg->load + seg->size <= start) {
+                continue;
+            }
+            if (image->host[page] != NULL && i == first) {
+                continue;
+            }
+            if (!copied && image->host[page] != NULL) {
+                memrom_load(&image->rom, start, image->host[page], RAM_PAGE_SIZE);
+            }
+            copied = true;
+            uint32_t from = seg->load > start ? seg->load : start;
+            uint32_t to = seg->load + seg->size < end ? seg->load + seg->size : end;
+            memrom_load(&image->rom, from, seg->bytes + (from - seg->load), to - from);
+        }
+        if (copied) {
+            image->host[page] = NULL;
+        }
+    }
+}
+
+MOS_6502_Image *mos6502_image_open(char const *path, WORD load)
+{
+    MOS_6502_Image *image = calloc(1, sizeof(MOS_6502_Image));
+    expect(image != NULL, "Could not allocate the image");
+    if (!image_add(image, path, load, 0, SIZE_MAX)) {
+        free(image);
+        return NULL;
+    }
+    image_build(image);
+    return image;
+}
+
+MOS_6502_Image *mos6502_image_manifest(char const *path)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        eprintf("%s: cannot open\n", path);
+        return NULL;
+    }
+    MOS_6502_Image *image = calloc(1, sizeof(MOS_6502_Image));
+    expect(image != NULL, "Could not allocate the image");
+
+    // Files are relative to the directory of the manifest
+    char const *slash = strrchr(path, '/');
+    int dir = slash != NULL ? slash - path + 1 : 0;
+
+    char line[PATH_MAX + 64];
+    for (size_t number = 1; fgets(line, sizeof(line), in) != NULL; number++) {
+        char file[PATH_MAX];
+        long load, offset = 0, size = -1;
+        char const *text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\n' || *text == '\0') {
+            continue;
+        }
+        int fields = sscanf(text, "%4095s %li %li %li", file, &load, &offset, &size);
+        if (fields < 2 || load < 0 || load >= RAM_SIZE || offset < 0 || (fields == 4 && size < 0)) {
+            eprintf("%s:%zu: expected `file load_addr [offset [size]]`\n", path, number);
+            goto fail;
+        }
+        char full[PATH_MAX + PATH_MAX];
+        snprintf(full, sizeof(full), "%.*s%s", file[0] == '/' ? 0 : dir, path, file);
+        if (!image_add(image, full, load, offset, size < 0 ? SIZE_MAX : (size_t) size)) {
+            eprintf("%s:%zu: cannot map \"%s\" at 0x%04lX\n", path, number, full, load);
+            goto fail;
+        }
+    }
+    fclose(in);
+    image_build(image);
+    return image;
+
+fail:
+    fclose(in);
+    mos6502_image_free(image);
+    return NULL;
+}
+
+void mos6502_image_map(MOS_6502_Image const *image, RAM *mem)
+{
+    for (size_t page = 0; page < RAM_PAGES; page++) {
+        if (image->host[page] != NULL) {
+            memmap_host(mem, page << 8, RAM_PAGE_SIZE, (BYTE *) image->host[page], false);
+        }
+    }
+    memrom_map(mem, &image->rom);
+}
+
+void mos6502_image_free(MOS_6502_Image *image)
+{
+    for (size_t i = 0; i < image->count; i++) {
+        if (image->segments[i].map != NULL) {
+            munmap(image->segments[i].map, image->segments[i].length);
+        }
+    }
+    memrom_free(&image->rom);
+    free(image);
+}
@@ -0,0 +1,709 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include "jit.h"
+#include "core.h"
+#include "hook.h"
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+// x86-64 backend. Generated blocks follow the System V calling convention and
+// keep the 6502 registers in callee-saved host registers. Loads and stores go
+// through the bus inline, like memldb and memstb do, and only call the slow
+// paths in ram.c for pages the bus does not cover:
+//
+//   rbx: Core *   r12: RAM *   r13: cycles spent on page crossings
+//   r14: A        r15: X       rbp: Y
+//
+// Each block is laid out as a shared exit stub followed by its entry point,
+// so every early exit is a backward jump to an address already known. The
+// slow paths of its loads and stores come last, out of the way of the code
+// that runs.
+
+#define JIT_SIZE     (1 << 20) // Bytes of code per cache
+#define JIT_MAX_SIZE 4096      // Upper bound on the code of a single block
+
+struct Jit {
+    BYTE *code;
+    size_t used;
+};
+
+enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+};
+
+// Slow path of a load, store or push, emitted after the rest of the block
+typedef enum {
+    Slow_Load,
+    Slow_Store,
+    Slow_Push,
+    Slow_Pointer, // Of an (indirect),Y operand, into esi
+    Slow_Return,  // Both pulls of an RTS
+} SlowKind;
+
+typedef struct {
+    SlowKind kind;
+    BYTE *jump; // Just past the branch to it
+    BYTE *back; // Where it resumes the block
+    int reg;    // Register loaded or stored, or byte pushed
+    bool known; // Whether it has to load `addr` into esi itself
+    WORD addr;
+    WORD next;  // Where a store that invalidated the block leaves it
+    uint32_t cycles;
+} Slow;
+
+typedef struct {
+    BYTE *p;
+    // Two per load or store, plus the two pushes of the JSR that ends a block
+    Slow slow[2 * BLOCK_INSNS + 2];
+    size_t slows;
+} Emitter;
+
+// Any function generated code calls. Call sites cast to it, since ISO C only
+// converts between function pointer types.
+typedef void (*Helper)(void);
+
+static void emit(Emitter *e, int n, ...)
+{
+    va_list args;
+    va_start(args, n);
+    for (int i = 0; i < n; i++) {
+        *e->p++ = va_arg(args, int);
+    }
+    va_end(args);
+}
+
+static void emit32(Emitter *e, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        *e->p++ = v >> (8 * i);
+    }
+}
+
+static void emit64(Emitter *e, uint64_t v)
+{
+    emit32(e, v);
+    emit32(e, v >> 32);
+}
+
+static BYTE rex(int w, int r, int b)
+{
+    return 0x40 | w << 3 | (r >> 3) << 2 | (b >> 3);
+}
+
+static BYTE modrm(int mod, int reg, int rm)
+{
+    return mod << 6 | (reg & 7) << 3 | (rm & 7);
+}
+
+// push/pop r64
+static void emit_push(Emitter *e, int r)
+{
+    if (r >= 8) {
+        emit(e, 1, rex(0, 0, r));
+    }
+    emit(e, 1, 0x50 + (r & 7));
+}
+
+static void emit_pop(Emitter *e, int r)
+{
+    if (r >= 8) {
+        emit(e, 1, rex(0, 0, r));
+    }
+    emit(e, 1, 0x58 + (r & 7));
+}
+
+// mov dst64, src64
+static void emit_mov64(Emitter *e, int dst, int src)
+{
+    emit(e, 3, rex(1, src, dst), 0x89, modrm(3, src, dst));
+}
+
+// mov dst32, src32
+static void emit_mov32(Emitter *e, int dst, int src)
+{
+    emit(e, 3, rex(0, src, dst), 0x89, modrm(3, src, dst));
+}
+
+// mov dst32, imm32
+static void emit_movi(Emitter *e, int dst, uint32_t imm)
+{
+    if (dst >= 8) {
+        emit(e, 1, rex(0, 0, dst));
+    }
+    emit(e, 1, 0xB8 + (dst & 7));
+    emit32(e, imm);
+}
+
+// add dst32, src32
+static void emit_add32(Emitter *e, int dst, int src)
+{
+    emit(e, 3, rex(0, src, dst), 0x01, modrm(3, src, dst));
+}
+
+// movzx dst32, src8
+static void emit_movzxb(Emitter *e, int dst, int src)
+{
+    emit(e, 4, rex(0, dst, src), 0x0F, 0xB6, modrm(3, dst, src));
+}
+
+// movzx dst32, src16
+static void emit_movzxw(Emitter *e, int dst, int src)
+{
+    emit(e, 4, rex(0, dst, src), 0x0F, 0xB7, modrm(3, dst, src));
+}
+
+// movzx dst32, byte [rbx + off]
+static void emit_load_core(Emitter *e, int dst, size_t off)
+{
+    emit(e, 5, rex(0, dst, RBX), 0x0F, 0xB6, modrm(1, dst, RBX), (BYTE) off);
+}
+
+// mov byte [rbx + off], src8
+static void emit_store_core(Emitter *e, size_t off, int src)
+{
+    emit(e, 4, rex(0, src, RBX), 0x88, modrm(1, src, RBX), (BYTE) off);
+}
+
+// mov word [rbx + off], src16
+static void emit_store_core16(Emitter *e, size_t off, int src)
+{
+    emit(e, 5, 0x66, rex(0, src, RBX), 0x89, modrm(1, src, RBX), (BYTE) off);
+}
+
+// mov word [rbx + off], imm16
+static void emit_store_core16i(Emitter *e, size_t off, WORD imm)
+{
+    emit(e, 6, 0x66, 0xC7, modrm(1, 0, RBX), (BYTE) off, imm & 0xFF, imm >> 8);
+}
+
+// mov rdi, r12; mov rax, fn; call rax
+static void emit_call(Emitter *e, Helper fn)
+{
+    emit_mov64(e, RDI, R12);
+    emit(e, 2, rex(1, 0, RAX), 0xB8);
+    emit64(e, (uintptr_t) fn);
+    emit(e, 2, 0xFF, modrm(3, 2, RAX));
+}
+
+// mov word [rbx + pc], pc; lea eax, [r13 + cycles]; jmp exit stub
+static void emit_exit(Emitter *e, BYTE const *leave, WORD pc, uint32_t cycles)
+{
+    emit_store_core16i(e, offsetof(Core, pc), pc);
+    emit(e, 3, rex(0, RAX, R13), 0x8D, modrm(2, RAX, R13));
+    emit32(e, cycles);
+    emit(e, 1, 0xE9);
+    emit32(e, leave - (e->p + 4));
+}
+
+static int jit_reg(Reg reg)
+{
+    return reg == Reg_a ? R14 : reg == Reg_x ? R15 : RBP;
+}
+
+// Whether the address of the operand is known when the block is compiled
+static bool jit_known(AddrMode mode)
+{
+    return mode == AddrMode_ZPG || mode == AddrMode_ABS;
+}
+
+// mov rdi, [r12 + host + page * 8]
+static void emit_host(Emitter *e, BYTE page)
+{
+    emit(e, 4, rex(1, RDI, R12), 0x8B, modrm(2, RDI, R12), 0x24);
+    emit32(e, offsetof(RAM, host) + page * sizeof(BYTE *));
+}
+
+// Leaves the page of the address in esi in eax, the host memory behind it in
+// rdi and the offset into it in ecx
+static void emit_host_at(Emitter *e)
+{
+    emit(e, 2, 0x89, modrm(3, RSI, RAX));                          // mov eax, esi
+    emit(e, 3, 0xC1, modrm(3, 5, RAX), 8);                         // shr eax, 8
+    emit(e, 4, rex(1, RDI, R12), 0x8B, modrm(2, RDI, RSP), 0xC4); // mov rdi, [r12 + rax * 8 + host]
+    emit32(e, offsetof(RAM, host));
+    emit_movzxb(e, RCX, RSI);
+}
+
+// test byte [r12 + wr + page / 8], 1 << page % 8
+static void emit_test_wr(Emitter *e, BYTE page)
+{
+    emit(e, 4, rex(0, 0, R12), 0xF6, modrm(2, 0, R12), 0x24);
+    emit32(e, offsetof(RAM, wr) + page / 8);
+    emit(e, 1, 1 << page % 8);
+}
+
+// Sets CF to the bit of the page in eax in `wr`, clobbering rdx
+static void emit_bt_wr(Emitter *e)
+{
+    emit(e, 2, 0x89, modrm(3, RAX, RDX));                          // mov edx, eax
+    emit(e, 3, 0xC1, modrm(3, 5, RDX), 6);                         // shr edx, 6
+    emit(e, 4, rex(1, RDX, R12), 0x8B, modrm(2, RDX, RSP), 0xD4); // mov rdx, [r12 + rdx * 8 + wr]
+    emit32(e, offsetof(RAM, wr));
+    emit(e, 4, rex(1, RAX, RDX), 0x0F, 0xA3, modrm(3, RAX, RDX)); // bt rdx, rax
+}
+
+// Branches on `cc` to a slow path, which resumes the block where the code
+// emitted next ends. Returns it for the caller to fill in.
+static Slow *emit_slow(Emitter *e, BYTE cc, SlowKind kind)
+{
+    expect(e->slows < sizeof(e->slow) / sizeof(e->slow[0]), "Too many slow paths");
+    emit(e, 2, 0x0F, 0x80 | cc); // jcc rel32
+    emit32(e, 0);
+    Slow *slow = &e->slow[e->slows++];
+    *slow = (Slow) { .kind = kind, .jump = e->p };
+    return slow;
+}
+
+// Points the rel32 that ends at `at` to `to`
+static void patch32(BYTE *at, BYTE const *to)
+{
+    uint32_t rel = to - at;
+    for (int i = 0; i < 4; i++) {
+        at[i - 4] = rel >> (8 * i);
+    }
+}
+
+// Leaves the effective address of the operand in esi
+static void emit_addr(Emitter *e, AddrMode mode, WORD operand)
+{
+    emit_movi(e, RSI, operand);
+    switch (mode) {
+        case AddrMode_ZPX:
+            emit_add32(e, RSI, R15);
+            break;
+        case AddrMode_ZPY:
+            emit_add32(e, RSI, RBP);
+            break;
+        case AddrMode_ABX:
+        case AddrMode_ABY:
+            emit_add32(e, RSI, mode == AddrMode_ABX ? R15 : RBP);
+            emit_movzxw(e, RSI, RSI);
+            break;
+        case AddrMode_IDX:
+            emit_add32(e, RSI, R15);
+            emit_call(e, (Helper) memldw);
+            emit_movzxw(e, RSI, RAX);
+            break;
+        case AddrMode_IDY:
+            if ((operand & 0xFF) == 0xFF) {
+                emit_call(e, (Helper) memldw);
+                emit_movzxw(e, RSI, RAX);
+            } else { // Mirrors memldw, with the pointer in the zero page
+                emit_host(e, 0x00);
+                emit(e, 3, rex(1, RDI, RDI), 0x85, modrm(3, RDI, RDI)); // test rdi, rdi
+                Slow *slow = emit_slow(e, 0x4, Slow_Pointer);           // jz
+                // movzx esi, word [rdi + operand]
+                emit(e, 4, rex(0, RSI, RDI), 0x0F, 0xB7, modrm(2, RSI, RDI));
+                emit32(e, operand & 0xFF);
+                slow->back = e->p;
+            }
+            emit_add32(e, RSI, RBP);
+            emit_movzxw(e, RSI, RSI);
+            break;
+        default:
+            break;
+    }
+}
+
+// r13 += (esi & 0xFF) < index
+static void emit_penalty(Emitter *e, int index)
+{
+    emit_movzxb(e, RCX, RSI);
+    emit(e, 3, rex(0, index, RCX), 0x39, modrm(3, index, RCX));
+    emit(e, 4, rex(0, 0, R13), 0x83, modrm(3, 2, R13), 0x00);
+}
+
+// Mirrors memldb: pages with host memory are read inline, others take the
+// slow path
+static void emit_ld(Emitter *e, MOS_6502_OpInfo const *info, WORD operand)
+{
+    int reg = jit_reg(info->reg);
+    if (info->mode == AddrMode_IMM) {
+        emit_movi(e, reg, operand & 0xFF);
+        emit_store_core16(e, offsetof(Core, nz), reg);
+        return;
+    }
+    bool known = jit_known(info->mode);
+    if (known) {
+        emit_host(e, operand >> 8);
+    } else {
+        emit_addr(e, info->mode, operand);
+        if (info->penalty) {
+            emit_penalty(e, info->mode == AddrMode_ABX ? R15 : RBP);
+        }
+        emit_host_at(e);
+    }
+    emit(e, 3, rex(1, RDI, RDI), 0x85, modrm(3, RDI, RDI)); // test rdi, rdi
+    Slow *slow = emit_slow(e, 0x4, Slow_Load);              // jz
+    if (known) { // movzx reg, byte [rdi + offset]
+        emit(e, 4, rex(0, reg, RDI), 0x0F, 0xB6, modrm(2, reg, RDI));
+        emit32(e, operand & 0xFF);
+    } else { // movzx reg, byte [rdi + rcx]
+        emit(e, 5, rex(0, reg, RDI), 0x0F, 0xB6, modrm(0, reg, RSP), 0x0F);
+    }
+    slow->back = e->p;
+    slow->reg = reg;
+    slow->known = known;
+    slow->addr = operand;
+    emit_store_core16(e, offsetof(Core, nz), reg);
+}
+
+// Mirrors memstb: pages in `wr` are written inline, others take the slow path.
+// Pages holding decoded code are never in `wr`, so only the slow path can
+// invalidate the block.
+static void emit_st(Emitter *e, MOS_6502_OpInfo const *info, WORD operand, WORD next,
+                    uint32_t cycles)
+{
+    int reg = jit_reg(info->reg);
+    bool known = jit_known(info->mode);
+    Slow *slow;
+    if (known) {
+        emit_test_wr(e, operand >> 8);
+        slow = emit_slow(e, 0x4, Slow_Store); // jz
+        emit_host(e, operand >> 8);
+        emit(e, 3, rex(0, reg, RDI), 0x88, modrm(2, reg, RDI)); // mov byte [rdi + offset], reg
+        emit32(e, operand & 0xFF);
+    } else {
+        emit_addr(e, info->mode, operand);
+        emit_host_at(e);
+        emit_bt_wr(e);
+        slow = emit_slow(e, 0x3, Slow_Store);                         // jnc
+        emit(e, 4, rex(0, reg, RDI), 0x88, modrm(0, reg, RSP), 0x0F); // mov byte [rdi + rcx], reg
+    }
+    slow->back = e->p;
+    slow->reg = reg;
+    slow->known = known;
+    slow->addr = operand;
+    slow->next = next;
+    slow->cycles = cycles;
+}
+
+// Mirrors core_push: the byte goes to 0x100 + s, then s is decremented. The
+// stack page is known, so only the offset is loaded for the inline store.
+static void emit_push_byte(Emitter *e, BYTE b)
+{
+    emit_test_wr(e, 0x01);
+    Slow *slow = emit_slow(e, 0x4, Slow_Push); // jz
+    emit_host(e, 0x01);
+    emit_load_core(e, RCX, offsetof(Core, s));
+    emit(e, 4, 0xC6, modrm(0, 0, RSP), 0x0F, b); // mov byte [rdi + rcx], b
+    slow->back = e->p;
+    slow->reg = b;
+    emit(e, 3, 0xFE, modrm(1, 1, RBX), (BYTE) offsetof(Core, s)); // dec byte [rbx + s]
+}
+
+// mov rdi, rbx; mov rsi, r12; mov rax, fn; call rax
+static void emit_call_core(Emitter *e, Helper fn)
+{
+    emit_mov64(e, RSI, R12);
+    emit_mov64(e, RDI, RBX);
+    emit(e, 2, rex(1, 0, RAX), 0xB8);
+    emit64(e, (uintptr_t) fn);
+    emit(e, 2, 0xFF, modrm(3, 2, RAX));
+}
+
+// Mirrors core_rts, pulling both bytes from the stack page inline
+static void emit_rts(Emitter *e)
+{
+    emit_host(e, 0x01);
+    emit(e, 3, rex(1, RDI, RDI), 0x85, modrm(3, RDI, RDI)); // test rdi, rdi
+    Slow *slow = emit_slow(e, 0x4, Slow_Return);            // jz
+    emit_load_core(e, RCX, offsetof(Core, s));
+    emit(e, 3, 0x80, modrm(3, 0, RCX), 1);            // add cl, 1
+    emit(e, 4, 0x0F, 0xB6, modrm(0, RAX, RSP), 0x0F); // movzx eax, byte [rdi + rcx]
+    emit(e, 3, 0x80, modrm(3, 0, RCX), 1);            // add cl, 1
+    emit(e, 4, 0x0F, 0xB6, modrm(0, RDX, RSP), 0x0F); // movzx edx, byte [rdi + rcx]
+    emit_store_core(e, offsetof(Core, s), RCX);
+    emit(e, 3, 0xC1, modrm(3, 4, RDX), 8); // shl edx, 8
+    emit(e, 2, 0x09, modrm(3, RDX, RAX));  // or eax, edx
+    emit(e, 2, 0xFF, modrm(3, 0, RAX));    // inc eax
+    emit_store_core16(e, offsetof(Core, pc), RAX);
+    slow->back = e->p;
+}
+
+// Called by generated code for a JSR to a subroutine that may be hooked
+static uint32_t jit_hook(Core *core, RAM *mem, uint32_t addr)
+{
+    return hook_jsr(core, mem, addr);
+}
+
+// Mirrors mos6502_jsr. Hooks see and change every register, so A, X and Y go
+// through Core around the call, which is skipped while nothing is hooked.
+static void emit_jsr(Emitter *e, WORD operand, WORD next)
+{
+    WORD ret = next - 1;
+    emit_push_byte(e, ret >> 8);
+    emit_push_byte(e, ret & 0xFF);
+    emit_store_core16i(e, offsetof(Core, pc), operand);
+
+    // mov rax, [r12 + hooks]; test rax, rax; jz over the call
+    emit(e, 4, rex(1, RAX, R12), 0x8B, modrm(2, RAX, R12), 0x24);
+    emit32(e, offsetof(RAM, hooks));
+    emit(e, 3, rex(1, RAX, RAX), 0x85, modrm(3, RAX, RAX));
+    emit(e, 2, 0x74, 0x00);
+    BYTE *skip = e->p;
+    emit_store_core(e, offsetof(Core, a), R14);
+    emit_store_core(e, offsetof(Core, x), R15);
+    emit_store_core(e, offsetof(Core, y), RBP);
+    emit_movi(e, RDX, operand);
+    emit_call_core(e, (Helper) jit_hook);
+    emit_add32(e, R13, RAX);
+    emit_load_core(e, R14, offsetof(Core, a));
+    emit_load_core(e, R15, offsetof(Core, x));
+    emit_load_core(e, RBP, offsetof(Core, y));
+    skip[-1] = e->p - skip;
+}
+
+// Called by generated code for BRK, with PC already past the opcode. Every
+// register BRK touches lives in Core.
+static void jit_brk(Core *core, RAM *mem)
+{
+    core->pc++;
+    core_interrupt(core, mem, Vector_IRQ, Flag_B);
+}
+
+static void emit_brk(Emitter *e, WORD next)
+{
+    emit_store_core16i(e, offsetof(Core, pc), next);
+    emit_call_core(e, (Helper) jit_brk);
+}
+
+// Called by generated code for branches, with PC already past the branch.
+// The flags it reads live in Core.
+static uint32_t jit_branch(Core *core, uint32_t opcode, uint32_t offset)
+{
+    return core_branch(core, opcode, offset);
+}
+
+// Leaves the extra cycles of the branch in eax
+static void emit_branch(Emitter *e, BYTE opcode, WORD operand, WORD next)
+{
+    emit_store_core16i(e, offsetof(Core, pc), next);
+    emit_mov64(e, RDI, RBX);
+    emit_movi(e, RSI, opcode);
+    emit_movi(e, RDX, operand & 0xFF);
+    emit(e, 2, rex(1, 0, RAX), 0xB8);
+    emit64(e, (uintptr_t) jit_branch);
+    emit(e, 2, 0xFF, modrm(3, 2, RAX));
+}
+
+// Emits the slow paths of the block, through the helpers in ram.c. A store
+// leaves the block when it invalidated it, like the interpreter does.
+static void emit_slow_paths(Emitter *e, Block const *block, BYTE const *leave)
+{
+    for (Slow const *slow = e->slow; slow < e->slow + e->slows; slow++) {
+        patch32(slow->jump, e->p);
+        if (slow->known) {
+            emit_movi(e, RSI, slow->addr);
+        }
+        if (slow->kind == Slow_Load) {
+            emit_call(e, (Helper) memldb_slow);
+            emit_movzxb(e, slow->reg, RAX);
+        } else if (slow->kind == Slow_Store) {
+            emit_mov32(e, RDX, slow->reg);
+            emit_call(e, (Helper) memstb_slow);
+        } else if (slow->kind == Slow_Pointer) { // esi still holds the operand
+            emit_call(e, (Helper) memldw);
+            emit_movzxw(e, RSI, RAX);
+        } else if (slow->kind == Slow_Return) {
+            emit_call_core(e, (Helper) core_rts);
+        } else {
+            emit_load_core(e, RSI, offsetof(Core, s));
+            emit(e, 2, 0x81, modrm(3, 1, RSI)); // or esi, 0x100
+            emit32(e, 0x0100);
+            emit_movi(e, RDX, slow->reg);
+            emit_call(e, (Helper) memstb_slow);
+        }
+        if (slow->kind == Slow_Store) {
+            // mov rax, &block->valid; cmp byte [rax], 0; jne back
+            emit(e, 2, rex(1, 0, RAX), 0xB8);
+            emit64(e, (uintptr_t) &block->valid);
+            emit(e, 3, 0x80, modrm(0, 7, RAX), 0x00);
+            emit(e, 2, 0x0F, 0x85);
+            emit32(e, 0);
+            patch32(e->p, slow->back);
+            emit_exit(e, leave, slow->next, slow->cycles);
+        } else {
+            emit(e, 1, 0xE9); // jmp back
+            emit32(e, 0);
+            patch32(e->p, slow->back);
+        }
+    }
+}
+
+Jit *jit_new(void)
+{
+    // Never writable and executable at once, see jit_compile
+    void *code = mmap(NULL, JIT_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    Jit *jit = malloc(sizeof(*jit));
+    expect(jit != NULL, "Could not allocate the JIT");
+    *jit = (Jit) { .code = code };
+    return jit;
+}
+
+void jit_free(Jit *jit)
+{
+    if (jit != NULL) {
+        munmap(jit->code, JIT_SIZE);
+        free(jit);
+    }
+}
+
+void jit_flush(Jit *jit)
+{
+    jit->used = 0;
+}
+
+static NativeBlock jit_emit(Jit *jit, Block const *block)
+{
+    Emitter e = { .p = jit->code + jit->used };
+
+    // Exit stub: eax already holds the cycles and Core the new PC
+    BYTE const *leave = e.p;
+    emit_store_core(&e, offsetof(Core, a), R14);
+    emit_store_core(&e, offsetof(Core, x), R15);
+    emit_store_core(&e, offsetof(Core, y), RBP);
+    emit(&e, 4, rex(1, 0, RSP), 0x83, modrm(3, 0, RSP), 0x08); // add rsp, 8
+    emit_pop(&e, R15);
+    emit_pop(&e, R14);
+    emit_pop(&e, R13);
+    emit_pop(&e, R12);
+    emit_pop(&e, RBP);
+    emit_pop(&e, RBX);
+    emit(&e, 1, 0xC3);
+
+    // Entry: six pushes plus 8 bytes keep the stack 16-byte aligned for calls
+    NativeBlock entry = __extension__(NativeBlock) e.p;
+    emit_push(&e, RBX);
+    emit_push(&e, RBP);
+    emit_push(&e, R12);
+    emit_push(&e, R13);
+    emit_push(&e, R14);
+    emit_push(&e, R15);
+    emit(&e, 4, rex(1, 0, RSP), 0x83, modrm(3, 5, RSP), 0x08); // sub rsp, 8
+    emit_mov64(&e, RBX, RDI);
+    emit_mov64(&e, R12, RSI);
+    emit(&e, 3, rex(0, R13, R13), 0x31, modrm(3, R13, R13)); // xor r13d, r13d
+    emit_load_core(&e, R14, offsetof(Core, a));
+    emit_load_core(&e, R15, offsetof(Core, x));
+    emit_load_core(&e, RBP, offsetof(Core, y));
+
+    WORD pc = block->pc;
+    uint32_t cycles = 0;
+    for (BYTE i = 0; i < block->count; i++) {
+        Insn const *insn = &block->insn[i];
+        MOS_6502_OpInfo const *info = &mos6502_opinfo[insn->opcode];
+        pc += info->bytes;
+        cycles += info->cycles;
+
+        if (info->op == Op_JSR || info->op == Op_RTS || info->op == Op_BRK || info->op == Op_RTI
+            || info->op == Op_JMP || info->op == Op_BR) {
+            if (info->op == Op_JSR) {
+                emit_jsr(&e, insn->operand, pc);
+            } else if (info->op == Op_RTS) {
+                emit_rts(&e);
+            } else if (info->op == Op_BRK) {
+                emit_brk(&e, pc);
+            } else if (info->op == Op_RTI) {
+                emit_call_core(&e, (Helper) core_rti);
+            } else if (info->op == Op_JMP) {
+                emit_store_core16i(&e, offsetof(Core, pc), insn->operand);
+            } else {
+                emit_branch(&e, insn->opcode, insn->operand, pc);
+                emit_add32(&e, R13, RAX);
+            }
+            // Same as emit_exit, without overwriting the PC they set
+            emit(&e, 3, rex(0, RAX, R13), 0x8D, modrm(2, RAX, R13));
+            emit32(&e, cycles);
+            emit(&e, 1, 0xE9);
+            emit32(&e, leave - (e.p + 4));
+            goto done;
+        }
+        switch (info->op) {
+            case Op_LD:
+                emit_ld(&e, info, insn->operand);
+                break;
+            case Op_ST:
+                emit_st(&e, info, insn->operand, pc, cycles);
+                break;
+            case Op_CLI: // and byte [rbx + p], ~I
+                emit(&e, 4, 0x80, modrm(1, 4, RBX), (BYTE) offsetof(Core, p), (BYTE) ~Flag_I);
+                break;
+            case Op_SEI: // or byte [rbx + p], I
+                emit(&e, 4, 0x80, modrm(1, 1, RBX), (BYTE) offsetof(Core, p), Flag_I);
+                break;
+            default:
+                return NULL;
+        }
+    }
+    emit_exit(&e, leave, pc, cycles);
+
+done:
+    emit_slow_paths(&e, block, leave);
+    expect(e.p - (jit->code + jit->used) <= JIT_MAX_SIZE, "Block code overflowed");
+    jit->used = e.p - jit->code;
+    return entry;
+}
+
+// The code is only made writable for the length of the compilation, which
+// never happens while generated code runs
+NativeBlock jit_compile(Jit *jit, Block const *block)
+{
+    if (JIT_SIZE - jit->used < JIT_MAX_SIZE) {
+        return NULL;
+    }
+    expect(mprotect(jit->code, JIT_SIZE, PROT_READ | PROT_WRITE) == 0,
+           "Could not make the JIT code writable");
+    NativeBlock entry = jit_emit(jit, block);
+    expect(mprotect(jit->code, JIT_SIZE, PROT_READ | PROT_EXEC) == 0,
+           "Could not make the JIT code executable");
+    return entry;
+}
+
+#else
+
+Jit *jit_new(void)
+{
+    return NULL;
+}
+
+void jit_free(Jit *jit)
+{
+    (void) jit;
+}
+
+void jit_flush(Jit *jit)
+{
+    (void) jit;
+}
+
+NativeBlock jit_compile(Jit *jit, Block const *block)
+{
+    (void) jit, (void) block;
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef MOS6502_JIT_H_
+#define MOS6502_JIT_H_
+
+#include "cache.h"
+
+#include <stdbool.h>
+
+typedef struct Jit Jit;
+
+// Returns NULL when generated code cannot run on this host
+Jit *jit_new(void);
+void jit_free(Jit *jit);
+
+// Translates `block` into native code. Returns NULL once the code buffer is
+// full; everything compiled so far stays valid until jit_flush.
+NativeBlock jit_compile(Jit *jit, Block const *block);
+// Throws away all generated code
+void jit_flush(Jit *jit);
+
+#endif // MOS6502_JIT_H_
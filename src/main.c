@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,8 +7,25 @@
 #include "lib.h"
 #include "mos6502.h"
 
+#include "tests/test_ram.c"
 #include "tests/test_ld.c"
 #include "tests/test_st.c"
+#include "tests/test_branch.c"
+#include "tests/test_cache.c"
+#include "tests/test_batch.c"
+#include "tests/test_pool.c"
+#include "tests/test_snapshot.c"
+#include "tests/test_bus.c"
+#include "tests/test_image.c"
+#include "tests/test_scheduler.c"
+#include "tests/test_irq.c"
+#include "tests/test_idle.c"
+#include "tests/test_hook.c"
+#include "tests/test_memo.c"
+#include "tests/test_profile.c"
+#include "tests/test_trace.c"
+#include "tests/test_replay.c"
+#include "tests/test_debug.c"
 
 // http://www.6502.org/users/obelisk/6502/index.html
 // https://www.c64-wiki.com/wiki/Reset_(Process)
@@ -18,17 +37,18 @@ int main(void)
         printf("Testing memory...\n");
         RAM mem = { 0 };
         memstw(&mem, 0xFFFE, 0x1234);
-        ASSERT_EQ(mem.data[0xFFFE], 0x34);
-        ASSERT_EQ(mem.data[0xFFFF], 0x12);
+        ASSERT_EQ(memldb(&mem, 0xFFFE), 0x34);
+        ASSERT_EQ(memldb(&mem, 0xFFFF), 0x12);
         memstb(&mem, 0xFFFD, 0xAB);
-        ASSERT_EQ(mem.data[0xFFFD], 0xAB);
+        ASSERT_EQ(memldb(&mem, 0xFFFD), 0xAB);
         WORD w = memldw(&mem, 0xFFFD);
         ASSERT_EQ(w, 0x34AB);
         BYTE b = memldb(&mem, 0xFFFF);
         ASSERT_EQ(b, 0x12);
+        memfree(&mem);
     }
 
-    RAM mem;
+    RAM mem = { 0 };
     MOS_6502 cpu;
 
     // Testing 6502 Reset
@@ -39,21 +59,40 @@ int main(void)
         ASSERT_EQ(cpu.s, 0xFD);
     }
 
+    test_ram();
+
     // Testing Load
     test_ld();
     test_st();
+    test_branch();
+    test_cache();
+    test_batch();
+    test_pool();
+    test_snapshot();
+    test_bus();
+    test_image();
+    test_sched();
+    test_irq();
+    test_idle();
+    test_hook();
+    test_memo();
+    test_profile();
+    test_trace();
+    test_replay();
+    test_debug();
 
     // Testing JSR
     {
         mos6502_reset(&cpu, &mem);
         WORD pc = cpu.pc;
-        mem.data[pc++] = JSR;
-        mem.data[pc++] = 0x10;
-        mem.data[pc++] = 0xFF;
+        memstb(&mem, pc++, JSR);
+        memstb(&mem, pc++, 0x10);
+        memstb(&mem, pc++, 0xFF);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 6), 6);
         ASSERT_EQ(cpu.s, 0xFB);
         ASSERT_EQ(cpu.pc, 0xFF10);
     }
 
+    memfree(&mem);
     printf("All tests passed.\n");
 }
@@ -0,0 +1,399 @@
+#include "memo.h"
+#include "core.h"
+#include "debug.h"
+#include "hook.h"
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Calls are remembered in a set-associative table, keyed by subroutine and
+// registers on entry. A full set replaces its ways round-robin.
+#define MEMO_SETS 64
+#define MEMO_WAYS 4
+
+#define MEMO_BYTES 32   // Bytes a call may read, and write, to be remembered
+#define MEMO_STEPS 4096 // Instructions a call may run for before recording gives up
+
+typedef struct {
+    BYTE a, x, y, p, s;
+} Regs;
+
+typedef struct {
+    WORD addr;
+    BYTE b;
+} Access;
+
+typedef struct {
+    bool valid;
+    WORD sub;
+    Regs in;
+    Regs out;        // Right before the RTS
+    uint32_t cycles; // From the first instruction of the subroutine to its RTS included
+    BYTE reads;
+    BYTE writes;
+    Access read[MEMO_BYTES];  // Bytes read before being written, with what was read
+    Access write[MEMO_BYTES]; // Bytes written, with what was written last
+} Entry;
+
+struct MOS_6502_Memo {
+    Entry entry[MEMO_SETS][MEMO_WAYS];
+    BYTE next[MEMO_SETS];          // Way of each set replaced next
+    uint64_t bytes[RAM_SIZE / 64]; // Bytes in the read set of some entry
+    MOS_6502_MemoStats stats;
+
+    // While a call is recorded, every page of the RAM is taken off its bus and
+    // sent down the slow path, which puts it back for the length of a single
+    // access. `rec` then points to `recording`, and is NULL otherwise.
+    Entry *rec;
+    Entry recording;
+    bool tainted; // The call did something that cannot be replayed
+    BYTE *host[RAM_PAGES];
+    uint64_t wr[RAM_PAGES / 64];
+};
+
+static inline uint64_t memo_bit(uint32_t n)
+{
+    return (uint64_t) 1 << (n % 64);
+}
+
+static Entry *memo_set(struct MOS_6502_Memo *memo, WORD sub, Regs const *in)
+{
+    uint32_t h = sub;
+    h = h * 31 + in->a;
+    h = h * 31 + in->x;
+    h = h * 31 + in->y;
+    h = h * 31 + in->p;
+    h = h * 31 + in->s;
+    return memo->entry[(h ^ h >> 6 ^ h >> 12) % MEMO_SETS];
+}
+
+// Index of `addr` in `access`, or -1
+static int memo_index(Access const *access, BYTE count, WORD addr)
+{
+    for (BYTE i = 0; i < count; i++) {
+        if (access[i].addr == addr) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Recomputes which bytes, and so which pages, stores have to be checked for
+static void memo_rewatch(struct MOS_6502_Memo *memo, RAM *mem)
+{
+    memset(memo->bytes, 0, sizeof(memo->bytes));
+    memset(mem->watch, 0, sizeof(mem->watch));
+    for (size_t set = 0; set < MEMO_SETS; set++) {
+        for (size_t way = 0; way < MEMO_WAYS; way++) {
+            Entry const *entry = &memo->entry[set][way];
+            for (BYTE i = 0; entry->valid && i < entry->reads; i++) {
+                WORD addr = entry->read[i].addr;
+                memo->bytes[addr / 64] |= memo_bit(addr);
+                mem->watch[addr >> 14] |= memo_bit(addr >> 8);
+            }
+        }
+    }
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        mem->wr[i] &= ~mem->watch[i];
+    }
+}
+
+// Drops the entries that read any of the `size` bytes from `addr`, or only
+// those that read something else than `b` there when it is not negative
+static void memo_drop(struct MOS_6502_Memo *memo, RAM *mem, WORD addr, size_t size, int b)
+{
+    size_t dropped = 0;
+    for (size_t set = 0; set < MEMO_SETS; set++) {
+        for (size_t way = 0; way < MEMO_WAYS; way++) {
+            Entry *entry = &memo->entry[set][way];
+            for (BYTE i = 0; entry->valid && i < entry->reads; i++) {
+                Access const *read = &entry->read[i];
+                if ((WORD) (read->addr - addr) < size && read->b != b) {
+                    entry->valid = false;
+                    dropped++;
+                }
+            }
+        }
+    }
+    if (dropped > 0) {
+        memo->stats.invalidations += dropped;
+        memo_rewatch(memo, mem);
+    }
+}
+
+// Remembers `rec`, unless it cannot be replayed. Its writes must leave its
+// read set as it found it, so that replaying them never drops it.
+static void memo_insert(struct MOS_6502_Memo *memo, RAM *mem, Entry const *rec)
+{
+    if (memo->tainted) {
+        return;
+    }
+    for (BYTE i = 0; i < rec->writes; i++) {
+        if (memo_index(rec->read, rec->reads, rec->write[i].addr) >= 0) {
+            return;
+        }
+    }
+    Entry *set = memo_set(memo, rec->sub, &rec->in);
+    size_t way = 0;
+    while (way < MEMO_WAYS && set[way].valid) {
+        way++;
+    }
+    bool evict = way == MEMO_WAYS;
+    if (evict) {
+        BYTE *next = &memo->next[(set - memo->entry[0]) / MEMO_WAYS];
+        way = *next;
+        *next = (*next + 1) % MEMO_WAYS;
+    }
+    set[way] = *rec;
+    set[way].valid = true;
+    if (evict) {
+        memo_rewatch(memo, mem);
+        return;
+    }
+    for (BYTE i = 0; i < rec->reads; i++) {
+        WORD addr = rec->read[i].addr;
+        memo->bytes[addr / 64] |= memo_bit(addr);
+        mem->watch[addr >> 14] |= memo_bit(addr >> 8);
+        mem->wr[addr >> 14] &= ~memo_bit(addr >> 8);
+    }
+}
+
+static Regs memo_regs(Core const *core)
+{
+    return (Regs) { .a = core->a, .x = core->x, .y = core->y, .p = core_getp(core), .s = core->s };
+}
+
+// Takes every page off the bus, so that each access of the call `core` just
+// made goes through memo_load or memo_store
+static void memo_start(struct MOS_6502_Memo *memo, RAM *mem, WORD sub, Core const *core)
+{
+    memo->recording = (Entry) { .sub = sub, .in = memo_regs(core) };
+    memo->rec = &memo->recording;
+    memo->tainted = false;
+    memcpy(memo->host, mem->host, sizeof(mem->host));
+    memcpy(memo->wr, mem->wr, sizeof(mem->wr));
+    memset(mem->host, 0, sizeof(mem->host));
+    memset(mem->wr, 0, sizeof(mem->wr));
+}
+
+static void memo_stop(struct MOS_6502_Memo *memo, RAM *mem)
+{
+    memcpy(mem->host, memo->host, sizeof(mem->host));
+    memcpy(mem->wr, memo->wr, sizeof(mem->wr));
+    memo->rec = NULL;
+}
+
+// Whether recording has to give up before the next instruction: anything a
+// run of the engine would have stopped for, or shown to someone watching it,
+// has to happen outside of the recorded call
+static bool memo_interrupted(MOS_6502 const *cpu, Core const *core, RAM *mem)
+{
+    uint32_t pending = atomic_load_explicit(&cpu->pending, memory_order_acquire);
+    if (pending != 0 && ((pending & Int_NMI) || !(core->p & Flag_I))) {
+        return true;
+    }
+    return mem->trace != NULL || mem->profiler != NULL || debug_armed(mem);
+}
+
+uint64_t memo_run(MOS_6502 *cpu, RAM *mem, uint64_t max_cycles)
+{
+    struct MOS_6502_Memo *memo = mem->memo;
+    Entry *rec = memo->rec;
+    Core core = core_load(cpu);
+    uint64_t cycles = 0;
+    for (size_t steps = 0;; steps++) {
+        // Peeked at behind the bus, so that the opcode is only fetched once,
+        // by core_step. Code outside of host pages cannot be replayed anyway.
+        BYTE const *page = memo->host[core.pc >> 8];
+        if (page == NULL) {
+            memo_stop(memo, mem);
+            break;
+        }
+        if (core.s == rec->in.s && mos6502_opinfo[page[core.pc & 0xFF]].op == Op_RTS) {
+            rec->out = memo_regs(&core);
+            rec->cycles = cycles + mos6502_opinfo[RTS].cycles;
+            memo_stop(memo, mem);
+            memo_insert(memo, mem, rec);
+            // The RTS itself runs as usual, back on the bus
+            if (cycles < max_cycles) {
+                cycles += core_step(&core, mem);
+            }
+            break;
+        }
+        if (steps == MEMO_STEPS || cycles >= max_cycles || memo_interrupted(cpu, &core, mem)) {
+            memo_stop(memo, mem);
+            break;
+        }
+        uint64_t taken = core_step(&core, mem);
+        if (taken == 0) {
+            // Not implemented, which the engine reports
+            memo_stop(memo, mem);
+            break;
+        }
+        cycles += taken;
+    }
+    core_store(&core, cpu);
+    return cycles;
+}
+
+bool memo_recording(RAM const *mem)
+{
+    return mem->memo->rec != NULL;
+}
+
+uint32_t memo_call(Core *core, RAM *mem, WORD addr)
+{
+    struct MOS_6502_Memo *memo = mem->memo;
+    if (memo->rec != NULL) {
+        // Called by the subroutine being recorded, which records this call too
+        return 0;
+    }
+    if (mem->trace != NULL || mem->profiler != NULL || debug_armed(mem)) {
+        // Runs as usual, so that the call shows in full to what watches it
+        return 0;
+    }
+
+    Regs in = memo_regs(core);
+    Entry *set = memo_set(memo, addr, &in);
+    for (size_t way = 0; way < MEMO_WAYS; way++) {
+        Entry const *entry = &set[way];
+        if (!entry->valid || entry->sub != addr || memcmp(&entry->in, &in, sizeof(in)) != 0) {
+            continue;
+        }
+        // None of the writes can drop `entry`, see memo_insert
+        memo->stats.hits++;
+        for (BYTE i = 0; i < entry->writes; i++) {
+            memstb(mem, entry->write[i].addr, entry->write[i].b);
+        }
+        core->a = entry->out.a;
+        core->x = entry->out.x;
+        core->y = entry->out.y;
+        core->s = entry->out.s;
+        core_setp(core, entry->out.p);
+        core_rts(core, mem);
+        return entry->cycles;
+    }
+
+    memo->stats.misses++;
+    memo_start(memo, mem, addr, core);
+    return 0;
+}
+
+void memo_taint(RAM *mem)
+{
+    mem->memo->tainted = true;
+}
+
+// Carries out a load or store of the call being recorded, with only the page
+// it targets back on the bus for the length of it
+static void memo_access(struct MOS_6502_Memo *memo, RAM *mem, WORD addr, BYTE *b, bool store)
+{
+    Entry *rec = memo->rec;
+    BYTE page = addr >> 8;
+    uint64_t bit = memo_bit(page);
+    if (mem->bus[page / 64] & bit) {
+        // Devices and host memory change behind the back of the store path
+        memo->tainted = true;
+    }
+    memo->rec = NULL;
+    mem->host[page] = memo->host[page];
+    mem->wr[page / 64] |= memo->wr[page / 64] & bit;
+    // memldb and memstb, minus the profile counts the access already got
+    if (store && (mem->wr[page / 64] & bit)) {
+        mem->host[page][addr & 0xFF] = *b;
+    } else if (store) {
+        memstb_slow(mem, addr, *b);
+    } else if (mem->host[page] != NULL) {
+        *b = mem->host[page][addr & 0xFF];
+    } else {
+        *b = memldb_slow(mem, addr);
+    }
+    memo->host[page] = mem->host[page];
+    memo->wr[page / 64] = (memo->wr[page / 64] & ~bit) | (mem->wr[page / 64] & bit);
+    mem->host[page] = NULL;
+    mem->wr[page / 64] &= ~bit;
+    memo->rec = rec;
+}
+
+bool memo_load(RAM *mem, WORD addr, BYTE *b)
+{
+    struct MOS_6502_Memo *memo = mem->memo;
+    Entry *rec = memo->rec;
+    if (rec == NULL) {
+        return false;
+    }
+    memo_access(memo, mem, addr, b, false);
+    if (memo_index(rec->write, rec->writes, addr) >= 0
+        || memo_index(rec->read, rec->reads, addr) >= 0) {
+        return true;
+    }
+    if (rec->reads == MEMO_BYTES) {
+        memo->tainted = true;
+    } else {
+        rec->read[rec->reads++] = (Access) { .addr = addr, .b = *b };
+    }
+    return true;
+}
+
+bool memo_store(RAM *mem, WORD addr, BYTE b)
+{
+    struct MOS_6502_Memo *memo = mem->memo;
+    Entry *rec = memo->rec;
+    if (rec == NULL) {
+        if (memo->bytes[addr / 64] & memo_bit(addr)) {
+            memo_drop(memo, mem, addr, 1, b);
+        }
+        return false;
+    }
+    memo_access(memo, mem, addr, &b, true);
+    int i = memo_index(rec->write, rec->writes, addr);
+    if (i < 0 && rec->writes == MEMO_BYTES) {
+        memo->tainted = true;
+    } else if (i < 0) {
+        rec->write[rec->writes++] = (Access) { .addr = addr, .b = b };
+    } else {
+        rec->write[i].b = b;
+    }
+    return true;
+}
+
+void memo_invalidate(RAM *mem, WORD addr, size_t size)
+{
+    if (mem->memo != NULL) {
+        memo_drop(mem->memo, mem, addr, size, -1);
+    }
+}
+
+void mos6502_memo(RAM *mem, WORD addr)
+{
+    if (mem->memo == NULL) {
+        mem->memo = calloc(1, sizeof(*mem->memo));
+        expect(mem->memo != NULL, "Could not allocate the memoization table");
+    }
+    hook_set(mem, addr, NULL, NULL, 0);
+}
+
+void mos6502_unmemo(RAM *mem, WORD addr)
+{
+    mos6502_unhook(mem, addr);
+    struct MOS_6502_Memo *memo = mem->memo;
+    if (memo == NULL) {
+        return;
+    }
+    for (size_t set = 0; set < MEMO_SETS; set++) {
+        for (size_t way = 0; way < MEMO_WAYS; way++) {
+            if (memo->entry[set][way].sub == addr) {
+                memo->entry[set][way].valid = false;
+            }
+        }
+    }
+    memo_rewatch(memo, mem);
+}
+
+MOS_6502_MemoStats mos6502_memo_stats(RAM const *mem)
+{
+    return mem->memo != NULL ? mem->memo->stats : (MOS_6502_MemoStats) { 0 };
+}
@@ -0,0 +1,31 @@
+#ifndef MOS6502_MEMO_H_
+#define MOS6502_MEMO_H_
+
+#include "core.h"
+#include "lib.h"
+#include "ram.h"
+
+// Replays the call `core` just made to the memoized subroutine at `addr`, and
+// returns from it. Returns the cycles to charge, or 0 when the call has to run
+// as usual, in which case it may start recording it: the engine then hands
+// over to memo_run right after the JSR.
+uint32_t memo_call(Core *core, RAM *mem, WORD addr);
+// Keeps the call being recorded, if any, from being replayed
+void memo_taint(RAM *mem);
+
+bool memo_recording(RAM const *mem);
+
+// Whether the engine has to stop and hand over to memo_run
+static forceinline bool memo_handover(RAM const *mem)
+{
+    return unlikely(mem->memo != NULL) && memo_recording(mem);
+}
+
+// Runs the call being recorded one instruction at a time, within `max_cycles`.
+// Recording ends at the RTS, which runs as usual, or gives up on anything the
+// engine would have stopped for or shown: the budget, an interrupt that can
+// be taken, a stop request, breakpoints, a trace or a profile. Returns the
+// cycles taken.
+uint64_t memo_run(MOS_6502 *cpu, RAM *mem, uint64_t max_cycles);
+
+#endif // MOS6502_MEMO_H_
@@ -1,42 +1,33 @@
 #include "mos6502.h"
+#include "cache.h"
+#include "core.h"
+#include "debug.h"
+#include "hook.h"
+#include "jit.h"
 #include "lib.h"
+#include "memo.h"
+#include "profile.h"
+#include "tracer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static BYTE mos6502_fetchb(MOS_6502 *cpu, RAM *mem)
+static forceinline BYTE mos6502_fetchb(Core *cpu, RAM *mem)
 {
     return memldb(mem, cpu->pc++);
 }
 
-static WORD mos6502_fetchw(MOS_6502 *cpu, RAM *mem)
+static forceinline WORD mos6502_fetchw(Core *cpu, RAM *mem)
 {
     return (cpu->pc += 2, memldw(mem, cpu->pc - 2));
 }
 
-// static void mos6502_pushb(MOS_6502 *cpu, RAM *mem, uint32_t *cycles, BYTE b)
-// {
-//     cpu->s --, memstw(mem, cpu->s + 1, w);
-// }
-
-static void mos6502_pushw(MOS_6502 *cpu, RAM *mem, WORD w)
+static forceinline void mos6502_pushw(Core *cpu, RAM *mem, WORD w)
 {
-    cpu->s -= 2, memstw(mem, cpu->s + 2, w);
+    core_push(cpu, mem, w >> 8), core_push(cpu, mem, w);
 }
 
-typedef enum {
-    AddrMode_IMM, // Immediate
-    AddrMode_ZPG, // from Zero Page
-    AddrMode_ZPX, // from Zero Page + X
-    AddrMode_ZPY, // from Zero Page + Y
-    AddrMode_ABS, // from absolute address
-    AddrMode_ABX, // from absolute address + X
-    AddrMode_ABY, // from absolute address + Y
-    AddrMode_IDX, // from address in X
-    AddrMode_IDY, // from address in Y
-} AddrMode;
-
 char const *modename(AddrMode mode)
 {
     switch (mode) {
@@ -58,267 +49,775 @@ char const *modename(AddrMode mode)
             return "AddrMode_IDX";
         case AddrMode_IDY:
             return "AddrMode_IDY";
+        case AddrMode_IMP:
+            return "AddrMode_IMP";
+        case AddrMode_REL:
+            return "AddrMode_REL";
         default:
             return "Unknown AddrMode";
     }
 }
 
-static AddrMode const modemap[0x100] = {
-    [LDA_IMM] = AddrMode_IMM, //
-    [LDA_ZPG] = AddrMode_ZPG, //
-    [LDA_ZPX] = AddrMode_ZPX, //
-    [LDA_ABS] = AddrMode_ABS, //
-    [LDA_ABX] = AddrMode_ABX, //
-    [LDA_ABY] = AddrMode_ABY, //
-    [LDA_IDX] = AddrMode_IDX, //
-    [LDA_IDY] = AddrMode_IDY, //
-
-    [LDX_IMM] = AddrMode_IMM, //
-    [LDX_ZPG] = AddrMode_ZPG, //
-    [LDX_ZPY] = AddrMode_ZPY, //
-    [LDX_ABS] = AddrMode_ABS, //
-    [LDX_ABY] = AddrMode_ABY, //
-
-    [LDY_IMM] = AddrMode_IMM, //
-    [LDY_ZPG] = AddrMode_ZPG, //
-    [LDY_ZPX] = AddrMode_ZPX, //
-    [LDY_ABS] = AddrMode_ABS, //
-    [LDY_ABX] = AddrMode_ABX, //
-
-    [STA_ZPG] = AddrMode_ZPG, //
-    [STA_ZPX] = AddrMode_ZPX, //
-    [STA_ABS] = AddrMode_ABS, //
-    [STA_ABX] = AddrMode_ABX, //
-    [STA_ABY] = AddrMode_ABY, //
-    [STA_IDX] = AddrMode_IDX, //
-    [STA_IDY] = AddrMode_IDY, //
-
-    [STX_ZPG] = AddrMode_ZPG, //
-    [STX_ZPY] = AddrMode_ZPY, //
-    [STX_ABS] = AddrMode_ABS, //
-
-    [STY_ZPG] = AddrMode_ZPG, //
-    [STY_ZPX] = AddrMode_ZPX, //
-    [STY_ABS] = AddrMode_ABS, //
-};
-
-static WORD mos6502_getaddr(MOS_6502 *cpu, RAM *mem, AddrMode mode)
+#define OPINFO(name, opcode, mnemonic, op, mode, reg, bytes, cycles, penalty) \
+    [opcode] = { #name, #mnemonic, Op_##op, AddrMode_##mode, Reg_##reg, bytes, cycles, penalty },
+MOS_6502_OpInfo const mos6502_opinfo[0x100] = { MOS6502_OPCODES(OPINFO) };
+#undef OPINFO
+
+#define IS_MODE(mode, m1, m2) ((mode) == AddrMode_##m1 || (mode) == AddrMode_##m2)
+
+// Legal (mode, register) pairs of each operation, checked at compile time
+// against every row of MOS6502_OPCODES
+#define LEGAL_LD(mode, reg)                          \
+    ((reg) != Reg_none                               \
+     && (!IS_MODE(mode, ZPX, ABX) || (reg) != Reg_x) \
+     && ((mode) != AddrMode_ZPY || (reg) == Reg_x)   \
+     && ((mode) != AddrMode_ABY || (reg) != Reg_y)   \
+     && (!IS_MODE(mode, IDX, IDY) || (reg) == Reg_a))
+#define LEGAL_ST(mode, reg)                        \
+    ((mode) != AddrMode_IMM && LEGAL_LD(mode, reg) \
+     && (!IS_MODE(mode, ABX, ABY) || (reg) == Reg_a))
+#define LEGAL_JSR(mode, reg) ((mode) == AddrMode_ABS && (reg) == Reg_none)
+#define LEGAL_RTS(mode, reg) ((mode) == AddrMode_IMP && (reg) == Reg_none)
+#define LEGAL_BRK(mode, reg) ((mode) == AddrMode_IMP && (reg) == Reg_none)
+#define LEGAL_RTI(mode, reg) ((mode) == AddrMode_IMP && (reg) == Reg_none)
+#define LEGAL_CLI(mode, reg) ((mode) == AddrMode_IMP && (reg) == Reg_none)
+#define LEGAL_SEI(mode, reg) ((mode) == AddrMode_IMP && (reg) == Reg_none)
+#define LEGAL_JMP(mode, reg) ((mode) == AddrMode_ABS && (reg) == Reg_none)
+#define LEGAL_BR(mode, reg)  ((mode) == AddrMode_REL && (reg) == Reg_none)
+
+// Instruction length implied by the addressing mode
+#define MODE_BYTES(mode) \
+    ((mode) == AddrMode_ABS || IS_MODE(mode, ABX, ABY) ? 3 : (mode) == AddrMode_IMP ? 1 : 2)
+
+// Only indexed reads can pay for crossing a page, and branches for being taken
+#define LEGAL_PENALTY(op, mode, penalty)                                                      \
+    ((penalty) == 0 || ((op) == Op_LD && (IS_MODE(mode, ABX, ABY) || (mode) == AddrMode_IDY)) \
+     || ((op) == Op_BR && (penalty) == 2))
+
+#define CHECK(name, opcode, mnemonic, op, mode, reg, bytes, cycles, penalty)                \
+    static_assert(LEGAL_##op(AddrMode_##mode, Reg_##reg), #name ": illegal mode/register"); \
+    static_assert((bytes) == MODE_BYTES(AddrMode_##mode), #name ": wrong length");          \
+    static_assert(LEGAL_PENALTY(Op_##op, AddrMode_##mode, penalty), #name ": bad penalty");
+MOS6502_OPCODES(CHECK)
+#undef CHECK
+
+// Fetches the operand bytes that follow the opcode
+static forceinline WORD mos6502_fetchop(Core *cpu, RAM *mem, AddrMode mode)
+{
+    switch (MODE_BYTES(mode)) {
+        case 3:
+            return mos6502_fetchw(cpu, mem);
+        case 2:
+            return mos6502_fetchb(cpu, mem);
+        default:
+            return 0;
+    }
+}
+
+// `mode` is always a constant at the call site, so once inlined every switch
+// below folds away and each handler is left with its own addressing code.
+static forceinline WORD mos6502_getaddr(Core *cpu, RAM *mem, AddrMode mode, WORD operand)
 {
     switch (mode) {
         case AddrMode_ZPG: // http://www.6502.org/users/obelisk/6502/addressing.html#ZPG
-            return mos6502_fetchb(cpu, mem);
+            return operand;
 
         case AddrMode_ZPX: // http://www.6502.org/users/obelisk/6502/addressing.html#ZPX
-            return mos6502_fetchb(cpu, mem) + cpu->x;
+            return operand + cpu->x;
 
         case AddrMode_ZPY: // http://www.6502.org/users/obelisk/6502/addressing.html#ZPY
-            return mos6502_fetchb(cpu, mem) + cpu->y;
+            return operand + cpu->y;
 
         case AddrMode_ABS: // http://www.6502.org/users/obelisk/6502/addressing.html#ABS
-            return mos6502_fetchw(cpu, mem);
+            return operand;
 
         case AddrMode_ABX: // http://www.6502.org/users/obelisk/6502/addressing.html#ABX
         case AddrMode_ABY: // http://www.6502.org/users/obelisk/6502/addressing.html#ABY
-            return mos6502_fetchw(cpu, mem) + ((mode == AddrMode_ABX) ? cpu->x : cpu->y);
+            return operand + ((mode == AddrMode_ABX) ? cpu->x : cpu->y);
 
         case AddrMode_IDX:
-            return memldw(mem, mos6502_fetchb(cpu, mem) + cpu->x);
+            return memldw(mem, operand + cpu->x);
 
         case AddrMode_IDY:
-            return memldw(mem, mos6502_fetchb(cpu, mem)) + cpu->y;
+            return memldw(mem, operand) + cpu->y;
 
         default:
             panic("Mode \"%s\" not implemented.", modename(mode));
     }
 }
 
-static uint64_t mos6502_ld(MOS_6502 *cpu, RAM *mem, AddrMode mode, BYTE *reg)
+// Returns the extra cycles spent on top of the opcode's base cost
+static forceinline BYTE mos6502_ld(Core *cpu, RAM *mem, AddrMode mode, BYTE *reg, WORD operand)
 {
-    uint64_t cycles;
+    BYTE penalty = 0;
     // http://www.6502.org/users/obelisk/6502/addressing.html#IMM
     if (mode == AddrMode_IMM) {
-        *reg = mos6502_fetchb(cpu, mem);
-        defer(cycles = 2);
+        *reg = operand;
+        defer(penalty = 0);
     }
 
-    WORD addr = mos6502_getaddr(cpu, mem, mode);
-    switch (mode) {
-        case AddrMode_ZPG: // http://www.6502.org/users/obelisk/6502/addressing.html#ZPG
-            *reg = memldb(mem, addr);
-            defer(cycles = 3);
+    WORD addr = mos6502_getaddr(cpu, mem, mode, operand);
+    *reg = memldb(mem, addr);
 
-        case AddrMode_ZPX: // http://www.6502.org/users/obelisk/6502/addressing.html#ZPX
-            expect(reg != &cpu->x, "Cannot apply instruction to register X.");
-            *reg = memldb(mem, addr);
-            defer(cycles = 4);
+    // https://retrocomputing.stackexchange.com/a/146
+    if (mode == AddrMode_ABX) {
+        penalty = (addr & 0xFF) < cpu->x;
+    } else if (mode == AddrMode_ABY || mode == AddrMode_IDY) {
+        penalty = (addr & 0xFF) < cpu->y;
+    }
 
-        case AddrMode_ZPY: // http://www.6502.org/users/obelisk/6502/addressing.html#ZPY
-            expect(reg == &cpu->x, "Cannot apply instruction but to register X");
-            *reg = memldb(mem, addr);
-            defer(cycles = 4);
+defer:
+    cpu->nz = *reg;
+    return penalty;
+}
 
-        case AddrMode_ABS: // http://www.6502.org/users/obelisk/6502/addressing.html#ABS
-            *reg = memldb(mem, addr);
-            defer(cycles = 4);
+// Stores never pay a page-crossing penalty: their base cost already includes it
+static forceinline BYTE mos6502_st(Core *cpu, RAM *mem, AddrMode mode, BYTE *reg, WORD operand)
+{
+    memstb(mem, mos6502_getaddr(cpu, mem, mode, operand), *reg);
+    return 0;
+}
 
-        case AddrMode_ABX: // http://www.6502.org/users/obelisk/6502/addressing.html#ABX
-            expect(reg != &cpu->x, "Cannot apply instruction to register X.");
-            *reg = memldb(mem, addr);
-            // https://retrocomputing.stackexchange.com/a/146
-            if ((addr & 0xFF) < cpu->x) {
-                defer(cycles = 5);
-            }
-            defer(cycles = 4);
+// Expects `cpu->pc` to already point past the instruction. Returns the cycles
+// of the hooked subroutine, if any, which then already returned.
+static forceinline uint32_t mos6502_jsr(Core *cpu, RAM *mem, WORD subroutine_addr)
+{
+    mos6502_pushw(cpu, mem, cpu->pc - 1);
+    cpu->pc = subroutine_addr;
+    return hook_jsr(cpu, mem, subroutine_addr);
+}
 
-        case AddrMode_ABY: // http://www.6502.org/users/obelisk/6502/addressing.html#ABY
-            expect(reg != &cpu->y, "Cannot apply instruction to register Y.");
-            *reg = memldb(mem, addr);
-            // https://retrocomputing.stackexchange.com/a/146
-            if ((addr & 0xFF) < cpu->y) {
-                defer(cycles = 5);
-            }
-            defer(cycles = 4);
-
-        case AddrMode_IDX: // http://www.6502.org/users/obelisk/6502/addressing.html#IDX
-            expect(reg == &cpu->a, "Cannot apply instruction but to register A.");
-            *reg = memldb(mem, addr);
-            defer(cycles = 6);
-
-        case AddrMode_IDY: // http://www.6502.org/users/obelisk/6502/addressing.html#IDY
-            expect(reg == &cpu->a, "Cannot apply instruction but to register A.");
-            *reg = memldb(mem, addr);
-            // TODO: figure out exactly the reason
-            if ((addr & 0xFF) < cpu->y) {
-                defer(cycles = 6);
-            }
-            defer(cycles = 5);
+static forceinline BYTE mos6502_rts(Core *cpu, RAM *mem)
+{
+    core_rts(cpu, mem);
+    return 0;
+}
 
-        default:
-            panic("Mode \"%s\" not implemented for Load instructions (LD*)",
-                  modename(mode));
+// Expects `cpu->pc` to already point past the opcode. The byte after it is
+// skipped on return, so BRK pushes its address plus two.
+static forceinline BYTE mos6502_brk(Core *cpu, RAM *mem)
+{
+    cpu->pc++;
+    core_interrupt(cpu, mem, Vector_IRQ, Flag_B);
+    return 0;
+}
+
+static forceinline BYTE mos6502_rti(Core *cpu, RAM *mem)
+{
+    core_rti(cpu, mem);
+    return 0;
+}
+
+// Interrupts are only taken where exec polls for them, see mos6502_unmask
+static forceinline BYTE mos6502_cli(Core *cpu)
+{
+    cpu->p &= ~Flag_I;
+    return 0;
+}
+
+static forceinline BYTE mos6502_sei(Core *cpu)
+{
+    cpu->p |= Flag_I;
+    return 0;
+}
+
+static forceinline BYTE mos6502_jmp(Core *cpu, WORD addr)
+{
+    cpu->pc = addr;
+    return 0;
+}
+
+// How each operation of MOS6502_OPCODES is carried out
+#define IMPL_LD(opcode, mode, reg)  mos6502_ld(cpu, mem, AddrMode_##mode, &cpu->reg, operand)
+#define IMPL_ST(opcode, mode, reg)  mos6502_st(cpu, mem, AddrMode_##mode, &cpu->reg, operand)
+#define IMPL_JSR(opcode, mode, reg) mos6502_jsr(cpu, mem, operand)
+#define IMPL_RTS(opcode, mode, reg) ((void) operand, mos6502_rts(cpu, mem))
+#define IMPL_BRK(opcode, mode, reg) ((void) operand, mos6502_brk(cpu, mem))
+#define IMPL_RTI(opcode, mode, reg) ((void) operand, mos6502_rti(cpu, mem))
+#define IMPL_CLI(opcode, mode, reg) ((void) mem, (void) operand, mos6502_cli(cpu))
+#define IMPL_SEI(opcode, mode, reg) ((void) mem, (void) operand, mos6502_sei(cpu))
+#define IMPL_JMP(opcode, mode, reg) ((void) mem, mos6502_jmp(cpu, operand))
+#define IMPL_BR(opcode, mode, reg)  ((void) mem, core_branch(cpu, opcode, operand))
+
+// Two handlers per opcode: exec_* runs an instruction whose operand has
+// already been fetched and returns the cycles it took on top of its base
+// cost (page crossings, taken branches, hooked subroutines), op_* fetches
+// the operand itself and returns the total number of cycles taken.
+#define HANDLER(name, opcode, mnemonic, op, mode, reg, bytes, cycles, penalty)             \
+    static forceinline uint32_t exec_##name(Core *cpu, RAM *mem, WORD operand)             \
+    {                                                                                      \
+        return IMPL_##op(opcode, mode, reg);                                               \
+    }                                                                                      \
+    static forceinline uint64_t op_##name(Core *cpu, RAM *mem)                             \
+    {                                                                                      \
+        return cycles + exec_##name(cpu, mem, mos6502_fetchop(cpu, mem, AddrMode_##mode)); \
     }
+MOS6502_OPCODES(HANDLER)
+#undef HANDLER
 
-defer:
-    cpu->z = *reg == 0x0;
-    cpu->n = *reg >> 7;
+typedef uint64_t (*Handler)(Core *cpu, RAM *mem);
+
+// Per-opcode constants, for code that is generated from opcode names alone
+#define CONSTANTS(name, opcode, mnemonic, op, mode, reg, bytes, cycles, penalty) \
+    Bytes_##name = bytes, Cycles_##name = cycles, Stores_##name = Op_##op == Op_ST,
+enum { MOS6502_OPCODES(CONSTANTS) };
+#undef CONSTANTS
+
+#define ENTRY(name, opcode, ...) [opcode] = op_##name,
+static Handler const handlers[0x100] = { MOS6502_OPCODES(ENTRY) };
+#undef ENTRY
+
+// Runs `instruction`, whose opcode was just fetched
+static forceinline uint64_t mos6502_run(Core *cpu, RAM *mem, MOS_6502 *snapshot, BYTE instruction)
+{
+    Handler handler = handlers[instruction];
+    if (handler == NULL) {
+        core_store(cpu, snapshot);
+        panic("Instruction not handled: 0x%x\n", instruction);
+    }
+    return handler(cpu, mem);
+}
+
+// CLI and RTI may unmask a held IRQ, which every engine then takes right after
+// them, as the poll between blocks does after the blocks they end. It so lands
+// on the same instruction whatever the engine and wherever runs are split.
+// Returns the cycles spent.
+static forceinline uint64_t mos6502_unmask(Core *cpu, RAM *mem, MOS_6502 *snapshot,
+                                           BYTE instruction)
+{
+    Op op = mos6502_opinfo[instruction].op;
+    return op == Op_CLI || op == Op_RTI ? core_poll(cpu, mem, snapshot) : 0;
+}
+
+// Runs a single instruction outside of any block
+static uint64_t mos6502_step(Core *cpu, RAM *mem, MOS_6502 *snapshot)
+{
+    return mos6502_run(cpu, mem, snapshot, mos6502_fetchb(cpu, mem));
+}
+
+uint64_t core_step(Core *core, RAM *mem)
+{
+    Handler handler = handlers[memldb(mem, core->pc)];
+    if (handler == NULL) {
+        return 0;
+    }
+    core->pc++;
+    return handler(core, mem);
+}
+
+// Whether `block` is to be run as native code, compiling it when it just got
+// hot enough
+static forceinline bool block_native(struct MOS_6502_Cache *cache, Block *block)
+{
+    if (block->native != NULL) {
+        return true;
+    }
+    if (cache->engine != Engine_JIT || ++block->hits < cache->threshold) {
+        return false;
+    }
+    return cache_compile(cache, block) != NULL;
+}
+
+#if defined(__GNUC__) && !defined(MOS6502_NO_COMPUTED_GOTO)
+
+// Threaded dispatch: every handler jumps straight to the next one through the
+// label table, so each opcode gets its own indirect branch to predict.
+static uint64_t mos6502_interpret(MOS_6502 *snapshot, RAM *mem, uint64_t max_cycles)
+{
+    Core core = core_load(snapshot), *cpu = &core;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#define LABEL(name, opcode, ...) [opcode] = &&op_##name,
+    static void *const labels[0x100] = { [0 ... 0xFF] = &&illegal, MOS6502_OPCODES(LABEL) };
+#undef LABEL
+
+    BYTE instruction;
+    uint64_t cycles = max_cycles > 0 ? core_poll(cpu, mem, snapshot) : 0;
+#define DISPATCH()                              \
+    do {                                        \
+        if (cycles >= max_cycles) {             \
+            core_store(cpu, snapshot);          \
+            return cycles;                      \
+        }                                       \
+        instruction = mos6502_fetchb(cpu, mem); \
+        goto *labels[instruction];              \
+    } while (0)
+
+    DISPATCH();
+
+#define TARGET(name, opcode, mnemonic, op, ...)                                \
+    op_##name:                                                                 \
+        cycles += op_##name(cpu, mem);                                         \
+        if ((Op_##op == Op_CLI || Op_##op == Op_RTI) && cycles < max_cycles) { \
+            cycles += mos6502_unmask(cpu, mem, snapshot, opcode);              \
+        }                                                                      \
+        if (Op_##op == Op_JSR && unlikely(memo_handover(mem))) {               \
+            core_store(cpu, snapshot);                                         \
+            return cycles;                                                     \
+        }                                                                      \
+        DISPATCH();
+    MOS6502_OPCODES(TARGET)
+#undef TARGET
+#undef DISPATCH
+#pragma GCC diagnostic pop
+
+illegal:
+    core_store(cpu, snapshot);
+    panic("Instruction not handled: 0x%x\n", instruction);
+}
+
+// Same as the interpreter, recording every instruction into the trace. Each
+// target records the operand it fetches anyway, and with its opcode known, so
+// whatever the record needs of the addressing mode is settled at compile time.
+static uint64_t mos6502_trace_run(MOS_6502 *snapshot, RAM *mem, uint64_t max_cycles)
+{
+    Core core = core_load(snapshot), *cpu = &core;
+    struct MOS_6502_Trace *trace = mem->trace;
+    TraceCursor cursor = trace->cursor;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#define LABEL(name, opcode, ...) [opcode] = &&trace_##name,
+    static void *const labels[0x100] = { [0 ... 0xFF] = &&illegal, MOS6502_OPCODES(LABEL) };
+#undef LABEL
+
+    BYTE instruction;
+    WORD operand;
+    uint64_t cycles = max_cycles > 0 ? core_poll(cpu, mem, snapshot) : 0, start;
+    cursor.delta += cycles;
+#define DISPATCH()                              \
+    do {                                        \
+        if (cycles >= max_cycles) {             \
+            goto done;                          \
+        }                                       \
+        instruction = mos6502_fetchb(cpu, mem); \
+        goto *labels[instruction];              \
+    } while (0)
+
+    DISPATCH();
+
+#define TARGET(name, opcode, mnemonic, op, mode, reg, bytes, cycles_, penalty)      \
+    trace_##name:                                                                   \
+        operand = mos6502_fetchop(cpu, mem, AddrMode_##mode);                       \
+        trace_insn(trace, &cursor, cpu, mem, cpu->pc - bytes, opcode, operand);     \
+        start = cycles;                                                             \
+        cycles += cycles_ + exec_##name(cpu, mem, operand);                         \
+        if ((Op_##op == Op_CLI || Op_##op == Op_RTI) && cycles < max_cycles) {      \
+            cycles += mos6502_unmask(cpu, mem, snapshot, opcode);                   \
+        }                                                                           \
+        cursor.delta = cycles - start;                                              \
+        DISPATCH();
+    MOS6502_OPCODES(TARGET)
+#undef TARGET
+#undef DISPATCH
+#pragma GCC diagnostic pop
+
+done:
+    trace->cursor = cursor;
+    atomic_store_explicit(&trace->head, cursor.head, memory_order_release);
+    core_store(cpu, snapshot);
     return cycles;
+
+illegal:
+    core_store(cpu, snapshot);
+    panic("Instruction not handled: 0x%x\n", instruction);
 }
 
-static uint64_t mos6502_st(MOS_6502 *cpu, RAM *mem, AddrMode mode, BYTE *reg)
+// Runs predecoded blocks as direct-threaded code: each instruction jumps to
+// the handler already resolved for the next one, with no fetch or decode.
+static uint64_t mos6502_run_blocks(MOS_6502 *snapshot, RAM *mem, uint64_t max_cycles)
 {
-    WORD addr = mos6502_getaddr(cpu, mem, mode);
-    switch (mode) {
-        case AddrMode_ZPG: {
-            memstb(mem, addr, *reg);
-            return 3;
+    Core core = core_load(snapshot), *cpu = &core;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define LABEL(name, opcode, ...) [opcode] = &&block_##name,
+    static void *const labels[0x100] = { MOS6502_OPCODES(LABEL) };
+#undef LABEL
+#define LABEL2(first, second)        [Fusion_##first##__##second] = &&fused_##first##__##second,
+#define LABEL3(first, second, third) [Fusion_##first##__##second##__##third] = &&fused_##first##__##second##__##third,
+    static void *const fused[Fusions] = { MOS6502_FUSIONS(LABEL2, LABEL3) };
+#undef LABEL3
+#undef LABEL2
+
+    uint64_t cycles = 0, base, taken;
+    uint32_t penalty;
+    Block *block, *last = NULL; // Block run last, NULL after a single step
+    Insn const *insn;
+    Idle idle = { 0 };
+
+block_dispatch:
+    // JSR ends every block, so a call being recorded is handed over right away
+    if (cycles >= max_cycles || unlikely(memo_handover(mem))) {
+        core_store(cpu, snapshot);
+        return cycles;
+    }
+    // Interrupts are only looked at here, between blocks
+    taken = core_poll(cpu, mem, snapshot);
+    if (unlikely(taken > 0)) {
+        cycles += taken;
+        goto block_dispatch;
+    }
+    block = cache_lookup(mem->cache, mem, cpu->pc);
+    // Near the end of the budget, or where no block could be decoded, fall
+    // back to one instruction at a time so the budget is honored exactly
+    if (block == NULL || cycles + block->cycles + block->penalty > max_cycles) {
+        cycles += mos6502_step(cpu, mem, snapshot);
+        last = NULL;
+        goto block_dispatch;
+    }
+    if (unlikely(block->idle)) {
+        taken = cache_idle(mem->cache, &idle, block, cpu, mem, cycles, max_cycles, last == block);
+        if (taken > 0) {
+            cycles += taken;
+            last = NULL;
+            goto block_dispatch;
         }
-
-        case AddrMode_ZPX: {
-            expect(reg != &cpu->x, "Cannot apply instruction to Register X");
-            memstb(mem, addr, *reg);
-            return 4;
+    }
+    last = block;
+    if (unlikely(mem->cache->profile != NULL)) {
+        cache_profile(mem->cache, block);
+    }
+    if (block_native(mem->cache, block)) {
+        cycles += block->native(cpu, mem);
+        goto block_dispatch;
+    }
+    if (unlikely(block->insn[0].handler == NULL)) {
+        for (BYTE i = 0; i < block->count; i++) {
+            Insn *insn = &block->insn[i];
+            insn->handler = insn->fusion ? fused[insn->fusion] : labels[insn->opcode];
         }
+        block->insn[block->count].handler = &&block_dispatch;
+    }
+    insn = block->insn;
+    goto *insn->handler;
+
+// Stores may have invalidated the very block being run, in which case the
+// rest of it is decoded again from memory
+#define AFTER_LD(...)
+#define AFTER_JSR(...)
+#define AFTER_RTS(...)
+#define AFTER_BRK(...)
+#define AFTER_RTI(...)
+#define AFTER_CLI(...)
+#define AFTER_SEI(...)
+#define AFTER_JMP(...)
+#define AFTER_BR(...)
+#define AFTER_ST(...)              \
+    if (unlikely(!block->valid)) { \
+        goto block_dispatch;       \
+    }
+#define TARGET(name, opcode, mnemonic, op, mode, reg, bytes, cycles_, penalty) \
+    block_##name:                                                              \
+        cpu->pc += bytes;                                                      \
+        cycles += cycles_ + exec_##name(cpu, mem, insn->operand);              \
+        AFTER_##op()                                                           \
+        goto *(++insn)->handler;
+    MOS6502_OPCODES(TARGET)
+#undef TARGET
+#undef AFTER_ST
+#undef AFTER_BR
+#undef AFTER_JMP
+#undef AFTER_SEI
+#undef AFTER_CLI
+#undef AFTER_RTI
+#undef AFTER_BRK
+#undef AFTER_RTS
+#undef AFTER_JSR
+#undef AFTER_LD
+
+// Superinstructions: one dispatch and one cycle addition for the whole group.
+// They only ever run inside a block that fits the budget whole, and a store
+// that invalidates the block still stops right after itself.
+#define FUSED_STEP(name, i)                            \
+    cpu->pc += Bytes_##name;                           \
+    penalty += exec_##name(cpu, mem, insn[i].operand); \
+    base += Cycles_##name;                             \
+    if (Stores_##name && unlikely(!block->valid)) {    \
+        cycles += base + penalty;                      \
+        goto block_dispatch;                           \
+    }
+#define FUSED2(first, second)     \
+    fused_##first##__##second:    \
+        base = penalty = 0;       \
+        FUSED_STEP(first, 0)      \
+        FUSED_STEP(second, 1)     \
+        cycles += base + penalty; \
+        insn += 2;                \
+        goto *insn->handler;
+#define FUSED3(first, second, third)      \
+    fused_##first##__##second##__##third: \
+        base = penalty = 0;               \
+        FUSED_STEP(first, 0)              \
+        FUSED_STEP(second, 1)             \
+        FUSED_STEP(third, 2)              \
+        cycles += base + penalty;         \
+        insn += 3;                        \
+        goto *insn->handler;
+    MOS6502_FUSIONS(FUSED2, FUSED3)
+#undef FUSED3
+#undef FUSED2
+#undef FUSED_STEP
+#pragma GCC diagnostic pop
+}
 
-        case AddrMode_ZPY: {
-            expect(reg == &cpu->x, "Cannot apply instruction but to Register X");
-            memstb(mem, addr, *reg);
-            return 4;
-        }
+#else
 
-        case AddrMode_ABS: {
-            memstb(mem, addr, *reg);
-            return 4;
+static uint64_t mos6502_interpret(MOS_6502 *snapshot, RAM *mem, uint64_t max_cycles)
+{
+    Core core = core_load(snapshot), *cpu = &core;
+    uint64_t cycles = max_cycles > 0 ? core_poll(cpu, mem, snapshot) : 0;
+    while (cycles < max_cycles && !memo_handover(mem)) {
+        BYTE instruction = mos6502_fetchb(cpu, mem);
+        cycles += mos6502_run(cpu, mem, snapshot, instruction);
+        if (cycles < max_cycles) {
+            cycles += mos6502_unmask(cpu, mem, snapshot, instruction);
         }
+    }
+    core_store(cpu, snapshot);
+    return cycles;
+}
 
-        case AddrMode_ABX:
-        case AddrMode_ABY: {
-            expect(reg == &cpu->a, "Cannot apply instruction but to Accumulator.");
-            memstb(mem, addr, *reg);
-            return 5;
+// Same as the interpreter, recording every instruction into the trace
+static uint64_t mos6502_trace_run(MOS_6502 *snapshot, RAM *mem, uint64_t max_cycles)
+{
+    Core core = core_load(snapshot), *cpu = &core;
+    struct MOS_6502_Trace *trace = mem->trace;
+    TraceCursor cursor = trace->cursor;
+    uint64_t cycles = max_cycles > 0 ? core_poll(cpu, mem, snapshot) : 0;
+    cursor.delta += cycles;
+    while (cycles < max_cycles) {
+        BYTE instruction = mos6502_fetchb(cpu, mem);
+        trace_insn(trace, &cursor, cpu, mem, cpu->pc - 1, instruction,
+                   trace_operand(cpu, mem, instruction));
+        uint64_t taken = mos6502_run(cpu, mem, snapshot, instruction);
+        if (cycles + taken < max_cycles) {
+            taken += mos6502_unmask(cpu, mem, snapshot, instruction);
         }
+        cursor.delta = taken;
+        cycles += taken;
+    }
+    trace->cursor = cursor;
+    atomic_store_explicit(&trace->head, cursor.head, memory_order_release);
+    core_store(cpu, snapshot);
+    return cycles;
+}
 
-        case AddrMode_IDX:
-        case AddrMode_IDY:
-            expect(reg == &cpu->a, "Cannot apply instruction but to Accumulator.");
-            memstb(mem, addr, *reg);
-            return 6;
+typedef uint32_t (*BlockHandler)(Core *cpu, RAM *mem, WORD operand);
 
-        default:
-            panic("Mode \"%s\" not implemented for Store instructions (ST*)",
-                  modename(mode));
+#define ENTRY(name, opcode, ...) [opcode] = exec_##name,
+static BlockHandler const block_handlers[0x100] = { MOS6502_OPCODES(ENTRY) };
+#undef ENTRY
+
+static uint64_t mos6502_run_blocks(MOS_6502 *snapshot, RAM *mem, uint64_t max_cycles)
+{
+    Core core = core_load(snapshot), *cpu = &core;
+    uint64_t cycles = 0;
+    Block *last = NULL;
+    Idle idle = { 0 };
+    while (cycles < max_cycles && !memo_handover(mem)) {
+        uint64_t taken = core_poll(cpu, mem, snapshot);
+        if (unlikely(taken > 0)) {
+            cycles += taken;
+            continue;
+        }
+        Block *block = cache_lookup(mem->cache, mem, cpu->pc);
+        if (block == NULL || cycles + block->cycles + block->penalty > max_cycles) {
+            cycles += mos6502_step(cpu, mem, snapshot);
+            last = NULL;
+            continue;
+        }
+        if (unlikely(block->idle)) {
+            taken = cache_idle(mem->cache, &idle, block, cpu, mem, cycles, max_cycles,
+                               last == block);
+            if (taken > 0) {
+                cycles += taken;
+                last = NULL;
+                continue;
+            }
+        }
+        last = block;
+        if (unlikely(mem->cache->profile != NULL)) {
+            cache_profile(mem->cache, block);
+        }
+        if (block_native(mem->cache, block)) {
+            cycles += block->native(cpu, mem);
+            continue;
+        }
+        for (Insn const *insn = block->insn; insn < block->insn + block->count; insn++) {
+            MOS_6502_OpInfo const *info = &mos6502_opinfo[insn->opcode];
+            cpu->pc += info->bytes;
+            cycles += info->cycles + block_handlers[insn->opcode](cpu, mem, insn->operand);
+            if (!block->valid) {
+                break;
+            }
+        }
     }
+    core_store(cpu, snapshot);
+    return cycles;
 }
 
-uint64_t mos6502_exec(MOS_6502 *cpu, RAM *mem, uint64_t max_cycles)
+#endif
+
+#ifdef MOS6502_PROFILE
+// Same as the interpreter, counting every instruction into the profile
+static uint64_t mos6502_profile_run(MOS_6502 *snapshot, RAM *mem, uint64_t max_cycles)
 {
-    uint64_t cycles = 0;
+    Core core = core_load(snapshot), *cpu = &core;
+    uint64_t cycles = max_cycles > 0 ? core_poll(cpu, mem, snapshot) : 0;
+    mem->profiler->run = 0;
     while (cycles < max_cycles) {
+        WORD pc = cpu->pc;
         BYTE instruction = mos6502_fetchb(cpu, mem);
-        switch (instruction) {
-            case LDA_IMM:
-            case LDA_ZPG:
-            case LDA_ZPX:
-            case LDA_ABS:
-            case LDA_ABX:
-            case LDA_ABY:
-            case LDA_IDX:
-            case LDA_IDY:
-                cycles += mos6502_ld(cpu, mem, modemap[instruction], &cpu->a);
-                continue;
-            case LDX_IMM:
-            case LDX_ZPG:
-            case LDX_ZPY:
-            case LDX_ABS:
-            case LDX_ABY:
-                cycles += mos6502_ld(cpu, mem, modemap[instruction], &cpu->x);
-                continue;
-            case LDY_IMM:
-            case LDY_ZPG:
-            case LDY_ZPX:
-            case LDY_ABS:
-            case LDY_ABX:
-                cycles += mos6502_ld(cpu, mem, modemap[instruction], &cpu->y);
-                continue;
+        uint64_t taken = mos6502_run(cpu, mem, snapshot, instruction);
+        profile_insn(mem->profiler, pc, instruction, taken);
+        cycles += taken;
+        if (cycles < max_cycles) {
+            cycles += mos6502_unmask(cpu, mem, snapshot, instruction);
+        }
+    }
+    core_store(cpu, snapshot);
+    return cycles;
+}
+#endif
 
-            case STA_ZPG:
-            case STA_ZPX:
-            case STA_ABS:
-            case STA_ABX:
-            case STA_ABY:
-            case STA_IDX:
-            case STA_IDY:
-                cycles += mos6502_st(cpu, mem, modemap[instruction], &cpu->a);
-                continue;
-            case STX_ZPG:
-            case STX_ZPY:
-            case STX_ABS:
-                cycles += mos6502_st(cpu, mem, modemap[instruction], &cpu->x);
-                continue;
-            case STY_ZPG:
-            case STY_ZPX:
-            case STY_ABS:
-                cycles += mos6502_st(cpu, mem, modemap[instruction], &cpu->y);
-                continue;
+// Same as the interpreter, stopping before instructions that hit a breakpoint
+// or watchpoint, except for the one it starts on. Also records into the trace
+// and counts into the profile, when either is running.
+static uint64_t mos6502_debug_run(MOS_6502 *snapshot, RAM *mem, uint64_t max_cycles)
+{
+    struct MOS_6502_Debug *debug = debug_get(mem);
+    Core core = core_load(snapshot), *cpu = &core;
+    WORD start = cpu->pc;
+    debug->stopped = Stop_Budget;
+    if (atomic_exchange_explicit(&mem->stop, false, memory_order_acq_rel)) {
+        debug->stopped = Stop_Event;
+        return 0;
+    }
+    struct MOS_6502_Trace *trace = mem->trace;
+    TraceCursor cursor = trace != NULL ? trace->cursor : (TraceCursor) { 0 };
+    uint64_t cycles = max_cycles > 0 ? core_poll(cpu, mem, snapshot) : 0;
+    cursor.delta += cycles;
+#ifdef MOS6502_PROFILE
+    if (mem->profiler != NULL) {
+        mem->profiler->run = 0;
+    }
+#endif
+    for (bool first = cpu->pc == start; cycles < max_cycles; first = false) {
+        if (!first && debug_hit(debug, cpu, mem)) {
+            break;
+        }
+#ifdef MOS6502_PROFILE
+        WORD pc = cpu->pc;
+#endif
+        BYTE instruction = mos6502_fetchb(cpu, mem);
+        if (trace != NULL) {
+            trace_insn(trace, &cursor, cpu, mem, cpu->pc - 1, instruction,
+                               trace_operand(cpu, mem, instruction));
+        }
+        uint64_t taken = mos6502_run(cpu, mem, snapshot, instruction);
+#ifdef MOS6502_PROFILE
+        if (mem->profiler != NULL) {
+            profile_insn(mem->profiler, pc, instruction, taken);
+        }
+#endif
+        if (cycles + taken < max_cycles) {
+            taken += mos6502_unmask(cpu, mem, snapshot, instruction);
+        }
+        cursor.delta = taken;
+        cycles += taken;
+    }
+    if (trace != NULL) {
+        trace->cursor = cursor;
+        atomic_store_explicit(&trace->head, cursor.head, memory_order_release);
+    }
+    core_store(cpu, snapshot);
+    return cycles;
+}
 
-            case JSR: {
-                WORD subroutine_addr = mos6502_fetchw(cpu, mem);
-                mos6502_pushw(cpu, mem, cpu->pc - 1);
-                cpu->pc = subroutine_addr;
-                cycles += 6;
-                continue;
-            }
+static uint64_t mos6502_engine(MOS_6502 *cpu, RAM *mem, uint64_t max_cycles)
+{
+    if (unlikely(mem->debug != NULL || atomic_load_explicit(&mem->stop, memory_order_relaxed))) {
+        if (debug_armed(mem)) {
+            return mos6502_debug_run(cpu, mem, max_cycles);
         }
+        mem->debug->stopped = Stop_Budget;
+    }
+    if (unlikely(mem->trace != NULL)) {
+        return mos6502_trace_run(cpu, mem, max_cycles);
+    }
+#ifdef MOS6502_PROFILE
+    if (unlikely(mem->profiler != NULL)) {
+        return mos6502_profile_run(cpu, mem, max_cycles);
+    }
+#endif
+    if (mem->cache != NULL) {
+        return mos6502_run_blocks(cpu, mem, max_cycles);
+    }
+    return mos6502_interpret(cpu, mem, max_cycles);
+}
 
-        panic("Instruction not handled: 0x%x\n", instruction);
+uint64_t mos6502_exec(MOS_6502 *cpu, RAM *mem, uint64_t max_cycles)
+{
+    uint64_t cycles = mos6502_engine(cpu, mem, max_cycles);
+    // The engines stop right after a JSR that starts recording a memoized call
+    while (unlikely(memo_handover(mem))) {
+        cycles += memo_run(cpu, mem, cycles < max_cycles ? max_cycles - cycles : 0);
+        if (cycles < max_cycles) {
+            cycles += mos6502_engine(cpu, mem, max_cycles - cycles);
+        }
     }
     return cycles;
 }
 
+BYTE mos6502_getp(MOS_6502 const *cpu)
+{
+    return cpu->c << 0 | cpu->z << 1 | cpu->i << 2 | cpu->d << 3 //
+           | cpu->b << 4 | cpu->_ << 5 | cpu->o << 6 | cpu->n << 7;
+}
+
+void mos6502_setp(MOS_6502 *cpu, BYTE p)
+{
+    cpu->c = p >> 0, cpu->z = p >> 1, cpu->i = p >> 2, cpu->d = p >> 3;
+    cpu->b = p >> 4, cpu->_ = p >> 5, cpu->o = p >> 6, cpu->n = p >> 7;
+}
+
+void mos6502_raise(MOS_6502 *cpu, uint32_t lines)
+{
+    atomic_fetch_or_explicit(&cpu->pending, lines, memory_order_release);
+}
+
+void mos6502_lower(MOS_6502 *cpu, uint32_t lines)
+{
+    atomic_fetch_and_explicit(&cpu->pending, ~lines, memory_order_release);
+}
+
 void mos6502_reset(MOS_6502 *cpu, RAM *mem)
 {
-    cpu->pc = 0xFFFC;
+    cpu->pc = Vector_RESET;
     cpu->s = 0xFD;
-    cpu->c = cpu->z = cpu->i = cpu->d = cpu->b = cpu->o = cpu->n = 0;
+    cpu->c = cpu->z = cpu->i = cpu->d = cpu->b = cpu->_ = cpu->o = cpu->n = 0;
     cpu->a = cpu->x = cpu->y = 0;
-    memset(mem->data, 0, RAM_SIZE);
+    atomic_store_explicit(&cpu->pending, 0, memory_order_relaxed);
+    memclear(mem);
+    if (mem->cache != NULL) {
+        mos6502_cache_flush(mem);
+    }
+}
+
+void mos6502_snapshot(MOS_6502 const *cpu, RAM *mem, MOS_6502_Snapshot *snap)
+{
+    snap->cpu = *cpu;
+    memsnapshot(mem, &snap->mem);
+}
+
+void mos6502_fork(MOS_6502_Snapshot const *snap, MOS_6502 *cpu, RAM *mem)
+{
+    *cpu = snap->cpu;
+    memfork(mem, &snap->mem);
+}
+
+void mos6502_snapshot_free(MOS_6502_Snapshot *snap)
+{
+    memsnapshot_free(&snap->mem);
 }
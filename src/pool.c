@@ -0,0 +1,379 @@
+#define _DEFAULT_SOURCE
+
+#include "pool.h"
+#include "lib.h"
+#include "mos6502.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define RING_SIZE 4096    // Jobs a ring can hold, must be a power of two
+#define OVERFLOW_BATCH 64 // Jobs a worker moves out of the overflow list at a time
+
+// Bounded ring with a single producer and any number of takers. The producer
+// pushes at the bottom; every taker, the producer included, takes from the
+// top. This is a FIFO shared by all takers rather than a Chase-Lev deque, so
+// a worker runs its jobs round-robin and a job preempted at the end of its
+// quantum goes behind the others.
+typedef struct {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    MOS_6502_Job *_Atomic jobs[RING_SIZE];
+} Ring;
+
+// Producer only. Returns false when the ring is full.
+static bool ring_push(Ring *ring, MOS_6502_Job *job)
+{
+    int64_t bottom = atomic_load_explicit(&ring->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&ring->top, memory_order_acquire);
+    if (bottom - top >= RING_SIZE) {
+        return false;
+    }
+    atomic_store_explicit(&ring->jobs[bottom & (RING_SIZE - 1)], job, memory_order_relaxed);
+    atomic_store_explicit(&ring->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+// Any thread. Returns NULL when the ring is empty or another thread won the
+// race for the top job.
+static MOS_6502_Job *ring_take(Ring *ring)
+{
+    int64_t top = atomic_load_explicit(&ring->top, memory_order_acquire);
+    int64_t bottom = atomic_load_explicit(&ring->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    MOS_6502_Job *job = atomic_load_explicit(&ring->jobs[top & (RING_SIZE - 1)],
+                                             memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&ring->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return job;
+}
+
+static bool ring_empty(Ring *ring)
+{
+    return atomic_load_explicit(&ring->top, memory_order_acquire)
+           >= atomic_load_explicit(&ring->bottom, memory_order_acquire);
+}
+
+typedef struct {
+    MOS_6502_Pool *pool;
+    pthread_t thread;
+    size_t index;
+    RAM *spare;  // Memory of the last job that did not keep it, reused by the next one
+    Ring inbox;  // Jobs submitted to this worker, pushed by the submitting thread
+    Ring queue;  // Jobs this worker preempted or took from the overflow, pushed by itself
+} Worker;
+
+struct MOS_6502_Pool {
+    uint64_t quantum;
+    size_t count;
+    Worker *workers;
+    size_t submit; // Worker the next job is submitted to, round-robin
+
+    // Jobs no ring had room for, linked through `next`
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    MOS_6502_Job *overflow_head;
+    MOS_6502_Job *overflow_tail;
+    _Atomic size_t overflow;
+    _Atomic size_t idle; // Workers asleep on `wake`
+    bool stop;
+
+    // Finished jobs: lock-free multi-producer single-consumer queue with a
+    // stub node (Vyukov), linked through `next`
+    MOS_6502_Job *_Atomic done_head;
+    MOS_6502_Job *done_tail;
+    MOS_6502_Job stub;
+    sem_t done;
+
+    size_t outstanding; // Submitted and not returned by mos6502_pool_wait yet
+};
+
+static void done_push(MOS_6502_Pool *pool, MOS_6502_Job *job)
+{
+    atomic_store_explicit(&job->next, NULL, memory_order_relaxed);
+    MOS_6502_Job *prev = atomic_exchange_explicit(&pool->done_head, job, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, job, memory_order_release);
+}
+
+// Returns NULL while a producer is between its exchange and its link
+static MOS_6502_Job *done_pop(MOS_6502_Pool *pool)
+{
+    MOS_6502_Job *tail = pool->done_tail;
+    MOS_6502_Job *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &pool->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        pool->done_tail = tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        pool->done_tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&pool->done_head, memory_order_acquire)) {
+        return NULL;
+    }
+    done_push(pool, &pool->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        pool->done_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Wakes a sleeping worker, if any, after a job was pushed to a ring. The fence
+// pairs with the one in worker_wait: either the sleeper sees the job, or this
+// sees the sleeper, which holds `lock` until it waits.
+static void pool_wake(MOS_6502_Pool *pool)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->idle, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void overflow_push(MOS_6502_Pool *pool, MOS_6502_Job *job)
+{
+    atomic_store_explicit(&job->next, NULL, memory_order_relaxed);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->overflow_tail != NULL) {
+        atomic_store_explicit(&pool->overflow_tail->next, job, memory_order_relaxed);
+    } else {
+        pool->overflow_head = job;
+    }
+    pool->overflow_tail = job;
+    atomic_fetch_add_explicit(&pool->overflow, 1, memory_order_release);
+    if (atomic_load_explicit(&pool->idle, memory_order_relaxed) > 0) {
+        pthread_cond_signal(&pool->wake);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Takes a job from the overflow list, moving up to OVERFLOW_BATCH - 1 more to
+// the queue of `worker`, where the others can steal them
+static MOS_6502_Job *overflow_take(Worker *worker)
+{
+    MOS_6502_Pool *pool = worker->pool;
+    if (atomic_load_explicit(&pool->overflow, memory_order_acquire) == 0) {
+        return NULL;
+    }
+    MOS_6502_Job *first = NULL;
+    size_t moved = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (moved < OVERFLOW_BATCH && pool->overflow_head != NULL) {
+        MOS_6502_Job *job = pool->overflow_head;
+        if (first != NULL && !ring_push(&worker->queue, job)) {
+            break;
+        }
+        first = first != NULL ? first : job;
+        pool->overflow_head = atomic_load_explicit(&job->next, memory_order_relaxed);
+        if (pool->overflow_head == NULL) {
+            pool->overflow_tail = NULL;
+        }
+        moved++;
+    }
+    atomic_fetch_sub_explicit(&pool->overflow, moved, memory_order_release);
+    pthread_mutex_unlock(&pool->lock);
+    if (moved > 1) {
+        pool_wake(pool);
+    }
+    return first;
+}
+
+// New jobs first, so they start as soon as any quantum ends, then the
+// worker's preempted ones, then anybody else's, then the overflow
+static MOS_6502_Job *worker_next(Worker *worker)
+{
+    MOS_6502_Pool *pool = worker->pool;
+    MOS_6502_Job *job = ring_take(&worker->inbox);
+    if (job == NULL) {
+        job = ring_take(&worker->queue);
+    }
+    for (size_t i = 1; job == NULL && i < pool->count; i++) {
+        Worker *victim = &pool->workers[(worker->index + i) % pool->count];
+        job = ring_take(&victim->inbox);
+        if (job == NULL) {
+            job = ring_take(&victim->queue);
+        }
+    }
+    if (job == NULL) {
+        job = overflow_take(worker);
+    }
+    return job;
+}
+
+// Sleeps until there may be work again. Returns false once the pool stops.
+static bool worker_wait(Worker *worker)
+{
+    MOS_6502_Pool *pool = worker->pool;
+    pthread_mutex_lock(&pool->lock);
+    // Announced before looking at the rings, see pool_wake
+    atomic_fetch_add_explicit(&pool->idle, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool work = pool->overflow_head != NULL;
+    for (size_t i = 0; !work && i < pool->count; i++) {
+        work = !ring_empty(&pool->workers[i].inbox) || !ring_empty(&pool->workers[i].queue);
+    }
+    if (!work && !pool->stop) {
+        pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    atomic_fetch_sub_explicit(&pool->idle, 1, memory_order_relaxed);
+    bool stop = pool->stop;
+    pthread_mutex_unlock(&pool->lock);
+    return !stop;
+}
+
+// Resetting a reused RAM only clears the pages the previous job wrote
+static void job_start(Worker *worker, MOS_6502_Job *job)
+{
+    job->mem = worker->spare != NULL ? worker->spare : calloc(1, sizeof(RAM));
+    worker->spare = NULL;
+    expect(job->mem != NULL, "Could not allocate memory for a job");
+    mos6502_reset(&job->cpu, job->mem);
+    memload(job->mem, job->load, job->image, job->size);
+    job->cpu.pc = job->entry;
+    job->cycles = 0;
+}
+
+// Runs one quantum of `job`. Returns true once the job is finished.
+static bool job_run(MOS_6502_Job *job, uint64_t quantum)
+{
+    // Slicing the budget does not change where the run stops: every slice
+    // ends on an instruction boundary and the last one ends at `max_cycles`
+    uint64_t left = job->max_cycles - job->cycles;
+    job->cycles += mos6502_exec(&job->cpu, job->mem, left < quantum ? left : quantum);
+    return job->cycles >= job->max_cycles;
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    MOS_6502_Pool *pool = worker->pool;
+    for (;;) {
+        MOS_6502_Job *job = worker_next(worker);
+        if (job == NULL) {
+            if (!worker_wait(worker)) {
+                return NULL;
+            }
+            continue;
+        }
+
+        if (job->mem == NULL) {
+            job_start(worker, job);
+        }
+        if (job->cycles < job->max_cycles && !job_run(job, pool->quantum)) {
+            if (!ring_push(&worker->queue, job)) {
+                overflow_push(pool, job);
+            } else {
+                // Somebody could be stealing this
+                pool_wake(pool);
+            }
+            continue;
+        }
+
+        if (!job->keep_mem) {
+            if (worker->spare != NULL) {
+                memfree(worker->spare);
+            }
+            free(worker->spare);
+            worker->spare = job->mem;
+            job->mem = NULL;
+        }
+        done_push(pool, job);
+        sem_post(&pool->done);
+    }
+}
+
+MOS_6502_Pool *mos6502_pool_new(size_t threads, uint64_t quantum)
+{
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    expect(quantum > 0, "The quantum must be at least one cycle");
+
+    MOS_6502_Pool *pool = calloc(1, sizeof(MOS_6502_Pool));
+    Worker *workers = calloc(threads, sizeof(Worker));
+    expect(pool != NULL && workers != NULL, "Could not allocate the pool");
+    pool->quantum = quantum;
+    pool->count = threads;
+    pool->workers = workers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pool->done_head = pool->done_tail = &pool->stub;
+    sem_init(&pool->done, 0, 0);
+
+    for (size_t i = 0; i < threads; i++) {
+        workers[i].pool = pool;
+        workers[i].index = i;
+        expect(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) == 0,
+               "Could not start worker %zu", i);
+    }
+    return pool;
+}
+
+void mos6502_pool_free(MOS_6502_Pool *pool)
+{
+    expect(pool->outstanding == 0, "%zu jobs were not waited for", pool->outstanding);
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        if (pool->workers[i].spare != NULL) {
+            memfree(pool->workers[i].spare);
+        }
+        free(pool->workers[i].spare);
+    }
+    sem_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+void mos6502_pool_submit(MOS_6502_Pool *pool, MOS_6502_Job *job)
+{
+    job->mem = NULL;
+    pool->outstanding++;
+    // Spread over the workers, each of which starts on its own jobs and
+    // only steals once it runs dry
+    for (size_t i = 0; i < pool->count; i++) {
+        Worker *worker = &pool->workers[pool->submit++ % pool->count];
+        if (ring_push(&worker->inbox, job)) {
+            pool_wake(pool);
+            return;
+        }
+    }
+    overflow_push(pool, job);
+}
+
+MOS_6502_Job *mos6502_pool_wait(MOS_6502_Pool *pool)
+{
+    if (pool->outstanding == 0) {
+        return NULL;
+    }
+    while (sem_wait(&pool->done) != 0) {
+        // Interrupted by a signal
+    }
+    MOS_6502_Job *job;
+    while ((job = done_pop(pool)) == NULL) {
+        // A worker is halfway through pushing it
+        sched_yield();
+    }
+    pool->outstanding--;
+    return job;
+}
@@ -0,0 +1,151 @@
+#include "profile.h"
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX(name, opcode, ...) [opcode] = Index_##name,
+BYTE const opindex[0x100] = { MOS6502_OPCODES(INDEX) };
+#undef INDEX
+
+#define OPCODE(name, opcode, ...) [Index_##name] = opcode,
+static BYTE const opcodes[Opcodes] = { MOS6502_OPCODES(OPCODE) };
+#undef OPCODE
+
+typedef struct {
+    uint64_t count;
+    BYTE length;
+    BYTE index[3];
+} Group;
+
+static int group_compare(void const *l, void const *r)
+{
+    Group const *a = l, *b = r;
+    if (a->count != b->count) {
+        return a->count < b->count ? 1 : -1;
+    }
+    return memcmp(a->index, b->index, sizeof(a->index));
+}
+
+void opgroups_write(OpGroups const *groups, FILE *out)
+{
+    size_t count = 0;
+    Group *sorted = malloc(sizeof(Group) * (Opcodes * Opcodes + Opcodes * Opcodes * Opcodes));
+    expect(sorted != NULL, "Could not allocate the profile groups");
+    for (BYTE a = 0; a < Opcodes; a++) {
+        for (BYTE b = 0; b < Opcodes; b++) {
+            if (groups->pairs[a][b] > 0) {
+                sorted[count++] = (Group) { groups->pairs[a][b], 2, { a, b } };
+            }
+            for (BYTE c = 0; c < Opcodes; c++) {
+                if (groups->triples[a][b][c] > 0) {
+                    sorted[count++] = (Group) { groups->triples[a][b][c], 3, { a, b, c } };
+                }
+            }
+        }
+    }
+    qsort(sorted, count, sizeof(Group), group_compare);
+
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%lu", sorted[i].count);
+        for (BYTE j = 0; j < sorted[i].length; j++) {
+            fprintf(out, " %s", mos6502_opinfo[opcodes[sorted[i].index[j]]].name);
+        }
+        fprintf(out, "\n");
+    }
+    free(sorted);
+}
+
+bool mos6502_profile_enable(RAM *mem)
+{
+#ifdef MOS6502_PROFILE
+    if (mem->profiler == NULL) {
+        mem->profiler = calloc(1, sizeof(*mem->profiler));
+        expect(mem->profiler != NULL, "Could not allocate the profile");
+        mem->heat = &mem->profiler->profile.heat;
+    }
+    return true;
+#else
+    (void) mem;
+    return false;
+#endif
+}
+
+void mos6502_profile_disable(RAM *mem)
+{
+    free(mem->profiler);
+    mem->profiler = NULL;
+    mem->heat = NULL;
+}
+
+MOS_6502_Profile const *mos6502_profile(RAM const *mem)
+{
+    return mem->profiler != NULL ? &mem->profiler->profile : NULL;
+}
+
+typedef struct {
+    uint64_t count;
+    WORD addr;
+} Hit;
+
+static int hit_compare(void const *l, void const *r)
+{
+    Hit const *a = l, *b = r;
+    if (a->count != b->count) {
+        return a->count < b->count ? 1 : -1;
+    }
+    return a->addr - b->addr;
+}
+
+bool mos6502_profile_save(RAM *mem, char const *path)
+{
+    expect(mem->profiler != NULL, "Profiling not enabled");
+    MOS_6502_Profile const *profile = &mem->profiler->profile;
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return false;
+    }
+
+    fprintf(out, "# 6502 execution profile: %lu instructions, %lu cycles\n", profile->instructions,
+            profile->cycles);
+    fprintf(out, "# op <opcode> <times run> <cycles>\n");
+    for (size_t opcode = 0; opcode < 0x100; opcode++) {
+        if (profile->op_count[opcode] > 0) {
+            fprintf(out, "op %s %lu %lu\n", mos6502_opinfo[opcode].name, profile->op_count[opcode],
+                    profile->op_cycles[opcode]);
+        }
+    }
+
+    // The first entries give the number of runs a block needs to be among
+    // the hottest, e.g. for the threshold of mos6502_cache_engine
+    size_t count = 0;
+    Hit *hits = malloc(sizeof(Hit) * RAM_SIZE);
+    expect(hits != NULL, "Could not allocate the profile hits");
+    for (size_t addr = 0; addr < RAM_SIZE; addr++) {
+        if (profile->pc[addr] > 0) {
+            hits[count++] = (Hit) { profile->pc[addr], addr };
+        }
+    }
+    qsort(hits, count, sizeof(Hit), hit_compare);
+    fprintf(out, "# pc <address> <times run>, most run first\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "pc 0x%04x %lu\n", hits[i].addr, hits[i].count);
+    }
+    free(hits);
+
+    RAM_Heat const *heat = &profile->heat;
+    fprintf(out, "# heat <address> <reads> <writes> <times run>\n");
+    for (size_t addr = 0; addr < RAM_SIZE; addr++) {
+        if (heat->read[addr] > 0 || heat->write[addr] > 0 || heat->exec[addr] > 0) {
+            fprintf(out, "heat 0x%04zx %lu %lu %lu\n", addr, heat->read[addr], heat->write[addr],
+                    heat->exec[addr]);
+        }
+    }
+
+    fprintf(out, "# <times run> <opcodes>: pairs and triples run in a row within a block, "
+                 "most run first\n");
+    opgroups_write(&mem->profiler->groups, out);
+    return fclose(out) == 0;
+}
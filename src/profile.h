@@ -0,0 +1,79 @@
+#ifndef MOS6502_PROFILE_H_
+#define MOS6502_PROFILE_H_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdio.h>
+
+// Dense numbering of the implemented opcodes, so that counters of opcode
+// groups can live in flat arrays
+enum {
+#define INDEX(name, ...) Index_##name,
+    MOS6502_OPCODES(INDEX)
+#undef INDEX
+    Opcodes
+};
+
+extern BYTE const opindex[0x100];
+
+// Control transfers and CLI end blocks, so groups of superinstruction
+// candidates never contain one. Both profiles count groups by this same rule.
+static forceinline bool opgroup_member(BYTE opcode)
+{
+    Op op = mos6502_opinfo[opcode].op;
+    return op != Op_JSR && op != Op_RTS && op != Op_BRK && op != Op_RTI && op != Op_JMP
+           && op != Op_BR && op != Op_CLI;
+}
+
+// Opcodes run in a row within a block, to choose superinstructions from
+typedef struct {
+    uint64_t pairs[Opcodes][Opcodes];
+    uint64_t triples[Opcodes][Opcodes][Opcodes];
+} OpGroups;
+
+// Writes the groups run at least once, most run first, as the
+// `count first second [third]` lines 6502-fusegen reads
+void opgroups_write(OpGroups const *groups, FILE *out);
+
+struct MOS_6502_Profiler {
+    MOS_6502_Profile profile;
+    OpGroups groups;
+    BYTE run;     // Instructions counted since the last control transfer, up to 2
+    BYTE last[2]; // Indices of the last two of them
+};
+
+// Counts the instruction at `pc` that just ran, taking `cycles`
+static forceinline void profile_insn(struct MOS_6502_Profiler *profiler, WORD pc, BYTE opcode,
+                                     uint64_t cycles)
+{
+    MOS_6502_Profile *profile = &profiler->profile;
+    MOS_6502_OpInfo const *info = &mos6502_opinfo[opcode];
+    profile->instructions++;
+    profile->cycles += cycles;
+    profile->op_count[opcode]++;
+    profile->op_cycles[opcode] += cycles;
+    profile->pc[pc]++;
+    for (BYTE i = 0; i < info->bytes; i++) {
+        profile->heat.exec[(WORD) (pc + i)]++;
+    }
+
+    if (!opgroup_member(opcode)) {
+        profiler->run = 0;
+        return;
+    }
+    OpGroups *groups = &profiler->groups;
+    BYTE index = opindex[opcode];
+    if (profiler->run >= 1) {
+        groups->pairs[profiler->last[1]][index]++;
+    }
+    if (profiler->run >= 2) {
+        groups->triples[profiler->last[0]][profiler->last[1]][index]++;
+    }
+    profiler->last[0] = profiler->last[1];
+    profiler->last[1] = index;
+    profiler->run += profiler->run < 2;
+}
+
+#endif // MOS6502_PROFILE_H_
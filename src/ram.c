@@ -1,37 +1,481 @@
 #include "ram.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-// Cycles: 1
-// Returns byte copy at `addr`
-BYTE memldb(RAM *mem, WORD addr)
+// Whether `addr` lies on a page the block cache decoded code from
+static inline bool memcode(RAM const *mem, WORD addr)
 {
-    return mem->data[addr];
+    return mem->code[addr >> 14] >> (addr >> 8 & 63) & 1;
 }
 
-// Cycles: 2
-// Expects `addr` to reference the low byte of word to be loaded
-// Returns little-endian word copy from `addr` through `addr + 1`
-WORD memldw(RAM *mem, WORD addr)
+static inline uint64_t membit(BYTE page)
 {
-    expect(addr < RAM_SIZE - 1, "Address 0x%x cannot be the low byte of a word", addr);
-    WORD w = mem->data[addr] & 0xFF;
-    return w |= mem->data[addr + 1] << 8;
+    return (uint64_t) 1 << (page & 63);
 }
 
-// Cycles: 1
-// Set byte at `addr` to be `b`
-void memstb(RAM *mem, WORD addr, BYTE b)
+// Drops the memoized calls that read from `page`, which is about to change
+// other than through memstb
+static inline void memwatch(RAM *mem, BYTE page)
 {
-    mem->data[addr] = b;
+    if (mem->watch[page / 64] & membit(page)) {
+        memo_invalidate(mem, page << 8, RAM_PAGE_SIZE);
+    }
 }
 
-// Cycles: 2
-// Expects `addr` to reference the low byte of word to be loaded
-// Set bytes from `addr` through `addr + 1` to be `w` in little-endian
-void memstw(RAM *mem, WORD addr, WORD w)
+// Pages come out of chunks of ARENA_CHUNK and are recycled through a free
+// list per thread, so that the first store to a page seldom calls malloc. A
+// page goes back to the list of the thread that drops its last reference.
+// Threads hand their list over to `spill` when they exit.
+#define ARENA_CHUNK 64
+
+typedef struct {
+    RAM_Page *free;
+    RAM_Page *next; // Not handed out yet in the current chunk
+    RAM_Page *end;
+} Arena;
+
+static _Thread_local Arena arena;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static RAM_Page *spill;
+
+// Read by every page that was never written
+static RAM_Page const memzero = { .rom = true };
+
+// Device mapped at `page` of `mem`, if any
+static inline RAM_Io const *memio(RAM const *mem, BYTE page)
+{
+    return mem->io != NULL ? mem->io[page] : NULL;
+}
+
+static void arena_exit(void *arg)
+{
+    Arena *arena = arg;
+    while (arena->next != arena->end) {
+        RAM_Page *page = arena->next++;
+        page->next = arena->free;
+        arena->free = page;
+    }
+    if (arena->free == NULL) {
+        return;
+    }
+    RAM_Page *last = arena->free;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    pthread_mutex_lock(&spill_lock);
+    last->next = spill;
+    spill = arena->free;
+    pthread_mutex_unlock(&spill_lock);
+    arena->free = NULL;
+}
+
+static void arena_init(void)
+{
+    expect(pthread_key_create(&arena_key, arena_exit) == 0, "Could not create the page arena");
+}
+
+static RAM_Page *arena_refill(void)
+{
+    pthread_once(&arena_once, arena_init);
+    pthread_setspecific(arena_key, &arena);
+
+    pthread_mutex_lock(&spill_lock);
+    RAM_Page *page = spill;
+    spill = NULL;
+    pthread_mutex_unlock(&spill_lock);
+    if (page != NULL) {
+        arena.free = page->next;
+        return page;
+    }
+
+    page = malloc(ARENA_CHUNK * sizeof(RAM_Page));
+    expect(page != NULL, "Could not allocate pages");
+    arena.next = page + 1;
+    arena.end = page + ARENA_CHUNK;
+    return page;
+}
+
+static RAM_Page *mempage_new(void)
+{
+    RAM_Page *page = arena.free;
+    if (likely(page != NULL)) {
+        arena.free = page->next;
+    } else if (arena.next != arena.end) {
+        page = arena.next++;
+    } else {
+        page = arena_refill();
+    }
+    atomic_init(&page->refs, 1);
+    page->rom = false;
+    return page;
+}
+
+static void mempage_release(RAM_Page *page)
+{
+    if (page != NULL && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        page->next = arena.free;
+        arena.free = page;
+    }
+}
+
+static void mempages_free(RAM_Page **page, uint64_t *used)
+{
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        for (uint64_t pages = used[i]; pages != 0; pages &= pages - 1) {
+            size_t index = i * 64 + __builtin_ctzll(pages);
+            mempage_release(page[index]);
+            page[index] = NULL;
+        }
+        used[i] = 0;
+    }
+}
+
+// Replaces `page` of `mem` with `to`, whose reference passes to `mem`,
+// undoing any mapping of the page
+static void mempage_set(RAM *mem, BYTE page, RAM_Page *to)
+{
+    mempage_release(mem->page[page]);
+    mem->page[page] = to;
+    mem->host[page] = to != NULL ? to->data : NULL;
+    mem->wr[page / 64] &= ~membit(page);
+    mem->used[page / 64] &= ~membit(page);
+    mem->rom[page / 64] &= ~membit(page);
+    mem->bus[page / 64] &= ~membit(page);
+    if (mem->io != NULL) {
+        mem->io[page] = NULL;
+    }
+    if (to != NULL) {
+        mem->used[page / 64] |= membit(page);
+        if (to->rom) {
+            mem->rom[page / 64] |= membit(page);
+        }
+    }
+    if (memcode(mem, page << 8)) {
+        memcode_invalidate(mem, page);
+    }
+    memwatch(mem, page);
+}
+
+// Makes `page` of `mem` refer to `to` too
+static void memshare(RAM *mem, BYTE page, RAM_Page *to)
+{
+    if (to == mem->page[page]) {
+        mem->wr[page / 64] &= ~membit(page);
+        return;
+    }
+    if (to != NULL) {
+        atomic_fetch_add_explicit(&to->refs, 1, memory_order_relaxed);
+    }
+    mempage_set(mem, page, to);
+}
+
+// Slow path of the stores: gives `mem` a page of its own at `page`, copying
+// the shared one or allocating a zeroed one, and lets the next stores to it go
+// straight to `host`. Returns NULL for ROM and devices.
+static BYTE *memwrite(RAM *mem, BYTE page)
+{
+    if ((mem->rom[page / 64] & membit(page)) || memio(mem, page) != NULL) {
+        return NULL;
+    }
+    if (memcode(mem, page << 8)) {
+        memcode_invalidate(mem, page);
+    }
+    if (!(mem->bus[page / 64] & membit(page))) {
+        RAM_Page *old = mem->page[page];
+        if (old == NULL || atomic_load_explicit(&old->refs, memory_order_acquire) > 1) {
+            RAM_Page *copy = mempage_new();
+            memcpy(copy->data, old != NULL ? old->data : memzero.data, RAM_PAGE_SIZE);
+            mempage_release(old);
+            mem->page[page] = copy;
+            mem->host[page] = copy->data;
+            mem->used[page / 64] |= membit(page);
+        }
+        mem->dirty[page / 64] |= membit(page);
+    }
+    if (!(mem->watch[page / 64] & membit(page))) {
+        mem->wr[page / 64] |= membit(page);
+    }
+    return mem->host[page];
+}
+
+BYTE memldb_slow(RAM *mem, WORD addr)
+{
+    BYTE b;
+    if (unlikely(mem->memo != NULL) && memo_load(mem, addr, &b)) {
+        return b;
+    }
+    RAM_Io const *io = memio(mem, addr >> 8);
+    if (io != NULL) {
+        return io->read(io->device, addr);
+    }
+    // Never written, so it reads from the zero page from now on
+    mem->host[addr >> 8] = (BYTE *) memzero.data;
+    return 0;
+}
+
+void memstb_slow(RAM *mem, WORD addr, BYTE b)
+{
+    if (unlikely(mem->memo != NULL) && memo_store(mem, addr, b)) {
+        return;
+    }
+    RAM_Io const *io = memio(mem, addr >> 8);
+    if (io != NULL) {
+        io->write(io->device, addr, b);
+        return;
+    }
+    BYTE *page = memwrite(mem, addr >> 8);
+    if (page != NULL) {
+        page[addr & 0xFF] = b;
+    }
+}
+
+void memload(RAM *mem, WORD addr, BYTE const *src, size_t size)
+{
+    expect(addr + size <= RAM_SIZE, "%zu bytes do not fit at 0x%x", size, addr);
+    for (uint32_t at = addr; size > 0;) {
+        size_t chunk = RAM_PAGE_SIZE - (at & 0xFF) < size ? RAM_PAGE_SIZE - (at & 0xFF) : size;
+        if (memio(mem, at >> 8) != NULL) {
+            for (size_t i = 0; i < chunk; i++) {
+                memstb(mem, at + i, src[i]);
+            }
+        } else {
+            BYTE *page = memwrite(mem, at >> 8);
+            memwatch(mem, at >> 8);
+            if (page != NULL) {
+                memcpy(page + (at & 0xFF), src, chunk);
+            }
+        }
+        at += chunk;
+        src += chunk;
+        size -= chunk;
+    }
+}
+
+void memread(RAM *mem, WORD addr, BYTE *dst, size_t size)
+{
+    expect(addr + size <= RAM_SIZE, "%zu bytes do not fit at 0x%x", size, addr);
+    for (uint32_t at = addr; size > 0;) {
+        size_t chunk = RAM_PAGE_SIZE - (at & 0xFF) < size ? RAM_PAGE_SIZE - (at & 0xFF) : size;
+        BYTE const *page = mem->host[at >> 8];
+        for (size_t i = 0; page == NULL && i < chunk; i++) {
+            dst[i] = memldb(mem, at + i);
+        }
+        if (page != NULL) {
+            memcpy(dst, page + (at & 0xFF), chunk);
+        }
+        at += chunk;
+        dst += chunk;
+        size -= chunk;
+    }
+}
+
+bool memequal(RAM *mem, WORD addr, BYTE const *bytes, size_t size)
+{
+    if (addr + size > RAM_SIZE) {
+        return false;
+    }
+    for (uint32_t at = addr; size > 0;) {
+        size_t chunk = RAM_PAGE_SIZE - (at & 0xFF) < size ? RAM_PAGE_SIZE - (at & 0xFF) : size;
+        BYTE const *page = mem->host[at >> 8];
+        for (size_t i = 0; page == NULL && i < chunk; i++) {
+            if (memldb(mem, at + i) != bytes[i]) {
+                return false;
+            }
+        }
+        if (page != NULL && memcmp(page + (at & 0xFF), bytes, chunk) != 0) {
+            return false;
+        }
+        at += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+void memclear(RAM *mem)
+{
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        for (uint64_t pages = mem->used[i] & ~mem->rom[i]; pages != 0; pages &= pages - 1) {
+            mempage_set(mem, i * 64 + __builtin_ctzll(pages), NULL);
+        }
+        mem->dirty[i] = 0;
+    }
+    mem->origin = NULL;
+}
+
+void memfree(RAM *mem)
+{
+    if (mem->cleanup != NULL) {
+        mem->cleanup(mem);
+        mem->cleanup = NULL;
+    }
+    memclear(mem);
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        for (uint64_t pages = mem->used[i] | mem->bus[i]; pages != 0; pages &= pages - 1) {
+            mempage_set(mem, i * 64 + __builtin_ctzll(pages), NULL);
+        }
+    }
+    free(mem->io);
+    mem->io = NULL;
+    free(mem->hooks);
+    mem->hooks = NULL;
+    free(mem->memo);
+    mem->memo = NULL;
+    memset(mem->watch, 0, sizeof(mem->watch));
+    free(mem->profiler);
+    mem->profiler = NULL;
+    mem->heat = NULL;
+    free(mem->debug);
+    mem->debug = NULL;
+}
+
+void memrestore(RAM *mem, RAM const *from)
+{
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        uint64_t source = from->used[i];
+        uint64_t pages = mem->dirty[i];
+        if (mem->origin != from) {
+            pages |= mem->used[i] | source;
+        }
+        for (pages &= ~mem->bus[i]; pages != 0; pages &= pages - 1) {
+            BYTE page = i * 64 + __builtin_ctzll(pages);
+            RAM_Page *to = from->page[page];
+            if (to == NULL || to->rom) {
+                memshare(mem, page, to);
+                continue;
+            }
+            if (mem->rom[i] & membit(page)) {
+                mempage_set(mem, page, NULL);
+            }
+            memwatch(mem, page);
+            memcpy(memwrite(mem, page), to->data, RAM_PAGE_SIZE);
+            mem->wr[i] &= ~membit(page);
+        }
+        mem->dirty[i] = 0;
+    }
+    mem->origin = from;
+}
+
+void memsnapshot(RAM *mem, RAM_Snapshot *snap)
+{
+    memset(snap->page, 0, sizeof(snap->page));
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        for (uint64_t pages = mem->used[i]; pages != 0; pages &= pages - 1) {
+            BYTE page = i * 64 + __builtin_ctzll(pages);
+            atomic_fetch_add_explicit(&mem->page[page]->refs, 1, memory_order_relaxed);
+            snap->page[page] = mem->page[page];
+        }
+        snap->used[i] = mem->used[i];
+        mem->wr[i] &= ~mem->used[i];
+        mem->dirty[i] = 0;
+    }
+    mem->origin = snap;
+}
+
+void memfork(RAM *mem, RAM_Snapshot const *snap)
+{
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        uint64_t pages = mem->dirty[i];
+        if (mem->origin != snap) {
+            pages |= mem->used[i] | snap->used[i];
+        }
+        for (pages &= ~mem->bus[i]; pages != 0; pages &= pages - 1) {
+            BYTE page = i * 64 + __builtin_ctzll(pages);
+            memshare(mem, page, snap->page[page]);
+        }
+        mem->dirty[i] = 0;
+    }
+    mem->origin = snap;
+}
+
+void memsnapshot_free(RAM_Snapshot *snap)
+{
+    mempages_free(snap->page, snap->used);
+}
+
+void memrom_load(RAM_Rom *rom, WORD addr, BYTE const *src, size_t size)
+{
+    expect(addr + size <= RAM_SIZE, "%zu bytes do not fit at 0x%x", size, addr);
+    for (uint32_t at = addr; size > 0;) {
+        size_t chunk = RAM_PAGE_SIZE - (at & 0xFF) < size ? RAM_PAGE_SIZE - (at & 0xFF) : size;
+        RAM_Page *page = rom->page[at >> 8];
+        if (page == NULL) {
+            page = rom->page[at >> 8] = mempage_new();
+            page->rom = true;
+            memset(page->data, 0, RAM_PAGE_SIZE);
+            rom->used[at >> 14] |= membit(at >> 8);
+        }
+        expect(atomic_load(&page->refs) == 1, "ROM page 0x%02x is mapped already", at >> 8);
+        memcpy(page->data + (at & 0xFF), src, chunk);
+        at += chunk;
+        src += chunk;
+        size -= chunk;
+    }
+}
+
+void memrom_map(RAM *mem, RAM_Rom const *rom)
+{
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        for (uint64_t pages = rom->used[i]; pages != 0; pages &= pages - 1) {
+            BYTE page = i * 64 + __builtin_ctzll(pages);
+            memshare(mem, page, rom->page[page]);
+        }
+    }
+}
+
+void memrom_free(RAM_Rom *rom)
+{
+    mempages_free(rom->page, rom->used);
+}
+
+static void memmap_check(WORD addr, size_t size)
+{
+    expect(((addr | size) & (RAM_PAGE_SIZE - 1)) == 0 && addr + size <= RAM_SIZE,
+           "0x%zx bytes at 0x%x are not whole pages", size, addr);
+}
+
+void memmap_host(RAM *mem, WORD addr, size_t size, BYTE *host, bool writable)
+{
+    memmap_check(addr, size);
+    for (size_t offset = 0; offset < size; offset += RAM_PAGE_SIZE) {
+        BYTE page = (addr + offset) >> 8;
+        mempage_set(mem, page, NULL);
+        mem->host[page] = host + offset;
+        mem->bus[page / 64] |= membit(page);
+        if (writable) {
+            mem->wr[page / 64] |= membit(page);
+        } else {
+            mem->rom[page / 64] |= membit(page);
+        }
+    }
+}
+
+void memmap_io(RAM *mem, WORD addr, size_t size, RAM_Io const *io)
+{
+    memmap_check(addr, size);
+    if (mem->io == NULL) {
+        mem->io = calloc(RAM_PAGES, sizeof(*mem->io));
+        expect(mem->io != NULL, "Could not allocate the device table");
+    }
+    for (size_t offset = 0; offset < size; offset += RAM_PAGE_SIZE) {
+        BYTE page = (addr + offset) >> 8;
+        mempage_set(mem, page, NULL);
+        mem->io[page] = io;
+        mem->bus[page / 64] |= membit(page);
+    }
+}
+
+void memunmap(RAM *mem, WORD addr, size_t size)
 {
-    mem->data[addr] = w & 0xFF;
-    mem->data[addr + 1] = (w >> 8);
+    memmap_check(addr, size);
+    for (size_t offset = 0; offset < size; offset += RAM_PAGE_SIZE) {
+        mempage_set(mem, (addr + offset) >> 8, NULL);
+    }
 }
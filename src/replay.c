@@ -0,0 +1,281 @@
+#include "replay.h"
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef enum {
+    Input_Raise,
+    Input_Lower,
+    Input_Store,
+} InputKind;
+
+typedef struct {
+    uint64_t cycle;
+    InputKind kind;
+    uint32_t lines; // Input_Raise and Input_Lower
+    WORD addr;      // Input_Store
+    BYTE b;
+} Input;
+
+typedef struct {
+    uint64_t cycle;
+    size_t inputs; // Inputs applied by then, which come after it on a tie
+    MOS_6502_Snapshot snap;
+} Checkpoint;
+
+struct MOS_6502_Replay {
+    MOS_6502 *cpu;
+    RAM *mem;
+    MOS_6502_ReplayConfig config;
+    uint64_t interval; // Doubled by Thinning_Spread
+    uint64_t now;
+
+    Input *input;
+    size_t inputs;
+    size_t capacity;
+    size_t next; // First input not applied yet. Only lags behind `inputs` after a seek back.
+
+    // Oldest first. Each one is allocated on its own, since the RAM keeps a
+    // pointer to the one it was last snapshotted to or forked from.
+    Checkpoint **checkpoint;
+    size_t checkpoints;
+};
+
+static Checkpoint *replay_newest(MOS_6502_Replay const *replay)
+{
+    return replay->checkpoint[replay->checkpoints - 1];
+}
+
+static void replay_checkpoint(MOS_6502_Replay *replay)
+{
+    Checkpoint *checkpoint = malloc(sizeof(Checkpoint));
+    expect(checkpoint != NULL, "Could not allocate a checkpoint");
+    checkpoint->cycle = replay->now;
+    checkpoint->inputs = replay->next;
+    mos6502_snapshot(replay->cpu, replay->mem, &checkpoint->snap);
+    replay->checkpoint[replay->checkpoints++] = checkpoint;
+}
+
+static void replay_release(MOS_6502_Replay *replay, Checkpoint *checkpoint)
+{
+    if (replay->mem->origin == &checkpoint->snap.mem) {
+        replay->mem->origin = NULL;
+    }
+    mos6502_snapshot_free(&checkpoint->snap);
+    free(checkpoint);
+}
+
+static void replay_drop(MOS_6502_Replay *replay, size_t i)
+{
+    replay_release(replay, replay->checkpoint[i]);
+    replay->checkpoints--;
+    for (; i < replay->checkpoints; i++) {
+        replay->checkpoint[i] = replay->checkpoint[i + 1];
+    }
+}
+
+// Drops checkpoints down to what the configuration allows
+static void replay_thin(MOS_6502_Replay *replay)
+{
+    if (replay->checkpoints <= replay->config.checkpoints) {
+        return;
+    }
+    switch (replay->config.thinning) {
+        case Thinning_Spread: {
+            // Drops every other one from the second on, which leaves the
+            // rest twice as far apart. The first and the newest stay.
+            size_t kept = 1;
+            for (size_t i = 1; i < replay->checkpoints; i++) {
+                if (i % 2 == 1 && i < replay->checkpoints - 1) {
+                    replay_release(replay, replay->checkpoint[i]);
+                } else {
+                    replay->checkpoint[kept++] = replay->checkpoint[i];
+                }
+            }
+            replay->checkpoints = kept;
+            replay->interval *= 2;
+            break;
+        }
+
+        case Thinning_Recent: {
+            size_t drop = 1;
+            double best = 0;
+            for (size_t i = 1; i < replay->checkpoints - 1; i++) {
+                uint64_t gap = replay->checkpoint[i + 1]->cycle - replay->checkpoint[i - 1]->cycle;
+                double score = (double) gap / (replay->now - replay->checkpoint[i]->cycle + 1);
+                if (i == 1 || score < best) {
+                    drop = i;
+                    best = score;
+                }
+            }
+            replay_drop(replay, drop);
+            break;
+        }
+
+        case Thinning_Window:
+            replay_drop(replay, 0);
+            break;
+    }
+}
+
+static void replay_apply(MOS_6502_Replay *replay, Input const *input)
+{
+    switch (input->kind) {
+        case Input_Raise:
+            mos6502_raise(replay->cpu, input->lines);
+            break;
+        case Input_Lower:
+            mos6502_lower(replay->cpu, input->lines);
+            break;
+        case Input_Store:
+            memstb(replay->mem, input->addr, input->b);
+            break;
+    }
+}
+
+// Runs until cycle `until`, applying the inputs logged on the way and
+// checkpointing past the newest checkpoint
+static void replay_advance(MOS_6502_Replay *replay, uint64_t until)
+{
+    for (;;) {
+        while (replay->next < replay->inputs && replay->input[replay->next].cycle <= replay->now) {
+            replay_apply(replay, &replay->input[replay->next++]);
+        }
+        if (replay->now >= until) {
+            return;
+        }
+
+        // Every run stops at the same instruction boundaries as the recorded
+        // one, since those only depend on the instructions run
+        uint64_t end = until;
+        if (replay->next < replay->inputs && replay->input[replay->next].cycle < end) {
+            end = replay->input[replay->next].cycle;
+        }
+        uint64_t due = replay_newest(replay)->cycle + replay->interval;
+        if (due > replay->now && due < end) {
+            end = due;
+        }
+        // The CPU looks at its lines as mos6502_exec starts and between
+        // blocks, which depends on where the run started. Running a single
+        // instruction at a time while a raised line can be taken takes it at
+        // the same boundary however the run is split. An IRQ held while I is
+        // set is taken right after the CLI or RTI that clears it, wherever
+        // that lands, so it runs at full speed until then.
+        uint32_t pending = atomic_load_explicit(&replay->cpu->pending, memory_order_acquire);
+        if ((pending & Int_NMI) || ((pending & Int_IRQ) && !replay->cpu->i)) {
+            end = replay->now + 1;
+        }
+        replay->now += mos6502_exec(replay->cpu, replay->mem, end - replay->now);
+
+        if (replay->now >= due) {
+            replay_checkpoint(replay);
+            replay_thin(replay);
+        }
+    }
+}
+
+// Drops what was recorded past the current cycle, before an input changes it
+static void replay_truncate(MOS_6502_Replay *replay)
+{
+    replay->inputs = replay->next;
+    while (replay_newest(replay)->cycle > replay->now) {
+        replay_drop(replay, replay->checkpoints - 1);
+    }
+}
+
+static void replay_log(MOS_6502_Replay *replay, Input input)
+{
+    replay_truncate(replay);
+    if (replay->inputs == replay->capacity) {
+        replay->capacity = replay->capacity > 0 ? replay->capacity * 2 : 64;
+        replay->input = realloc(replay->input, replay->capacity * sizeof(Input));
+        expect(replay->input != NULL, "Could not grow the input log");
+    }
+    input.cycle = replay->now;
+    replay->input[replay->inputs++] = input;
+    replay->next = replay->inputs;
+    replay_apply(replay, &input);
+}
+
+MOS_6502_Replay *mos6502_replay_new(MOS_6502 *cpu, RAM *mem, MOS_6502_ReplayConfig const *config)
+{
+    expect(config->interval > 0, "Checkpoints need an interval");
+    expect(config->checkpoints >= 2, "A replay needs at least 2 checkpoints, not %zu",
+           config->checkpoints);
+    MOS_6502_Replay *replay = calloc(1, sizeof(MOS_6502_Replay));
+    expect(replay != NULL, "Could not allocate the replay");
+    replay->cpu = cpu;
+    replay->mem = mem;
+    replay->config = *config;
+    replay->interval = config->interval;
+    // One more than kept, for the one taken before thinning
+    replay->checkpoint = malloc((config->checkpoints + 1) * sizeof(Checkpoint *));
+    expect(replay->checkpoint != NULL, "Could not allocate the checkpoints");
+    replay_checkpoint(replay);
+    return replay;
+}
+
+void mos6502_replay_free(MOS_6502_Replay *replay)
+{
+    while (replay->checkpoints > 0) {
+        replay_drop(replay, replay->checkpoints - 1);
+    }
+    free(replay->checkpoint);
+    free(replay->input);
+    free(replay);
+}
+
+uint64_t mos6502_replay_now(MOS_6502_Replay const *replay)
+{
+    return replay->now;
+}
+
+size_t mos6502_replay_checkpoints(MOS_6502_Replay const *replay)
+{
+    return replay->checkpoints;
+}
+
+uint64_t mos6502_replay_run(MOS_6502_Replay *replay, uint64_t cycles)
+{
+    uint64_t start = replay->now;
+    replay_advance(replay, start + cycles);
+    return replay->now - start;
+}
+
+bool mos6502_replay_seek(MOS_6502_Replay *replay, uint64_t when)
+{
+    if (when < replay->checkpoint[0]->cycle) {
+        return false;
+    }
+    size_t i = replay->checkpoints - 1;
+    while (replay->checkpoint[i]->cycle > when) {
+        i--;
+    }
+    Checkpoint const *checkpoint = replay->checkpoint[i];
+    // Running on is faster than going back when the machine is in between
+    if (replay->now < checkpoint->cycle || replay->now > when) {
+        mos6502_fork(&checkpoint->snap, replay->cpu, replay->mem);
+        replay->now = checkpoint->cycle;
+        replay->next = checkpoint->inputs;
+    }
+    replay_advance(replay, when);
+    return true;
+}
+
+void mos6502_replay_raise(MOS_6502_Replay *replay, uint32_t lines)
+{
+    replay_log(replay, (Input) { .kind = Input_Raise, .lines = lines });
+}
+
+void mos6502_replay_lower(MOS_6502_Replay *replay, uint32_t lines)
+{
+    replay_log(replay, (Input) { .kind = Input_Lower, .lines = lines });
+}
+
+void mos6502_replay_store(MOS_6502_Replay *replay, WORD addr, BYTE b)
+{
+    replay_log(replay, (Input) { .kind = Input_Store, .addr = addr, .b = b });
+}
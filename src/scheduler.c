@@ -0,0 +1,146 @@
+#include "scheduler.h"
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    uint64_t when;
+    MOS_6502_Event id; // Increases with every event, so it also breaks ties
+    MOS_6502_EventFn fn;
+    void *user;
+} Entry;
+
+struct MOS_6502_Scheduler {
+    uint64_t now;
+    MOS_6502_Event last_id;
+
+    // Binary min-heap on (when, id)
+    Entry *heap;
+    size_t count;
+    size_t capacity;
+};
+
+static bool entry_before(Entry const *a, Entry const *b)
+{
+    return a->when < b->when || (a->when == b->when && a->id < b->id);
+}
+
+static void heap_up(MOS_6502_Scheduler *sched, size_t i)
+{
+    Entry entry = sched->heap[i];
+    while (i > 0 && entry_before(&entry, &sched->heap[(i - 1) / 2])) {
+        sched->heap[i] = sched->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sched->heap[i] = entry;
+}
+
+static void heap_down(MOS_6502_Scheduler *sched, size_t i)
+{
+    Entry entry = sched->heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= sched->count) {
+            break;
+        }
+        if (child + 1 < sched->count && entry_before(&sched->heap[child + 1], &sched->heap[child])) {
+            child++;
+        }
+        if (!entry_before(&sched->heap[child], &entry)) {
+            break;
+        }
+        sched->heap[i] = sched->heap[child];
+        i = child;
+    }
+    sched->heap[i] = entry;
+}
+
+static void heap_remove(MOS_6502_Scheduler *sched, size_t i)
+{
+    sched->heap[i] = sched->heap[--sched->count];
+    if (i < sched->count) {
+        heap_down(sched, i);
+        heap_up(sched, i);
+    }
+}
+
+// Fires every event that is due, including those the callbacks schedule for
+// the past
+static void sched_fire(MOS_6502_Scheduler *sched)
+{
+    while (sched->count > 0 && sched->heap[0].when <= sched->now) {
+        Entry entry = sched->heap[0];
+        heap_remove(sched, 0);
+        entry.fn(sched, entry.user, entry.when);
+    }
+}
+
+MOS_6502_Scheduler *mos6502_sched_new(void)
+{
+    MOS_6502_Scheduler *sched = calloc(1, sizeof(MOS_6502_Scheduler));
+    expect(sched != NULL, "Could not allocate the scheduler");
+    return sched;
+}
+
+void mos6502_sched_free(MOS_6502_Scheduler *sched)
+{
+    free(sched->heap);
+    free(sched);
+}
+
+uint64_t mos6502_sched_now(MOS_6502_Scheduler const *sched)
+{
+    return sched->now;
+}
+
+MOS_6502_Event mos6502_sched_at(MOS_6502_Scheduler *sched, uint64_t when, MOS_6502_EventFn fn,
+                                void *user)
+{
+    if (sched->count == sched->capacity) {
+        sched->capacity = sched->capacity ? sched->capacity * 2 : 16;
+        sched->heap = realloc(sched->heap, sched->capacity * sizeof(Entry));
+        expect(sched->heap != NULL, "Could not grow the event heap");
+    }
+    MOS_6502_Event id = ++sched->last_id;
+    sched->heap[sched->count] = (Entry) { .when = when, .id = id, .fn = fn, .user = user };
+    heap_up(sched, sched->count++);
+    return id;
+}
+
+MOS_6502_Event mos6502_sched_in(MOS_6502_Scheduler *sched, uint64_t delay, MOS_6502_EventFn fn,
+                                void *user)
+{
+    return mos6502_sched_at(sched, sched->now + delay, fn, user);
+}
+
+bool mos6502_sched_cancel(MOS_6502_Scheduler *sched, MOS_6502_Event event)
+{
+    for (size_t i = 0; i < sched->count; i++) {
+        if (sched->heap[i].id == event) {
+            heap_remove(sched, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t mos6502_sched_run(MOS_6502_Scheduler *sched, MOS_6502 *cpu, RAM *mem, uint64_t cycles)
+{
+    uint64_t start = sched->now;
+    uint64_t end = start + cycles;
+    sched_fire(sched);
+    while (sched->now < end) {
+        uint64_t deadline = end;
+        if (sched->count > 0 && sched->heap[0].when < end) {
+            deadline = sched->heap[0].when;
+        }
+        sched->now += mos6502_exec(cpu, mem, deadline - sched->now);
+        sched_fire(sched);
+        if (mos6502_stopped(mem, NULL) != Stop_Budget) {
+            break;
+        }
+    }
+    return sched->now - start;
+}
@@ -0,0 +1,39 @@
+#ifndef TEST_H_
+#define TEST_H_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdio.h>
+
+// Test of the execution paths, run on a CPU and RAM fresh from a reset.
+// `engine` names the path for messages.
+typedef void (*TestBody)(MOS_6502 *cpu, RAM *mem, char const *engine, void *user);
+
+// Runs `body` without the block cache, then with each engine of the cache,
+// skipping those that are not available
+static void test_engines(TestBody body, void *user)
+{
+    for (int engine = -1; engine <= Engine_JIT; engine++) {
+        char const *name = engine < 0 ? "no cache" : engine == Engine_JIT ? "JIT" : "Interpreter";
+        MOS_6502 cpu;
+        RAM mem = { 0 };
+        mos6502_reset(&cpu, &mem);
+        // Blocks are compiled the first time they run, so the JIT always is
+        if (engine >= 0) {
+            mos6502_cache_enable(&mem);
+            if (!mos6502_cache_engine(&mem, engine, 1)) {
+                printf("Engine %s not available, skipping...\n", name);
+                mos6502_cache_disable(&mem);
+                memfree(&mem);
+                continue;
+            }
+        }
+        body(&cpu, &mem, name, user);
+        mos6502_cache_disable(&mem);
+        memfree(&mem);
+    }
+}
+
+#endif // TEST_H_
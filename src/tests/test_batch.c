@@ -0,0 +1,110 @@
+#ifndef TEST_BATCH_C_
+#define TEST_BATCH_C_
+
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_BATCH_CPUS 40
+
+// Loads lane `lane` with a program whose operands, page crossings and branches
+// depend on the lane, and whose code differs for a few of them
+static void test_batch_load(MOS_6502 *cpu, RAM *mem, size_t lane)
+{
+    mos6502_reset(cpu, mem);
+    WORD pc = cpu->pc = 0x0200;
+    memstb(mem, pc++, LDX_IMM);
+    memstb(mem, pc++, lane * 7);
+    memstb(mem, pc++, LDA_ABX);
+    memstb(mem, pc++, 0xF0);
+    memstb(mem, pc++, 0x30);
+    memstb(mem, pc++, STA_ZPX);
+    memstb(mem, pc++, 0x40);
+    memstb(mem, pc++, lane % 13 == 3 ? LDY_IMM : LDY_ZPG);
+    memstb(mem, pc++, 0x50);
+    memstb(mem, pc++, LDA_IDY);
+    memstb(mem, pc++, 0x60);
+    memstb(mem, pc++, STA_ABY);
+    memstb(mem, pc++, 0x00);
+    memstb(mem, pc++, 0x31);
+    memstb(mem, pc++, STX_ABS);
+    memstb(mem, pc++, 0x00);
+    memstb(mem, pc++, 0x32);
+    // N depends on the lane, so lanes split here and run CLI or SEI
+    memstb(mem, pc++, BMI);
+    memstb(mem, pc++, 0x01);
+    memstb(mem, pc++, SEI);
+    memstb(mem, pc++, CLI);
+    memstb(mem, pc++, JSR);
+    memstb(mem, pc++, 0x80);
+    memstb(mem, pc++, 0x02);
+    memstb(mem, pc++, BRK);
+    memstb(mem, pc++, 0xEA);
+    memstb(mem, pc++, JSR);
+    memstb(mem, pc++, 0x00);
+    memstb(mem, pc++, 0x02);
+    memstb(mem, 0x0280, RTS);
+    memstb(mem, 0x0290, RTI);
+    memstw(mem, Vector_IRQ, 0x0290);
+
+    memstb(mem, 0x50, lane * 3);
+    memstw(mem, 0x60, 0x30F8);
+    for (WORD addr = 0x30F0; addr < 0x3200; addr++) {
+        memstb(mem, addr, addr ^ lane);
+    }
+}
+
+void test_batch(void)
+{
+    MOS_6502 *cpus = calloc(TEST_BATCH_CPUS, sizeof(MOS_6502));
+    MOS_6502 *refs = calloc(TEST_BATCH_CPUS, sizeof(MOS_6502));
+    RAM *mems = calloc(TEST_BATCH_CPUS, sizeof(RAM));
+    RAM *refmems = calloc(TEST_BATCH_CPUS, sizeof(RAM));
+    BYTE *bytes = malloc(RAM_SIZE);
+    uint64_t cycles[TEST_BATCH_CPUS];
+
+    uint64_t const budgets[] = { 1, 7, 30, 100, 257, 1000 };
+    for (size_t b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+        printf("Testing batch against mos6502_exec (%3lu cycles)...\n", budgets[b]);
+        for (size_t i = 0; i < TEST_BATCH_CPUS; i++) {
+            test_batch_load(&cpus[i], &mems[i], i);
+            test_batch_load(&refs[i], &refmems[i], i);
+            // Every other lane shares its pages with a snapshot, so that its
+            // first stores and pushes copy them
+            if (i % 2 == 1) {
+                MOS_6502_Snapshot snap;
+                mos6502_snapshot(&cpus[i], &mems[i], &snap);
+                mos6502_fork(&snap, &cpus[i], &mems[i]);
+                mos6502_snapshot_free(&snap);
+            }
+        }
+
+        mos6502_exec_batch(cpus, mems, TEST_BATCH_CPUS, budgets[b], cycles);
+        for (size_t i = 0; i < TEST_BATCH_CPUS; i++) {
+            ASSERT_EQ(cycles[i], mos6502_exec(&refs[i], &refmems[i], budgets[b]));
+            ASSERT_EQ(cpus[i].pc, refs[i].pc);
+            ASSERT_EQ(cpus[i].s, refs[i].s);
+            ASSERT_EQ(cpus[i].a, refs[i].a);
+            ASSERT_EQ(cpus[i].x, refs[i].x);
+            ASSERT_EQ(cpus[i].y, refs[i].y);
+            ASSERT_EQ(mos6502_getp(&cpus[i]), mos6502_getp(&refs[i]));
+            memread(&refmems[i], 0, bytes, RAM_SIZE);
+            ASSERT_SET(memequal(&mems[i], 0, bytes, RAM_SIZE));
+        }
+    }
+
+    for (size_t i = 0; i < TEST_BATCH_CPUS; i++) {
+        memfree(&mems[i]);
+        memfree(&refmems[i]);
+    }
+    free(bytes);
+    free(refmems);
+    free(mems);
+    free(refs);
+    free(cpus);
+}
+
+#endif // TEST_BATCH_C_
@@ -0,0 +1,118 @@
+#ifndef TEST_BRANCH_C_
+#define TEST_BRANCH_C_
+
+#include "lib.h"
+#include "mos6502.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void test_branch(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+
+    // Testing every branch on both values of its flag
+    {
+        struct {
+            BYTE opcode;
+            char const *name;
+            BYTE flag;
+            bool when; // Value of the flag the branch is taken on
+        } const branches[] = {
+            { BPL, "BPL", Flag_N, false }, { BMI, "BMI", Flag_N, true },
+            { BVC, "BVC", Flag_V, false }, { BVS, "BVS", Flag_V, true },
+            { BCC, "BCC", Flag_C, false }, { BCS, "BCS", Flag_C, true },
+            { BNE, "BNE", Flag_Z, false }, { BEQ, "BEQ", Flag_Z, true },
+        };
+        for (size_t i = 0; i < sizeof(branches) / sizeof(branches[0]); i++) {
+            printf("Testing %s...\n", branches[i].name);
+            for (int set = 0; set <= 1; set++) {
+                mos6502_reset(&cpu, &mem);
+                mos6502_setp(&cpu, set ? branches[i].flag : 0);
+                cpu.pc = 0x0200;
+                memstb(&mem, 0x0200, branches[i].opcode);
+                memstb(&mem, 0x0201, 0x10);
+                bool taken = set == branches[i].when;
+                ASSERT_EQ(mos6502_exec(&cpu, &mem, 2), taken ? 3 : 2);
+                ASSERT_EQ(cpu.pc, taken ? 0x0212 : 0x0202);
+            }
+        }
+    }
+
+    // Testing branches that cross a page, both ways
+    {
+        printf("Testing branches across pages...\n");
+        mos6502_reset(&cpu, &mem);
+        cpu.pc = 0x02F0;
+        memstb(&mem, 0x02F0, BNE);
+        memstb(&mem, 0x02F1, 0x20);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 2), 4);
+        ASSERT_EQ(cpu.pc, 0x0312);
+
+        memstb(&mem, 0x0312, BNE);
+        memstb(&mem, 0x0313, 0xDC); // -36
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 2), 4);
+        ASSERT_EQ(cpu.pc, 0x02F0);
+    }
+
+    // Testing JMP
+    {
+        printf("Testing JMP...\n");
+        mos6502_reset(&cpu, &mem);
+        cpu.pc = 0x0200;
+        BYTE const program[] = { JMP_ABS, 0x34, 0x12 };
+        memload(&mem, 0x0200, program, sizeof(program));
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 3), 3);
+        ASSERT_EQ(cpu.pc, 0x1234);
+    }
+
+    // Testing branches in blocks, with both block engines
+    {
+        BYTE const program[] = {
+            LDA_IMM, 0x00,       // 0x0200
+            BEQ, 0x02,           // 0x0202: taken
+            LDA_IMM, 0x01,       // 0x0204
+            LDX_ZPG, 0x80,       // 0x0206
+            BMI, 0x03,           // 0x0208: taken once 0x80 is negative
+            STX_ZPG, 0x80,       // 0x020A
+            JMP_ABS, 0x00, 0x02, // 0x020C
+            LDY_IMM, 0x01,       // 0x020F
+            BNE, 0xED,           // 0x0211: back to 0x0200
+        };
+        Engine const engines[] = { Engine_Interpreter, Engine_JIT };
+        char const *const names[] = { "Interpreter", "JIT" };
+        for (size_t e = 0; e < 2; e++) {
+            for (uint64_t max_cycles = 1; max_cycles <= 60; max_cycles++) {
+                printf("Testing branches in blocks (%s, %2lu cycles)...\n", names[e], max_cycles);
+                MOS_6502 ref;
+                RAM refmem = { 0 };
+                mos6502_reset(&ref, &refmem);
+                mos6502_reset(&cpu, &mem);
+                mos6502_cache_enable(&mem);
+                mos6502_cache_engine(&mem, engines[e], 1);
+                memload(&mem, 0x0200, program, sizeof(program));
+                memload(&refmem, 0x0200, program, sizeof(program));
+                memstb(&mem, 0x80, 0x7F);
+                memstb(&refmem, 0x80, 0x7F);
+                cpu.pc = ref.pc = 0x0200;
+                // Twice, so that the JIT runs what it compiled the first time
+                for (int run = 0; run < 2; run++) {
+                    ASSERT_EQ(mos6502_exec(&cpu, &mem, max_cycles),
+                              mos6502_exec(&ref, &refmem, max_cycles));
+                    ASSERT_EQ(cpu.pc, ref.pc);
+                    ASSERT_EQ(cpu.a, ref.a);
+                    ASSERT_EQ(cpu.x, ref.x);
+                    ASSERT_EQ(cpu.y, ref.y);
+                    ASSERT_EQ(mos6502_getp(&cpu), mos6502_getp(&ref));
+                }
+                mos6502_cache_disable(&mem);
+                memfree(&refmem);
+            }
+        }
+    }
+
+    memfree(&mem);
+}
+
+#endif // TEST_BRANCH_C_
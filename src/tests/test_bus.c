@@ -0,0 +1,168 @@
+#ifndef TEST_BUS_C_
+#define TEST_BUS_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    BYTE reg;
+    WORD last_read;
+    WORD last_write;
+    size_t reads;
+    size_t writes;
+} TestBusDevice;
+
+static BYTE test_bus_read(void *device, WORD addr)
+{
+    TestBusDevice *dev = device;
+    dev->last_read = addr;
+    dev->reads++;
+    return dev->reg;
+}
+
+static void test_bus_write(void *device, WORD addr, BYTE b)
+{
+    TestBusDevice *dev = device;
+    dev->last_write = addr;
+    dev->writes++;
+    dev->reg = b + 1;
+}
+
+// Loads and stores of every engine through devices, a page never written and
+// the page of the code itself, both at fixed and at indexed addresses
+static void test_bus_engine(MOS_6502 *cpu, RAM *mem, char const *name, void *user)
+{
+    (void) name, (void) user;
+    BYTE const program[] = {
+        LDX_IMM, 0x04,       //
+        LDA_ABS, 0x12, 0xD0, // Device
+        STA_ABX, 0x30, 0xD0, // Device, at 0xD034
+        LDY_ABX, 0x00, 0xD0, // Device, at 0xD004
+        STY_ZPG, 0x40,       //
+        LDA_ABS, 0x00, 0x60, // Never written
+        STA_ABX, 0x10, 0x02, // Operand of the LDX below
+        LDX_IMM, 0x55,       //
+        LDA_IDY, 0x50,       // Device, at 0xD011
+    };
+    for (int run = 0; run < 2; run++) {
+        TestBusDevice dev = { .reg = 0x10 };
+        RAM_Io const io = { test_bus_read, test_bus_write, &dev };
+        memmap_io(mem, 0xD000, 0x100, &io);
+        memload(mem, 0x0200, program, sizeof(program));
+        memstw(mem, 0x0050, 0xD000);
+        cpu->pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(cpu, mem, 34), 34);
+        ASSERT_EQ(cpu->a, 0x11);
+        ASSERT_EQ(cpu->x, 0x00);
+        ASSERT_EQ(cpu->y, 0x11);
+        ASSERT_EQ(memldb(mem, 0x0040), 0x11);
+        ASSERT_EQ(dev.last_read, 0xD011);
+        ASSERT_EQ(dev.last_write, 0xD034);
+        ASSERT_EQ(dev.reads, 3);
+        ASSERT_EQ(dev.writes, 1);
+        memunmap(mem, 0xD000, 0x100);
+    }
+}
+
+void test_bus(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+
+    // Testing loads and stores to a device
+    {
+        printf("Testing bus devices...\n");
+        TestBusDevice dev = { .reg = 0x10 };
+        RAM_Io const io = { test_bus_read, test_bus_write, &dev };
+        mos6502_reset(&cpu, &mem);
+        memmap_io(&mem, 0xD000, 0x100, &io);
+        BYTE const program[] = {
+            LDA_ABS, 0x12, 0xD0, //
+            STA_ABS, 0x34, 0xD0, //
+            LDX_ABS, 0x00, 0xD0, //
+        };
+        memload(&mem, 0x0200, program, sizeof(program));
+        cpu.pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 12), 12);
+        ASSERT_EQ(cpu.a, 0x10);
+        ASSERT_EQ(cpu.x, 0x11);
+        ASSERT_EQ(dev.last_read, 0xD000);
+        ASSERT_EQ(dev.last_write, 0xD034);
+        ASSERT_EQ(dev.reads, 2);
+        ASSERT_EQ(dev.writes, 1);
+
+        // Reset leaves the device mapped, unmapping gives the page back
+        mos6502_reset(&cpu, &mem);
+        ASSERT_EQ(memldb(&mem, 0xD0FF), 0x11);
+        memunmap(&mem, 0xD000, 0x100);
+        ASSERT_EQ(memldb(&mem, 0xD0FF), 0x00);
+        ASSERT_EQ(dev.reads, 3);
+    }
+
+    // Testing mirrors and bank switching
+    {
+        printf("Testing bus mirrors and banks...\n");
+        static BYTE ram[0x800];
+        static BYTE banks[2][0x2000];
+        banks[0][0x0123] = 0xB0;
+        banks[1][0x0123] = 0xB1;
+        mos6502_reset(&cpu, &mem);
+        for (WORD mirror = 0x0000; mirror < 0x2000; mirror += sizeof(ram)) {
+            memmap_host(&mem, mirror, sizeof(ram), ram, true);
+        }
+        memmap_host(&mem, 0x8000, sizeof(banks[0]), banks[0], false);
+
+        memstb(&mem, 0x0801, 0x42);
+        ASSERT_EQ(ram[0x0001], 0x42);
+        ASSERT_EQ(memldb(&mem, 0x1801), 0x42);
+        memstb(&mem, 0x8123, 0xFF);
+        ASSERT_EQ(memldb(&mem, 0x8123), 0xB0);
+        memmap_host(&mem, 0x8000, sizeof(banks[1]), banks[1], false);
+        ASSERT_EQ(memldb(&mem, 0x8123), 0xB1);
+
+        // Snapshots and reset leave host memory alone
+        MOS_6502_Snapshot snap;
+        mos6502_snapshot(&cpu, &mem, &snap);
+        memstb(&mem, 0x0002, 0x24);
+        mos6502_fork(&snap, &cpu, &mem);
+        ASSERT_EQ(memldb(&mem, 0x1002), 0x24);
+        mos6502_snapshot_free(&snap);
+        mos6502_reset(&cpu, &mem);
+        ASSERT_EQ(memldb(&mem, 0x0801), 0x42);
+    }
+
+    // Testing self-modifying code in host memory
+    {
+        printf("Testing bus with the block cache...\n");
+        static BYTE code[0x100];
+        BYTE const program[] = {
+            LDA_IMM, 0x07,       //
+            STA_ABS, 0x06, 0x30, // Operand of the LDX below
+            LDX_IMM, 0x01,       //
+        };
+        mos6502_reset(&cpu, &mem);
+        mos6502_cache_enable(&mem);
+        memmap_host(&mem, 0x3000, sizeof(code), code, true);
+        memload(&mem, 0x3000, program, sizeof(program));
+        for (int run = 0; run < 2; run++) {
+            cpu.pc = 0x3000;
+            ASSERT_EQ(mos6502_exec(&cpu, &mem, 8), 8);
+            ASSERT_EQ(cpu.x, 0x07);
+            code[0x06] = 0x01;
+            mos6502_cache_flush(&mem);
+        }
+        mos6502_cache_disable(&mem);
+    }
+
+    memfree(&mem);
+
+    printf("Testing bus accesses of every engine...\n");
+    test_engines(test_bus_engine, NULL);
+}
+
+#endif // TEST_BUS_C_
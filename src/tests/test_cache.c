@@ -0,0 +1,202 @@
+#ifndef TEST_CACHE_C_
+#define TEST_CACHE_C_
+
+#include "lib.h"
+#include "mos6502.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void test_cache_engine(Engine engine, char const *engine_name)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+
+    mos6502_cache_enable(&mem);
+    // Compile blocks the first time they run, so the JIT is always exercised
+    if (!mos6502_cache_engine(&mem, engine, 1)) {
+        printf("Engine %s not available, skipping...\n", engine_name);
+        mos6502_cache_disable(&mem);
+        return;
+    }
+
+    BYTE const program[] = {
+        LDA_IMM, 0x42,       //
+        LDX_IMM, 0x03,       //
+        STA_ZPX, 0x80,       //
+        LDY_ABS, 0x83, 0x00, //
+        STY_ABS, 0x00, 0x30, //
+        LDA_ABX, 0xFE, 0x2F, //
+    };
+
+    // Testing that blocks run like the interpreter, including a budget that
+    // runs out halfway through a block
+    for (uint64_t max_cycles = 1; max_cycles <= 21; max_cycles++) {
+        printf("Testing Block Cache (%s) against interpreter (%2lu cycles)...\n",
+               engine_name, max_cycles);
+        MOS_6502 ref;
+        RAM *refmem = calloc(1, sizeof(RAM));
+        mos6502_reset(&ref, refmem);
+        mos6502_reset(&cpu, &mem);
+        for (size_t i = 0; i < sizeof(program); i++) {
+            memstb(refmem, 0x0200 + i, program[i]);
+            memstb(&mem, 0x0200 + i, program[i]);
+        }
+        ref.pc = cpu.pc = 0x0200;
+
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, max_cycles), mos6502_exec(&ref, refmem, max_cycles));
+        ASSERT_EQ(cpu.pc, ref.pc);
+        ASSERT_EQ(cpu.a, ref.a);
+        ASSERT_EQ(cpu.x, ref.x);
+        ASSERT_EQ(cpu.y, ref.y);
+        ASSERT_EQ(mos6502_getp(&cpu), mos6502_getp(&ref));
+        ASSERT_EQ(memldb(&mem, 0x3000), memldb(refmem, 0x3000));
+        memfree(refmem);
+        free(refmem);
+    }
+
+    // Testing a store into the block being run
+    {
+        printf("Testing Block Cache (%s) with self-modifying code...\n", engine_name);
+        mos6502_reset(&cpu, &mem);
+        WORD pc = cpu.pc = 0x0200;
+        memstb(&mem, pc++, LDA_IMM);
+        memstb(&mem, pc++, 0x42);
+        memstb(&mem, pc++, STA_ABS);
+        memstb(&mem, pc++, 0x08);
+        memstb(&mem, pc++, 0x02);
+        memstb(&mem, pc++, LDX_IMM);
+        memstb(&mem, pc++, 0x00);
+        memstb(&mem, pc++, LDY_IMM);
+        memstb(&mem, pc++, 0x00); // Overwritten by STA_ABS
+
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 10), 10);
+        ASSERT_EQ(cpu.x, 0x00);
+        ASSERT_EQ(cpu.y, 0x42);
+
+        // The second run comes from the cache, until a store changes the code
+        cpu.pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 10), 10);
+        ASSERT_EQ(cpu.y, 0x42);
+        memstb(&mem, 0x0201, 0x24);
+        cpu.pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 10), 10);
+        ASSERT_EQ(cpu.y, 0x24);
+    }
+
+    // Testing JSR at the end of a block
+    {
+        printf("Testing Block Cache (%s) with JSR...\n", engine_name);
+        mos6502_reset(&cpu, &mem);
+        WORD pc = cpu.pc = 0x0200;
+        memstb(&mem, pc++, LDY_IMM);
+        memstb(&mem, pc++, 0x80);
+        memstb(&mem, pc++, JSR);
+        memstb(&mem, pc++, 0x10);
+        memstb(&mem, pc++, 0xFF);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 8), 8);
+        ASSERT_EQ(cpu.s, 0xFB);
+        ASSERT_EQ(cpu.pc, 0xFF10);
+        ASSERT_EQ(memldw(&mem, 0x01FC), 0x0204);
+        ASSERT_SET(cpu.n);
+    }
+
+    mos6502_cache_disable(&mem);
+    memfree(&mem);
+}
+
+static void test_cache_fusion(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+    mos6502_cache_enable(&mem);
+
+    // Every group of src/fusions.h, 22 cycles in total
+    BYTE const program[] = {
+        LDX_IMM, 0x01,       //
+        LDY_IMM, 0x02,       //
+        LDA_IMM, 0x03,       //
+        LDA_IMM, 0x80,       //
+        STA_ABS, 0x00, 0x30, //
+        LDX_IMM, 0x00,       //
+        LDY_IMM, 0x00,       //
+        LDA_ZPG, 0x10,       //
+        STA_ZPG, 0x11,       //
+    };
+
+    // Testing that a budget running out inside a fused group still stops
+    // between its instructions
+    for (uint64_t max_cycles = 1; max_cycles <= 22; max_cycles++) {
+        printf("Testing Block Cache fusion against interpreter (%2lu cycles)...\n", max_cycles);
+        MOS_6502 ref;
+        RAM *refmem = calloc(1, sizeof(RAM));
+        mos6502_reset(&ref, refmem);
+        mos6502_reset(&cpu, &mem);
+        for (size_t i = 0; i < sizeof(program); i++) {
+            memstb(refmem, 0x0200 + i, program[i]);
+            memstb(&mem, 0x0200 + i, program[i]);
+        }
+        memstb(refmem, 0x10, 0x90);
+        memstb(&mem, 0x10, 0x90);
+        ref.pc = cpu.pc = 0x0200;
+
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, max_cycles), mos6502_exec(&ref, refmem, max_cycles));
+        ASSERT_EQ(cpu.pc, ref.pc);
+        ASSERT_EQ(cpu.a, ref.a);
+        ASSERT_EQ(cpu.x, ref.x);
+        ASSERT_EQ(cpu.y, ref.y);
+        ASSERT_EQ(mos6502_getp(&cpu), mos6502_getp(&ref));
+        ASSERT_EQ(memldb(&mem, 0x3000), memldb(refmem, 0x3000));
+        ASSERT_EQ(memldb(&mem, 0x11), memldb(refmem, 0x11));
+        memfree(refmem);
+        free(refmem);
+    }
+
+    // Testing the profile superinstructions are chosen from
+    {
+        printf("Testing Block Cache profile...\n");
+        char const *path = "test_cache.profile";
+        mos6502_cache_profile(&mem);
+        mos6502_reset(&cpu, &mem);
+        for (size_t i = 0; i < sizeof(program); i++) {
+            memstb(&mem, 0x0200 + i, program[i]);
+        }
+        // Ends the block with a JMP, which groups leave out as the execution
+        // profile does, rather than the BRK of the zeroed memory
+        BYTE const jmp[] = { JMP_ABS, 0x00, 0x02 };
+        memload(&mem, 0x0200 + sizeof(program), jmp, sizeof(jmp));
+        for (int run = 0; run < 3; run++) {
+            cpu.pc = 0x0200;
+            ASSERT_EQ(mos6502_exec(&cpu, &mem, 25), 25);
+        }
+        ASSERT_EQ(mos6502_cache_profile_save(&mem, path), true);
+
+        FILE *in = fopen(path, "r");
+        expect(in != NULL, "");
+        char line[128];
+        bool pair = false, triple = false;
+        while (fgets(line, sizeof(line), in) != NULL) {
+            pair |= strcmp(line, "3 LDA_ZPG STA_ZPG\n") == 0;
+            triple |= strcmp(line, "3 LDX_IMM LDY_IMM LDA_IMM\n") == 0;
+            expect(!isdigit((unsigned char) line[0]) || strstr(line, "JMP_ABS") == NULL, "%s", line);
+        }
+        fclose(in);
+        remove(path);
+        ASSERT_SET(pair);
+        ASSERT_SET(triple);
+    }
+
+    mos6502_cache_disable(&mem);
+    memfree(&mem);
+}
+
+void test_cache(void)
+{
+    test_cache_engine(Engine_Interpreter, "Interpreter");
+    test_cache_engine(Engine_JIT, "JIT");
+    test_cache_fusion();
+}
+
+#endif // TEST_CACHE_C_
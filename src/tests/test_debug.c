@@ -0,0 +1,198 @@
+#ifndef TEST_DEBUG_C_
+#define TEST_DEBUG_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Stops the run it is called from
+static uint32_t test_debug_stop(MOS_6502 *cpu, RAM *mem, void *user)
+{
+    (void) cpu, (void) user;
+    mos6502_stop(mem);
+    return 0;
+}
+
+static void test_debug_event(MOS_6502_Scheduler *sched, void *mem, uint64_t when)
+{
+    (void) sched, (void) when;
+    mos6502_stop(mem);
+}
+
+static void *test_debug_thread(void *mem)
+{
+    mos6502_stop(mem);
+    return NULL;
+}
+
+// Runs from `cpu->pc` until it stops, expecting `why` at `addr` after `cycles`
+static void test_debug_run(MOS_6502 *cpu, RAM *mem, uint64_t cycles, Stop why, WORD addr)
+{
+    ASSERT_EQ(mos6502_exec(cpu, mem, 1000), cycles);
+    WORD at = 0;
+    ASSERT_EQ(mos6502_stopped(mem, &at), why);
+    ASSERT_EQ(at, addr);
+}
+
+static void test_debug_engine(MOS_6502 *cpu, RAM *mem, char const *name, void *user)
+{
+    (void) user;
+
+    // 28 cycles a round
+    BYTE const program[] = {
+        LDA_IMM, 0x01,       // 0x0200
+        STA_ZPG, 0x10,       // 0x0202
+        LDX_ZPG, 0x10,       // 0x0204
+        JSR, 0x00, 0xF0,     // 0x0206
+        JMP_ABS, 0x00, 0x02, // 0x0209
+    };
+    BYTE const sub[] = {
+        LDA_IDY, 0x20, // 0xF000
+        RTS,           // 0xF002
+    };
+
+    memload(mem, 0x0200, program, sizeof(program));
+    memload(mem, 0xF000, sub, sizeof(sub));
+    memstw(mem, 0x0020, 0x3000);
+    cpu->pc = 0x0200;
+    ASSERT_EQ(mos6502_exec(cpu, mem, 28 * 3), 28 * 3);
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Budget);
+
+    printf("Testing breakpoints (%s)...\n", name);
+    mos6502_break(mem, Break_Exec, 0x0204);
+    test_debug_run(cpu, mem, 5, Stop_Breakpoint, 0x0204);
+    ASSERT_EQ(cpu->pc, 0x0204);
+    ASSERT_EQ(cpu->a, 0x01);
+    // Steps past it
+    test_debug_run(cpu, mem, 28, Stop_Breakpoint, 0x0204);
+    mos6502_unbreak(mem, Break_Exec, 0x0204);
+
+    printf("Testing watchpoints (%s)...\n", name);
+    mos6502_break(mem, Break_Write, 0x0010);
+    test_debug_run(cpu, mem, 28 - 3, Stop_Watchpoint, 0x0010);
+    ASSERT_EQ(cpu->pc, 0x0202);
+    // Loads from it do not count
+    mos6502_unbreak(mem, Break_Write, 0x0010);
+    mos6502_break(mem, Break_Read, 0x0010);
+    test_debug_run(cpu, mem, 3, Stop_Watchpoint, 0x0010);
+    ASSERT_EQ(cpu->pc, 0x0204);
+    mos6502_unbreak(mem, Break_Read, 0x0010);
+
+    // Through the pointer of an indirect mode, then what it points to
+    mos6502_break(mem, Break_Read, 0x0021);
+    mos6502_break(mem, Break_Read, 0x3000);
+    test_debug_run(cpu, mem, 3 + 6, Stop_Watchpoint, 0x0021);
+    ASSERT_EQ(cpu->pc, 0xF000);
+    mos6502_unbreak(mem, Break_Read, 0x0021);
+    test_debug_run(cpu, mem, 28, Stop_Watchpoint, 0x3000);
+    mos6502_unbreak(mem, Break_Read, 0x3000);
+
+    // The stack of JSR and RTS
+    mos6502_break(mem, Break_Write, 0x01FC);
+    test_debug_run(cpu, mem, 5 + 6 + 3 + 2 + 3 + 3, Stop_Watchpoint, 0x01FC);
+    ASSERT_EQ(cpu->pc, 0x0206);
+    mos6502_unbreak(mem, Break_Write, 0x01FC);
+    mos6502_break(mem, Break_Read, 0x01FD);
+    test_debug_run(cpu, mem, 6 + 5, Stop_Watchpoint, 0x01FD);
+    ASSERT_EQ(cpu->pc, 0xF002);
+    mos6502_unbreak(mem, Break_Read, 0x01FD);
+
+    // With none left, the budget is all that stops it
+    ASSERT_EQ(mos6502_exec(cpu, mem, 28), 28);
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Budget);
+
+    printf("Testing stop requests (%s)...\n", name);
+    mos6502_stop(mem);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 28), 0);
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Event);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 28), 28);
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Budget);
+    // From a hook, right after the call while any breakpoint is set
+    mos6502_hook(mem, 0xF000, test_debug_stop, NULL, 10);
+    mos6502_break(mem, Break_Exec, 0xFFFF);
+    cpu->pc = 0x0200;
+    uint64_t spent = mos6502_exec(cpu, mem, 1000);
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Event);
+    ASSERT_EQ(cpu->pc, 0x0209);
+    // Up to the JSR, then what the hook charges
+    expect(spent <= 2 + 3 + 3 + 6 + 10, "Ran on for %lu cycles", (unsigned long) spent);
+    mos6502_unhook(mem, 0xF000);
+    mos6502_unbreak(mem, Break_Exec, 0xFFFF);
+
+    printf("Testing stops under the scheduler (%s)...\n", name);
+    MOS_6502_Scheduler *sched = mos6502_sched_new();
+    mos6502_break(mem, Break_Exec, 0x0204);
+    cpu->pc = 0x0200;
+    ASSERT_EQ(mos6502_sched_run(sched, cpu, mem, 100), 5);
+    ASSERT_EQ(mos6502_sched_now(sched), 5);
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Breakpoint);
+    ASSERT_EQ(cpu->pc, 0x0204);
+    mos6502_unbreak(mem, Break_Exec, 0x0204);
+    // From an event, once it fires
+    mos6502_sched_in(sched, 10, test_debug_event, mem);
+    spent = mos6502_sched_run(sched, cpu, mem, 100);
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Event);
+    expect(spent >= 10 && spent < 100, "Stopped after %lu cycles", (unsigned long) spent);
+    expect(mos6502_sched_run(sched, cpu, mem, 100) >= 100, "");
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Budget);
+    mos6502_sched_free(sched);
+
+    printf("Testing breakpoints while tracing (%s)...\n", name);
+    char const *path = "test_debug.trace";
+    ASSERT_EQ(mos6502_trace_start(mem, path), true);
+    mos6502_break(mem, Break_Exec, 0x0204);
+    cpu->pc = 0x0200;
+    test_debug_run(cpu, mem, 5, Stop_Breakpoint, 0x0204);
+    test_debug_run(cpu, mem, 28, Stop_Breakpoint, 0x0204);
+    mos6502_unbreak(mem, Break_Exec, 0x0204);
+    ASSERT_EQ(mos6502_trace_stop(mem), true);
+    WORD const pc[] = { 0x0200, 0x0202, 0x0204, 0x0206, 0xF000, 0xF002, 0x0209, 0x0200, 0x0202 };
+    uint64_t const at[] = { 0, 2, 5, 8, 14, 19, 25, 28, 30 };
+    MOS_6502_TraceReader *reader = mos6502_trace_open(path);
+    expect(reader != NULL, "Could not open the trace");
+    MOS_6502_TraceEntry entry;
+    size_t count = 0;
+    while (mos6502_trace_next(reader, &entry)) {
+        expect(count < sizeof(pc) / sizeof(pc[0]), "%zu entries", count + 1);
+        expect(entry.pc == pc[count], "0x%04x at %zu", entry.pc, count);
+        expect(entry.cycle == at[count], "%lu at %zu", (unsigned long) entry.cycle, count);
+        count++;
+    }
+    ASSERT_EQ(count, sizeof(pc) / sizeof(pc[0]));
+    mos6502_trace_close(reader);
+    remove(path);
+}
+
+void test_debug(void)
+{
+    test_engines(test_debug_engine, NULL);
+
+    // Testing a stop request from another thread, which allocates nothing
+    {
+        printf("Testing stop requests from another thread...\n");
+        MOS_6502 cpu;
+        RAM mem = { 0 };
+        mos6502_reset(&cpu, &mem);
+        memstb(&mem, 0x0200, JMP_ABS);
+        memstw(&mem, 0x0201, 0x0200);
+        cpu.pc = 0x0200;
+        pthread_t thread;
+        expect(pthread_create(&thread, NULL, test_debug_thread, &mem) == 0, "");
+        pthread_join(thread, NULL);
+        ASSERT_EQ(mem.debug, NULL);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 30), 0);
+        ASSERT_EQ(mos6502_stopped(&mem, NULL), Stop_Event);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 30), 30);
+        ASSERT_EQ(mos6502_stopped(&mem, NULL), Stop_Budget);
+        memfree(&mem);
+    }
+}
+
+#endif // TEST_DEBUG_C_
@@ -0,0 +1,110 @@
+#ifndef TEST_HOOK_C_
+#define TEST_HOOK_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A = A * X, also stored at 0x0010
+static uint32_t test_hook_multiply(MOS_6502 *cpu, RAM *mem, void *user)
+{
+    (void) user;
+
+    cpu->a *= cpu->x;
+    cpu->z = cpu->a == 0;
+    cpu->n = cpu->a >> 7;
+    memstb(mem, 0x0010, cpu->a);
+    return 50;
+}
+
+// Prints the zero-terminated string that follows the JSR, and returns past it
+static uint32_t test_hook_print(MOS_6502 *cpu, RAM *mem, void *user)
+{
+    char *out = user;
+    WORD ret = memldw(mem, 0x0100 | (BYTE) (cpu->s + 1));
+    WORD addr = ret + 1;
+    size_t n = 0;
+    for (BYTE c; (c = memldb(mem, addr++)) != 0;) {
+        out[n++] = c;
+    }
+    out[n] = '\0';
+    memstw(mem, 0x0100 | (BYTE) (cpu->s + 1), addr - 1);
+    return 20 + 10 * n;
+}
+
+static void test_hook_engine(MOS_6502 *cpu, RAM *mem, char const *name, void *user)
+{
+    (void) user;
+    BYTE const program[] = {
+        LDA_IMM, 0x06,       // 0x0200
+        LDX_IMM, 0x07,       // 0x0202
+        JSR, 0x00, 0xF0,     // 0x0204
+        JMP_ABS, 0x07, 0x02, // 0x0207
+    };
+
+    for (int run = 0; run < 2; run++) {
+        // Testing a subroutine that is not hooked
+        printf("Testing JSR and RTS (%s)...\n", name);
+        mos6502_reset(cpu, mem);
+        memload(mem, 0x0200, program, sizeof(program));
+        memstb(mem, 0xF000, RTS);
+        cpu->pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(cpu, mem, 16), 16);
+        ASSERT_EQ(cpu->pc, 0x0207);
+        ASSERT_EQ(cpu->s, 0xFD);
+        ASSERT_EQ(cpu->a, 0x06);
+
+        // Testing the cycles the hook measures
+        printf("Testing hooks (%s)...\n", name);
+        mos6502_hook(mem, 0xF000, test_hook_multiply, NULL, 0);
+        cpu->pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(cpu, mem, 10), 60);
+        ASSERT_EQ(cpu->pc, 0x0207);
+        ASSERT_EQ(cpu->s, 0xFD);
+        ASSERT_EQ(cpu->a, 42);
+        ASSERT_EQ(memldb(mem, 0x0010), 42);
+
+        // Testing a fixed count
+        mos6502_hook(mem, 0xF000, test_hook_multiply, NULL, 100);
+        cpu->pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(cpu, mem, 10), 110);
+        ASSERT_EQ(cpu->pc, 0x0207);
+
+        mos6502_unhook(mem, 0xF000);
+        cpu->pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(cpu, mem, 16), 16);
+        ASSERT_EQ(cpu->a, 0x06);
+    }
+}
+
+void test_hook(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+
+    test_engines(test_hook_engine, NULL);
+
+    // Testing a hook that reads arguments inline and moves the return address
+    {
+        printf("Testing hooks with inline arguments...\n");
+        char out[16];
+        mos6502_reset(&cpu, &mem);
+        BYTE const print[] = { JSR, 0x00, 0xF1, 'h', 'i', 0, LDY_IMM, 0x01 };
+        memload(&mem, 0x0200, print, sizeof(print));
+        mos6502_hook(&mem, 0xF100, test_hook_print, out, 0);
+        cpu.pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 47), 6 + 40 + 2);
+        ASSERT_EQ(strcmp(out, "hi"), 0);
+        ASSERT_EQ(cpu.y, 0x01);
+        ASSERT_EQ(cpu.pc, 0x0208);
+    }
+
+    memfree(&mem);
+}
+
+#endif // TEST_HOOK_C_
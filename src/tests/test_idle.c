@@ -0,0 +1,107 @@
+#ifndef TEST_IDLE_C_
+#define TEST_IDLE_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Waits for 0x0080 to be set, stores it, then waits forever
+static BYTE const test_idle_program[] = {
+    LDA_ZPG, 0x80,          // 0x0200
+    BEQ, 0xFC,              // 0x0202: back to 0x0200
+    LDX_IMM, 0x01,          // 0x0204
+    STA_ABS, 0x00, 0x30,    // 0x0206
+    JMP_ABS, 0x09, 0x02,    // 0x0209: to itself
+};
+
+static void test_idle_set(MOS_6502_Scheduler *sched, void *user, uint64_t when)
+{
+    (void) sched, (void) when;
+    memstb(user, 0x0080, 0x42);
+}
+
+static BYTE test_idle_read(void *device, WORD addr)
+{
+    (void) addr;
+    (*(size_t *) device)++;
+    return 0;
+}
+
+void test_idle(void)
+{
+    MOS_6502 cpu, ref;
+    RAM mem = { 0 }, refmem = { 0 };
+
+    // Testing that skipping idle loops changes nothing but the time it takes
+    {
+        printf("Testing idle loops against the interpreter...\n");
+        mos6502_reset(&cpu, &mem);
+        mos6502_reset(&ref, &refmem);
+        mos6502_cache_enable(&mem);
+        memload(&mem, 0x0200, test_idle_program, sizeof(test_idle_program));
+        memload(&refmem, 0x0200, test_idle_program, sizeof(test_idle_program));
+        cpu.pc = ref.pc = 0x0200;
+
+        MOS_6502_Scheduler *sched = mos6502_sched_new();
+        MOS_6502_Scheduler *refsched = mos6502_sched_new();
+        mos6502_sched_at(sched, 100001, test_idle_set, &mem);
+        mos6502_sched_at(refsched, 100001, test_idle_set, &refmem);
+        ASSERT_EQ(mos6502_sched_run(sched, &cpu, &mem, 200000),
+                  mos6502_sched_run(refsched, &ref, &refmem, 200000));
+        ASSERT_EQ(mos6502_sched_now(sched), mos6502_sched_now(refsched));
+        ASSERT_EQ(cpu.pc, 0x0209);
+        ASSERT_EQ(cpu.pc, ref.pc);
+        ASSERT_EQ(cpu.a, ref.a);
+        ASSERT_EQ(cpu.x, ref.x);
+        ASSERT_EQ(memldb(&mem, 0x3000), 0x42);
+
+        // Both loops were skipped, nearly all the way
+        MOS_6502_CacheStats stats = mos6502_cache_stats(&mem);
+        ASSERT_EQ(stats.idle_skips, 2);
+        ASSERT_SET((stats.idle_cycles > 199900));
+        mos6502_sched_free(sched);
+        mos6502_sched_free(refsched);
+        mos6502_cache_disable(&mem);
+    }
+
+    // Testing that every budget stops where the interpreter does
+    for (uint64_t max_cycles = 1; max_cycles <= 40; max_cycles++) {
+        printf("Testing idle loops against the interpreter (%2lu cycles)...\n", max_cycles);
+        mos6502_reset(&cpu, &mem);
+        mos6502_reset(&ref, &refmem);
+        mos6502_cache_enable(&mem);
+        memload(&mem, 0x0200, test_idle_program, sizeof(test_idle_program));
+        memload(&refmem, 0x0200, test_idle_program, sizeof(test_idle_program));
+        cpu.pc = ref.pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, max_cycles), mos6502_exec(&ref, &refmem, max_cycles));
+        ASSERT_EQ(cpu.pc, ref.pc);
+        ASSERT_EQ(mos6502_getp(&cpu), mos6502_getp(&ref));
+        mos6502_cache_disable(&mem);
+    }
+
+    // Testing that loops polling a device are left alone
+    {
+        printf("Testing idle loops on a device...\n");
+        size_t reads = 0;
+        RAM_Io const io = { test_idle_read, NULL, &reads };
+        mos6502_reset(&cpu, &mem);
+        mos6502_cache_enable(&mem);
+        memmap_io(&mem, 0xD000, 0x100, &io);
+        BYTE const program[] = { LDA_ABS, 0x00, 0xD0, BEQ, 0xFB };
+        memload(&mem, 0x0200, program, sizeof(program));
+        cpu.pc = 0x0200;
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 7000), 7000);
+        ASSERT_EQ(reads, 1000);
+        ASSERT_EQ(mos6502_cache_stats(&mem).idle_skips, 0);
+        mos6502_cache_disable(&mem);
+    }
+
+    memfree(&mem);
+    memfree(&refmem);
+}
+
+#endif // TEST_IDLE_C_
@@ -0,0 +1,122 @@
+#ifndef TEST_IMAGE_C_
+#define TEST_IMAGE_C_
+
+#include "image.h"
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void test_image_write(char const *dir, char const *name, void const *bytes, size_t size)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *out = fopen(path, "wb");
+    expect(out != NULL, "Could not create %s", path);
+    expect(fwrite(bytes, 1, size, out) == size, "Could not write %s", path);
+    fclose(out);
+}
+
+static void test_image_remove(char const *dir, char const *name)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    unlink(path);
+}
+
+void test_image(void)
+{
+    char dir[] = "/tmp/6502-test-XXXXXX";
+    expect(mkdtemp(dir) != NULL, "Could not create a temporary directory");
+
+    // Two and a half pages of code, then the reset vector on its own
+    static BYTE rom[0x280];
+    BYTE const program[] = {
+        LDA_ABS, 0x7F, 0x82, // Last byte of the file
+        STA_ABS, 0x00, 0x80, // Ignored, the image is read-only
+        LDX_ABS, 0x00, 0x80, //
+        STX_ZPG, 0x10,       //
+    };
+    memcpy(rom, program, sizeof(program));
+    rom[0x27F] = 0x5A;
+    BYTE const vector[] = { 0x00, 0x80 };
+    test_image_write(dir, "rom.bin", rom, sizeof(rom));
+    test_image_write(dir, "vector.bin", vector, sizeof(vector));
+
+    MOS_6502 cpu;
+    RAM *mems = calloc(2, sizeof(RAM));
+
+    // Testing a raw binary, shared by two RAMs
+    {
+        printf("Testing raw image mapping...\n");
+        char path[256];
+        snprintf(path, sizeof(path), "%s/rom.bin", dir);
+        MOS_6502_Image *image = mos6502_image_open(path, 0x8000);
+        ASSERT_UNSET((image == NULL));
+        for (size_t i = 0; i < 2; i++) {
+            mos6502_reset(&cpu, &mems[i]);
+            mos6502_image_map(image, &mems[i]);
+            cpu.pc = 0x8000;
+            ASSERT_EQ(mos6502_exec(&cpu, &mems[i], 15), 15);
+            ASSERT_EQ(cpu.a, 0x5A);
+            ASSERT_EQ(cpu.x, LDA_ABS);
+            ASSERT_EQ(memldb(&mems[i], 0x0010), LDA_ABS);
+        }
+        // Whole pages come straight from the file, the last one is a copy
+        ASSERT_EQ(mems[0].host[0x80], mems[1].host[0x80]);
+        ASSERT_EQ(mems[0].host[0x81], mems[0].host[0x80] + RAM_PAGE_SIZE);
+        ASSERT_EQ(mems[0].page[0x80], NULL);
+        ASSERT_UNSET((mems[0].page[0x82] == NULL));
+        ASSERT_EQ(mems[0].page[0x82], mems[1].page[0x82]);
+        ASSERT_EQ(memldb(&mems[0], 0x82FF), 0x00);
+        for (size_t i = 0; i < 2; i++) {
+            memfree(&mems[i]);
+        }
+        mos6502_image_free(image);
+    }
+
+    // Testing a manifest with overlapping segments
+    {
+        printf("Testing image manifest...\n");
+        char const manifest[] = "# Test image\n"
+                                "rom.bin 0x8000\n"
+                                "\n"
+                                "  rom.bin 0x8100 0x27F 1\n"
+                                "vector.bin 0xFFFC\n";
+        test_image_write(dir, "image.txt", manifest, sizeof(manifest) - 1);
+        char path[256];
+        snprintf(path, sizeof(path), "%s/image.txt", dir);
+        MOS_6502_Image *image = mos6502_image_manifest(path);
+        ASSERT_UNSET((image == NULL));
+        mos6502_image_map(image, &mems[0]);
+        mos6502_reset(&cpu, &mems[0]);
+        ASSERT_EQ(memldw(&mems[0], cpu.pc), 0x8000);
+        ASSERT_EQ(memldb(&mems[0], 0x8000), LDA_ABS);
+        ASSERT_EQ(memldb(&mems[0], 0x8100), 0x5A);
+        ASSERT_EQ(memldb(&mems[0], 0x8101), 0x00);
+        ASSERT_EQ(memldb(&mems[0], 0x827F), 0x5A);
+        ASSERT_UNSET((mems[0].host[0x80] == NULL));
+        ASSERT_EQ(mems[0].page[0x80], NULL);
+        ASSERT_UNSET((mems[0].page[0x81] == NULL));
+        memfree(&mems[0]);
+        mos6502_image_free(image);
+
+        char const broken[] = "rom.bin\n";
+        test_image_write(dir, "broken.txt", broken, sizeof(broken) - 1);
+        snprintf(path, sizeof(path), "%s/broken.txt", dir);
+        printf("Expecting an error about %s:1...\n", path);
+        ASSERT_EQ(mos6502_image_manifest(path), NULL);
+    }
+
+    free(mems);
+    test_image_remove(dir, "rom.bin");
+    test_image_remove(dir, "vector.bin");
+    test_image_remove(dir, "image.txt");
+    test_image_remove(dir, "broken.txt");
+    rmdir(dir);
+}
+
+#endif // TEST_IMAGE_C_
@@ -0,0 +1,221 @@
+#ifndef TEST_IRQ_C_
+#define TEST_IRQ_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "scheduler.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// 0x0200: 128 LDA #$01, 2 cycles each. IRQ handler at 0x0300 and NMI handler
+// at 0x0400, which set X and Y to 1 and return, in 8 cycles.
+static void test_irq_program(MOS_6502 *cpu, RAM *mem)
+{
+    mos6502_reset(cpu, mem);
+    for (WORD addr = 0x0200; addr < 0x0300; addr += 2) {
+        memstb(mem, addr, LDA_IMM);
+        memstb(mem, addr + 1, 0x01);
+    }
+    BYTE const irq[] = { LDX_IMM, 0x01, RTI };
+    BYTE const nmi[] = { LDY_IMM, 0x01, RTI };
+    memload(mem, 0x0300, irq, sizeof(irq));
+    memload(mem, 0x0400, nmi, sizeof(nmi));
+    memstw(mem, Vector_IRQ, 0x0300);
+    memstw(mem, Vector_NMI, 0x0400);
+    cpu->pc = 0x0200;
+}
+
+static void test_irq_raise(MOS_6502_Scheduler *sched, void *user, uint64_t when)
+{
+    (void) sched, (void) when;
+    mos6502_raise(user, Int_IRQ);
+}
+
+static void *test_irq_thread(void *arg)
+{
+    mos6502_raise(arg, Int_NMI);
+    return NULL;
+}
+
+// CLI; LDA #$80; BRK to a handler that loads 0 and clears I before its RTI
+// restores both N and Z; SEI; JMP back. 26 cycles per trip.
+static void test_irq_rti_engine(MOS_6502 *cpu, RAM *mem, char const *name, void *user)
+{
+    (void) name, (void) user;
+    BYTE const program[] = { CLI, LDA_IMM, 0x80, BRK, 0xEA, SEI, JMP_ABS, 0x00, 0x02 };
+    BYTE const handler[] = { LDA_IMM, 0x00, CLI, RTI };
+    memload(mem, 0x0200, program, sizeof(program));
+    memload(mem, 0x0300, handler, sizeof(handler));
+    memstw(mem, Vector_IRQ, 0x0300);
+    cpu->pc = 0x0200;
+    cpu->i = 1;
+    for (int trip = 0; trip < 2; trip++) {
+        ASSERT_EQ(mos6502_exec(cpu, mem, 26), 26);
+        ASSERT_EQ(cpu->pc, 0x0200);
+        ASSERT_EQ(cpu->s, 0xFD);
+        ASSERT_EQ(cpu->a, 0x00);
+        ASSERT_SET(cpu->n);
+        ASSERT_UNSET(cpu->z);
+        ASSERT_SET(cpu->i);
+    }
+    // Stopped in the handler, with I as BRK left it
+    ASSERT_EQ(mos6502_exec(cpu, mem, 13), 13);
+    ASSERT_EQ(cpu->pc, 0x0302);
+    ASSERT_SET(cpu->i);
+    ASSERT_SET(cpu->z);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 2), 2);
+    ASSERT_UNSET(cpu->i);
+}
+
+// IRQ held through SEI; LDA #1; LDX #1; CLI; LDA #2; JMP back, taken right
+// after the CLI however the 8 cycles up to it are split. The handler loops.
+static void test_irq_unmask_engine(MOS_6502 *cpu, RAM *mem, char const *name, void *user)
+{
+    (void) name, (void) user;
+    BYTE const program[] = {
+        SEI, LDA_IMM, 0x01, LDX_IMM, 0x01, CLI, LDA_IMM, 0x02, JMP_ABS, 0x00, 0x02,
+    };
+    BYTE const handler[] = { LDY_IMM, 0x01, JMP_ABS, 0x00, 0x03 };
+    memload(mem, 0x0200, program, sizeof(program));
+    memload(mem, 0x0300, handler, sizeof(handler));
+    memstw(mem, Vector_IRQ, 0x0300);
+    for (uint64_t split = 1; split <= 8; split++) {
+        cpu->pc = 0x0200;
+        cpu->s = 0xFD;
+        cpu->a = cpu->y = 0;
+        cpu->i = 1;
+        mos6502_raise(cpu, Int_IRQ);
+        uint64_t cycles = mos6502_exec(cpu, mem, split);
+        cycles += mos6502_exec(cpu, mem, 8 + 7 + 2 - cycles);
+        ASSERT_EQ(cycles, 8 + 7 + 2);
+        ASSERT_EQ(cpu->pc, 0x0302);
+        ASSERT_EQ(cpu->a, 0x01);
+        ASSERT_EQ(cpu->y, 0x01);
+        ASSERT_EQ(memldw(mem, 0x01FC), 0x0206);
+        mos6502_lower(cpu, Int_IRQ);
+    }
+}
+
+void test_irq(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+
+    // Testing BRK
+    {
+        printf("Testing BRK...\n");
+        test_irq_program(&cpu, &mem);
+        BYTE const program[] = { LDA_IMM, 0x80, BRK, 0xEA };
+        memload(&mem, 0x0200, program, sizeof(program));
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 9), 9);
+        ASSERT_EQ(cpu.pc, 0x0300);
+        ASSERT_EQ(cpu.s, 0xFA);
+        ASSERT_SET(cpu.i);
+        // The byte after BRK is skipped on return
+        ASSERT_EQ(memldw(&mem, 0x01FC), 0x0204);
+        ASSERT_EQ(memldb(&mem, 0x01FB), Flag_N | Flag_B | Flag__);
+
+        // Back after the skipped byte, with P as it was and B untouched
+        cpu.n = 0;
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 8), 8);
+        ASSERT_EQ(cpu.pc, 0x0204);
+        ASSERT_EQ(cpu.s, 0xFD);
+        ASSERT_EQ(cpu.x, 0x01);
+        ASSERT_SET(cpu.n);
+        ASSERT_UNSET(cpu.i);
+        ASSERT_UNSET(cpu.b);
+    }
+
+    // Testing that IRQs wait for the I flag and NMIs do not
+    {
+        printf("Testing IRQ and NMI...\n");
+        test_irq_program(&cpu, &mem);
+        cpu.i = 1;
+        mos6502_raise(&cpu, Int_IRQ);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
+        ASSERT_EQ(cpu.pc, 0x0204);
+
+        cpu.i = 0;
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 7), 7);
+        ASSERT_EQ(cpu.pc, 0x0300);
+        ASSERT_SET(cpu.i);
+        ASSERT_EQ(memldw(&mem, 0x01FC), 0x0204);
+        ASSERT_EQ(memldb(&mem, 0x01FB) & Flag_B, 0);
+        // Still raised, but masked by the handler until it returns
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 8), 8);
+        ASSERT_EQ(cpu.pc, 0x0204);
+        ASSERT_UNSET(cpu.i);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 7), 7);
+        ASSERT_EQ(cpu.pc, 0x0300);
+        mos6502_lower(&cpu, Int_IRQ);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 10), 10);
+        ASSERT_EQ(cpu.pc, 0x0206);
+
+        cpu.i = 1;
+        mos6502_raise(&cpu, Int_NMI);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 7), 7);
+        ASSERT_EQ(cpu.pc, 0x0400);
+        ASSERT_EQ(cpu.pending, 0);
+        ASSERT_EQ(mos6502_exec(&cpu, &mem, 8), 8);
+        ASSERT_EQ(cpu.pc, 0x0206);
+        ASSERT_EQ(cpu.y, 0x01);
+        ASSERT_SET(cpu.i);
+    }
+
+    for (int cached = 0; cached <= 1; cached++) {
+        // Testing an IRQ raised by a scheduler event
+        {
+            printf("Testing IRQ from the scheduler%s...\n", cached ? " with the block cache" : "");
+            test_irq_program(&cpu, &mem);
+            if (cached) {
+                mos6502_cache_enable(&mem);
+            }
+            MOS_6502_Scheduler *sched = mos6502_sched_new();
+            mos6502_sched_at(sched, 5, test_irq_raise, &cpu);
+            // Taken on the boundary at cycle 6, then 7 cycles of entry and
+            // the LDX of the handler
+            ASSERT_EQ(mos6502_sched_run(sched, &cpu, &mem, 15), 15);
+            ASSERT_EQ(cpu.pc, 0x0302);
+            ASSERT_EQ(memldw(&mem, 0x01FC), 0x0206);
+            ASSERT_EQ(cpu.s, 0xFA);
+            mos6502_lower(&cpu, Int_IRQ);
+            ASSERT_EQ(mos6502_sched_run(sched, &cpu, &mem, 6), 6);
+            ASSERT_EQ(cpu.pc, 0x0206);
+            ASSERT_EQ(cpu.s, 0xFD);
+            mos6502_sched_free(sched);
+            mos6502_cache_disable(&mem);
+        }
+    }
+
+    // Testing an NMI raised by another thread while the CPU runs
+    {
+        printf("Testing NMI from another thread...\n");
+        test_irq_program(&cpu, &mem);
+        BYTE const loop[] = { JSR, 0x00, 0x02 };
+        memload(&mem, 0x0200, loop, sizeof(loop));
+        mos6502_cache_enable(&mem);
+        pthread_t thread;
+        expect(pthread_create(&thread, NULL, test_irq_thread, &cpu) == 0, "");
+        bool taken = false;
+        for (int i = 0; i < 1000000 && !taken; i++) {
+            mos6502_exec(&cpu, &mem, 1000);
+            taken = cpu.y == 0x01;
+        }
+        pthread_join(thread, NULL);
+        ASSERT_SET(taken);
+        mos6502_cache_disable(&mem);
+    }
+
+    memfree(&mem);
+
+    printf("Testing CLI, SEI and RTI...\n");
+    test_engines(test_irq_rti_engine, NULL);
+    printf("Testing IRQs unmasked by CLI...\n");
+    test_engines(test_irq_unmask_engine, NULL);
+}
+
+#endif // TEST_IRQ_C_
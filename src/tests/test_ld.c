@@ -10,7 +10,7 @@
 void test_ld(void)
 {
     MOS_6502 cpu;
-    RAM mem;
+    RAM mem = { 0 };
     
     char const *const regnames[] = { "Accumulator", "Register X ", "Register Y " };
     BYTE *const reg[3] = { &cpu.a, &cpu.x, &cpu.y };
@@ -22,22 +22,22 @@ void test_ld(void)
             printf("Testing Load %s Immediate and flags...\n", regnames[i]);
             mos6502_reset(&cpu, &mem);
 
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0x0;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x0);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 2), 2);
             ASSERT_EQ(*reg[i], 0x0);
             ASSERT_UNSET(cpu.n);
             ASSERT_SET(cpu.z);
 
-            mem.data[cpu.pc] = ins[i];
-            mem.data[(WORD) (cpu.pc + 1)] = 0x7F;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, (WORD) (cpu.pc + 1), 0x7F);
             mos6502_exec(&cpu, &mem, 2);
             ASSERT_EQ(*reg[i], 0x7F);
             ASSERT_UNSET(cpu.n);
             ASSERT_UNSET(cpu.z);
 
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0x80;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x80);
             mos6502_exec(&cpu, &mem, 2);
             ASSERT_EQ(*reg[i], 0x80);
             ASSERT_SET(cpu.n);
@@ -51,9 +51,9 @@ void test_ld(void)
         for (size_t i = 0; i < 3; i++) {
             mos6502_reset(&cpu, &mem);
             printf("Testing Load %s from Zero Page...\n", regnames[i]);
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0x23;
-            mem.data[0x23] = 0x42;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x23);
+            memstb(&mem, 0x23, 0x42);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 3), 3);
             ASSERT_EQ(*reg[i], 0x42);
         }
@@ -66,9 +66,9 @@ void test_ld(void)
             printf("Testing Load %s from Zero Page X...\n", regnames[i]);
             mos6502_reset(&cpu, &mem);
             cpu.x = 0x10;
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0x23;
-            mem.data[0x33] = 0xF1;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x23);
+            memstb(&mem, 0x33, 0xF1);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
             ASSERT_EQ(*reg[i], 0xF1);
         }
@@ -79,9 +79,9 @@ void test_ld(void)
         printf("Testing Load from Zero Page Y...\n");
         mos6502_reset(&cpu, &mem);
         cpu.y = 0x10;
-        mem.data[cpu.pc] = LDX_ZPY;
-        mem.data[cpu.pc + 1] = 0x23;
-        mem.data[0x33] = 0xF1;
+        memstb(&mem, cpu.pc, LDX_ZPY);
+        memstb(&mem, cpu.pc + 1, 0x23);
+        memstb(&mem, 0x33, 0xF1);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
         ASSERT_EQ(cpu.x, 0xF1);
     }
@@ -92,10 +92,10 @@ void test_ld(void)
         for (size_t i = 0; i < 3; i++) {
             printf("Testing Load %s From Absolute Address...\n", regnames[i]);
             mos6502_reset(&cpu, &mem);
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0xFE;
-            mem.data[cpu.pc + 2] = 0xCA;
-            mem.data[0xCAFE] = 0xF0;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0xFE);
+            memstb(&mem, cpu.pc + 2, 0xCA);
+            memstb(&mem, 0xCAFE, 0xF0);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
             ASSERT_EQ(*reg[i], 0xF0);
         }
@@ -109,10 +109,10 @@ void test_ld(void)
                    regnames[i]);
             mos6502_reset(&cpu, &mem);
             cpu.x = 0x10;
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0x00;
-            mem.data[cpu.pc + 2] = 0x20;
-            mem.data[0x2010] = 0xF0;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x00);
+            memstb(&mem, cpu.pc + 2, 0x20);
+            memstb(&mem, 0x2010, 0xF0);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
             ASSERT_EQ(*reg[i], 0xF0);
         }
@@ -126,10 +126,10 @@ void test_ld(void)
                    regnames[i]);
             mos6502_reset(&cpu, &mem);
             cpu.x = 0xFF;
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0x50;
-            mem.data[cpu.pc + 2] = 0x20;
-            mem.data[0x214F] = 0x7C;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x50);
+            memstb(&mem, cpu.pc + 2, 0x20);
+            memstb(&mem, 0x214F, 0x7C);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 5), 5);
             ASSERT_EQ(*reg[i], 0x7C);
         }
@@ -143,10 +143,10 @@ void test_ld(void)
                    regnames[i]);
             mos6502_reset(&cpu, &mem);
             cpu.y = 0x10;
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0x00;
-            mem.data[cpu.pc + 2] = 0x20;
-            mem.data[0x2010] = 0xF0;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x00);
+            memstb(&mem, cpu.pc + 2, 0x20);
+            memstb(&mem, 0x2010, 0xF0);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
             ASSERT_EQ(*reg[i], 0xF0);
         }
@@ -160,10 +160,10 @@ void test_ld(void)
                    regnames[i]);
             mos6502_reset(&cpu, &mem);
             cpu.y = 0xFF;
-            mem.data[cpu.pc] = ins[i];
-            mem.data[cpu.pc + 1] = 0x50;
-            mem.data[cpu.pc + 2] = 0x20;
-            mem.data[0x214F] = 0x7C;
+            memstb(&mem, cpu.pc, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x50);
+            memstb(&mem, cpu.pc + 2, 0x20);
+            memstb(&mem, 0x214F, 0x7C);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 5), 5);
             ASSERT_EQ(*reg[i], 0x7C);
         }
@@ -174,11 +174,11 @@ void test_ld(void)
         printf("Testing Load Indexed Indirect (X)...\n");
         mos6502_reset(&cpu, &mem);
         cpu.x = 0x10;
-        mem.data[0x23] = 0xBE;
-        mem.data[0x24] = 0xBA;
-        mem.data[cpu.pc] = LDA_IDX;
-        mem.data[cpu.pc + 1] = 0x13;
-        mem.data[0xBABE] = 0x0;
+        memstb(&mem, 0x23, 0xBE);
+        memstb(&mem, 0x24, 0xBA);
+        memstb(&mem, cpu.pc, LDA_IDX);
+        memstb(&mem, cpu.pc + 1, 0x13);
+        memstb(&mem, 0xBABE, 0x0);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 6), 6);
         ASSERT_EQ(cpu.a, 0x0);
     }
@@ -188,11 +188,11 @@ void test_ld(void)
         printf("Testing Load Indirect Indexed (Y, Page not crossed)...\n");
         mos6502_reset(&cpu, &mem);
         cpu.y = 0x10;
-        mem.data[0x23] = 0xBE;
-        mem.data[0x24] = 0xBA;
-        mem.data[cpu.pc] = LDA_IDY;
-        mem.data[cpu.pc + 1] = 0x23;
-        mem.data[0xBACE] = 0x80;
+        memstb(&mem, 0x23, 0xBE);
+        memstb(&mem, 0x24, 0xBA);
+        memstb(&mem, cpu.pc, LDA_IDY);
+        memstb(&mem, cpu.pc + 1, 0x23);
+        memstb(&mem, 0xBACE, 0x80);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 5), 5);
         ASSERT_EQ(cpu.a, 0x80);
     }
@@ -202,14 +202,16 @@ void test_ld(void)
         printf("Testing Load Indirect Indexed (Y, Page crossed)...\n");
         mos6502_reset(&cpu, &mem);
         cpu.y = 0x50;
-        mem.data[0x23] = 0xBE;
-        mem.data[0x24] = 0xBA;
-        mem.data[cpu.pc] = LDA_IDY;
-        mem.data[cpu.pc + 1] = 0x23;
-        mem.data[0xBB0E] = 0x80;
+        memstb(&mem, 0x23, 0xBE);
+        memstb(&mem, 0x24, 0xBA);
+        memstb(&mem, cpu.pc, LDA_IDY);
+        memstb(&mem, cpu.pc + 1, 0x23);
+        memstb(&mem, 0xBB0E, 0x80);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 6), 6);
         ASSERT_EQ(cpu.a, 0x80);
     }
+
+    memfree(&mem);
 }
 
 #endif // TEST_LD_C_
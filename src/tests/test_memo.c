@@ -0,0 +1,178 @@
+#ifndef TEST_MEMO_C_
+#define TEST_MEMO_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "test.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static void test_memo_engine(MOS_6502 *cpu, RAM *mem, char const *name, void *user)
+{
+    (void) user;
+
+    // 31 cycles a round: A = table[3] through a subroutine that also loads Y
+    // from 0x0010 and stores A to 0x0020
+    BYTE const program[] = {
+        LDA_IMM, 0x00,       // 0x0200
+        LDY_IMM, 0x00,       // 0x0202
+        LDX_IMM, 0x03,       // 0x0204
+        JSR, 0x00, 0xF0,     // 0x0206
+        JMP_ABS, 0x00, 0x02, // 0x0209
+    };
+    BYTE const lookup[] = {
+        LDA_ABX, 0x00, 0x30, // 0xF000
+        LDY_ZPG, 0x10,       // 0xF003
+        STA_ZPG, 0x20,       // 0xF005
+        RTS,                 // 0xF007
+    };
+    // Same, after storing 0x55 to table[3]
+    BYTE const patch[] = {
+        LDA_IMM, 0x55,       // 0x0300
+        STA_ABS, 0x03, 0x30, // 0x0302
+        JMP_ABS, 0x00, 0x02, // 0x0305
+    };
+    // Swaps 0x0040 and 0x0041, so it reads what it writes
+    BYTE const swap[] = {
+        LDA_ZPG, 0x40, // 0xF100
+        LDX_ZPG, 0x41, // 0xF102
+        STX_ZPG, 0x40, // 0xF104
+        STA_ZPG, 0x41, // 0xF106
+        RTS,           // 0xF108
+    };
+    BYTE const table[] = { 0x10, 0x11, 0x12, 0x13, 0x14 };
+
+    memload(mem, 0x0200, program, sizeof(program));
+    memload(mem, 0x0300, patch, sizeof(patch));
+    memload(mem, 0xF000, lookup, sizeof(lookup));
+    memload(mem, 0xF100, swap, sizeof(swap));
+    memload(mem, 0x3000, table, sizeof(table));
+    memstb(mem, 0x0010, 0x77);
+
+    printf("Testing memoized calls (%s)...\n", name);
+    mos6502_memo(mem, 0xF000);
+    cpu->pc = 0x0200;
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31 * 10), 31 * 10);
+    ASSERT_EQ(cpu->pc, 0x0200);
+    ASSERT_EQ(cpu->s, 0xFD);
+    ASSERT_EQ(cpu->a, 0x13);
+    ASSERT_EQ(cpu->y, 0x77);
+    ASSERT_EQ(memldb(mem, 0x0020), 0x13);
+    MOS_6502_MemoStats stats = mos6502_memo_stats(mem);
+    ASSERT_EQ(stats.misses, 1);
+    ASSERT_EQ(stats.hits, 9);
+    ASSERT_EQ(stats.invalidations, 0);
+
+    // Stores elsewhere, or of what was read, keep the call
+    memstb(mem, 0x0020, 0x00);
+    memstb(mem, 0x3004, 0x99);
+    memstb(mem, 0x0010, 0x77);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 31);
+    ASSERT_EQ(memldb(mem, 0x0020), 0x13);
+    stats = mos6502_memo_stats(mem);
+    ASSERT_EQ(stats.hits, 10);
+    ASSERT_EQ(stats.invalidations, 0);
+
+    printf("Testing invalidation of memoized calls (%s)...\n", name);
+    memstb(mem, 0x0010, 0x78);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 31);
+    ASSERT_EQ(cpu->y, 0x78);
+    stats = mos6502_memo_stats(mem);
+    ASSERT_EQ(stats.misses, 2);
+    ASSERT_EQ(stats.invalidations, 1);
+
+    // Through STA, only the first time since the value stays the same
+    cpu->pc = 0x0300;
+    ASSERT_EQ(mos6502_exec(cpu, mem, 9 + 31 * 4), 9 + 31 * 4);
+    ASSERT_EQ(cpu->a, 0x55);
+    ASSERT_EQ(memldb(mem, 0x0020), 0x55);
+    stats = mos6502_memo_stats(mem);
+    ASSERT_EQ(stats.misses, 3);
+    ASSERT_EQ(stats.hits, 13);
+    ASSERT_EQ(stats.invalidations, 2);
+
+    // Through memload
+    memload(mem, 0x3000, table, sizeof(table));
+    cpu->pc = 0x0200;
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 31);
+    ASSERT_EQ(cpu->a, 0x13);
+    ASSERT_EQ(mos6502_memo_stats(mem).invalidations, 3);
+
+    printf("Testing calls that cannot be memoized (%s)...\n", name);
+    BYTE const call[] = { JSR, 0x00, 0xF1, JMP_ABS, 0x00, 0x04 };
+    memload(mem, 0x0400, call, sizeof(call));
+    memstb(mem, 0x0040, 0x01);
+    memstb(mem, 0x0041, 0x02);
+    mos6502_memo(mem, 0xF100);
+    uint64_t misses = mos6502_memo_stats(mem).misses;
+    cpu->pc = 0x0400;
+    ASSERT_EQ(mos6502_exec(cpu, mem, 27 * 3), 27 * 3);
+    ASSERT_EQ(memldb(mem, 0x0040), 0x02);
+    ASSERT_EQ(memldb(mem, 0x0041), 0x01);
+    ASSERT_EQ(mos6502_memo_stats(mem).misses, misses + 3);
+
+    mos6502_unmemo(mem, 0xF000);
+    mos6502_unmemo(mem, 0xF100);
+    cpu->pc = 0x0200;
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 31);
+    ASSERT_EQ(mos6502_memo_stats(mem).misses, misses + 3);
+
+    // 12 cycles up to the JSR, then 4 for LDA_ABX when recording gives up
+    printf("Testing memoized calls cut by the budget (%s)...\n", name);
+    mos6502_memo(mem, 0xF000);
+    cpu->pc = 0x0200;
+    ASSERT_EQ(mos6502_exec(cpu, mem, 15), 16);
+    ASSERT_EQ(cpu->pc, 0xF003);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 15), 15);
+    ASSERT_EQ(cpu->pc, 0x0200);
+    ASSERT_EQ(memldb(mem, 0x0020), 0x13);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 31);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 31);
+    stats = mos6502_memo_stats(mem);
+    ASSERT_EQ(stats.misses, misses + 5);
+    uint64_t hits = stats.hits;
+
+    printf("Testing memoized calls under breakpoints and traces (%s)...\n", name);
+    mos6502_break(mem, Break_Exec, 0xF005);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 19);
+    ASSERT_EQ(mos6502_stopped(mem, NULL), Stop_Breakpoint);
+    ASSERT_EQ(cpu->pc, 0xF005);
+    mos6502_unbreak(mem, Break_Exec, 0xF005);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 12), 12);
+    ASSERT_EQ(cpu->pc, 0x0200);
+
+    char const *path = "test_memo.trace";
+    ASSERT_EQ(mos6502_trace_start(mem, path), true);
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 31);
+    ASSERT_EQ(mos6502_trace_stop(mem), true);
+    WORD const pc[] = { 0x0200, 0x0202, 0x0204, 0x0206, 0xF000, 0xF003, 0xF005, 0xF007, 0x0209 };
+    MOS_6502_TraceReader *reader = mos6502_trace_open(path);
+    expect(reader != NULL, "Could not open the trace");
+    MOS_6502_TraceEntry entry;
+    size_t count = 0;
+    while (mos6502_trace_next(reader, &entry)) {
+        expect(count < sizeof(pc) / sizeof(pc[0]), "%zu entries", count + 1);
+        expect(entry.pc == pc[count], "0x%04x at %zu", entry.pc, count);
+        count++;
+    }
+    ASSERT_EQ(count, sizeof(pc) / sizeof(pc[0]));
+    mos6502_trace_close(reader);
+    remove(path);
+    stats = mos6502_memo_stats(mem);
+    ASSERT_EQ(stats.misses, misses + 5);
+    ASSERT_EQ(stats.hits, hits);
+
+    ASSERT_EQ(mos6502_exec(cpu, mem, 31), 31);
+    ASSERT_EQ(mos6502_memo_stats(mem).hits, hits + 1);
+    mos6502_unmemo(mem, 0xF000);
+}
+
+void test_memo(void)
+{
+    test_engines(test_memo_engine, NULL);
+}
+
+#endif // TEST_MEMO_C_
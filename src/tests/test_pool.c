@@ -0,0 +1,115 @@
+#ifndef TEST_POOL_C_
+#define TEST_POOL_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_POOL_JOBS 200
+#define TEST_POOL_MANY 20000
+
+void test_pool(void)
+{
+    printf("Testing pool against mos6502_exec...\n");
+
+    // Copies a byte around and calls itself, forever
+    BYTE const image[] = {
+        LDA_ZPG, 0x80,       //
+        LDX_IMM, 0x01,       //
+        STA_ZPX, 0x80,       //
+        LDY_ABS, 0x81, 0x00, //
+        STY_ABS, 0x00, 0x30, //
+        JSR, 0x00, 0x02,     //
+    };
+
+    MOS_6502_Job *jobs = calloc(TEST_POOL_JOBS, sizeof(MOS_6502_Job));
+    // A quantum much shorter than the jobs, so that they get preempted
+    MOS_6502_Pool *pool = mos6502_pool_new(4, 50);
+    for (size_t i = 0; i < TEST_POOL_JOBS; i++) {
+        jobs[i] = (MOS_6502_Job) {
+            .image = image,
+            .size = sizeof(image),
+            .load = 0x0200,
+            .entry = 0x0200,
+            .max_cycles = 1 + i * 37 % 1000,
+            .keep_mem = i % 2 == 0,
+            .user = &jobs[i],
+        };
+        mos6502_pool_submit(pool, &jobs[i]);
+    }
+
+    BYTE *bytes = malloc(RAM_SIZE);
+    size_t finished = 0;
+    MOS_6502_Job *job;
+    while ((job = mos6502_pool_wait(pool)) != NULL) {
+        ASSERT_EQ(job->user, job);
+        MOS_6502 ref;
+        RAM *refmem = calloc(1, sizeof(RAM));
+        mos6502_reset(&ref, refmem);
+        memload(refmem, 0x0200, image, sizeof(image));
+        ref.pc = 0x0200;
+
+        ASSERT_EQ(job->cycles, mos6502_exec(&ref, refmem, job->max_cycles));
+        ASSERT_EQ(job->cpu.pc, ref.pc);
+        ASSERT_EQ(job->cpu.s, ref.s);
+        ASSERT_EQ(job->cpu.a, ref.a);
+        ASSERT_EQ(job->cpu.x, ref.x);
+        ASSERT_EQ(job->cpu.y, ref.y);
+        ASSERT_EQ(mos6502_getp(&job->cpu), mos6502_getp(&ref));
+        if (job->keep_mem) {
+            memread(refmem, 0, bytes, RAM_SIZE);
+            ASSERT_SET(memequal(job->mem, 0, bytes, RAM_SIZE));
+            memfree(job->mem);
+            free(job->mem);
+        } else {
+            ASSERT_EQ(job->mem, NULL);
+        }
+        memfree(refmem);
+        free(refmem);
+        finished++;
+    }
+    ASSERT_EQ(finished, TEST_POOL_JOBS);
+    mos6502_pool_free(pool);
+
+    // More jobs than the queues of 2 workers hold, so that some overflow
+    printf("Testing pool with more jobs than its queues hold...\n");
+    uint64_t expected[64];
+    for (size_t i = 0; i < 64; i++) {
+        MOS_6502 ref;
+        RAM *refmem = calloc(1, sizeof(RAM));
+        mos6502_reset(&ref, refmem);
+        memload(refmem, 0x0200, image, sizeof(image));
+        ref.pc = 0x0200;
+        expected[i] = mos6502_exec(&ref, refmem, 1 + i);
+        memfree(refmem);
+        free(refmem);
+    }
+    jobs = realloc(jobs, TEST_POOL_MANY * sizeof(MOS_6502_Job));
+    pool = mos6502_pool_new(2, 16);
+    for (size_t i = 0; i < TEST_POOL_MANY; i++) {
+        jobs[i] = (MOS_6502_Job) {
+            .image = image,
+            .size = sizeof(image),
+            .load = 0x0200,
+            .entry = 0x0200,
+            .max_cycles = 1 + i % 64,
+        };
+        mos6502_pool_submit(pool, &jobs[i]);
+    }
+    finished = 0;
+    while ((job = mos6502_pool_wait(pool)) != NULL) {
+        ASSERT_EQ(job->cycles, expected[job->max_cycles - 1]);
+        finished++;
+    }
+    ASSERT_EQ(finished, TEST_POOL_MANY);
+
+    mos6502_pool_free(pool);
+    free(bytes);
+    free(jobs);
+}
+
+#endif // TEST_POOL_C_
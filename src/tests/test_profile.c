@@ -0,0 +1,84 @@
+#ifndef TEST_PROFILE_C_
+#define TEST_PROFILE_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void test_profile(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+    mos6502_reset(&cpu, &mem);
+
+    if (!mos6502_profile_enable(&mem)) {
+        printf("Testing profiling is compiled out...\n");
+        ASSERT_EQ(mos6502_profile(&mem), NULL);
+        memfree(&mem);
+        return;
+    }
+
+    // 11 cycles a round
+    BYTE const program[] = {
+        LDA_IMM, 0x01,       // 0x0200
+        STA_ZPG, 0x10,       // 0x0202
+        LDX_ZPG, 0x10,       // 0x0204
+        JMP_ABS, 0x00, 0x02, // 0x0206
+    };
+    memload(&mem, 0x0200, program, sizeof(program));
+
+    // The JIT would compile the loop right away, yet every instruction counts
+    printf("Testing the execution profile...\n");
+    mos6502_cache_enable(&mem);
+    mos6502_cache_engine(&mem, Engine_JIT, 1);
+    cpu.pc = 0x0200;
+    ASSERT_EQ(mos6502_exec(&cpu, &mem, 11 * 5), 11 * 5);
+    MOS_6502_Profile const *profile = mos6502_profile(&mem);
+    ASSERT_EQ(profile->instructions, 20);
+    ASSERT_EQ(profile->cycles, 11 * 5);
+    ASSERT_EQ(profile->op_count[LDA_IMM], 5);
+    ASSERT_EQ(profile->op_cycles[STA_ZPG], 3 * 5);
+    ASSERT_EQ(profile->op_count[JSR], 0);
+    ASSERT_EQ(profile->pc[0x0204], 5);
+    ASSERT_EQ(profile->pc[0x0205], 0);
+    ASSERT_EQ(profile->heat.read[0x0010], 5);
+    ASSERT_EQ(profile->heat.write[0x0010], 5);
+    ASSERT_EQ(profile->heat.exec[0x0010], 0);
+    ASSERT_EQ(profile->heat.exec[0x0208], 5);
+    ASSERT_EQ(profile->heat.write[0x0208], 0);
+
+    printf("Testing the execution profile dump...\n");
+    char const *path = "test_profile.profile";
+    ASSERT_EQ(mos6502_profile_save(&mem, path), true);
+    FILE *in = fopen(path, "r");
+    expect(in != NULL, "");
+    char line[128];
+    bool op = false, pc = false, heat = false, triple = false;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        op |= strcmp(line, "op STA_ZPG 5 15\n") == 0;
+        pc |= strcmp(line, "pc 0x0206 5\n") == 0;
+        heat |= strcmp(line, "heat 0x0010 5 5 0\n") == 0;
+        triple |= strcmp(line, "5 LDA_IMM STA_ZPG LDX_ZPG\n") == 0;
+        // Groups never span the JMP that ends the block
+        expect(!isdigit((unsigned char) line[0]) || strstr(line, "JMP_ABS") == NULL, "%s", line);
+    }
+    fclose(in);
+    remove(path);
+    ASSERT_SET(op);
+    ASSERT_SET(pc);
+    ASSERT_SET(heat);
+    ASSERT_SET(triple);
+
+    mos6502_profile_disable(&mem);
+    ASSERT_EQ(mos6502_profile(&mem), NULL);
+    mos6502_cache_disable(&mem);
+    memfree(&mem);
+}
+
+#endif // TEST_PROFILE_C_
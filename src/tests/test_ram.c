@@ -0,0 +1,130 @@
+#ifndef TEST_RAM_C_
+#define TEST_RAM_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_RAM_INSTANCES 1000
+
+static bool test_ram_zero(RAM *mem)
+{
+    static BYTE const zero[RAM_SIZE];
+    return memequal(mem, 0, zero, RAM_SIZE);
+}
+
+void test_ram(void)
+{
+    MOS_6502 cpu;
+    RAM *mem = calloc(1, sizeof(RAM));
+
+    // Testing that reset clears what was written, and only that
+    {
+        printf("Testing reset of dirty pages...\n");
+        mos6502_reset(&cpu, mem);
+        memstb(mem, 0x0010, 0x42);
+        memstw(mem, 0x12FF, 0xBEEF);
+        ASSERT_EQ(mem->dirty[0], (uint64_t) 1 << 0x00 | (uint64_t) 1 << 0x12 | (uint64_t) 1 << 0x13);
+        ASSERT_EQ(mem->dirty[1] | mem->dirty[2] | mem->dirty[3], 0);
+        // Pages nobody wrote to have no storage behind them
+        ASSERT_EQ(mem->page[0x80], NULL);
+        ASSERT_EQ(memldb(mem, 0x8000), 0x00);
+
+        mos6502_reset(&cpu, mem);
+        ASSERT_EQ(memldb(mem, 0x0010), 0x00);
+        ASSERT_EQ(memldw(mem, 0x12FF), 0x0000);
+        ASSERT_EQ(mem->dirty[0], 0);
+        ASSERT_EQ(mem->used[0], 0);
+        ASSERT_SET(test_ram_zero(mem));
+    }
+
+    // Testing restore from a loaded image, after a run wrote to it
+    {
+        printf("Testing restore of dirty pages...\n");
+        BYTE const program[] = {
+            LDA_IMM, 0x42,       //
+            STA_ABS, 0x00, 0x30, //
+            LDX_ABS, 0x00, 0x40, //
+            STX_ZPG, 0x80,       //
+        };
+        MOS_6502 clean;
+        RAM *image = calloc(1, sizeof(RAM));
+        mos6502_reset(&clean, image);
+        memload(image, 0x0200, program, sizeof(program));
+        memstb(image, 0x4000, 0x99);
+        clean.pc = 0x0200;
+
+        for (int run = 0; run < 3; run++) {
+            cpu = clean;
+            memrestore(mem, image);
+            BYTE bytes[sizeof(program)];
+            memread(image, 0x0200, bytes, sizeof(bytes));
+            ASSERT_SET(memequal(mem, 0x0200, bytes, sizeof(bytes)));
+            ASSERT_EQ(memldb(mem, 0x3000), 0x00);
+            ASSERT_EQ(memldb(mem, 0x4000), 0x99);
+            ASSERT_EQ(mos6502_exec(&cpu, mem, 13), 13);
+            ASSERT_EQ(memldb(mem, 0x3000), 0x42);
+            ASSERT_EQ(memldb(mem, 0x0080), 0x99);
+            // Only the pages the run wrote are copied back next time
+            ASSERT_EQ(mem->dirty[0], (uint64_t) 1 << 0x00 | (uint64_t) 1 << 0x30);
+        }
+
+        mos6502_reset(&cpu, mem);
+        ASSERT_SET(test_ram_zero(mem));
+        memfree(image);
+        free(image);
+    }
+
+    // Testing ROM shared by many RAMs, which only allocate what they write
+    {
+        printf("Testing shared ROM pages...\n");
+        BYTE const program[] = {
+            LDA_IMM, 0x42,       //
+            STA_ABS, 0x00, 0x80, // Ignored, 0x8000 is ROM
+            LDX_ABS, 0x00, 0x80, //
+            STX_ZPG, 0x10,       //
+        };
+        BYTE const reset[] = { 0x00, 0x80 };
+        RAM_Rom rom = { 0 };
+        memrom_load(&rom, 0x8000, program, sizeof(program));
+        memrom_load(&rom, 0xFFFC, reset, sizeof(reset));
+
+        RAM *mems = calloc(TEST_RAM_INSTANCES, sizeof(RAM));
+        for (size_t i = 0; i < TEST_RAM_INSTANCES; i++) {
+            memrom_map(&mems[i], &rom);
+            mos6502_reset(&cpu, &mems[i]);
+            cpu.pc = memldw(&mems[i], cpu.pc);
+            ASSERT_EQ(mos6502_exec(&cpu, &mems[i], 13), 13);
+            ASSERT_EQ(cpu.x, LDA_IMM);
+            ASSERT_EQ(memldb(&mems[i], 0x0010), LDA_IMM);
+            ASSERT_EQ(mems[i].page[0x80], rom.page[0x80]);
+            ASSERT_EQ(mems[i].page[0xFF], rom.page[0xFF]);
+            ASSERT_EQ(mems[i].used[0], 1);
+        }
+        ASSERT_EQ(atomic_load(&rom.page[0x80]->refs), 1 + TEST_RAM_INSTANCES);
+
+        // Reset keeps the ROM, the page written goes back to the arena
+        RAM_Page *written = mems[0].page[0x00];
+        mos6502_reset(&cpu, &mems[0]);
+        ASSERT_EQ(mems[0].page[0x00], NULL);
+        ASSERT_EQ(memldb(&mems[0], 0x8000), LDA_IMM);
+        memstb(&mems[0], 0x0100, 0x01);
+        ASSERT_EQ(mems[0].page[0x01], written);
+
+        memrom_free(&rom);
+        for (size_t i = 0; i < TEST_RAM_INSTANCES; i++) {
+            memfree(&mems[i]);
+            ASSERT_SET(test_ram_zero(&mems[i]));
+        }
+        free(mems);
+    }
+
+    memfree(mem);
+    free(mem);
+}
+
+#endif // TEST_RAM_C_
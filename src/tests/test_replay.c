@@ -0,0 +1,147 @@
+#ifndef TEST_REPLAY_C_
+#define TEST_REPLAY_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "replay.h"
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REPLAY_POINTS 48
+
+// Machine as it was at some cycle of the recorded run
+typedef struct {
+    uint64_t cycle;
+    MOS_6502 cpu;
+    BYTE mem[4][RAM_PAGE_SIZE]; // Zero page, stack and both tables
+} TestReplayPoint;
+
+static void test_replay_capture(MOS_6502_Replay *replay, MOS_6502 *cpu, RAM *mem,
+                                TestReplayPoint *point)
+{
+    point->cycle = mos6502_replay_now(replay);
+    point->cpu = *cpu;
+    WORD const pages[] = { 0x0000, 0x0100, 0x3000, 0x4000 };
+    for (size_t i = 0; i < 4; i++) {
+        memread(mem, pages[i], point->mem[i], RAM_PAGE_SIZE);
+    }
+}
+
+static void test_replay_check(MOS_6502_Replay *replay, MOS_6502 *cpu, RAM *mem,
+                              TestReplayPoint const *point)
+{
+    TestReplayPoint now;
+    ASSERT_EQ(mos6502_replay_seek(replay, point->cycle), true);
+    test_replay_capture(replay, cpu, mem, &now);
+    ASSERT_EQ(now.cycle, point->cycle);
+    ASSERT_EQ(now.cpu.pc, point->cpu.pc);
+    ASSERT_EQ(now.cpu.a, point->cpu.a);
+    ASSERT_EQ(now.cpu.x, point->cpu.x);
+    ASSERT_EQ(now.cpu.y, point->cpu.y);
+    ASSERT_EQ(now.cpu.s, point->cpu.s);
+    ASSERT_EQ(mos6502_getp(&now.cpu), mos6502_getp(&point->cpu));
+    ASSERT_EQ(atomic_load(&now.cpu.pending), atomic_load(&point->cpu.pending));
+    expect(memcmp(now.mem, point->mem, sizeof(now.mem)) == 0, "Memory differs at cycle %lu",
+           (unsigned long) point->cycle);
+}
+
+static char const *const test_replay_policies[] = { "spread", "recent", "window" };
+
+static void test_replay_engine(MOS_6502 *cpu, RAM *mem, char const *name, void *user)
+{
+    Thinning thinning = *(Thinning const *) user;
+    char const *policy = test_replay_policies[thinning];
+
+    // 26 cycles a round, storing what inputs put at 0x0010 into tables at
+    // offsets they put at 0x0011 and 0x0012. Both handlers note A and Y
+    // before jumping back, leaving their return address on the stack and I
+    // set, so that a held IRQ is only taken again at the CLI.
+    BYTE const program[] = {
+        LDA_ZPG, 0x10,       // 0x0200
+        LDY_ZPG, 0x11,       // 0x0202
+        STA_ABY, 0x00, 0x30, // 0x0204
+        LDX_ZPG, 0x12,       // 0x0207
+        STA_ABX, 0x00, 0x40, // 0x0209
+        CLI,                 // 0x020C
+        SEI,                 // 0x020D
+        JMP_ABS, 0x00, 0x02, // 0x020E
+    };
+    BYTE const nmi[] = { STA_ZPG, 0x13, JMP_ABS, 0x00, 0x02 };
+    BYTE const irq[] = { STY_ZPG, 0x14, JMP_ABS, 0x00, 0x02 };
+
+    memload(mem, 0x0200, program, sizeof(program));
+    memload(mem, 0x0300, nmi, sizeof(nmi));
+    memload(mem, 0x0400, irq, sizeof(irq));
+    memstw(mem, Vector_NMI, 0x0300);
+    memstw(mem, Vector_IRQ, 0x0400);
+    cpu->pc = 0x0200;
+
+    printf("Testing recording a replay (%s, %s)...\n", policy, name);
+    MOS_6502_ReplayConfig config = {
+        .interval = 2000,
+        .checkpoints = 6,
+        .thinning = thinning,
+    };
+    MOS_6502_Replay *replay = mos6502_replay_new(cpu, mem, &config);
+    static TestReplayPoint points[REPLAY_POINTS];
+    test_replay_capture(replay, cpu, mem, &points[0]);
+    uint32_t seed = 1;
+    for (size_t i = 1; i < REPLAY_POINTS; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint64_t cycles = 100 + (seed >> 8) % 3000;
+        expect(mos6502_replay_run(replay, cycles) >= cycles, "");
+        switch ((seed >> 4) % 8) {
+            case 0:
+                mos6502_replay_raise(replay, Int_NMI);
+                break;
+            case 1:
+                mos6502_replay_raise(replay, Int_IRQ);
+                break;
+            case 2:
+                mos6502_replay_lower(replay, Int_IRQ);
+                break;
+            default:
+                mos6502_replay_store(replay, 0x10 + (seed >> 12) % 3, seed >> 16);
+                break;
+        }
+        test_replay_capture(replay, cpu, mem, &points[i]);
+        expect(mos6502_replay_checkpoints(replay) <= config.checkpoints, "");
+    }
+
+    printf("Testing seeking through a replay (%s, %s)...\n", policy, name);
+    size_t first = 0;
+    if (thinning == Thinning_Window) {
+        ASSERT_EQ(mos6502_replay_seek(replay, 0), false);
+        first = REPLAY_POINTS - 4;
+    }
+    // Back and forth
+    for (size_t i = 0, n = REPLAY_POINTS - first; i < n; i++) {
+        test_replay_check(replay, cpu, mem, &points[first + i * 7 % n]);
+    }
+
+    // A new input drops the run recorded after it
+    printf("Testing branching off a replay (%s, %s)...\n", policy, name);
+    size_t at = REPLAY_POINTS - 1;
+    ASSERT_EQ(mos6502_replay_seek(replay, points[at - 1].cycle + 50), true);
+    mos6502_replay_store(replay, 0x10, 0xEE);
+    mos6502_replay_run(replay, 5000);
+    ASSERT_EQ(memldb(mem, 0x0010), 0xEE);
+    test_replay_check(replay, cpu, mem, &points[at - 1]);
+    ASSERT_EQ(mos6502_replay_seek(replay, points[at].cycle), true);
+    ASSERT_EQ(memldb(mem, 0x0010), 0xEE);
+
+    mos6502_replay_free(replay);
+}
+
+void test_replay(void)
+{
+    for (Thinning thinning = Thinning_Spread; thinning <= Thinning_Window; thinning++) {
+        test_engines(test_replay_engine, &thinning);
+    }
+}
+
+#endif // TEST_REPLAY_C_
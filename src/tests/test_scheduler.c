@@ -0,0 +1,146 @@
+#ifndef TEST_SCHEDULER_C_
+#define TEST_SCHEDULER_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_SCHED_MAX_FIRED 32
+
+typedef struct {
+    size_t count;
+    int tag[TEST_SCHED_MAX_FIRED];
+    uint64_t when[TEST_SCHED_MAX_FIRED];
+    uint64_t now[TEST_SCHED_MAX_FIRED];
+} TestSchedLog;
+
+typedef struct {
+    TestSchedLog *log;
+    int tag;
+} TestSchedEvent;
+
+static void test_sched_record(MOS_6502_Scheduler *sched, void *user, uint64_t when)
+{
+    TestSchedEvent *event = user;
+    TestSchedLog *log = event->log;
+    expect(log->count < TEST_SCHED_MAX_FIRED, "Too many events fired");
+    log->tag[log->count] = event->tag;
+    log->when[log->count] = when;
+    log->now[log->count] = mos6502_sched_now(sched);
+    log->count++;
+}
+
+static void test_sched_periodic(MOS_6502_Scheduler *sched, void *user, uint64_t when)
+{
+    test_sched_record(sched, user, when);
+    mos6502_sched_in(sched, 6, test_sched_periodic, user);
+}
+
+// 0x0200: 128 LDA #$01, 2 cycles each
+static void test_sched_program(MOS_6502 *cpu, RAM *mem)
+{
+    mos6502_reset(cpu, mem);
+    for (WORD addr = 0x0200; addr < 0x0300; addr += 2) {
+        memstb(mem, addr, LDA_IMM);
+        memstb(mem, addr + 1, 0x01);
+    }
+    cpu->pc = 0x0200;
+}
+
+void test_sched(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+
+    for (int cached = 0; cached <= 1; cached++) {
+        // Testing deadlines, ties and cancellation
+        {
+            printf("Testing scheduler deadlines%s...\n", cached ? " with the block cache" : "");
+            test_sched_program(&cpu, &mem);
+            if (cached) {
+                mos6502_cache_enable(&mem);
+            }
+            MOS_6502_Scheduler *sched = mos6502_sched_new();
+            TestSchedLog log = { 0 };
+            TestSchedEvent events[] = {
+                { &log, 0 }, { &log, 1 }, { &log, 2 }, { &log, 3 }, { &log, 4 },
+            };
+            mos6502_sched_at(sched, 7, test_sched_record, &events[0]);
+            mos6502_sched_at(sched, 4, test_sched_record, &events[1]);
+            mos6502_sched_at(sched, 10, test_sched_record, &events[2]);
+            MOS_6502_Event cancelled = mos6502_sched_at(sched, 20, test_sched_record, &events[3]);
+            mos6502_sched_at(sched, 10, test_sched_record, &events[4]);
+            ASSERT_SET(mos6502_sched_cancel(sched, cancelled));
+            ASSERT_UNSET(mos6502_sched_cancel(sched, cancelled));
+
+            ASSERT_EQ(mos6502_sched_run(sched, &cpu, &mem, 30), 30);
+            ASSERT_EQ(mos6502_sched_now(sched), 30);
+            ASSERT_EQ(cpu.pc, 0x0200 + 30);
+            ASSERT_EQ(log.count, 4);
+            // Cycle 7 falls inside an instruction, so the clock reads 8
+            ASSERT_EQ(log.tag[0], 1);
+            ASSERT_EQ(log.when[0], 4);
+            ASSERT_EQ(log.now[0], 4);
+            ASSERT_EQ(log.tag[1], 0);
+            ASSERT_EQ(log.when[1], 7);
+            ASSERT_EQ(log.now[1], 8);
+            // Ties fire in the order they were scheduled
+            ASSERT_EQ(log.tag[2], 2);
+            ASSERT_EQ(log.tag[3], 4);
+            ASSERT_EQ(log.now[3], 10);
+            mos6502_sched_free(sched);
+            mos6502_cache_disable(&mem);
+        }
+
+        // Testing events that reschedule themselves
+        {
+            printf("Testing periodic events%s...\n", cached ? " with the block cache" : "");
+            test_sched_program(&cpu, &mem);
+            if (cached) {
+                mos6502_cache_enable(&mem);
+            }
+            MOS_6502_Scheduler *sched = mos6502_sched_new();
+            TestSchedLog log = { 0 };
+            TestSchedEvent event = { &log, 0 };
+            mos6502_sched_in(sched, 6, test_sched_periodic, &event);
+            // Split runs behave like a single one, and an event due right at
+            // the end of a run fires before it returns
+            ASSERT_EQ(mos6502_sched_run(sched, &cpu, &mem, 30), 30);
+            ASSERT_EQ(log.count, 5);
+            ASSERT_EQ(mos6502_sched_run(sched, &cpu, &mem, 30), 30);
+            ASSERT_EQ(log.count, 10);
+            for (size_t i = 0; i < log.count; i++) {
+                ASSERT_EQ(log.when[i], 6 * (i + 1));
+                ASSERT_EQ(log.now[i], 6 * (i + 1));
+            }
+            mos6502_sched_free(sched);
+            mos6502_cache_disable(&mem);
+        }
+    }
+
+    // Testing an instruction that crosses the deadline
+    {
+        printf("Testing deadlines inside an instruction...\n");
+        mos6502_reset(&cpu, &mem);
+        BYTE const program[] = { JSR, 0x00, 0x02 };
+        memload(&mem, 0x0200, program, sizeof(program));
+        cpu.pc = 0x0200;
+        MOS_6502_Scheduler *sched = mos6502_sched_new();
+        TestSchedLog log = { 0 };
+        TestSchedEvent event = { &log, 0 };
+        mos6502_sched_at(sched, 3, test_sched_record, &event);
+        ASSERT_EQ(mos6502_sched_run(sched, &cpu, &mem, 5), 6);
+        ASSERT_EQ(log.count, 1);
+        ASSERT_EQ(log.when[0], 3);
+        ASSERT_EQ(log.now[0], 6);
+        mos6502_sched_free(sched);
+    }
+
+    memfree(&mem);
+}
+
+#endif // TEST_SCHEDULER_C_
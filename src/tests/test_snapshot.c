@@ -0,0 +1,115 @@
+#ifndef TEST_SNAPSHOT_C_
+#define TEST_SNAPSHOT_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_SNAPSHOT_FORKS 64
+
+// Runs the rest of the program
+static void test_snapshot_check(MOS_6502 *cpu, RAM *mem, BYTE x, BYTE y)
+{
+    ASSERT_EQ(mos6502_exec(cpu, mem, 12), 12);
+    ASSERT_EQ(cpu->a, 0x11);
+    ASSERT_EQ(cpu->x, x);
+    ASSERT_EQ(cpu->y, y);
+    ASSERT_EQ(memldb(mem, 0x3001), x);
+    ASSERT_EQ(memldb(mem, 0x0020), y);
+}
+
+void test_snapshot(void)
+{
+    BYTE const program[] = {
+        LDA_IMM, 0x11,       //
+        STA_ABS, 0x00, 0x30, // Snapshot taken here
+        LDX_ZPG, 0x10,       //
+        STX_ABS, 0x01, 0x30, //
+        LDY_IMM, 0x22,       //
+        STY_ZPG, 0x20,       //
+    };
+
+    MOS_6502 cpu;
+    RAM *mem = calloc(1, sizeof(RAM));
+    mos6502_reset(&cpu, mem);
+    memload(mem, 0x0200, program, sizeof(program));
+    memstb(mem, 0x0010, 0x55);
+    cpu.pc = 0x0200;
+    ASSERT_EQ(mos6502_exec(&cpu, mem, 6), 6);
+
+    MOS_6502_Snapshot snap;
+    mos6502_snapshot(&cpu, mem, &snap);
+
+    // Testing that writes after the snapshot do not leak into it
+    {
+        printf("Testing snapshot copy-on-write...\n");
+        RAM_Page *shared = mem->page[0x30];
+        memstb(mem, 0x3000, 0x77);
+        ASSERT_SET((mem->page[0x30] != shared));
+        ASSERT_EQ(snap.mem.page[0x30], shared);
+        ASSERT_EQ(shared->data[0x00], 0x11);
+        test_snapshot_check(&cpu, mem, 0x55, 0x22);
+        ASSERT_EQ(memldb(mem, 0x3000), 0x77);
+    }
+
+    // Testing forks, which share every page they do not write to
+    {
+        printf("Testing snapshot forks...\n");
+        RAM *forks = calloc(TEST_SNAPSHOT_FORKS, sizeof(RAM));
+        for (size_t i = 0; i < TEST_SNAPSHOT_FORKS; i++) {
+            MOS_6502 fork;
+            mos6502_fork(&snap, &fork, &forks[i]);
+            ASSERT_EQ(fork.pc, 0x0205);
+            memstb(&forks[i], 0x0010, i);
+            test_snapshot_check(&fork, &forks[i], i, 0x22);
+            ASSERT_EQ(memldb(&forks[i], 0x3000), 0x11);
+
+            uint64_t written = (uint64_t) 1 << 0x00 | (uint64_t) 1 << 0x30;
+            ASSERT_EQ(forks[i].dirty[0], written);
+            ASSERT_EQ(forks[i].dirty[1] | forks[i].dirty[2] | forks[i].dirty[3], 0);
+            for (size_t page = 0; page < RAM_PAGES; page++) {
+                if (page >= 64 || !(written >> page & 1)) {
+                    ASSERT_EQ(forks[i].page[page], snap.mem.page[page]);
+                }
+            }
+        }
+        // The program is shared by the snapshot, the parent and every fork
+        ASSERT_EQ(atomic_load(&snap.mem.page[0x02]->refs), 2 + TEST_SNAPSHOT_FORKS);
+
+        for (size_t i = 0; i < TEST_SNAPSHOT_FORKS; i++) {
+            memfree(&forks[i]);
+        }
+        free(forks);
+        ASSERT_EQ(atomic_load(&snap.mem.page[0x02]->refs), 2);
+    }
+
+    // Testing restore, which only swaps back the pages written since
+    {
+        printf("Testing snapshot restore...\n");
+        mos6502_fork(&snap, &cpu, mem);
+        ASSERT_EQ(mem->page[0x30], snap.mem.page[0x30]);
+        ASSERT_EQ(memldb(mem, 0x3001), 0x00);
+        ASSERT_EQ(memldb(mem, 0x0020), 0x00);
+
+        mos6502_cache_enable(mem);
+        for (BYTE y = 0x20; y < 0x24; y++) {
+            mos6502_fork(&snap, &cpu, mem);
+            if (y != 0x22) {
+                memstb(mem, 0x020B, y); // Code decoded by the last run
+            }
+            test_snapshot_check(&cpu, mem, 0x55, y);
+        }
+        mos6502_fork(&snap, &cpu, mem);
+        test_snapshot_check(&cpu, mem, 0x55, 0x22);
+        mos6502_cache_disable(mem);
+    }
+
+    mos6502_snapshot_free(&snap);
+    memfree(mem);
+    free(mem);
+}
+
+#endif // TEST_SNAPSHOT_C_
@@ -10,7 +10,7 @@
 void test_st(void)
 {
     MOS_6502 cpu;
-    RAM mem;
+    RAM mem = { 0 };
 
     char const *const regnames[] = { "Accumulator", "Register X ", "Register Y " };
     BYTE *const reg[3] = { &cpu.a, &cpu.x, &cpu.y };
@@ -22,10 +22,10 @@ void test_st(void)
             printf("Testing Store %s On Zero Page...\n", regnames[i]);
             mos6502_reset(&cpu, &mem);
             *reg[i] = 0x42;
-            mem.data[cpu.pc + 0] = ins[i];
-            mem.data[cpu.pc + 1] = 0x80;
+            memstb(&mem, cpu.pc + 0, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x80);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 3), 3);
-            ASSERT_EQ(mem.data[0x80], 0x42);
+            ASSERT_EQ(memldb(&mem, 0x80), 0x42);
         }
     }
 
@@ -37,10 +37,10 @@ void test_st(void)
             mos6502_reset(&cpu, &mem);
             *reg[i] = 0x24;
             cpu.x = 0x1E;
-            mem.data[cpu.pc + 0] = ins[i];
-            mem.data[cpu.pc + 1] = 0x80;
+            memstb(&mem, cpu.pc + 0, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0x80);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
-            ASSERT_EQ(mem.data[0x9E], 0x24);
+            ASSERT_EQ(memldb(&mem, 0x9E), 0x24);
         }
     }
 
@@ -50,10 +50,10 @@ void test_st(void)
         mos6502_reset(&cpu, &mem);
         cpu.x = 0x3F;
         cpu.y = 0xA0;
-        mem.data[cpu.pc + 0] = STX_ZPY;
-        mem.data[cpu.pc + 1] = 0x18;
+        memstb(&mem, cpu.pc + 0, STX_ZPY);
+        memstb(&mem, cpu.pc + 1, 0x18);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
-        ASSERT_EQ(mem.data[0xB8], 0x3F);
+        ASSERT_EQ(memldb(&mem, 0xB8), 0x3F);
     }
 
     // Testing ST*_ABS
@@ -63,11 +63,11 @@ void test_st(void)
             printf("Testing Store %s On Absolute Address...\n", regnames[i]);
             mos6502_reset(&cpu, &mem);
             *reg[i] = 0x30 + i;
-            mem.data[cpu.pc + 0] = ins[i];
-            mem.data[cpu.pc + 1] = 0xBE + i;
-            mem.data[cpu.pc + 2] = 0xBA;
+            memstb(&mem, cpu.pc + 0, ins[i]);
+            memstb(&mem, cpu.pc + 1, 0xBE + i);
+            memstb(&mem, cpu.pc + 2, 0xBA);
             ASSERT_EQ(mos6502_exec(&cpu, &mem, 4), 4);
-            ASSERT_EQ(mem.data[0xBABE + i], 0x30 + i);
+            ASSERT_EQ(memldb(&mem, 0xBABE + i), 0x30 + i);
         }
     }
 
@@ -77,11 +77,11 @@ void test_st(void)
         mos6502_reset(&cpu, &mem);
         cpu.a = 0x42;
         cpu.x = 0xAA;
-        mem.data[cpu.pc + 0] = STA_ABX;
-        mem.data[cpu.pc + 1] = 0x10;
-        mem.data[cpu.pc + 2] = 0xCC;
+        memstb(&mem, cpu.pc + 0, STA_ABX);
+        memstb(&mem, cpu.pc + 1, 0x10);
+        memstb(&mem, cpu.pc + 2, 0xCC);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 5), 5);
-        ASSERT_EQ(mem.data[0xCCBA], 0x42);
+        ASSERT_EQ(memldb(&mem, 0xCCBA), 0x42);
     }
 
     // Testing STA_ABY
@@ -90,11 +90,11 @@ void test_st(void)
         mos6502_reset(&cpu, &mem);
         cpu.a = 0x42;
         cpu.y = 0xAA;
-        mem.data[cpu.pc + 0] = STA_ABY;
-        mem.data[cpu.pc + 1] = 0x10;
-        mem.data[cpu.pc + 2] = 0xCC;
+        memstb(&mem, cpu.pc + 0, STA_ABY);
+        memstb(&mem, cpu.pc + 1, 0x10);
+        memstb(&mem, cpu.pc + 2, 0xCC);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 5), 5);
-        ASSERT_EQ(mem.data[0xCCBA], 0x42);
+        ASSERT_EQ(memldb(&mem, 0xCCBA), 0x42);
     }
 
     // Testing STA_IDX
@@ -103,12 +103,12 @@ void test_st(void)
         mos6502_reset(&cpu, &mem);
         cpu.a = 0x42;
         cpu.x = 0x10;
-        mem.data[0xCB] = 0x1A;
-        mem.data[0xCC] = 0x2A;
-        mem.data[cpu.pc + 0] = STA_IDX;
-        mem.data[cpu.pc + 1] = 0xBB;
+        memstb(&mem, 0xCB, 0x1A);
+        memstb(&mem, 0xCC, 0x2A);
+        memstb(&mem, cpu.pc + 0, STA_IDX);
+        memstb(&mem, cpu.pc + 1, 0xBB);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 6), 6);
-        ASSERT_EQ(mem.data[0x2A1A], 0x42);
+        ASSERT_EQ(memldb(&mem, 0x2A1A), 0x42);
     }
 
     // Testing STA_IDY
@@ -117,13 +117,33 @@ void test_st(void)
         mos6502_reset(&cpu, &mem);
         cpu.a = 0x42;
         cpu.y = 0x10;
-        mem.data[0xBB] = 0x1A;
-        mem.data[0xBC] = 0x2A;
-        mem.data[cpu.pc + 0] = STA_IDY;
-        mem.data[cpu.pc + 1] = 0xBB;
+        memstb(&mem, 0xBB, 0x1A);
+        memstb(&mem, 0xBC, 0x2A);
+        memstb(&mem, cpu.pc + 0, STA_IDY);
+        memstb(&mem, cpu.pc + 1, 0xBB);
         ASSERT_EQ(mos6502_exec(&cpu, &mem, 6), 6);
-        ASSERT_EQ(mem.data[0x2A2A], 0x42);
+        ASSERT_EQ(memldb(&mem, 0x2A2A), 0x42);
     }
+
+    // Testing that stores leave every flag untouched
+    {
+        printf("Testing Store preserves flags...\n");
+        for (BYTE p = 0; p < 4; p++) {
+            mos6502_reset(&cpu, &mem);
+            cpu.c = cpu.o = 1;
+            cpu.z = p & 1;
+            cpu.n = p >> 1;
+            memstb(&mem, cpu.pc + 0, STA_ZPG);
+            memstb(&mem, cpu.pc + 1, 0x80);
+            ASSERT_EQ(mos6502_exec(&cpu, &mem, 3), 3);
+            ASSERT_EQ(cpu.z, p & 1);
+            ASSERT_EQ(cpu.n, p >> 1);
+            ASSERT_SET(cpu.c);
+            ASSERT_SET(cpu.o);
+        }
+    }
+
+    memfree(&mem);
 }
 
 #endif // TEST_ST_C_
@@ -0,0 +1,99 @@
+#ifndef TEST_TRACE_C_
+#define TEST_TRACE_C_
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void test_trace(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+    mos6502_reset(&cpu, &mem);
+
+    // 11 cycles a round
+    BYTE const program[] = {
+        LDA_IMM, 0x01, // 0x0200
+        STA_ZPG, 0x10, // 0x0202
+        LDX_ZPG, 0x10, // 0x0204
+        BNE, 0xF8,     // 0x0206
+    };
+    memload(&mem, 0x0200, program, sizeof(program));
+    WORD const pc[] = { 0x0200, 0x0202, 0x0204, 0x0206 };
+    WORD const addr[] = { 0x0000, 0x0010, 0x0010, 0x0200 };
+    uint64_t const at[] = { 0, 2, 5, 8 };
+
+    // Many times the ring, which the thread has to drain as it fills up. The
+    // JIT would compile the loop right away, yet every instruction is traced.
+    printf("Testing the trace recorder...\n");
+    size_t const rounds = 100000;
+    char const *path = "test_trace.trace";
+    mos6502_cache_enable(&mem);
+    mos6502_cache_engine(&mem, Engine_JIT, 1);
+    ASSERT_EQ(mos6502_trace_start(&mem, path), true);
+    cpu.pc = 0x0200;
+    ASSERT_EQ(mos6502_exec(&cpu, &mem, 11 * rounds / 2), 11 * rounds / 2);
+    ASSERT_EQ(mos6502_exec(&cpu, &mem, 11 * rounds / 2), 11 * rounds / 2);
+    ASSERT_EQ(mos6502_trace_stop(&mem), true);
+    ASSERT_EQ(cpu.pc, 0x0200);
+
+    printf("Testing the trace reader...\n");
+    MOS_6502_TraceReader *reader = mos6502_trace_open(path);
+    expect(reader != NULL, "Could not open the trace");
+    MOS_6502_TraceEntry entry;
+    size_t count = 0;
+    while (mos6502_trace_next(reader, &entry)) {
+        size_t round = count / 4, i = count % 4;
+        expect(entry.pc == pc[i], "0x%04x at %zu", entry.pc, count);
+        expect(entry.addr == addr[i], "0x%04x at %zu", entry.addr, count);
+        expect(entry.cycle == round * 11 + at[i], "%lu at %zu", entry.cycle, count);
+        expect(entry.opcode == program[i * 2], "0x%02x at %zu", entry.opcode, count);
+        expect(entry.a == (count > 0), "0x%02x at %zu", entry.a, count);
+        expect(entry.s == 0xFD, "0x%02x at %zu", entry.s, count);
+        count++;
+    }
+    mos6502_trace_close(reader);
+    remove(path);
+    ASSERT_EQ(count, rounds * 4);
+
+    // Pointers are read as the instruction runs, so the reader does not need
+    // the memory to resolve them
+    printf("Testing traced addresses...\n");
+    BYTE const modes[] = {
+        LDY_IMM, 0x05,       // 0x0300
+        LDA_IDY, 0x20,       // 0x0302
+        LDA_IDX, 0x21,       // 0x0304
+        LDA_ABX, 0x00, 0x30, // 0x0306
+        JSR, 0x00, 0xF0,     // 0x0309
+    };
+    memload(&mem, 0x0300, modes, sizeof(modes));
+    memstb(&mem, 0x0020, 0x00);
+    memstb(&mem, 0x0021, 0x30);
+    memstb(&mem, 0x0022, 0x40);
+    memstb(&mem, 0x0023, 0x12);
+    ASSERT_EQ(mos6502_trace_start(&mem, path), true);
+    cpu.pc = 0x0300;
+    ASSERT_EQ(mos6502_exec(&cpu, &mem, 2 + 5 + 6 + 4 + 6), 2 + 5 + 6 + 4 + 6);
+    // Stopped by memfree as well
+    mos6502_cache_disable(&mem);
+    memfree(&mem);
+    WORD const expected[] = { 0x0000, 0x3005, 0x1240, 0x3001, 0xF000 };
+    reader = mos6502_trace_open(path);
+    expect(reader != NULL, "Could not open the trace");
+    count = 0;
+    while (mos6502_trace_next(reader, &entry)) {
+        expect(entry.addr == expected[count], "0x%04x at %zu", entry.addr, count);
+        count++;
+    }
+    mos6502_trace_close(reader);
+    remove(path);
+    ASSERT_EQ(count, 5);
+
+    ASSERT_EQ(mos6502_trace_open("test_trace.missing"), NULL);
+}
+
+#endif // TEST_TRACE_C_
@@ -0,0 +1,249 @@
+#define _DEFAULT_SOURCE
+
+#include "trace.h"
+#include "lib.h"
+#include "tracer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A trace file starts with TRACE_MAGIC, followed by the words of its records
+// XORed with what TraceModel predicts of them.
+// Each record is a 16-bit mask of the bytes that came out other than zero,
+// then those bytes. Instructions mostly follow each other and, in loops, run
+// again with the same operands, registers and cycle deltas, so this takes
+// most records down to a handful of bytes.
+#define TRACE_MAGIC "6502TRC\3"
+
+#define TRACE_POLL_NS 100000 // Sleep of the thread of a trace when its ring is empty
+#define TRACE_CHUNK   4096   // Records the thread of a trace compresses per write
+
+// Prediction both ends of a trace file make of every record: its PC follows
+// the instruction before, and the rest is what the last instruction whose PC
+// has the same low byte left
+typedef struct {
+    WORD next;
+    uint64_t last[256][2];
+} TraceModel;
+
+// What `model` predicts of the record of the instruction at `pc`
+static void trace_guess(TraceModel const *model, WORD pc, uint64_t guess[2])
+{
+    uint64_t const *last = model->last[pc & 0xFF];
+    guess[0] = (last[0] & ~(uint64_t) 0xFFFF) | model->next;
+    guess[1] = last[1];
+}
+
+static void trace_learn(TraceModel *model, uint64_t const word[2])
+{
+    WORD pc = word[0];
+    model->last[pc & 0xFF][0] = word[0];
+    model->last[pc & 0xFF][1] = word[1];
+    model->next = pc + mos6502_opinfo[(BYTE) (word[0] >> 32)].bytes;
+}
+
+// Appends `record` to `out`, returning the bytes written
+static size_t trace_write(TraceModel *model, TraceRecord const *record, BYTE *restrict out)
+{
+    uint64_t const *word = record->word;
+    uint64_t guess[2];
+    trace_guess(model, word[0], guess);
+    trace_learn(model, word);
+    size_t size = 2;
+    unsigned mask = 0;
+    for (size_t w = 0; w < 2; w++) {
+        uint64_t diff = word[w] ^ guess[w];
+        // High bit of every byte that is not zero, then those bits gathered
+        uint64_t high = 0x8080808080808080;
+        uint64_t nonzero = (((diff & ~high) + ~high) | diff) & high;
+        unsigned bytes = (nonzero >> 7) * 0x0102040810204080 >> 56;
+        mask |= bytes << 8 * w;
+        for (; bytes != 0; bytes &= bytes - 1) {
+            out[size++] = diff >> 8 * __builtin_ctz(bytes);
+        }
+    }
+    out[0] = mask;
+    out[1] = mask >> 8;
+    return size;
+}
+
+static void trace_flush(struct MOS_6502_Trace *trace, BYTE const *out, size_t size)
+{
+    if (fwrite(out, 1, size, trace->file) != size) {
+        trace->failed = true;
+    }
+}
+
+// Thread of a trace: drains its ring into its file until told to stop, and
+// then until the ring is empty
+static void *trace_drain(void *arg)
+{
+    struct MOS_6502_Trace *trace = arg;
+    TraceModel *model = calloc(1, sizeof(TraceModel));
+    static_assert(TRACE_RING % TRACE_CHUNK == 0, "Chunks should not straddle the ring");
+    BYTE *out = malloc(TRACE_CHUNK * (2 + sizeof(TraceRecord)));
+    expect(model != NULL && out != NULL, "Could not allocate the buffers of the trace");
+    uint64_t tail = 0;
+    for (;;) {
+        // Read before `head`, so the last records are never left behind
+        bool stop = atomic_load_explicit(&trace->stop, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+        if (head == tail) {
+            if (stop) {
+                free(model);
+                free(out);
+                return NULL;
+            }
+            nanosleep(&(struct timespec) { .tv_nsec = TRACE_POLL_NS }, NULL);
+            continue;
+        }
+        while (tail != head) {
+            size_t size = 0;
+            for (uint64_t end = tail + TRACE_CHUNK < head ? tail + TRACE_CHUNK : head; tail != end;
+                 tail++) {
+                size += trace_write(model, &trace->ring[tail & (TRACE_RING - 1)], out + size);
+            }
+            // Hands the records back before the write, which may block
+            atomic_store_explicit(&trace->tail, tail, memory_order_release);
+            trace_flush(trace, out, size);
+        }
+    }
+}
+
+static void trace_cleanup(RAM *mem)
+{
+    mos6502_trace_stop(mem);
+}
+
+bool mos6502_trace_start(RAM *mem, char const *path)
+{
+    expect(mem->trace == NULL, "A trace is already running");
+    expect(mem->cleanup == NULL, "Something else already cleans up after the RAM");
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    struct MOS_6502_Trace *trace = aligned_alloc(alignof(struct MOS_6502_Trace), sizeof(*trace));
+    expect(trace != NULL, "Could not allocate the trace");
+    memset(trace, 0, sizeof(*trace));
+    trace->file = file;
+    if (fwrite(TRACE_MAGIC, 1, 8, file) != 8) {
+        trace->failed = true;
+    }
+    expect(pthread_create(&trace->thread, NULL, trace_drain, trace) == 0,
+           "Could not start the thread of the trace");
+    mem->trace = trace;
+    mem->cleanup = trace_cleanup;
+    return true;
+}
+
+bool mos6502_trace_stop(RAM *mem)
+{
+    struct MOS_6502_Trace *trace = mem->trace;
+    if (trace == NULL) {
+        return true;
+    }
+    atomic_store_explicit(&trace->stop, true, memory_order_release);
+    pthread_join(trace->thread, NULL);
+    bool ok = fclose(trace->file) == 0 && !trace->failed;
+    free(trace);
+    mem->trace = NULL;
+    mem->cleanup = NULL;
+    return ok;
+}
+
+struct MOS_6502_TraceReader {
+    FILE *file;
+    TraceModel model;
+    uint64_t cycle;
+};
+
+MOS_6502_TraceReader *mos6502_trace_open(char const *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+        fclose(file);
+        return NULL;
+    }
+    MOS_6502_TraceReader *reader = calloc(1, sizeof(*reader));
+    expect(reader != NULL, "Could not allocate the trace reader");
+    reader->file = file;
+    return reader;
+}
+
+// Same addresses as mos6502_getaddr, and branch targets, from the raw operand
+// and the pointer the record holds
+static WORD trace_addr(MOS_6502_TraceEntry const *entry, WORD operand, WORD pointer)
+{
+    MOS_6502_OpInfo const *info = &mos6502_opinfo[entry->opcode];
+    if (info->bytes == 2) {
+        operand &= 0xFF;
+    }
+    switch (info->mode) {
+        case AddrMode_ZPG:
+        case AddrMode_ABS:
+            return operand;
+        case AddrMode_IDX:
+            return pointer;
+        case AddrMode_ZPX:
+        case AddrMode_ABX:
+            return operand + entry->x;
+        case AddrMode_ZPY:
+        case AddrMode_ABY:
+            return operand + entry->y;
+        case AddrMode_IDY:
+            return pointer + entry->y;
+        case AddrMode_REL:
+            return entry->pc + 2 + (int8_t) operand;
+        default:
+            return 0;
+    }
+}
+
+bool mos6502_trace_next(MOS_6502_TraceReader *reader, MOS_6502_TraceEntry *entry)
+{
+    BYTE in[2];
+    if (fread(in, 1, 2, reader->file) != 2) {
+        return false;
+    }
+    WORD mask = in[0] | in[1] << 8;
+    uint64_t word[2] = { 0 }, guess[2];
+    for (size_t i = 0; i < 16; i++) {
+        int c = mask >> i & 1 ? fgetc(reader->file) : 0;
+        if (c == EOF) {
+            return false;
+        }
+        word[i / 8] |= (uint64_t) c << 8 * (i % 8);
+    }
+    trace_guess(&reader->model, word[0] ^ reader->model.next, guess);
+    word[0] ^= guess[0];
+    word[1] ^= guess[1];
+    trace_learn(&reader->model, word);
+
+    reader->cycle += word[1] >> 32;
+    *entry = (MOS_6502_TraceEntry) {
+        .cycle = reader->cycle,
+        .pc = word[0],
+        .opcode = word[0] >> 32,
+        .a = word[0] >> 40,
+        .x = word[0] >> 48,
+        .y = word[0] >> 56,
+        .s = word[1],
+        .p = word[1] >> 8,
+    };
+    entry->addr = trace_addr(entry, word[0] >> 16, word[1] >> 16);
+    return true;
+}
+
+void mos6502_trace_close(MOS_6502_TraceReader *reader)
+{
+    if (reader != NULL) {
+        fclose(reader->file);
+        free(reader);
+    }
+}
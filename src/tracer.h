@@ -0,0 +1,110 @@
+#ifndef MOS6502_TRACER_H_
+#define MOS6502_TRACER_H_
+
+#include "core.h"
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define TRACE_RING 65536 // Records, must be a power of two
+
+// Fixed-size record of the ring, as two little-endian words built in registers
+// and stored whole:
+//
+//   word[0]: PC, operand, opcode, A, X, Y
+//   word[1]: S, P, pointer, cycle delta (32 bits)
+//
+// The operand is the raw bytes after the opcode, from which the reader of the
+// trace works out the address. The pointer is what the pointer of an indirect
+// operand held, which the reader could no longer know, and 0 for the other
+// modes. The cycle is a delta from the record before, which keeps it small
+// for the compressor.
+typedef struct {
+    uint64_t word[2];
+} TraceRecord;
+static_assert(sizeof(TraceRecord) == 16, "Trace records should be 16 bytes");
+
+#define TRACE_PUBLISH 64 // Records written between two updates of `head`
+
+// Where mos6502_exec is in the ring, kept in locals while it runs
+typedef struct {
+    uint64_t head;  // Next record to write
+    uint64_t tail;  // `tail` when last read, which is only needed when the ring looks full
+    uint32_t delta; // Cycles since the last record
+} TraceCursor;
+
+// Single-producer single-consumer ring: mos6502_exec writes records at
+// `head`, the thread of the trace drains them from `tail`
+struct MOS_6502_Trace {
+    alignas(64) _Atomic uint64_t head;
+    TraceCursor cursor;
+
+    alignas(64) _Atomic uint64_t tail;
+    _Atomic bool stop;
+    pthread_t thread;
+    FILE *file;
+    bool failed; // A write to `file` failed
+
+    TraceRecord ring[TRACE_RING];
+};
+
+// The raw bytes after `opcode`, which only the reader makes sense of, for
+// loops that record before they fetch the operand
+static forceinline WORD trace_operand(Core const *core, RAM const *mem, BYTE opcode)
+{
+    BYTE bytes = mos6502_opinfo[opcode].bytes;
+    if (bytes < 3) {
+        return bytes == 2 ? mempeek(mem, core->pc) : 0;
+    }
+    BYTE const *page = mem->host[core->pc >> 8];
+    if (likely(page != NULL && (core->pc & 0xFF) != 0xFF)) {
+        return page[core->pc & 0xFF] | page[(core->pc & 0xFF) + 1] << 8;
+    }
+    return mempeekw(mem, core->pc);
+}
+
+// What the pointer of an indirect `operand` holds, or 0 for the other modes
+static forceinline WORD trace_pointer(Core const *core, RAM const *mem, BYTE opcode,
+                                      WORD operand)
+{
+    AddrMode mode = mos6502_opinfo[opcode].mode;
+    if (likely(mode != AddrMode_IDX && mode != AddrMode_IDY)) {
+        return 0;
+    }
+    return mempeekw(mem, (BYTE) operand + (mode == AddrMode_IDX ? core->x : 0));
+}
+
+// Records `opcode` at `pc` and its raw `operand`, with the registers of `core`
+// before it runs. Only waits when the thread of the trace fell a whole ring
+// behind.
+static forceinline void trace_insn(struct MOS_6502_Trace *trace, TraceCursor *cursor,
+                                   Core const *core, RAM const *mem, WORD pc, BYTE opcode,
+                                   WORD operand)
+{
+    if (unlikely(cursor->head - cursor->tail == TRACE_RING)) {
+        atomic_store_explicit(&trace->head, cursor->head, memory_order_release);
+        while ((cursor->tail = atomic_load_explicit(&trace->tail, memory_order_acquire))
+               == cursor->head - TRACE_RING) {
+            sched_yield();
+        }
+    }
+    TraceRecord *record = &trace->ring[cursor->head & (TRACE_RING - 1)];
+    record->word[0] = pc | (uint64_t) operand << 16 | (uint64_t) opcode << 32
+                      | (uint64_t) core->a << 40 | (uint64_t) core->x << 48
+                      | (uint64_t) core->y << 56;
+    record->word[1] = core->s | core_getp(core) << 8
+                      | (uint64_t) trace_pointer(core, mem, opcode, operand) << 16
+                      | (uint64_t) cursor->delta << 32;
+    if (++cursor->head % TRACE_PUBLISH == 0) {
+        atomic_store_explicit(&trace->head, cursor->head, memory_order_release);
+    }
+}
+
+#endif // MOS6502_TRACER_H_
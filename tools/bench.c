@@ -0,0 +1,624 @@
+#define _DEFAULT_SOURCE
+
+// Measures the speed of the emulator, from single memory accesses up to whole
+// programs, and compares it against a baseline.
+//
+//     6502-bench [results.json [baseline.json [tolerance]]]
+//
+// Memory accesses go through the bus of ram.h. `flat` is the memory model the
+// bus replaced, a 64KiB array behind functions that are not inlined, kept as
+// the baseline every bus access is compared against. Addresses are drawn from
+// a fixed pseudo-random sequence over 16 pages, so every case does the same
+// work around the access itself.
+//
+// Every opcode then runs on its own, repeated over a block that jumps back to
+// its start, on the plain interpreter and on each engine of the block cache.
+// Control flow opcodes loop on their own instead, except RTI, which is left
+// out. Programs follow: a copy of a page, nested subroutine calls and a run of
+// immediate loads and branches, each also on many CPUs at once through
+// mos6502_exec_batch, along with its speedup over running them one after the
+// other. Last comes mos6502_reset.
+//
+// Results are written to `results.json`, one per line. Against a baseline
+// written the same way, any case more than `tolerance` percent slower is
+// reported and makes the exit status 1. Times are first divided by the
+// median change over all cases, so that a machine running slower or faster as
+// a whole, as shared and virtual ones do from one run to the next, does not
+// show as a change. A baseline is the results of an earlier run on the same
+// machine.
+
+#include "lib.h"
+#include "mos6502.h"
+#include "ram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ACCESSES  (1 << 25)
+#define ADDRESSES (1 << 12)
+
+#define CYCLES  (1 << 22) // Budget of every run of a program
+#define RUNS    9         // Runs of every case, of which the median counts
+#define REPEATS 64        // Copies of the opcode in the block of its benchmark
+#define RESETS  (1 << 16)
+#define CPUS    64 // Instances of the batch benchmark
+
+#define CODE 0x0400 // Where programs are loaded
+#define DATA 0x3000 // What their operands point to
+#define ZP   0x80   // Zero page operand, away from the pointer at 0x10
+
+#define RESULTS 512
+
+// Percent. Above the spread between runs of an unchanged tree on a shared VM,
+// where some cases come out up to 2.2x slower from one process to the next.
+#define TOLERANCE 150
+
+typedef struct {
+    BYTE data[RAM_SIZE];
+    uint64_t dirty[RAM_PAGES / 64];
+    uint64_t code[RAM_PAGES / 64];
+} Flat;
+
+static __attribute__((noinline)) BYTE flat_ldb(Flat *mem, WORD addr)
+{
+    return mem->data[addr];
+}
+
+static __attribute__((noinline)) void flat_stb(Flat *mem, WORD addr, BYTE b)
+{
+    mem->data[addr] = b;
+    mem->dirty[addr >> 14] |= (uint64_t) 1 << (addr >> 8 & 63);
+    if (unlikely(mem->code[addr >> 14] >> (addr >> 8 & 63) & 1)) {
+        abort();
+    }
+}
+
+static BYTE bench_read(void *device, WORD addr)
+{
+    return *(BYTE *) device + addr;
+}
+
+static void bench_write(void *device, WORD addr, BYTE b)
+{
+    *(BYTE *) device = addr + b;
+}
+
+static WORD addrs[ADDRESSES];
+
+// Time per unit of every case, and emulated MHz of those that run programs,
+// 0 for the others
+typedef struct {
+    char name[48];
+    double ns;
+    double mhz;
+} Result;
+
+static Result results[RESULTS];
+static size_t nresults;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(void const *a, void const *b)
+{
+    double x = *(double const *) a, y = *(double const *) b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the `RUNS` values of `runs` and returns their median, which a few runs
+// slowed down, or sped up, by the rest of the machine do not move
+static double median(double *runs)
+{
+    qsort(runs, RUNS, sizeof(double), compare_doubles);
+    return runs[RUNS / 2];
+}
+
+static void record(char const *name, double ns, double mhz)
+{
+    expect(nresults < RESULTS, "Too many results");
+    Result *result = &results[nresults++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->ns = ns;
+    result->mhz = mhz;
+}
+
+// Prints the time per access of a run that took `elapsed`, and returns it
+static double report(char const *name, double elapsed, double baseline)
+{
+    double ns = elapsed * 1e9 / ACCESSES;
+    printf("%-24s %7.3f ns/access", name, ns);
+    if (baseline > 0) {
+        printf("  %5.2fx flat", ns / baseline);
+    }
+    printf("\n");
+    record(name, ns, 0);
+    return ns;
+}
+
+// Runs `access` for every address, keeping its result alive, and sets `elapsed`
+// to the median time of the runs
+#define BENCH(elapsed, sum, access)                     \
+    do {                                                \
+        double runs[RUNS];                              \
+        for (size_t run = 0; run < RUNS; run++) {       \
+            double start = now();                       \
+            for (size_t i = 0; i < ACCESSES; i++) {     \
+                WORD addr = addrs[i & (ADDRESSES - 1)]; \
+                access;                                 \
+            }                                           \
+            __asm__ volatile("" : : "r"(sum));          \
+            runs[run] = now() - start;                  \
+        }                                               \
+        elapsed = median(runs);                         \
+    } while (0)
+
+static void bench_memory(void)
+{
+    uint32_t seed = 1;
+    for (size_t i = 0; i < ADDRESSES; i++) {
+        seed = seed * 1103515245 + 12345;
+        addrs[i] = 0x2000 + (seed >> 8) % 0x1000;
+    }
+
+    Flat *flat = calloc(1, sizeof(Flat));
+    RAM *mem = calloc(1, sizeof(RAM));
+    RAM *host = calloc(1, sizeof(RAM));
+    RAM *io = calloc(1, sizeof(RAM));
+    static BYTE hostmem[0x1000];
+    BYTE reg = 0;
+    RAM_Io const device = { bench_read, bench_write, &reg };
+    for (WORD addr = 0x2000; addr < 0x3000; addr++) {
+        memstb(mem, addr, addr);
+        flat_stb(flat, addr, addr);
+    }
+    memmap_host(host, 0x2000, sizeof(hostmem), hostmem, true);
+    memmap_io(io, 0x2000, 0x1000, &device);
+
+    BYTE sum = 0;
+    double elapsed = 0;
+    BENCH(elapsed, sum, sum += flat_ldb(flat, addr));
+    double baseline = report("flat ldb", elapsed, 0);
+
+    BENCH(elapsed, sum, sum += memldb(mem, addr));
+    report("ram ldb", elapsed, baseline);
+
+    BENCH(elapsed, sum, sum += memldb(host, addr));
+    report("host ldb", elapsed, baseline);
+
+    BENCH(elapsed, sum, sum += memldb(io, addr));
+    report("io ldb", elapsed, baseline);
+
+    BENCH(elapsed, sum, flat_stb(flat, addr, i));
+    baseline = report("flat stb", elapsed, 0);
+
+    BENCH(elapsed, sum, memstb(mem, addr, i));
+    report("ram stb", elapsed, baseline);
+
+    BENCH(elapsed, sum, memstb(host, addr, i));
+    report("host stb", elapsed, baseline);
+
+    BENCH(elapsed, sum, memstb(io, addr, i));
+    report("io stb", elapsed, baseline);
+
+    memfree(mem);
+    memfree(host);
+    memfree(io);
+    free(flat);
+    free(mem);
+    free(host);
+    free(io);
+}
+
+// How programs are run: without a cache, or by an engine of the cache
+typedef struct {
+    char const *name;
+    int engine;
+} Runner;
+
+static Runner const runners[] = {
+    { "interpreter", -1 },
+    { "blocks", Engine_Interpreter },
+    { "jit", Engine_JIT },
+};
+
+typedef struct {
+    BYTE code[0x800];
+    size_t size;
+} Program;
+
+static void emit(Program *program, BYTE opcode, WORD operand)
+{
+    MOS_6502_OpInfo const *info = &mos6502_opinfo[opcode];
+    expect(program->size + info->bytes <= sizeof(program->code), "Program too long");
+    BYTE *at = &program->code[program->size];
+    at[0] = opcode;
+    if (info->bytes > 1) {
+        at[1] = operand;
+    }
+    if (info->bytes > 2) {
+        at[2] = operand >> 8;
+    }
+    program->size += info->bytes;
+}
+
+// What an instance of `program` starts from: registers at 0, a pointer to
+// DATA at 0x10, BRK vectored to the start of the program and a stack from
+// which RTS returns there too
+static void setup(MOS_6502 *cpu, RAM *mem, Program const *program)
+{
+    mos6502_reset(cpu, mem);
+    memload(mem, CODE, program->code, program->size);
+    memstw(mem, 0x0010, DATA);
+    memstw(mem, Vector_IRQ, CODE);
+    // S starts odd, so every RTS pulls its low byte from an even address
+    for (WORD addr = 0x0100; addr < 0x0200; addr += 2) {
+        memstw(mem, addr, CODE - 1);
+    }
+    cpu->pc = CODE;
+}
+
+// Instructions and cycles of one trip around the main loop of `program`, run
+// one instruction at a time from its start until it gets back there
+static void calibrate(Program const *program, uint64_t *insns, uint64_t *cycles)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+    setup(&cpu, &mem, program);
+    *insns = *cycles = 0;
+    do {
+        uint64_t taken = mos6502_exec(&cpu, &mem, 1);
+        expect(taken > 0, "Opcode 0x%02x is not implemented", memldb(&mem, cpu.pc));
+        *cycles += taken;
+        ++*insns;
+    } while (cpu.pc != CODE);
+    memfree(&mem);
+}
+
+// Runs `program` with `runner` and records its time per instruction
+static void bench_program(char const *name, Program const *program, Runner const *runner)
+{
+    uint64_t insns, trip;
+    calibrate(program, &insns, &trip);
+
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+    setup(&cpu, &mem, program);
+    if (runner->engine >= 0) {
+        mos6502_cache_enable(&mem);
+        if (!mos6502_cache_engine(&mem, runner->engine, 1)) {
+            mos6502_cache_disable(&mem);
+            memfree(&mem);
+            return;
+        }
+    }
+    // Warms up the cache, then keeps the median time per cycle of the runs
+    mos6502_exec(&cpu, &mem, CYCLES);
+    double runs[RUNS];
+    for (size_t run = 0; run < RUNS; run++) {
+        double start = now();
+        uint64_t spent = mos6502_exec(&cpu, &mem, CYCLES);
+        runs[run] = (now() - start) / spent;
+    }
+    double per_cycle = median(runs);
+    mos6502_cache_disable(&mem);
+    memfree(&mem);
+
+    char full[48];
+    snprintf(full, sizeof(full), "%s %s", name, runner->name);
+    double ns = per_cycle * 1e9 * trip / insns;
+    double mhz = 1e-6 / per_cycle;
+    printf("%-24s %7.3f ns/insn %8.1f MHz\n", full, ns, mhz);
+    record(full, ns, mhz);
+}
+
+// Program that runs `opcode` over and over. Returns false for RTI, which
+// needs a stack of interrupt frames that no loop of its own can keep up.
+static bool opcode_program(Program *program, BYTE opcode)
+{
+    MOS_6502_OpInfo const *info = &mos6502_opinfo[opcode];
+    program->size = 0;
+    switch (info->op) {
+        case Op_JSR:
+            emit(program, opcode, CODE);
+            return true;
+        case Op_JMP:
+            // Each to the next one, since the block cache skips a jump to
+            // itself in one go
+            for (size_t i = 1; i < REPEATS; i++) {
+                emit(program, opcode, CODE + program->size + info->bytes);
+            }
+            emit(program, opcode, CODE);
+            return true;
+        case Op_RTS:
+        case Op_BRK:
+            // See setup for where those go
+            emit(program, opcode, 0);
+            return true;
+        case Op_RTI:
+            return false;
+        default:
+            break;
+    }
+    WORD operand;
+    switch (info->mode) {
+        case AddrMode_IMM:
+            operand = 0x42;
+            break;
+        case AddrMode_ZPG:
+        case AddrMode_ZPX:
+        case AddrMode_ZPY:
+            operand = ZP;
+            break;
+        case AddrMode_IDX:
+        case AddrMode_IDY:
+            operand = 0x10;
+            break;
+        case AddrMode_REL:
+            // Taken or not, lands on the next instruction
+            operand = 0;
+            break;
+        default:
+            operand = DATA;
+            break;
+    }
+    for (size_t i = 0; i < REPEATS; i++) {
+        emit(program, opcode, operand);
+    }
+    // Back through a second jump, so the block is not a loop on itself the
+    // cache skips as idle
+    emit(program, JMP_ABS, CODE + program->size + 3);
+    emit(program, JMP_ABS, CODE);
+    return true;
+}
+
+static void bench_opcodes(void)
+{
+    static Program program;
+#define OPCODE(name, opcode, ...)                                            \
+    if (opcode_program(&program, opcode)) {                                  \
+        for (size_t i = 0; i < sizeof(runners) / sizeof(runners[0]); i++) { \
+            bench_program(#name, &program, &runners[i]);                     \
+        }                                                                    \
+    }
+    MOS6502_OPCODES(OPCODE)
+#undef OPCODE
+}
+
+// Copies a page from DATA to the next one
+static void copy_program(Program *program)
+{
+    program->size = 0;
+    for (WORD i = 0; i < 0x100; i += 2) {
+        emit(program, LDA_ABS, DATA + i);
+        emit(program, STA_ABS, DATA + 0x100 + i);
+        emit(program, LDX_ABS, DATA + i + 1);
+        emit(program, STX_ABS, DATA + 0x100 + i + 1);
+    }
+    emit(program, JMP_ABS, CODE);
+}
+
+// Calls down 8 levels of subroutines, each of which loads and stores a byte
+static void call_program(Program *program)
+{
+    WORD const depth = 8, sub = CODE + 0x100;
+    program->size = 0;
+    emit(program, JSR, sub);
+    emit(program, JMP_ABS, CODE);
+    program->size = sub - CODE;
+    for (WORD level = 0; level < depth; level++) {
+        emit(program, LDA_ZPG, ZP + level);
+        emit(program, STA_ZPG, ZP + level + 1);
+        if (level + 1 < depth) {
+            emit(program, JSR, program->size + CODE + 4);
+        }
+        emit(program, RTS, 0);
+    }
+}
+
+// Loads of immediates, with a branch after every few, which is all register
+// updates and so what lockstep runs best
+static void register_program(Program *program)
+{
+    program->size = 0;
+    for (BYTE i = 0; i < 0x40; i++) {
+        emit(program, LDA_IMM, i);
+        emit(program, LDX_IMM, i + 1);
+        emit(program, BNE, 0);
+        emit(program, LDY_IMM, i);
+    }
+    emit(program, JMP_ABS, CODE);
+}
+
+// Runs `CPUS` instances of `program` through mos6502_exec_batch, as forks of
+// the same machine. Every run alternates with one of as many other forks
+// through mos6502_exec one after the other, so that the speedup it prints
+// compares runs the machine ran at the same speed.
+static void bench_batch(char const *name, Program const *program)
+{
+    uint64_t insns, trip;
+    calibrate(program, &insns, &trip);
+
+    // The batch, then the forks run alone
+    MOS_6502 *cpus = calloc(2 * CPUS, sizeof(MOS_6502));
+    RAM *mems = calloc(2 * CPUS, sizeof(RAM));
+    uint64_t *spent = calloc(CPUS, sizeof(uint64_t));
+    expect(cpus != NULL && mems != NULL && spent != NULL, "Could not allocate the batch");
+    MOS_6502_Snapshot snap;
+    setup(&cpus[0], &mems[0], program);
+    mos6502_snapshot(&cpus[0], &mems[0], &snap);
+    for (size_t i = 0; i < 2 * CPUS; i++) {
+        mos6502_fork(&snap, &cpus[i], &mems[i]);
+    }
+    mos6502_snapshot_free(&snap);
+    double runs[RUNS], alone[RUNS];
+    for (size_t run = 0; run < RUNS; run++) {
+        double start = now();
+        mos6502_exec_batch(cpus, mems, CPUS, CYCLES / CPUS, spent);
+        double elapsed = now() - start;
+        uint64_t cycles = 0;
+        for (size_t i = 0; i < CPUS; i++) {
+            cycles += spent[i];
+        }
+        runs[run] = elapsed / cycles;
+
+        start = now();
+        cycles = 0;
+        for (size_t i = CPUS; i < 2 * CPUS; i++) {
+            cycles += mos6502_exec(&cpus[i], &mems[i], CYCLES / CPUS);
+        }
+        alone[run] = (now() - start) / cycles;
+    }
+    double per_cycle = median(runs);
+    double speedup = median(alone) / per_cycle;
+    for (size_t i = 0; i < 2 * CPUS; i++) {
+        memfree(&mems[i]);
+    }
+    free(cpus);
+    free(mems);
+    free(spent);
+
+    char full[48];
+    snprintf(full, sizeof(full), "%s batch", name);
+    double ns = per_cycle * 1e9 * trip / insns;
+    double mhz = 1e-6 / per_cycle;
+    printf("%-24s %7.3f ns/insn %8.1f MHz %6.2fx alone\n", full, ns, mhz, speedup);
+    record(full, ns, mhz);
+}
+
+// mos6502_reset of a RAM with a page written since the last one
+static void bench_reset(void)
+{
+    MOS_6502 cpu;
+    RAM mem = { 0 };
+    double runs[RUNS];
+    for (size_t run = 0; run < RUNS; run++) {
+        double start = now();
+        for (size_t i = 0; i < RESETS; i++) {
+            memstb(&mem, DATA, i);
+            mos6502_reset(&cpu, &mem);
+        }
+        runs[run] = now() - start;
+    }
+    memfree(&mem);
+    double ns = median(runs) * 1e9 / RESETS;
+    printf("%-24s %7.3f ns/call\n", "reset", ns);
+    record("reset", ns, 0);
+}
+
+static void bench_programs(void)
+{
+    static Program program;
+    copy_program(&program);
+    for (size_t i = 0; i < sizeof(runners) / sizeof(runners[0]); i++) {
+        bench_program("copy", &program, &runners[i]);
+    }
+    bench_batch("copy", &program);
+    call_program(&program);
+    for (size_t i = 0; i < sizeof(runners) / sizeof(runners[0]); i++) {
+        bench_program("calls", &program, &runners[i]);
+    }
+    bench_batch("calls", &program);
+    register_program(&program);
+    for (size_t i = 0; i < sizeof(runners) / sizeof(runners[0]); i++) {
+        bench_program("registers", &program, &runners[i]);
+    }
+    bench_batch("registers", &program);
+    bench_reset();
+}
+
+static bool save(char const *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    fprintf(file, "[\n");
+    for (size_t i = 0; i < nresults; i++) {
+        Result const *result = &results[i];
+        fprintf(file, "  {\"name\": \"%s\", \"ns\": %.4f, \"mhz\": %.2f}%s\n", result->name,
+                result->ns, result->mhz, i + 1 < nresults ? "," : "");
+    }
+    fprintf(file, "]\n");
+    return fclose(file) == 0;
+}
+
+static Result const *find(Result const *list, size_t count, char const *name)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(list[i].name, name) == 0) {
+            return &list[i];
+        }
+    }
+    return NULL;
+}
+
+// Compares the results to those in the file at `path`, as save writes them,
+// relative to the median change. Returns the number of cases slower by more
+// than `tolerance` percent.
+static size_t compare(char const *path, double tolerance)
+{
+    FILE *file = fopen(path, "r");
+    expect(file != NULL, "Could not open the baseline \"%s\"", path);
+    static Result baseline[RESULTS];
+    size_t count = 0;
+    char line[256];
+    while (count < RESULTS && fgets(line, sizeof(line), file) != NULL) {
+        Result *result = &baseline[count];
+        if (sscanf(line, " {\"name\": \"%47[^\"]\", \"ns\": %lf", result->name, &result->ns)
+            == 2) {
+            count++;
+        }
+    }
+    fclose(file);
+
+    // Change of each case found in both, indexed like `results`
+    static double change[RESULTS], sorted[RESULTS];
+    size_t compared = 0;
+    for (size_t i = 0; i < nresults; i++) {
+        Result const *old = find(baseline, count, results[i].name);
+        change[i] = old != NULL && old->ns > 0 ? results[i].ns / old->ns : 0;
+        if (change[i] > 0) {
+            sorted[compared++] = change[i];
+        }
+    }
+    expect(compared > 0, "No case in common with \"%s\"", path);
+    qsort(sorted, compared, sizeof(double), compare_doubles);
+    double scale = sorted[compared / 2];
+    printf("Cases take %.2fx their time in \"%s\" on the median\n", scale, path);
+
+    size_t regressions = 0;
+    for (size_t i = 0; i < nresults; i++) {
+        double percent = (change[i] / scale - 1) * 100;
+        if (change[i] > 0 && percent > tolerance) {
+            printf("%-24s %7.3f ns, was %7.3f ns (%+.1f%%)\n", results[i].name, results[i].ns,
+                   results[i].ns / change[i], percent);
+            regressions++;
+        }
+    }
+    printf("%zu of %zu cases slower than \"%s\" by more than %.0f%%\n", regressions, compared,
+           path, tolerance);
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    bench_memory();
+    bench_opcodes();
+    bench_programs();
+
+    if (argc > 1 && !save(argv[1])) {
+        fprintf(stderr, "Could not write \"%s\"\n", argv[1]);
+        return 1;
+    }
+    if (argc > 2) {
+        double tolerance = argc > 3 ? atof(argv[3]) : TOLERANCE;
+        return compare(argv[2], tolerance) > 0;
+    }
+    return 0;
+}
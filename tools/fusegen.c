@@ -0,0 +1,96 @@
+// Chooses superinstructions from a profile written by
+// mos6502_cache_profile_save or mos6502_profile_save and prints them as
+// src/fusions.h.
+//
+//     6502-fusegen profile [count]
+//
+// Keeps the `count` (default 8) most frequent pairs and triples. Triples are
+// listed first so that they win over the pairs they start with.
+
+#include "lib.h"
+#include "mos6502.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_FUSIONS 64
+
+typedef struct {
+    uint64_t count;
+    int length;
+    char names[3][16];
+} Group;
+
+// Whether `name` is an implemented opcode, e.g. "LDA_IMM"
+static bool known(char const *name)
+{
+    for (size_t opcode = 0; opcode < 0x100; opcode++) {
+        if (mos6502_opinfo[opcode].name != NULL && strcmp(mos6502_opinfo[opcode].name, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        eprintf("Usage: %s profile [count]\n", argv[0]);
+        return 1;
+    }
+    size_t wanted = argc == 3 ? strtoul(argv[2], NULL, 0) : 8;
+    expect(wanted <= MAX_FUSIONS, "At most %d fusions", MAX_FUSIONS);
+
+    FILE *in = fopen(argv[1], "r");
+    if (in == NULL) {
+        panic("Could not open \"%s\"", argv[1]);
+    }
+
+    // The profile is sorted, so the first groups read are the ones to keep
+    Group groups[MAX_FUSIONS];
+    size_t count = 0;
+    char line[256];
+    while (count < wanted && fgets(line, sizeof(line), in) != NULL) {
+        // Comments, and the other sections of mos6502_profile_save
+        if (!isdigit((unsigned char) line[0])) {
+            continue;
+        }
+        Group *group = &groups[count];
+        int fields = sscanf(line, "%" SCNu64 " %15s %15s %15s", &group->count, group->names[0],
+                            group->names[1], group->names[2]);
+        expect(fields == 3 || fields == 4, "Malformed profile line: %s", line);
+        group->length = fields - 1;
+        for (int i = 0; i < group->length; i++) {
+            expect(known(group->names[i]), "Unknown opcode \"%s\"", group->names[i]);
+        }
+        count++;
+    }
+    fclose(in);
+
+    printf("#ifndef MOS6502_FUSIONS_H_\n#define MOS6502_FUSIONS_H_\n\n");
+    printf("// Superinstructions: runs of opcodes that blocks execute with a single\n");
+    printf("// dispatch. Earlier rows win when several match at the same instruction.\n");
+    printf("// Generated by 6502-fusegen from %s, regenerate from a profile with\n", argv[1]);
+    printf("// `make fusions PROFILE=<file>`.\n//\n");
+    printf("// X2(first, second)\n// X3(first, second, third)\n");
+    printf("#define MOS6502_FUSIONS(X2, X3)");
+    for (int length = 3; length >= 2; length--) {
+        for (size_t i = 0; i < count; i++) {
+            Group const *group = &groups[i];
+            if (group->length != length) {
+                continue;
+            }
+            printf(" \\\n    X%d(%s, %s", length, group->names[0], group->names[1]);
+            if (length == 3) {
+                printf(", %s", group->names[2]);
+            }
+            printf(") /* %" PRIu64 " */", group->count);
+        }
+    }
+    printf("\n\n#endif // MOS6502_FUSIONS_H_\n");
+    return 0;
+}
@@ -0,0 +1,455 @@
+// Ahead-of-time recompiler: translates a 6502 binary image into a C
+// translation unit that runs it without fetching or decoding anything.
+//
+//     6502-recomp [-o out.c] [-p prefix] [-e entry]... image load_addr
+//
+// Code is discovered from the reset entry (0xFFFC, where mos6502_reset points
+// PC), from every `-e` entry and from every jump, branch and JSR target found
+// along the way.
+// The output defines
+//
+//     uint64_t <prefix>_exec(MOS_6502 *cpu, RAM *mem, uint64_t max_cycles);
+//
+// with the same contract as mos6502_exec, and is built with `-Iinclude -Isrc`
+// against the emulator's objects. Anything that could not be proven static
+// falls back to mos6502_exec one instruction at a time: code outside the
+// image, unimplemented opcodes, pages the image stores into, blocks whose
+// bytes changed since translation, and the end of the cycle budget. While
+// breakpoints, a stop request, a trace or a profile are active, the rest of
+// the run is handed to mos6502_exec.
+
+#include "lib.h"
+#include "mos6502.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_ENTRIES 256
+#define BLOCK_INSNS 64
+
+typedef struct {
+    BYTE image[RAM_SIZE];
+    uint32_t start, end; // Addresses the image was loaded to, `end` excluded
+
+    bool leader[RAM_SIZE];  // Addresses a block starts at
+    bool written[RAM_PAGES]; // Pages the image stores into with a fixed address
+    bool code[RAM_PAGES];    // Pages translated blocks were read from
+
+    WORD worklist[RAM_SIZE];
+    size_t pending;
+} Program;
+
+static bool in_image(Program const *prog, uint32_t addr, BYTE bytes)
+{
+    return addr >= prog->start && addr + bytes <= prog->end;
+}
+
+static void add_leader(Program *prog, WORD addr)
+{
+    if (!prog->leader[addr] && in_image(prog, addr, 1)) {
+        prog->leader[addr] = true;
+        prog->worklist[prog->pending++] = addr;
+    }
+}
+
+// Whether `op` leaves for somewhere else than the next instruction
+static bool transfers(Op op)
+{
+    return op == Op_JSR || op == Op_RTS || op == Op_BRK || op == Op_RTI || op == Op_JMP
+           || op == Op_BR;
+}
+
+static WORD operand_at(Program const *prog, uint32_t addr, BYTE bytes)
+{
+    return bytes == 3 ? prog->image[addr + 1] | prog->image[addr + 2] << 8 : prog->image[addr + 1];
+}
+
+// Follows straight-line code from every leader, collecting the targets of
+// jumps, branches and JSRs as new leaders and the pages that stores with a
+// fixed address land on
+static void discover(Program *prog)
+{
+    while (prog->pending > 0) {
+        uint32_t addr = prog->worklist[--prog->pending];
+        for (;;) {
+            MOS_6502_OpInfo const *info = &mos6502_opinfo[prog->image[addr]];
+            if (info->name == NULL || !in_image(prog, addr, info->bytes)) {
+                break;
+            }
+            WORD operand = operand_at(prog, addr, info->bytes);
+            if (info->op == Op_ST && (info->mode == AddrMode_ZPG || info->mode == AddrMode_ABS)) {
+                prog->written[operand >> 8] = true;
+            }
+            addr += info->bytes;
+            if (info->op == Op_JSR) {
+                add_leader(prog, operand);
+                // Where the subroutine returns to
+                add_leader(prog, addr);
+                break;
+            }
+            if (info->op == Op_JMP) {
+                add_leader(prog, operand);
+                break;
+            }
+            if (info->op == Op_BR) {
+                add_leader(prog, addr + (int8_t) operand);
+                add_leader(prog, addr);
+                break;
+            }
+            if (info->op == Op_RTS || info->op == Op_BRK || info->op == Op_RTI) {
+                break;
+            }
+            if (info->op == Op_CLI) {
+                // Ends its block, see decode
+                add_leader(prog, addr);
+                break;
+            }
+        }
+    }
+}
+
+typedef struct {
+    WORD pc;
+    uint32_t end;    // Address past the last instruction
+    size_t count;    // Instructions translated
+    uint32_t cycles; // Base cycles of the whole block
+    uint32_t penalty;
+} Block;
+
+// Decodes the block at `pc`, which ends at a jump, branch, return, BRK or CLI,
+// before an instruction that cannot be translated, or before the next leader.
+// Ending at CLI lets dispatch take an IRQ it unmasks right after it.
+// Returns false when not even the first instruction can be translated.
+static bool decode(Program const *prog, WORD pc, Block *block)
+{
+    *block = (Block) { .pc = pc, .end = pc };
+    while (block->count < BLOCK_INSNS) {
+        uint32_t addr = block->end;
+        if (addr != pc && prog->leader[addr]) {
+            break;
+        }
+        MOS_6502_OpInfo const *info = &mos6502_opinfo[prog->image[addr]];
+        if (info->name == NULL || !in_image(prog, addr, info->bytes)
+            || prog->written[addr >> 8] || prog->written[(addr + info->bytes - 1) >> 8]) {
+            break;
+        }
+        block->count++;
+        block->cycles += info->cycles;
+        block->penalty += info->penalty;
+        block->end += info->bytes;
+        if (transfers(info->op) || info->op == Op_CLI) {
+            break;
+        }
+    }
+    return block->count > 0;
+}
+
+static char const *regname(Reg reg)
+{
+    switch (reg) {
+        case Reg_a:
+            return "c.a";
+        case Reg_x:
+            return "c.x";
+        case Reg_y:
+            return "c.y";
+        default:
+            panic("No register to name");
+    }
+}
+
+// Prints the effective address of an instruction, matching mos6502_getaddr
+static void emit_addr(FILE *out, AddrMode mode, WORD operand)
+{
+    switch (mode) {
+        case AddrMode_ZPG:
+        case AddrMode_ABS:
+            fprintf(out, "0x%04X", operand);
+            break;
+        case AddrMode_ZPX:
+        case AddrMode_ABX:
+            fprintf(out, "(WORD) (0x%04X + c.x)", operand);
+            break;
+        case AddrMode_ZPY:
+        case AddrMode_ABY:
+            fprintf(out, "(WORD) (0x%04X + c.y)", operand);
+            break;
+        case AddrMode_IDX:
+            fprintf(out, "memldw(mem, (WORD) (0x%04X + c.x))", operand);
+            break;
+        case AddrMode_IDY:
+            fprintf(out, "(WORD) (memldw(mem, 0x%04X) + c.y)", operand);
+            break;
+        default:
+            panic("Mode \"%s\" not implemented.", modename(mode));
+    }
+}
+
+// Leaves the block when a store hit a translated page, so the bytes of
+// whatever runs next are checked again
+static void emit_store_check(FILE *out, char const *addr, WORD next)
+{
+    fprintf(out, "        if (code_page(%s)) {\n", addr);
+    fprintf(out, "            c.pc = 0x%04X;\n", next);
+    fprintf(out, "            goto dispatch;\n");
+    fprintf(out, "        }\n");
+}
+
+static void emit_insn(FILE *out, Program const *prog, uint32_t addr)
+{
+    BYTE opcode = prog->image[addr];
+    MOS_6502_OpInfo const *info = &mos6502_opinfo[opcode];
+    WORD operand = operand_at(prog, addr, info->bytes);
+    WORD next = addr + info->bytes;
+
+    fprintf(out, "    // 0x%04X: %s\n", addr, info->name);
+    fprintf(out, "    cycles += %u;\n", info->cycles);
+    switch (info->op) {
+        case Op_LD:
+            if (info->mode == AddrMode_IMM) {
+                fprintf(out, "    %s = 0x%02X;\n", regname(info->reg), operand);
+                fprintf(out, "    c.nz = %s;\n", regname(info->reg));
+                break;
+            }
+            fprintf(out, "    {\n        WORD addr = ");
+            emit_addr(out, info->mode, operand);
+            fprintf(out, ";\n        %s = memldb(mem, addr);\n", regname(info->reg));
+            fprintf(out, "        c.nz = %s;\n", regname(info->reg));
+            if (info->mode == AddrMode_ABX) {
+                fprintf(out, "        cycles += (addr & 0xFF) < c.x;\n");
+            } else if (info->mode == AddrMode_ABY || info->mode == AddrMode_IDY) {
+                fprintf(out, "        cycles += (addr & 0xFF) < c.y;\n");
+            }
+            fprintf(out, "    }\n");
+            break;
+
+        case Op_ST:
+            fprintf(out, "    {\n        WORD addr = ");
+            emit_addr(out, info->mode, operand);
+            fprintf(out, ";\n        memstb(mem, addr, %s);\n", regname(info->reg));
+            emit_store_check(out, "addr", next);
+            fprintf(out, "    }\n");
+            break;
+
+        case Op_JSR:
+            // Same push as mos6502_pushw
+            fprintf(out, "    core_push(&c, mem, 0x%02X);\n", (WORD) (next - 1) >> 8);
+            fprintf(out, "    core_push(&c, mem, 0x%02X);\n", (WORD) (next - 1) & 0xFF);
+            fprintf(out, "    c.pc = 0x%04X;\n", operand);
+            fprintf(out, "    cycles += hook_jsr(&c, mem, 0x%04X);\n", operand);
+            // A memoized call that starts recording runs under memo.c, as in mos6502_exec
+            fprintf(out, "    if (memo_handover(mem)) {\n");
+            fprintf(out, "        core_store(&c, cpu);\n");
+            fprintf(out, "        cycles += memo_run(cpu, mem, cycles < max_cycles ? "
+                         "max_cycles - cycles : 0);\n");
+            fprintf(out, "        c = core_load(cpu);\n");
+            fprintf(out, "    }\n");
+            fprintf(out, "    goto dispatch;\n");
+            break;
+
+        case Op_RTS:
+            fprintf(out, "    core_rts(&c, mem);\n");
+            fprintf(out, "    goto dispatch;\n");
+            break;
+
+        case Op_JMP:
+            fprintf(out, "    c.pc = 0x%04X;\n", operand);
+            fprintf(out, "    goto dispatch;\n");
+            break;
+
+        case Op_BR:
+            fprintf(out, "    c.pc = 0x%04X;\n", next);
+            fprintf(out, "    cycles += core_branch(&c, 0x%02X, 0x%02X);\n", opcode, operand);
+            fprintf(out, "    goto dispatch;\n");
+            break;
+
+        case Op_BRK:
+            fprintf(out, "    c.pc = 0x%04X;\n", (WORD) (next + 1));
+            fprintf(out, "    core_interrupt(&c, mem, Vector_IRQ, Flag_B);\n");
+            fprintf(out, "    goto dispatch;\n");
+            break;
+
+        case Op_RTI:
+            fprintf(out, "    core_rti(&c, mem);\n");
+            fprintf(out, "    goto dispatch;\n");
+            break;
+
+        case Op_CLI:
+            fprintf(out, "    c.p &= ~Flag_I;\n");
+            break;
+
+        case Op_SEI:
+            fprintf(out, "    c.p |= Flag_I;\n");
+            break;
+    }
+}
+
+static void emit_block(FILE *out, Program const *prog, Block const *block)
+{
+    fprintf(out, "block_%04X:\n", block->pc);
+    fprintf(out, "    if (cycles + %u > max_cycles\n", block->cycles + block->penalty);
+    fprintf(out, "        || !memequal(mem, 0x%04X, image + 0x%04X, %u)) {\n",
+            block->pc, block->pc - prog->start, block->end - block->pc);
+    fprintf(out, "        goto fallback;\n");
+    fprintf(out, "    }\n");
+
+    uint32_t addr = block->pc;
+    Op last = Op_LD;
+    for (size_t i = 0; i < block->count; i++) {
+        emit_insn(out, prog, addr);
+        last = mos6502_opinfo[prog->image[addr]].op;
+        addr += mos6502_opinfo[prog->image[addr]].bytes;
+    }
+    // Jumps, branches and BRK already left for their target
+    if (!transfers(last)) {
+        fprintf(out, "    c.pc = 0x%04X;\n", (WORD) addr);
+        fprintf(out, "    goto dispatch;\n");
+    }
+    fprintf(out, "\n");
+}
+
+static void emit(FILE *out, Program *prog, char const *source, char const *prefix)
+{
+    Block *blocks = calloc(RAM_SIZE, sizeof(Block));
+    size_t count = 0;
+    for (uint32_t pc = prog->start; pc < prog->end; pc++) {
+        if (prog->leader[pc] && decode(prog, pc, &blocks[count])) {
+            for (uint32_t addr = pc; addr < blocks[count].end; addr++) {
+                prog->code[addr >> 8] = true;
+            }
+            count++;
+        }
+    }
+
+    fprintf(out, "// Generated by 6502-recomp from %s, do not edit\n\n", source);
+    fprintf(out, "#include \"core.h\"\n#include \"debug.h\"\n#include \"hook.h\"\n");
+    fprintf(out, "#include \"lib.h\"\n#include \"memo.h\"\n#include \"mos6502.h\"\n\n");
+    fprintf(out, "#include <stdbool.h>\n\n");
+
+    // The bytes every block was translated from, compared against memory
+    // before the block runs
+    fprintf(out, "static BYTE const image[0x%X] = {", prog->end - prog->start);
+    for (uint32_t addr = prog->start; addr < prog->end; addr++) {
+        fprintf(out, "%s0x%02X,", (addr - prog->start) % 12 == 0 ? "\n    " : " ",
+                prog->image[addr]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static uint64_t const code_pages[%d] = {", RAM_PAGES / 64);
+    for (size_t i = 0; i < RAM_PAGES / 64; i++) {
+        uint64_t bits = 0;
+        for (size_t page = 0; page < 64; page++) {
+            bits |= (uint64_t) prog->code[i * 64 + page] << page;
+        }
+        fprintf(out, "%s0x%016" PRIX64, i == 0 ? " " : ", ", bits);
+    }
+    fprintf(out, " };\n\n");
+
+    fprintf(out, "static inline bool code_page(WORD addr)\n{\n");
+    fprintf(out, "    return code_pages[addr >> 14] >> (addr >> 8 & 63) & 1;\n}\n\n");
+
+    fprintf(out, "uint64_t %s_exec(MOS_6502 *cpu, RAM *mem, uint64_t max_cycles)\n{\n", prefix);
+    fprintf(out, "    Core c = core_load(cpu);\n");
+    fprintf(out, "    uint64_t cycles = 0, taken;\n");
+    fprintf(out, "    if (mem->debug != NULL) {\n");
+    fprintf(out, "        mem->debug->stopped = Stop_Budget;\n");
+    fprintf(out, "    }\n\n");
+    fprintf(out, "dispatch:\n");
+    fprintf(out, "    if (cycles >= max_cycles) {\n");
+    fprintf(out, "        core_store(&c, cpu);\n");
+    fprintf(out, "        return cycles;\n");
+    fprintf(out, "    }\n");
+    // Only mos6502_exec stops at breakpoints and requests, and records what
+    // it runs into traces and profiles
+    fprintf(out, "    if (debug_armed(mem) || mem->trace != NULL || mem->profiler != NULL) {\n");
+    fprintf(out, "        core_store(&c, cpu);\n");
+    fprintf(out, "        return cycles + mos6502_exec(cpu, mem, max_cycles - cycles);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    taken = core_poll(&c, mem, cpu);\n");
+    fprintf(out, "    if (taken > 0) {\n");
+    fprintf(out, "        cycles += taken;\n");
+    fprintf(out, "        goto dispatch;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    switch (c.pc) {\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "        case 0x%04X:\n", blocks[i].pc);
+        fprintf(out, "            goto block_%04X;\n", blocks[i].pc);
+    }
+    fprintf(out, "    }\n\n");
+    fprintf(out, "fallback:\n");
+    fprintf(out, "    core_store(&c, cpu);\n");
+    fprintf(out, "    cycles += mos6502_exec(cpu, mem, 1);\n");
+    fprintf(out, "    c = core_load(cpu);\n");
+    fprintf(out, "    goto dispatch;\n\n");
+
+    for (size_t i = 0; i < count; i++) {
+        emit_block(out, prog, &blocks[i]);
+    }
+    fprintf(out, "}\n");
+
+    eprintf("%zu blocks translated\n", count);
+    free(blocks);
+}
+
+static void usage(char const *program)
+{
+    eprintf("Usage: %s [-o out.c] [-p prefix] [-e entry]... image load_addr\n", program);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    Program *prog = calloc(1, sizeof(Program));
+    char const *output = NULL, *prefix = "recomp";
+    char const *positional[2];
+    int npositional = 0;
+
+    WORD entries[MAX_ENTRIES];
+    size_t nentries = 0;
+    entries[nentries++] = 0xFFFC;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            prefix = argv[++i];
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc && nentries < MAX_ENTRIES) {
+            entries[nentries++] = strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][0] != '-' && npositional < 2) {
+            positional[npositional++] = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (npositional != 2) {
+        usage(argv[0]);
+    }
+
+    prog->start = strtoul(positional[1], NULL, 0);
+    expect(prog->start < RAM_SIZE, "Load address 0x%x out of memory", prog->start);
+    FILE *in = fopen(positional[0], "rb");
+    if (in == NULL) {
+        panic("Could not open \"%s\"", positional[0]);
+    }
+    prog->end = prog->start + fread(prog->image + prog->start, 1, RAM_SIZE - prog->start, in);
+    fclose(in);
+
+    for (size_t i = 0; i < nentries; i++) {
+        add_leader(prog, entries[i]);
+    }
+    discover(prog);
+
+    FILE *out = output == NULL ? stdout : fopen(output, "w");
+    if (out == NULL) {
+        panic("Could not open \"%s\"", output);
+    }
+    emit(out, prog, positional[0], prefix);
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(prog);
+    return 0;
+}
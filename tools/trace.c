@@ -0,0 +1,51 @@
+// Prints a trace written by mos6502_trace_start, one instruction a line.
+//
+//     6502-trace trace [from [to]]
+//
+// Keeps the instructions whose PC or address, as in MOS_6502_TraceEntry, lies
+// in [from, to]. Both default to the whole memory, `to` to `from` alone.
+
+#include "lib.h"
+#include "mos6502.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static void usage(char const *program)
+{
+    eprintf("Usage: %s trace [from [to]]\n", program);
+    exit(1);
+}
+
+static bool within(WORD addr, unsigned long from, unsigned long to)
+{
+    return addr >= from && addr <= to;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4) {
+        usage(argv[0]);
+    }
+    unsigned long from = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+    unsigned long to = argc > 3 ? strtoul(argv[3], NULL, 0) : argc > 2 ? from : RAM_SIZE - 1;
+    expect(from <= to && to < RAM_SIZE, "Invalid range 0x%lx-0x%lx", from, to);
+
+    MOS_6502_TraceReader *reader = mos6502_trace_open(argv[1]);
+    if (reader == NULL) {
+        panic("Could not read the trace \"%s\"", argv[1]);
+    }
+    MOS_6502_TraceEntry entry;
+    while (mos6502_trace_next(reader, &entry)) {
+        if (!within(entry.pc, from, to) && !within(entry.addr, from, to)) {
+            continue;
+        }
+        char const *name = mos6502_opinfo[entry.opcode].name;
+        printf("%12lu 0x%04x %-8s 0x%04x A=%02x X=%02x Y=%02x S=%02x P=%02x\n",
+               (unsigned long) entry.cycle, entry.pc, name != NULL ? name : "???", entry.addr,
+               entry.a, entry.x, entry.y, entry.s, entry.p);
+    }
+    mos6502_trace_close(reader);
+    return 0;
+}